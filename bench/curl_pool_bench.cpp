@@ -0,0 +1,39 @@
+#include "curl_pool.h"
+#include <benchmark/benchmark.h>
+
+namespace mltdl {
+
+// acquire and release from threads sharing one pool, as the workers of a
+// DownloadManager do for every segment
+static void BM_AcquireRelease(benchmark::State &state) {
+  static CurlPool pool(8);
+  for (auto _ : state) {
+    CurlGuard guard(pool);
+    benchmark::DoNotOptimize(guard.handle());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AcquireRelease)->ThreadRange(1, 8)->UseRealTime();
+
+// the same from pool workers, each of which owns a handle
+static void BM_AcquireReleaseWorker(benchmark::State &state) {
+  static CurlPool pool(8);
+  for (auto _ : state) {
+    CurlGuard guard(pool, state.thread_index());
+    benchmark::DoNotOptimize(guard.handle());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AcquireReleaseWorker)->ThreadRange(1, 8)->UseRealTime();
+
+// what each request pays to bring a pooled handle back to a known state
+static void BM_ResetHandle(benchmark::State &state) {
+  CURL *curl = curl_easy_init();
+  for (auto _ : state) {
+    resetHandle(curl);
+  }
+  curl_easy_cleanup(curl);
+}
+BENCHMARK(BM_ResetHandle);
+
+} // namespace mltdl
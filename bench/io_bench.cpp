@@ -0,0 +1,106 @@
+#include "async_writer.h"
+#include "client.h"
+#include "download_manager.h"
+#include "utils.h"
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace mltdl {
+
+static const std::string kBenchDir = "/tmp";
+
+// a file of size bytes in the page cache, so the numbers are not the disk's
+static std::string makeFile(const std::string &name, int64_t size) {
+  auto path = kBenchDir + "/mltdl_bench_" + name + "_" + std::to_string(size);
+  std::ofstream out(path, std::ios::binary);
+  std::vector<char> block(64 * 1024, 'x');
+  for (int64_t left = size; left > 0; left -= block.size()) {
+    out.write(block.data(), std::min<int64_t>(left, block.size()));
+  }
+  return path;
+}
+
+static void BM_Md5(benchmark::State &state) {
+  auto path = makeFile("hash", state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(calculateMd5(path));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+  std::remove(path.c_str());
+}
+BENCHMARK(BM_Md5)->RangeMultiplier(16)->Range(4 << 10, 64 << 20);
+
+static void BM_Sha256(benchmark::State &state) {
+  auto path = makeFile("hash", state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(calculateSHA256(path));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+  std::remove(path.c_str());
+}
+BENCHMARK(BM_Sha256)->RangeMultiplier(16)->Range(4 << 10, 64 << 20);
+
+// 8 segment files of range(0) bytes each into one
+static void BM_FileMerge(benchmark::State &state) {
+  std::vector<DownloadManager::FilePiece> pieces;
+  for (int i = 0; i < 8; ++i) {
+    pieces.push_back(DownloadManager::FilePiece{
+        makeFile("piece" + std::to_string(i), state.range(0)), -1});
+  }
+  auto output = kBenchDir + "/mltdl_bench_merged";
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(DownloadManager::fileMerge(output, pieces));
+  }
+  state.SetBytesProcessed(state.iterations() * 8 * state.range(0));
+  for (const auto &piece : pieces) {
+    std::remove(piece.path.c_str());
+  }
+  std::remove(output.c_str());
+}
+BENCHMARK(BM_FileMerge)->RangeMultiplier(8)->Range(64 << 10, 4 << 20);
+
+/**
+ * the write callbacks, driven by a real transfer of a local file:// url so
+ * curl hands over its usual chunks without a network in the way
+ */
+enum WritePath { kMemory, kFile, kWriteBehind };
+
+static void BM_WritePath(benchmark::State &state) {
+  const int64_t size = 16 << 20;
+  auto source = makeFile("source", size);
+  auto url = "file://" + source;
+  auto target = kBenchDir + "/mltdl_bench_target";
+  auto path = static_cast<WritePath>(state.range(0));
+  HttpClient client;
+  RetryStrategy rs{1, 0, 1, 0};
+  CURL *curl = curl_easy_init();
+  AsyncWriter writer;
+  for (auto _ : state) {
+    TransferControl control;
+    if (path == kMemory) {
+      auto response = client.get(url, rs, curl, 0, size - 1);
+      benchmark::DoNotOptimize(response.body.data());
+      continue;
+    }
+    control.writer = path == kWriteBehind ? &writer : nullptr;
+    FILE *file = fopen(target.c_str(), "wb");
+    client.get(url, rs, curl, 0, size - 1, file, &control);
+    fclose(file);
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+  curl_easy_cleanup(curl);
+  std::remove(source.c_str());
+  std::remove(target.c_str());
+}
+BENCHMARK(BM_WritePath)
+    ->ArgName("path")
+    ->Arg(kMemory)
+    ->Arg(kFile)
+    ->Arg(kWriteBehind)
+    ->UseRealTime();
+
+} // namespace mltdl
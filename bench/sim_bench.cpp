@@ -0,0 +1,29 @@
+#include "download_manager.h"
+#include "sim_client.h"
+#include <benchmark/benchmark.h>
+
+namespace mltdl {
+
+// segments of sim:// downloads through the scheduler, streamed to a sink so
+// neither the network nor the disk is in the way
+static void BM_SimSegments(benchmark::State &state) {
+  constexpr int64_t kSegment = 4096;
+  const int64_t segments = 1000;
+  DownloadManager dm(8, kSegment, 0);
+  auto url = "sim://bench/file?size=" + std::to_string(segments * kSegment) +
+             "&error_rate=" + std::to_string(state.range(0) / 100.0);
+  auto sink = std::make_shared<FunctionSink>(
+      [](int64_t, const char *, size_t) { return true; });
+  for (auto _ : state) {
+    auto status = dm.stream(url, sink, Delivery::kUnordered)->wait();
+    if (!status.ok()) {
+      state.SkipWithError(status.toString().c_str());
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * segments);
+}
+// percent of the attempts that fail
+BENCHMARK(BM_SimSegments)->Arg(0)->Arg(1)->UseRealTime();
+
+} // namespace mltdl
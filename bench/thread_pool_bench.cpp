@@ -0,0 +1,71 @@
+#include "thread_pool.h"
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <thread>
+
+namespace mltdl {
+
+// one task at a time, from spawn until it ran on a worker
+static void BM_DispatchLatency(benchmark::State &state) {
+  ThreadPool pool(1);
+  std::atomic<bool> ran{false};
+  for (auto _ : state) {
+    ran = false;
+    pool.spawn([&ran](int) { ran.store(true, std::memory_order_release); });
+    while (!ran.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+  pool.waitForCompletion();
+}
+BENCHMARK(BM_DispatchLatency)->UseRealTime();
+
+// a batch of empty tasks through a pool of range(0) workers
+static void BM_Throughput(benchmark::State &state) {
+  constexpr int kTasks = 10000;
+  ThreadPool pool(state.range(0));
+  std::atomic<int> done{0};
+  for (auto _ : state) {
+    done = 0;
+    for (int i = 0; i < kTasks; ++i) {
+      pool.spawn([&done](int) { done.fetch_add(1, std::memory_order_relaxed); });
+    }
+    pool.waitForCompletion();
+  }
+  state.SetItemsProcessed(state.iterations() * kTasks);
+}
+BENCHMARK(BM_Throughput)->Arg(1)->Arg(4)->Arg(8)->UseRealTime();
+
+// several producers spawning into one shared pool
+static void BM_ContendedSpawn(benchmark::State &state) {
+  static ThreadPool pool(4);
+  static std::atomic<int64_t> done{0};
+  int64_t spawned = 0;
+  for (auto _ : state) {
+    pool.spawn([](int) { done.fetch_add(1, std::memory_order_relaxed); });
+    ++spawned;
+  }
+  state.SetItemsProcessed(spawned);
+  if (state.thread_index() == 0) {
+    pool.waitForCompletion();
+  }
+}
+BENCHMARK(BM_ContendedSpawn)->ThreadRange(1, 8)->UseRealTime();
+
+// the scheduler alone, without threads
+static void BM_WorkQueue(benchmark::State &state) {
+  WorkQueue queue;
+  WorkOptions options;
+  int flows = state.range(0);
+  int i = 0;
+  for (auto _ : state) {
+    options.flow = flows > 1 ? std::to_string(i++ % flows) : "";
+    queue.push([](int) {}, options);
+    benchmark::DoNotOptimize(queue.pop());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_WorkQueue)->Arg(1)->Arg(16);
+
+} // namespace mltdl
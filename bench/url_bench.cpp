@@ -0,0 +1,80 @@
+#include "url.h"
+#include "utils.h"
+#include <benchmark/benchmark.h>
+
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace mltdl {
+
+static const std::vector<std::string> g_urls = {
+    "https://cdn.kernel.org/pub/linux/kernel/v5.x/linux-5.10.1.tar.xz",
+    "http://example.com:8080/path/to/resource?param1=value1&param2=value2",
+    "http://192.0.2.0/data/part-00017.parquet",
+    "https://[2001:db8::1]:8443/bucket/object%20name.bin",
+    "ftp://mirror.example.org/a/very/long/path/that/keeps/going/file.iso"};
+
+// one parse, what every check in the download path costs now
+static void BM_ParseUrl(benchmark::State &state) {
+  UrlParts parts;
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(parseUrl(g_urls[i++ % g_urls.size()], parts));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ParseUrl);
+
+static void BM_IsUrlValid(benchmark::State &state) {
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(isUrlValid(g_urls[i++ % g_urls.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IsUrlValid);
+
+// the previous implementation, a regex built on every call
+static void BM_RegexPerCall(benchmark::State &state) {
+  size_t i = 0;
+  for (auto _ : state) {
+    std::regex url_regex(
+        R"(^(http|https|ftp)://([a-z0-9.-]+)(:[0-9]+)?(/[\w\-./?%&=]*)?$)");
+    benchmark::DoNotOptimize(
+        std::regex_match(g_urls[i++ % g_urls.size()], url_regex));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RegexPerCall);
+
+static void BM_GetUrlName(benchmark::State &state) {
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(getUrlName(g_urls[i++ % g_urls.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetUrlName);
+
+static void BM_GetProtocol(benchmark::State &state) {
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(getProtocol(g_urls[i++ % g_urls.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetProtocol);
+
+// includes the existence check of the target file
+static void BM_AdjustFilepath(benchmark::State &state) {
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        adjustFilepath("/tmp", g_urls[i++ % g_urls.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AdjustFilepath);
+
+} // namespace mltdl
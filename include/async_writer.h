@@ -0,0 +1,80 @@
+#pragma once
+
+#include "memory_budget.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace mltdl {
+
+/**
+ * write-behind for downloads: the transfer threads hand their buffers over
+ * and go back to the network, a background thread writes them to disk with
+ * positional writes. Every buffer holds bytes of the memory budget until it
+ * has been written.
+ */
+class AsyncWriter {
+public:
+  // the writes of one transfer to one file
+  class Stream {
+  public:
+    explicit Stream(int fd) : fd_(fd) {}
+
+    Stream(const Stream &) = delete;
+    Stream &operator=(const Stream &) = delete;
+
+    // block until every buffer submitted to this stream has been written,
+    // false if one of them failed
+    bool drain();
+
+  private:
+    friend class AsyncWriter;
+
+    int fd_;
+    int pending_{0};
+    bool failed_{false};
+    std::mutex mutex_;
+    std::condition_variable drained_;
+  };
+
+  explicit AsyncWriter(MemoryBudget &budget = MemoryBudget::global());
+
+  // writes what is still queued before the thread stops
+  ~AsyncWriter();
+
+  AsyncWriter(const AsyncWriter &) = delete;
+  AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+  /**
+   * queue data to be written at offset, the caller already charged
+   * data.size() bytes to the budget and the writer releases them
+   */
+  void submit(Stream &stream, int64_t offset, std::vector<char> data);
+
+  MemoryBudget &budget() { return budget_; }
+
+  // keep the writer thread on one cpu
+  bool pin(int cpu);
+
+private:
+  struct Request {
+    Stream *stream;
+    int64_t offset;
+    std::vector<char> data;
+  };
+
+  void threadMain();
+
+  MemoryBudget &budget_;
+  std::queue<Request> requests_;
+  bool running_{true};
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::thread thread_;
+};
+
+} // namespace mltdl
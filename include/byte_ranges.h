@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace mltdl {
+
+// bytes start to end of a resource, both included
+struct ByteRange {
+  int64_t start;
+  int64_t end;
+
+  int64_t length() const { return end - start + 1; }
+  bool operator==(const ByteRange &other) const {
+    return start == other.start && end == other.end;
+  }
+};
+
+// receives bytes at their offset in the resource, false aborts the transfer
+using RangeWriter =
+    std::function<bool(int64_t offset, const char *data, size_t size)>;
+
+// sorted, with overlapping and adjacent ranges merged
+std::vector<ByteRange> normalizeRanges(std::vector<ByteRange> ranges);
+
+// the parts of wanted not covered by the sorted, disjoint covered ranges
+std::vector<ByteRange> subtractRanges(const std::vector<ByteRange> &wanted,
+                                      const std::vector<ByteRange> &covered);
+
+// "bytes 0-99/1000" or "bytes 0-99/*", false for anything else
+bool parseContentRange(const std::string &value, ByteRange &range);
+
+// the boundary of a "multipart/byteranges; boundary=..." content type, empty
+// if it is not one
+std::string byterangesBoundary(const std::string &content_type);
+
+/**
+ * a streaming parser for multipart/byteranges bodies. Feed it the body in
+ * chunks as they arrive, the data of every part is handed to the writer
+ * straight out of the chunk, at the offset its Content-Range names. Only
+ * the delimiter and header lines are buffered.
+ */
+class ByterangesParser {
+public:
+  ByterangesParser(std::string boundary, RangeWriter writer);
+
+  // false once the body is malformed or the writer refused data
+  bool feed(const char *data, size_t size);
+
+  // the closing delimiter was seen
+  bool done() const { return state_ == kDone; }
+
+  // what arrived so far, in the order of the parts
+  const std::vector<ByteRange> &received() const { return received_; }
+
+private:
+  enum State { kDelimiter, kHeaders, kBody, kDone, kError };
+
+  // a complete line was collected in line_
+  bool onLine();
+
+  const std::string delimiter_;
+  RangeWriter writer_;
+  State state_{kDelimiter};
+  std::string line_;
+  // the part being read
+  ByteRange part_{0, -1};
+  bool has_range_{false};
+  int64_t part_offset_{0};
+  std::vector<ByteRange> received_;
+};
+
+} // namespace mltdl
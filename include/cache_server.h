@@ -0,0 +1,167 @@
+#pragma once
+
+#include "byte_ranges.h"
+#include "curl_pool.h"
+#include "download_manager.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mltdl {
+
+struct CacheServerOptions {
+  // threads of the downloads
+  size_t num_thread{8};
+  // the downloads are cut into segments of at most this size. A reader
+  // ahead of the download waits for a running segment at most, the bytes of
+  // those still queued it fetches itself
+  int64_t segment_size{8LL * 1024 * 1024};
+  // threads of the fetches of readers that are ahead of the download
+  size_t demand_threads{4};
+  // bytes a reader waiting for missing data fetches at once
+  int64_t demand_window{4LL * 1024 * 1024};
+  std::chrono::milliseconds demand_after{50};
+};
+
+/**
+ * an HTTP endpoint on localhost that serves what the node downloads, while
+ * it is still downloading. Local consumers ask for
+ *   GET /?url=<percent-encoded origin url>      HEAD works too
+ * with or without a Range header of a single range. The first request for
+ * a url starts its download, every later one reads the same file, so the
+ * origin is asked once however many consumers there are.
+ *
+ * A reader gets the bytes as they land. One that waits longer than
+ * demand_after for bytes no running segment is fetching fetches the next
+ * window of them itself, on a pool of its own that does not queue behind
+ * the segments, so a consumer jumping ahead is not stuck behind the order
+ * of the segments. A segment that starts later leaves out what was fetched
+ * that way, so the origin sends every byte once.
+ *
+ * Files are kept in cache_dir, named by the SHA-256 of their url, as
+ * <name>.part while downloading. Nothing is ever evicted.
+ */
+class CacheServer {
+public:
+  CacheServer(const std::string &cache_dir,
+              const CacheServerOptions &options = CacheServerOptions());
+  ~CacheServer();
+
+  CacheServer(const CacheServer &) = delete;
+  CacheServer &operator=(const CacheServer &) = delete;
+
+  // listen on 127.0.0.1, port 0 picks a free one
+  bool listen(int port = 0);
+
+  // the port it listens on
+  int port() const { return port_; }
+
+  // serve connections until stop() is called
+  void run();
+
+  // safe to call from another thread or a signal handler
+  void stop() { running_ = false; }
+
+  // the file a url is cached in once it is complete
+  std::string cachePath(const std::string &url) const;
+
+  // demand fetches started so far
+  uint64_t demandFetches() const { return demand_fetches_; }
+
+private:
+  // a url being served, from the first request on
+  struct Entry {
+    std::string url;
+    // where it ends up, and where it is written until then
+    std::string path;
+    std::string part_path;
+    // read and written with pread and pwrite, survives the rename
+    int fd{-1};
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    // -1 until the probe is done
+    int64_t size{-1};
+    // of the resource, the fetches of readers only take the same one
+    std::string validator;
+    // what is in the file, sorted and merged
+    std::vector<ByteRange> have;
+    // what readers are fetching, and what the server fetches for segments
+    // that left bytes out
+    std::vector<ByteRange> demanded;
+    // what the running segments claimed, each delivers its range in order
+    std::vector<ByteRange> fetching;
+    // of the download itself
+    Status download_status{StatusCode::kPending, ""};
+    // kPending until the download and the fetches are over
+    Status status{StatusCode::kPending, ""};
+    bool settled{false};
+    std::shared_ptr<DownloadHandle> handle;
+
+    ~Entry();
+
+    // put the bytes in the file and wake the readers waiting for them
+    bool write(int64_t offset, const char *data, size_t size);
+
+    // bytes from offset on that are in the file, under mutex
+    int64_t available(int64_t offset) const;
+  };
+
+  class EntrySink;
+
+  void serveConnection(int fd);
+
+  // the entry of url, set up and its download started by the first caller.
+  // Null with status set if the url can't be served
+  std::shared_ptr<Entry> entry(const std::string &url, Status &status);
+
+  // learn the size, open the file and start the download
+  Status start(const std::shared_ptr<Entry> &entry);
+
+  // the download of the entry is over
+  void finished(const std::shared_ptr<Entry> &entry, const Status &status);
+
+  // narrow the range of a segment that is about to start to the bytes
+  // nobody has or fetches, and fetch what that leaves out of it
+  bool claim(const std::shared_ptr<Entry> &entry, int64_t &start,
+             int64_t &end);
+
+  // complete the entry once the download and the fetches are over
+  void settle(const std::shared_ptr<Entry> &entry);
+
+  // wait until bytes from offset are in the file, fetching them if the
+  // download is not getting there. The bytes available, 0 if it failed
+  int64_t waitFor(const std::shared_ptr<Entry> &entry, int64_t offset,
+                  int64_t end);
+
+  // fetch [start, end] of the entry out of the download's order
+  void demand(const std::shared_ptr<Entry> &entry, ByteRange range);
+
+  const std::string cache_dir_;
+  const CacheServerOptions options_;
+  int listen_fd_{-1};
+  int port_{0};
+  std::atomic<bool> running_{false};
+  std::atomic<uint64_t> demand_fetches_{0};
+  // the parent of the fetches of readers, cancelled on the way out
+  TransferControl cancel_;
+
+  std::mutex mutex_;
+  std::condition_variable connections_cv_;
+  int active_connections_{0};
+  std::unordered_map<std::string, std::shared_ptr<Entry>> entries_;
+
+  ThreadPool demand_pool_;
+  CurlPool demand_curls_;
+  // declared last so it is destroyed first, its sinks use the members above
+  DownloadManager manager_;
+};
+
+} // namespace mltdl
@@ -1,7 +1,13 @@
 #pragma once
 
+#include "byte_ranges.h"
+#include "memory_budget.h"
+#include "sink.h"
+
+#include <atomic>
 #include <curl/curl.h>
 #include <functional>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -12,28 +18,122 @@ struct Response {
   long status{0};
   long status_code{0};
   std::vector<char> body;
+  // the ETag the server answered with, only set by put
+  std::string etag;
+  // the share of the memory budget the body is charged for, released when the
+  // last copy of the response goes away
+  std::shared_ptr<MemoryBudget::Lease> lease;
+};
+
+class AsyncWriter;
+
+/**
+ * shared between the caller and the client for the lifetime of a transfer,
+ * so the progress can be observed and the transfer aborted from another thread
+ */
+struct TransferControl {
+  std::atomic<int64_t> bytes{0};
+  std::atomic<bool> cancelled{false};
+  // the job this transfer is part of, it sees the bytes and its cancellation
+  // stops this transfer too
+  TransferControl *parent{nullptr};
+  // called on the transfer's thread every time curl reports progress
+  std::function<void()> on_progress;
+  // hand the data of a transfer to a file over to this writer instead of
+  // writing it on the transfer's thread
+  AsyncWriter *writer{nullptr};
+  // a validator of the resource, the range is only taken if it still
+  // matches, a changed resource comes back whole and fails the transfer
+  std::string if_range;
+  // the job and segment the transfer is part of, for the log
+  uint64_t job_id{0};
+  int segment{-1};
+
+  bool isCancelled() const {
+    return cancelled || (parent != nullptr && parent->isCancelled());
+  }
+  void add(int64_t n) {
+    bytes += n;
+    if (parent != nullptr) {
+      parent->add(n);
+    }
+  }
+};
+
+// what a HEAD request tells about a resource before it is downloaded
+struct ResourceInfo {
+  // -1 if it is not known
+  int64_t size{-1};
+  // false only if the server said so, many that support ranges don't tell
+  bool accept_ranges{true};
+  std::string etag;
+  std::string last_modified;
+
+  // what If-Range accepts, a strong ETag or else the modification date
+  std::string validator() const {
+    if (!etag.empty() && etag.compare(0, 2, "W/") != 0) {
+      return etag;
+    }
+    return last_modified;
+  }
 };
 
 struct RetryStrategy {
+  // number of attempts, including the first one
   int max_retries{0};
   int delay_ms{0};
   int delay_factor{1};
+  // upper bound of a single backoff, including a Retry-After, 0 for none
+  int max_delay_ms{0};
 };
 
+// 4xx errors that will not go away by asking again, i.e. all but 408 and 429
+bool isPermanentHttpError(long status_code);
+
+/**
+ * the backoff before retry number attempt + 1: delay_ms * delay_factor^attempt
+ * with jitter on the upper half, raised to the Retry-After of the server
+ */
+int64_t retryDelay(const RetryStrategy &rs, int attempt,
+                   int64_t retry_after_ms = 0);
+
 class Client {
 public:
   virtual ~Client() {}
 
-  // Define a callback function to download a large amount of data in batches
-  using CallBack = std::function<size_t(void *, size_t, size_t, void *)>;
-
   virtual Response get(const std::string &url, const RetryStrategy &rs,
                        CURL *curl, int64_t start, int64_t end,
-                       void *userp = nullptr) = 0;
+                       void *userp = nullptr,
+                       TransferControl *control = nullptr) = 0;
   virtual Response post(const std::string &url, const std::string &post_fields,
                         const RetryStrategy &rs, CURL *curl,
                         void *userp = nullptr) = 0;
+  // like get, but the bytes go to the sink as they arrive, no retry sends a
+  // byte to it twice
+  virtual Response stream(const std::string &url, const RetryStrategy &rs,
+                          CURL *curl, int64_t start, int64_t end, Sink &sink,
+                          TransferControl *control = nullptr) = 0;
+  // upload length bytes of the file from offset as the body of a PUT, read
+  // from the disk as curl sends them. headers are added as they are, like
+  // "Content-Range: bytes 0-99/1000"
+  virtual Response put(const std::string & /*url*/,
+                       const std::string & /*file_path*/, int64_t /*offset*/,
+                       int64_t /*length*/,
+                       const std::vector<std::string> & /*headers*/,
+                       const RetryStrategy & /*rs*/, CURL * /*curl*/,
+                       TransferControl * /*control*/ = nullptr) {
+    Response response;
+    response.status = CURLE_UNSUPPORTED_PROTOCOL;
+    return response;
+  }
   virtual int64_t getFileSize(const std::string &url, CURL *curl) = 0;
+  // the size and validators of a resource, a client that can only tell the
+  // size does not need to override it
+  virtual ResourceInfo probe(const std::string &url, CURL *curl) {
+    ResourceInfo info;
+    info.size = getFileSize(url, curl);
+    return info;
+  }
 };
 
 class HttpClient : public Client {
@@ -42,21 +142,65 @@ public:
   ~HttpClient();
 
   Response get(const std::string &url, const RetryStrategy &rs, CURL *curl,
-               int64_t start, int64_t end, void *userp = nullptr) override;
+               int64_t start, int64_t end, void *userp = nullptr,
+               TransferControl *control = nullptr) override;
   Response post(const std::string &url, const std::string &post_fields,
                 const RetryStrategy &rs, CURL *curl,
                 void *userp = nullptr) override;
+  Response stream(const std::string &url, const RetryStrategy &rs, CURL *curl,
+                  int64_t start, int64_t end, Sink &sink,
+                  TransferControl *control = nullptr) override;
+  Response put(const std::string &url, const std::string &file_path,
+               int64_t offset, int64_t length,
+               const std::vector<std::string> &headers,
+               const RetryStrategy &rs, CURL *curl,
+               TransferControl *control = nullptr) override;
   int64_t getFileSize(const std::string &url, CURL *curl) override;
+  ResourceInfo probe(const std::string &url, CURL *curl) override;
+
+  /**
+   * fetch many ranges of a resource with as few requests as possible: up to
+   * kMaxRangesPerRequest ranges go into one Range header and the
+   * multipart/byteranges answer is parsed as it streams in. Servers that
+   * answer with a single, possibly merged, part or with the whole resource
+   * are handled too. What a server would not send that way is fetched range
+   * by range. Every byte
+   * goes to writer at its offset in the resource, the ranges that could not
+   * be fetched at all end up in missing.
+   */
+  Response getRanges(const std::string &url, const RetryStrategy &rs,
+                     CURL *curl, const std::vector<ByteRange> &ranges,
+                     const RangeWriter &writer,
+                     std::vector<ByteRange> *missing = nullptr);
+
+  // a longer Range header is refused by many servers
+  static constexpr size_t kMaxRangesPerRequest = 64;
 
 private:
+  // the retry loop of get and stream, the data goes to file, to sink or
+  // into the body of the response if both are null
+  Response transfer(const std::string &url, const RetryStrategy &rs,
+                    CURL *curl, int64_t start, int64_t end, FILE *file,
+                    Sink *sink, TransferControl *control);
+
   // declare the callback function as static in multithread
   // Byte stream is loaded into memory
   static size_t writeCallBack(void *contents, size_t size, size_t nmemb,
-                              std::vector<char> *out);
+                              void *userp);
 
   // Fetch byte streams in batches and write them to disk
   static size_t writeCallBack2(void *ptr, size_t size, size_t nmemb,
                                void *stream);
+
+  // Hand the chunk to a sink without copying it
+  static size_t sinkCallBack(void *ptr, size_t size, size_t nmemb,
+                             void *userp);
+
+  // Called by curl while the transfer runs, aborts it once cancelled and
+  // resumes it once it was paused for memory and the budget has room again
+  static int progressCallBack(void *clientp, curl_off_t dltotal,
+                              curl_off_t dlnow, curl_off_t ultotal,
+                              curl_off_t ulnow);
 };
 
 } // namespace mltdl
\ No newline at end of file
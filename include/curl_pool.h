@@ -1,28 +1,126 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <curl/curl.h>
 #include <mutex>
 #include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace mltdl {
 
+/**
+ * curl_easy_reset puts the options of a handle back to their defaults, it
+ * keeps the live connections, the DNS and TLS session caches and the share.
+ * Clients call this instead, it also attaches handles that never had it,
+ * like new ones, to the share all handles of the process use.
+ */
+void resetHandle(CURL *curl);
+
 /**
  * define a CURL pool to assign CURL handles to each thread
  * this allows you to reuse connections that CURL has already made
+ *
+ * Each of the num_curl workers of a ThreadPool owns a handle, so a worker
+ * gets the same handle and the connections it keeps open on every call and
+ * takes no lock for it. Callers that are not a worker share the handles of a
+ * mutex guarded free list. Handles are only created when first needed.
  * */
 
+struct PrewarmOptions {
+  bool enabled{false};
+  // warm and warming connections to one host, at most
+  size_t max_per_host{8};
+  // a warm connection nobody took within this time is closed
+  std::chrono::milliseconds idle_timeout{30000};
+};
+
 class CurlPool {
 public:
   CurlPool(int num_curl);
 
   ~CurlPool();
 
-  CURL *acquire();
-  void release(CURL *curl);
+  /**
+   * the handle of the worker with this thread id, or a shared one for -1.
+   * With a host, see hostKey, a handle that was warmed up for it is taken
+   * over if the worker's own one was last used for another host
+   */
+  CURL *acquire(int worker = -1, const std::string &host = "");
+  void release(CURL *curl, int worker = -1);
+
+  // handles created so far
+  size_t created() const { return created_; }
+
+  /**
+   * pre-warming opens connections to a host before the transfers need
+   * them: HEAD requests for the url go out on fresh handles, all at once
+   * from threads of their own, and the handles are kept with their open,
+   * handshaken connections until acquire hands them out. Redirects are
+   * followed like the transfers do, a handle is kept for the host it ended
+   * up at. A HEAD is used
+   * because curl does not reuse the connections of a connect-only handle,
+   * and a plain easy handle because one run by a multi handle leaves its
+   * connection with the multi handle.
+   */
+  void setPrewarm(const PrewarmOptions &options);
+
+  // start warming up to n connections to the host of the url
+  void prewarm(const std::string &url, size_t n);
+
+  // warm connections waiting for the host
+  size_t warm(const std::string &host);
+
+  // HEAD requests of the warm-up still running
+  size_t warmingUp();
+
+  // "scheme://host:port" of an http or https url, empty for anything else
+  static std::string hostKey(const std::string &url);
 
 private:
+  // one cache line per worker, a worker only touches its own
+  struct alignas(64) Slot {
+    CURL *curl{nullptr};
+    bool in_use{false};
+    // the host the handle was last acquired for
+    std::string host;
+  };
+
+  struct Warm {
+    CURL *curl;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  CURL *create();
+
+  // a warm handle for the host, or null
+  CURL *takeWarm(const std::string &host);
+
+  // one HEAD request on a thread of its own
+  void warmUp(const std::string &url, const std::string &host);
+
+  // closes the warm handles that idled too long
+  void prewarmMain();
+
+  std::vector<Slot> slots_;
   std::queue<CURL *> curls_;
   std::mutex mutex_;
+  std::atomic<size_t> created_{0};
+
+  // guarded by mutex_ like the rest, the thread starts with the first
+  // prewarm
+  PrewarmOptions options_;
+  std::thread prewarm_thread_;
+  std::condition_variable prewarm_cv_;
+  bool stopping_{false};
+  std::unordered_map<std::string, std::vector<Warm>> warm_;
+  // HEAD requests in flight by the host of their url, and in all
+  std::unordered_map<std::string, size_t> warming_;
+  size_t warm_ups_{0};
 };
 
 /**
@@ -33,7 +131,7 @@ private:
  */
 class CurlGuard {
 public:
-  CurlGuard(CurlPool &pool);
+  CurlGuard(CurlPool &pool, int worker = -1, const std::string &host = "");
   ~CurlGuard();
 
   // return the CURL* handle
@@ -46,6 +144,7 @@ public:
 
 private:
   CurlPool &pool_;
+  int worker_;
   CURL *curl_;
 };
 
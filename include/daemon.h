@@ -0,0 +1,86 @@
+#pragma once
+
+#include "download_manager.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace mltdl {
+
+/**
+ * keeps one DownloadManager alive and takes jobs over a Unix domain socket,
+ * so the threads, CURL handles, open connections and TLS sessions are reused
+ * by every job instead of being rebuilt by a new process each time.
+ *
+ * The protocol is line based, every request line gets one reply line:
+ *   SUBMIT <url> [high|normal|low] [tenant]  -> OK <id>
+ *   STATUS <id>                              -> OK <id> <state> <done>/<total>
+ *                                               <path> [message]
+ *   WAIT <id>                                -> like STATUS, once it finished
+ *   CANCEL <id>                              -> OK <id>
+ *   SHUTDOWN                                 -> OK
+ * errors are replied as ERR <reason>. <state> is the status token, always
+ * the third word: running, done or failed. The path and the message may
+ * hold anything, read the state with daemonJobState.
+ */
+class DownloadDaemon {
+public:
+  DownloadDaemon(const std::string &socket_path,
+                 const std::string &download_dir, size_t num_thread);
+  ~DownloadDaemon();
+
+  DownloadDaemon(const DownloadDaemon &) = delete;
+  DownloadDaemon &operator=(const DownloadDaemon &) = delete;
+
+  // bind and listen on the socket, false if the socket can not be created
+  bool listen();
+
+  // accept connections until stop() is called or SHUTDOWN is received
+  void run();
+
+  // safe to call from another thread or a signal handler
+  void stop() { running_ = false; }
+
+  DownloadManager &manager() { return manager_; }
+
+  // answer one request line, public so it can be driven without a socket
+  std::string handleCommand(const std::string &line);
+
+private:
+  void serveConnection(int fd);
+
+  std::string describe(uint64_t id, const DownloadHandle &handle) const;
+
+  // forget the oldest finished jobs once there are too many of them
+  void pruneFinished();
+
+  const std::string socket_path_;
+  const std::string download_dir_;
+  int listen_fd_{-1};
+  std::atomic<bool> running_{false};
+
+  std::mutex mutex_;
+  std::condition_variable connections_cv_;
+  int active_connections_{0};
+  uint64_t next_id_{1};
+  std::unordered_map<uint64_t, std::shared_ptr<DownloadHandle>> jobs_;
+  std::deque<uint64_t> finished_;
+
+  // declared last so it is destroyed first, its completion callbacks use the
+  // members above
+  DownloadManager manager_;
+};
+
+// send one request line to a daemon and return its reply line
+std::string sendDaemonCommand(const std::string &socket_path,
+                              const std::string &line);
+
+// the <state> of a STATUS or WAIT reply, empty for any other reply
+std::string daemonJobState(const std::string &reply);
+
+} // namespace mltdl
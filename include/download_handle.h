@@ -0,0 +1,85 @@
+#pragma once
+
+#include "client.h"
+#include "status.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mltdl {
+
+/**
+ * returned by DownloadManager::submit right away, the download itself runs on
+ * the threads of the manager. The caller can poll it, block on it, or register
+ * a callback and go on with other work.
+ */
+class DownloadHandle {
+public:
+  using Callback = std::function<void(const DownloadHandle &)>;
+
+  struct Progress {
+    int64_t downloaded{0};
+    // -1 until the size of the resource is known
+    int64_t total{-1};
+  };
+
+  explicit DownloadHandle(std::string url);
+
+  DownloadHandle(const DownloadHandle &) = delete;
+  DownloadHandle &operator=(const DownloadHandle &) = delete;
+
+  const std::string &url() const { return url_; }
+
+  // the path the file is saved to, empty until the download has been set up
+  std::string filePath() const;
+
+  bool done() const;
+
+  // blocks until the download finished and returns its final status
+  Status wait() const;
+
+  // returns false if the download is still running after the timeout
+  bool waitFor(std::chrono::milliseconds timeout) const;
+
+  // kPending while the download is running
+  Status status() const;
+
+  Progress progress() const;
+
+  /**
+   * the callback runs on the thread that finishes the download, or right away
+   * on the calling thread if the download is already done. It must not block
+   * for long because it holds a thread of the pool.
+   */
+  void onComplete(Callback callback);
+
+  // ask the running transfers to stop, the status becomes kCancelled
+  void cancel();
+
+private:
+  friend class DownloadManager;
+
+  TransferControl *control() { return &control_; }
+  void setFilePath(const std::string &file_path);
+  void setTotal(int64_t total) { total_ = total; }
+
+  // set the final status and run the callbacks, only the first call counts
+  void complete(Status status);
+
+  const std::string url_;
+  TransferControl control_;
+  std::atomic<int64_t> total_{-1};
+
+  mutable std::mutex mutex_;
+  mutable std::condition_variable done_cv_;
+  std::string file_path_;
+  Status status_{StatusCode::kPending, ""};
+  std::vector<Callback> callbacks_;
+};
+
+} // namespace mltdl
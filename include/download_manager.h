@@ -1,31 +1,297 @@
 #pragma once
 
+#include "async_writer.h"
 #include "curl_pool.h"
+#include "download_handle.h"
+#include "sink.h"
+#include "status.h"
 #include "thread_pool.h"
+#include <atomic>
 #include <curl/curl.h>
+#include <deque>
+#include <memory>
 #include <queue>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace mltdl {
 
+struct HedgeOptions {
+  bool enabled{false};
+  // a segment is hedged when it is projected to take this many times the
+  // median time of the segments of the same download that already finished
+  double slowdown{2.0};
+  // the bytes all hedges of a download may fetch, as a fraction of its size
+  double budget{0.05};
+};
+
+// how the bytes of a streamed download reach its sink
+enum class Delivery {
+  // as they arrive, from all segments at once
+  kUnordered,
+  // one after another from the first byte, see OrderedSink
+  kOrdered,
+};
+
+struct DownloadOptions {
+  // segments of higher priority downloads are dispatched first
+  Priority priority{Priority::kNormal};
+  // downloads of the same tenant share the threads as one flow against the
+  // other tenants, an empty tenant makes the download a flow of its own
+  std::string tenant;
+  // relative share of the threads and bandwidth against other flows
+  uint32_t weight{1};
+  // duplicate the requests of straggling segments on another connection
+  HedgeOptions hedge;
+  // attach to a download of the same url that is already running instead of
+  // starting another transfer. Its file is then shared under a name of its
+  // own, and the priority, tenant and hedging of the running one apply
+  bool coalesce{false};
+  // an ETag, version or checksum the caller expects of the resource,
+  // downloads only coalesce when theirs match
+  std::string validator;
+};
+
 class DownloadManager {
 public:
-  DownloadManager(size_t max_concurrent_tasks = 8)
-      : thread_pool_(max_concurrent_tasks), curl_pool_(max_concurrent_tasks),
-        num_thread_(max_concurrent_tasks) {}
+  // large files are cut into segments of at most this size, so a worker is
+  // handed back to the scheduler regularly even during a huge transfer
+  static constexpr int64_t kDefaultMaxSegmentSize = 64LL * 1024 * 1024;
+
+  // the jobs next in line whose size and validators are probed ahead of
+  // their turn on the workers. Their files and segments still wait for it
+  static constexpr size_t kDefaultLookahead = 4;
+
+  // a lookahead of 0 probes each job on a worker when its turn comes
+  DownloadManager(size_t max_concurrent_tasks = 8,
+                  int64_t max_segment_size = kDefaultMaxSegmentSize,
+                  size_t lookahead = kDefaultLookahead);
+
+  // let the submitted downloads finish before the pools go away
+  ~DownloadManager();
+
   void start(bool wait = true) { thread_pool_.executeAll(wait); };
-  int download(const std::string &url, const std::string &file_dir);
+
+  /**
+   * hand the data of the segments to a background writer instead of writing
+   * it on the transfer threads. The buffers in flight are bounded by the
+   * global MemoryBudget, transfers pause while it is used up.
+   * Takes effect for downloads submitted afterwards.
+   */
+  void setWriteBehind(bool enabled);
+
+  /**
+   * open and handshake connections to the host of every download while its
+   * size is probed, so the segments start on warm connections instead of
+   * all handshaking at once. Set before submitting.
+   */
+  void setPrewarm(const PrewarmOptions &options) {
+    curl_pool_.setPrewarm(options);
+  }
+
+  /**
+   * pin the worker threads to the cpus, see ThreadPool::pinThreads. The
+   * write-behind thread, if any, gets the cpu after the last worker's.
+   */
+  bool pinThreads(const std::vector<int> &cpus = {});
+
+  // download the url into file_dir and block until it is done
+  Status download(const std::string &url, const std::string &file_dir);
+
+  /**
+   * start downloading the url into file_dir and return at once, the handle
+   * reports progress and the final status. Several downloads can be submitted
+   * to the same manager, they share its threads and CURL handles.
+   *
+   * With coalesce on, a download of a url that is already being downloaded
+   * with coalesce on rides along with that transfer: when it is done the
+   * file is hard-linked into file_dir under a name of its own, or copied
+   * where a link is not possible. If the transfer was cancelled by its own
+   * caller, the first download riding along takes over.
+   */
+  std::shared_ptr<DownloadHandle>
+  submit(const std::string &url, const std::string &file_dir,
+         DownloadHandle::Callback callback = nullptr);
+
+  std::shared_ptr<DownloadHandle>
+  submit(const std::string &url, const std::string &file_dir,
+         const DownloadOptions &options,
+         DownloadHandle::Callback callback = nullptr);
+
+  /**
+   * download the url into sink instead of a file, nothing touches the disk.
+   * The sink's finish runs before the callback. Hedging is not done for
+   * these, a hedge would deliver bytes the segment delivers as well.
+   */
+  std::shared_ptr<DownloadHandle>
+  stream(const std::string &url, std::shared_ptr<Sink> sink,
+         Delivery delivery = Delivery::kUnordered,
+         const DownloadOptions &options = DownloadOptions(),
+         DownloadHandle::Callback callback = nullptr);
+
+  // a piece of a temporary file that goes into the merged file, a negative
+  // length takes the whole file
+  struct FilePiece {
+    std::string path;
+    int64_t length;
+  };
+
+  // concatenate the pieces into file_path, returns the bytes written
+  static int64_t fileMerge(const std::string file_path,
+                           const std::vector<FilePiece> &pieces);
 
 private:
-  void downloadFile(const std::string &url, const std::string &file_path,
-                    int64_t start, int64_t end);
+  // one byte range of a download, with the hedge racing it if there is one
+  struct Segment {
+    enum { kNone = 0, kPrimary = 1, kHedge = 2 };
+
+    int64_t start{0};
+    int64_t end{0};
+    std::string file_path;
+    TransferControl control;
+    // steady clock time the segment left the queue
+    std::atomic<int64_t> started_ns{0};
+    std::atomic<int64_t> checked_ns{0};
+
+    std::atomic<bool> hedged{false};
+    // the hedge fetches [hedge_cut, end] into hedge_path
+    int64_t hedge_cut{0};
+    std::string hedge_path;
+    TransferControl hedge_control;
+    // which side finished first
+    std::atomic<int> winner{kNone};
+    // why the primary failed, guarded by the job mutex
+    Status error;
+  };
+
+  // the state shared by the segments of one submitted download
+  struct Job {
+    // numbers the jobs of the manager in the log
+    uint64_t id{0};
+    std::shared_ptr<DownloadHandle> handle;
+    std::string file_dir;
+    WorkOptions work_options;
+    HedgeOptions hedge;
+    // null unless write-behind is enabled
+    AsyncWriter *writer{nullptr};
+    // set for a streamed download, the segments write to it instead of files
+    std::shared_ptr<Sink> sink;
+    // the sink again when the delivery is ordered
+    std::shared_ptr<OrderedSink> ordered;
+    std::string file_path;
+    std::vector<std::unique_ptr<Segment>> segments;
+    // what the probe learned about the resource
+    ResourceInfo info;
+    int64_t file_size{0};
+    // tasks that have not finished yet, the last one merges the file
+    std::atomic<int> pending{0};
+    // segments that have not left the queue yet
+    std::atomic<int> queued{0};
+    // bytes requested by hedges so far
+    std::atomic<int64_t> hedge_bytes{0};
+    std::mutex mutex;
+    // how long the finished segments took
+    std::vector<int64_t> durations_ns;
+    // the way through the look-ahead, guarded by the manager's
+    // lookahead_mutex_
+    enum { kUnprobed, kProbing, kProbed } probe_state{kUnprobed};
+    bool probe_ok{false};
+    // holds a place of the window
+    bool in_window{false};
+    // a worker picked the job, the files and segments may be set up
+    bool turn{false};
+  };
+
+  // a download riding along with a running transfer of the same url
+  struct Follower {
+    std::shared_ptr<DownloadHandle> handle;
+    std::string file_dir;
+    DownloadOptions options;
+  };
+
+  // start a transfer for handle, the first of its flight
+  void lead(const std::shared_ptr<DownloadHandle> &handle,
+            const std::string &file_dir, const DownloadOptions &options,
+            DownloadHandle::Callback callback);
+
+  // the transfer of a flight is over, pass its result to the followers
+  void land(const std::string &key, const DownloadHandle &leader);
+
+  // a link or copy of the leader's file for the follower
+  Status shareFile(const DownloadHandle &leader, const Follower &follower);
+
+  static std::string flightKey(const std::string &url,
+                               const DownloadOptions &options);
+
+  // queue the preparation of a job whose handle is set up
+  std::shared_ptr<DownloadHandle> dispatch(const std::shared_ptr<Job> &job,
+                                           const DownloadOptions &options,
+                                           DownloadHandle::Callback callback);
+
+  // check the url and learn the size and validators of the resource with a
+  // handle of curls, worker is the thread id of the pool thread running it.
+  // False if the job is over already
+  bool probe(const std::shared_ptr<Job> &job, CurlPool &curls, int worker);
+
+  // reserve the files of the job and dispatch its segments
+  void prepare(const std::shared_ptr<Job> &job);
+
+  // a step of setting up a job, what it throws fails the job instead of the
+  // thread running it
+  template <typename Step>
+  static bool guarded(const std::shared_ptr<Job> &job, Step step);
+
+  // a worker picked the job, prepare it once it is probed
+  void turn(const std::shared_ptr<Job> &job);
+
+  // start the probes of the jobs next in line while the window has room
+  void fillWindow();
+
+  // probe the job on the look-ahead pool
+  void startProbe(const std::shared_ptr<Job> &job);
+
+  Status downloadFile(const std::shared_ptr<Job> &job,
+                      const std::string &file_path, int64_t start, int64_t end,
+                      TransferControl *control, int worker);
+
+  void maybeHedge(const std::shared_ptr<Job> &job, Segment *segment);
+
+  // record the outcome of one side of a segment
+  void segmentDone(const std::shared_ptr<Job> &job, Segment *segment, int side,
+                   const Status &status);
+
+  // merge the segments and complete the handle
+  void finish(const std::shared_ptr<Job> &job);
+
+  void removeSegmentFiles(const std::shared_ptr<Job> &job);
 
-  int64_t fileMerge(const std::string file_path,
-                    const std::vector<std::string> &temp_file_paths);
+  static int64_t nowNs();
 
+  // declared before the pools so it outlives the jobs that write through it
+  std::unique_ptr<AsyncWriter> writer_;
+  bool write_behind_{false};
   ThreadPool thread_pool_;
   CurlPool curl_pool_;
   std::mutex mutex_;
   int num_thread_;
+  int64_t max_segment_size_;
+  std::atomic<uint64_t> next_job_id_{0};
+  // the look-ahead probes, null without one. Declared after the workers'
+  // pool because the probes spawn segments into it
+  std::unique_ptr<ThreadPool> probe_pool_;
+  std::unique_ptr<CurlPool> probe_curls_;
+  size_t lookahead_;
+  std::mutex lookahead_mutex_;
+  // the jobs waiting for their turn, in the order they were submitted.
+  // Those whose probe started already are skipped
+  std::deque<std::shared_ptr<Job>> waiting_;
+  // jobs probed or being probed ahead of their turn
+  size_t in_window_{0};
+  std::atomic<uint64_t> probes_started_{0};
+  std::atomic<int> probing_{0};
+  // the downloads riding along with each running transfer, by flight key,
+  // guarded by mutex_
+  std::unordered_map<std::string, std::vector<Follower>> flights_;
 };
 } // namespace mltdl
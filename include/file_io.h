@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mltdl {
+
+/**
+ * positional file I/O with a cache of open descriptors. Reads and writes go
+ * straight to pread/pwrite on the cached descriptor and take no lock of
+ * their own, so threads working on different files, or on different regions
+ * of one file, do not wait for each other. Only opening a file that is not
+ * cached yet takes the cache lock exclusively.
+ *
+ * A descriptor closed by eviction or close() stays valid for the calls that
+ * are still using it.
+ */
+class FileIO {
+public:
+  // the instance shared by everything in the process
+  static FileIO &instance();
+
+  explicit FileIO(size_t max_open = 64);
+
+  FileIO(const FileIO &) = delete;
+  FileIO &operator=(const FileIO &) = delete;
+
+  // write size bytes at offset, the file is created if needed
+  bool pwrite(const std::string &path, int64_t offset, const void *data,
+              size_t size);
+
+  // read up to size bytes at offset, the bytes read or -1
+  int64_t pread(const std::string &path, int64_t offset, void *data,
+                size_t size);
+
+  // replace the content of the file with data
+  bool write(const std::string &path, const std::vector<char> &data);
+
+  // the whole file, read into a buffer sized from the file, empty on error
+  std::vector<char> read(const std::string &path);
+
+  // create the file with size bytes reserved, so positional writes from
+  // several threads can fill it in any order
+  bool preallocate(const std::string &path, int64_t size);
+
+  // resize the file to size bytes
+  bool truncate(const std::string &path, int64_t size);
+
+  int64_t size(const std::string &path);
+
+  bool sync(const std::string &path);
+
+  // drop the cached descriptor, needed before the file is renamed or removed
+  // by someone else
+  void close(const std::string &path);
+
+  size_t openCount() const;
+
+private:
+  class Descriptor {
+  public:
+    Descriptor(int fd, bool writable) : fd_(fd), writable_(writable) {}
+    ~Descriptor();
+
+    int fd() const { return fd_; }
+    bool writable() const { return writable_; }
+
+    // for eviction of the least recently used descriptor
+    std::atomic<uint64_t> last_used{0};
+
+  private:
+    int fd_;
+    bool writable_;
+  };
+
+  std::shared_ptr<Descriptor> open(const std::string &path, bool writable);
+
+  // close the least recently used descriptors until there is room for one
+  void evict();
+
+  const size_t max_open_;
+  std::atomic<uint64_t> clock_{0};
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<Descriptor>> open_;
+};
+
+} // namespace mltdl
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// records below this level are compiled out, their arguments never evaluated:
+// 0 debug, 1 info, 2 warn, 3 error, 4 nothing at all
+#ifndef MLTDL_MIN_LOG_LEVEL
+#define MLTDL_MIN_LOG_LEVEL 0
+#endif
+
+namespace mltdl {
+
+enum class LogLevel : int { kDebug = 0, kInfo, kWarn, kError, kOff };
+
+const char *toString(LogLevel level);
+
+// one line of the log, the fields that are not set are left out
+struct LogRecord {
+  LogLevel level{LogLevel::kInfo};
+  // microseconds since the epoch
+  int64_t ts_us{0};
+  // what happened, a string literal like "retry"
+  const char *event{""};
+  // the thread that logged it, numbered from 1 in order of first use
+  int tid{0};
+  uint64_t job{0};
+  int64_t segment{-1};
+  std::string host;
+  int64_t bytes{-1};
+  // a status code, curl code or errno
+  int64_t code{0};
+  std::string message;
+};
+
+/**
+ * structured logging that stays off the hot path: a record is moved into a
+ * ring of the logging thread, which takes no lock, and a background thread
+ * drains the rings every few milliseconds and writes the lines in one batch.
+ * A retry storm across hundreds of segments costs each of them a move into
+ * its ring, not a synchronized flush of stderr per line. A thread whose ring
+ * is full drops the record and counts it, logging never blocks.
+ *
+ * Lines are logfmt, key=value pairs:
+ *   ts=2026-10-19T05:57:01.123456Z level=warn event=retry job=3 segment=2
+ *   host=example.com bytes=1048576 code=503 tid=4 msg="..."
+ *
+ * Use MLTDL_LOG, it checks the level before anything is evaluated.
+ */
+class Logger {
+public:
+  // records a thread can have waiting for the flusher
+  static constexpr size_t kRingSize = 1024;
+
+  static Logger &global();
+
+  // stops the flusher and writes what is left
+  ~Logger();
+
+  bool enabled(LogLevel level) const {
+    return level >= level_.load(std::memory_order_relaxed);
+  }
+
+  // kOff turns it off at runtime, the default is kInfo
+  void setLevel(LogLevel level) { level_ = level; }
+  LogLevel level() const { return level_; }
+
+  // append the lines to this file instead of stderr, an empty path goes back
+  // to stderr
+  bool setOutput(const std::string &path);
+
+  void submit(LogRecord record);
+
+  // write everything submitted so far before returning
+  void flush();
+
+  // records lost to full rings
+  uint64_t dropped() const { return dropped_; }
+
+  // the rings of live threads and of exited ones not drained yet
+  size_t rings();
+
+  static std::string format(const LogRecord &record);
+
+private:
+  // single producer, the owning thread, single consumer, the drain
+  struct Ring {
+    int tid{0};
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    std::vector<LogRecord> slots{kRingSize};
+    // set when the owning thread exits, the drain that empties it drops it
+    std::atomic<bool> retired{false};
+  };
+
+  // holds the locks across fork(), so a child process can log and flush
+  Logger();
+
+  Ring &ring();
+
+  // take the waiting records of every ring and write them, under
+  // drain_mutex_
+  void drain();
+
+  void flusherMain();
+
+  std::atomic<LogLevel> level_{LogLevel::kInfo};
+  std::atomic<uint64_t> dropped_{0};
+
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<Ring>> rings_;
+  // threads are numbered from 1 in order of their first record
+  int next_tid_{1};
+
+  // one drain at a time, it also guards out_
+  std::mutex drain_mutex_;
+  FILE *out_{stderr};
+
+  std::once_flag started_;
+  std::thread flusher_;
+  std::condition_variable wake_;
+  bool stopping_{false};
+};
+
+/**
+ * a record being filled in, submitted when the statement ends:
+ *   MLTDL_LOG(kWarn, "retry").job(id).code(503).message("...");
+ */
+class LogLine {
+public:
+  LogLine(LogLevel level, const char *event) {
+    record_.level = level;
+    record_.event = event;
+  }
+  ~LogLine() { Logger::global().submit(std::move(record_)); }
+
+  LogLine(const LogLine &) = delete;
+  LogLine &operator=(const LogLine &) = delete;
+
+  LogLine &job(uint64_t job) {
+    record_.job = job;
+    return *this;
+  }
+  LogLine &segment(int64_t segment) {
+    record_.segment = segment;
+    return *this;
+  }
+  LogLine &host(std::string host) {
+    record_.host = std::move(host);
+    return *this;
+  }
+  LogLine &bytes(int64_t bytes) {
+    record_.bytes = bytes;
+    return *this;
+  }
+  LogLine &code(int64_t code) {
+    record_.code = code;
+    return *this;
+  }
+  LogLine &message(std::string message) {
+    record_.message = std::move(message);
+    return *this;
+  }
+
+private:
+  LogRecord record_;
+};
+
+} // namespace mltdl
+
+// the else binds the chained calls to the LogLine, nothing after the level
+// check runs when the record would be dropped
+#define MLTDL_LOG(level, event)                                               \
+  if (static_cast<int>(::mltdl::LogLevel::level) < MLTDL_MIN_LOG_LEVEL ||     \
+      !::mltdl::Logger::global().enabled(::mltdl::LogLevel::level)) {         \
+  } else                                                                      \
+    ::mltdl::LogLine(::mltdl::LogLevel::level, event)
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "download_manager.h"
+#include "pack_store.h"
+#include "status.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+namespace mltdl {
+
+/**
+ * one line of a manifest:
+ *   <url> [destination] [checksum]
+ * separated by spaces or tabs. The destination is a file path, or a
+ * directory when it ends with '/', relative to the download dir unless it is
+ * absolute. The checksum is md5:<hex> or sha256:<hex>, a bare hex string is
+ * told apart by its length. A '-' leaves a column empty.
+ */
+struct ManifestEntry {
+  std::string url;
+  std::string dest;
+  std::string checksum;
+
+  // identifies the entry for deduplication and in the results log
+  uint64_t key() const;
+};
+
+/**
+ * reads a manifest one line at a time, so only the current line is held in
+ * memory no matter how long the manifest is. Blank lines and lines starting
+ * with '#' are skipped.
+ */
+class ManifestReader {
+public:
+  explicit ManifestReader(std::istream &in) : in_(in) {}
+
+  // false at the end of the input
+  bool next(ManifestEntry &entry);
+
+  uint64_t lineNumber() const { return line_number_; }
+
+private:
+  std::istream &in_;
+  std::string line_;
+  uint64_t line_number_{0};
+};
+
+/**
+ * an append-only log of finished entries, one short line per entry:
+ *   <key as 16 hex digits> ok|fail <url>
+ * the keys of the entries that succeeded are loaded when it is opened, so a
+ * run over the same manifest skips them. They stay in memory, a set of
+ * 64-bit keys that grows with every entry that succeeded, tens of bytes
+ * each: about 40 MB for a million.
+ */
+class ResultsLog {
+public:
+  explicit ResultsLog(const std::string &path);
+
+  bool isOpen() const { return out_.is_open(); }
+
+  bool completed(uint64_t key) const;
+
+  size_t completedCount() const;
+
+  // thread safe, the line is flushed so an interrupted run loses nothing
+  void record(const ManifestEntry &entry, const Status &status);
+
+private:
+  mutable std::mutex mutex_;
+  std::unordered_set<uint64_t> completed_;
+  std::ofstream out_;
+};
+
+// compare the file against the checksum of a manifest entry, ok if it is empty
+Status verifyChecksum(const std::string &file_path,
+                      const std::string &checksum);
+
+// the same for data in memory
+Status verifyChecksum(const char *data, size_t size,
+                      const std::string &checksum);
+
+/**
+ * feeds the entries of a manifest to a DownloadManager while keeping at most
+ * max_in_flight of them submitted, so reading a manifest of millions of lines
+ * never queues more than that many jobs.
+ *
+ * Duplicates are found by the key of every distinct entry read so far, so
+ * unlike the jobs, the memory of a run is O(entries), tens of bytes each on
+ * top of what the ResultsLog holds.
+ */
+class ManifestRunner {
+public:
+  struct Summary {
+    uint64_t succeeded{0};
+    uint64_t failed{0};
+    // already completed according to the results log
+    uint64_t skipped{0};
+    uint64_t duplicates{0};
+  };
+
+  // log may be null, nothing is skipped or recorded then
+  ManifestRunner(DownloadManager &manager, const std::string &download_dir,
+                 size_t max_in_flight, ResultsLog *log = nullptr);
+
+  /**
+   * store the entries in a pack store instead of files of their own, keyed
+   * by their destination or, without one, their url. Meant for manifests of
+   * many small objects, each is held in memory until it is complete.
+   */
+  void setPackStore(PackStore *store) { pack_store_ = store; }
+
+  // blocks until every entry of the manifest has finished
+  Summary run(std::istream &in);
+
+private:
+  void submit(const ManifestEntry &entry);
+
+  void submitToPack(const ManifestEntry &entry);
+
+  // count the entry as finished and free its slot
+  void done(const ManifestEntry &entry, const Status &status);
+
+  /**
+   * the directory to download the entry into, and the path to move the file
+   * to afterwards, empty when it keeps the name taken from the url
+   */
+  void resolve(const ManifestEntry &entry, std::string &dir,
+               std::string &target) const;
+
+  DownloadManager &manager_;
+  const std::string download_dir_;
+  const size_t max_in_flight_;
+  ResultsLog *log_;
+  PackStore *pack_store_{nullptr};
+
+  std::mutex mutex_;
+  std::condition_variable slot_free_;
+  size_t in_flight_{0};
+  Summary summary_;
+};
+
+} // namespace mltdl
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace mltdl {
+
+/**
+ * counts the bytes that transfers hold in memory, response bodies and
+ * write-behind buffers, against one limit shared by all downloads of the
+ * process. A transfer that can not get budget for its next chunk pauses
+ * until the writer has drained enough, so the memory use stays bounded when
+ * the disk is slower than the network.
+ */
+class MemoryBudget {
+public:
+  // a capacity of 0 means unlimited
+  explicit MemoryBudget(int64_t capacity = 0) : capacity_(capacity) {}
+
+  MemoryBudget(const MemoryBudget &) = delete;
+  MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+  // the budget shared by every transfer that is not given another one
+  static MemoryBudget &global();
+
+  void setCapacity(int64_t capacity) { capacity_ = capacity; }
+  int64_t capacity() const { return capacity_; }
+  int64_t used() const { return used_; }
+
+  /**
+   * take n bytes if they fit. A request larger than the whole budget is
+   * granted while nothing else is held, otherwise it could never proceed
+   */
+  bool tryAcquire(int64_t n);
+
+  // take n bytes even above the capacity, for memory that can not wait
+  void acquire(int64_t n) { used_ += n; }
+
+  void release(int64_t n) { used_ -= n; }
+
+  // true when n more bytes would currently be granted
+  bool fits(int64_t n) const {
+    auto capacity = capacity_.load();
+    auto used = used_.load();
+    return capacity <= 0 || used == 0 || used + n <= capacity;
+  }
+
+  // true when a transfer asking for more would be paused
+  bool exhausted() const {
+    auto capacity = capacity_.load();
+    return capacity > 0 && used_ >= capacity;
+  }
+
+  /**
+   * holds bytes of a budget until it is destroyed, handed out with a
+   * response body so the budget is released once the caller is done with it
+   */
+  class Lease {
+  public:
+    explicit Lease(MemoryBudget &budget) : budget_(budget) {}
+    ~Lease() { budget_.release(bytes_); }
+
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+
+    void add(int64_t n) {
+      budget_.acquire(n);
+      bytes_ += n;
+    }
+    int64_t bytes() const { return bytes_; }
+
+  private:
+    MemoryBudget &budget_;
+    int64_t bytes_{0};
+  };
+
+private:
+  std::atomic<int64_t> capacity_;
+  std::atomic<int64_t> used_{0};
+};
+
+} // namespace mltdl
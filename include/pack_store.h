@@ -0,0 +1,204 @@
+#pragma once
+
+#include "sink.h"
+#include "status.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mltdl {
+
+/**
+ * stores many small objects in a few large append-only pack files instead of
+ * a file each, so pulling millions of them costs a few file creations and
+ * sequential writes rather than millions of inodes.
+ *
+ * The directory holds
+ *   pack-NNNNNN.pack  records of <header><key><data>, appended
+ *   index             entries sorted by key hash, read through mmap
+ *   index.log         entries appended since the index was last written
+ *
+ * An index entry is 64 bytes: key hash, pack, offset, length and the
+ * SHA-256 of the data. Lookups binary search the mapped index and a hash map
+ * of the log entries, so the heap only holds what was added since the last
+ * checkpoint. Objects are found by a 64-bit hash of their key, the key
+ * stored in the pack is compared before an object is handed out, replaced
+ * or removed. A put whose key collides with the key of another live object
+ * is refused.
+ *
+ * Thread safe, puts and reads run in parallel, compaction runs alone.
+ */
+class PackStore {
+public:
+  static constexpr int64_t kDefaultMaxPackSize = 1LL << 30;
+
+  // the hashes are stored, a store has to be opened with the function it
+  // was written with. Other than the default only for tests
+  using KeyHash = uint64_t (*)(const std::string &key);
+
+  // where an object is
+  struct Location {
+    uint32_t pack{0};
+    // of the data in the pack file
+    int64_t offset{0};
+    int64_t length{0};
+    // SHA-256 of the data in hex
+    std::string digest;
+  };
+
+  // a new pack is started once the current one would grow past max_pack_size
+  explicit PackStore(const std::string &dir,
+                     int64_t max_pack_size = kDefaultMaxPackSize,
+                     KeyHash hash = hashKey);
+  // writes the index, see checkpoint
+  ~PackStore();
+
+  PackStore(const PackStore &) = delete;
+  PackStore &operator=(const PackStore &) = delete;
+
+  bool isOpen() const { return open_; }
+
+  // store the object under key, replacing an object stored before. false
+  // if the key's hash is taken by another key
+  bool put(const std::string &key, const char *data, size_t size);
+
+  bool contains(const std::string &key) const;
+
+  bool lookup(const std::string &key, Location &location) const;
+
+  // the data of the object, checked against its digest if verify is set
+  bool read(const std::string &key, std::vector<char> &data,
+            bool verify = false) const;
+
+  bool remove(const std::string &key);
+
+  // live objects
+  size_t size() const;
+
+  // bytes in the packs that belong to replaced or removed objects
+  int64_t deadBytes() const;
+
+  /**
+   * merge the log into the sorted index and map it again. Done on its own
+   * once the log grows to a fraction of the index, so the cost of all
+   * checkpoints stays linear in the number of objects.
+   */
+  bool checkpoint();
+
+  /**
+   * copy the live objects into new packs, in the order they were written,
+   * and drop the old packs with the bytes of replaced and removed objects
+   */
+  bool compact();
+
+private:
+  struct Entry {
+    uint64_t key_hash;
+    uint32_t pack;
+    uint16_t flags;
+    uint16_t key_length;
+    // of the record header
+    uint64_t offset;
+    // of the data
+    uint64_t length;
+    unsigned char digest[32];
+  };
+  static_assert(sizeof(Entry) == 64, "index entries are 64 bytes on disk");
+
+  enum Flags : uint16_t { kLive = 1, kRemoved = 2 };
+
+  // FNV-1a
+  static uint64_t hashKey(const std::string &key);
+
+  // the bytes of the record in its pack, header and key included
+  static int64_t recordSize(const Entry &entry);
+
+  std::string packPath(uint32_t pack) const;
+
+  // the newest entry for the hash, null if there is none, under mutex_
+  const Entry *find(uint64_t key_hash) const;
+
+  // the live entry of key, null if there is none or the hash belongs to
+  // another key, under mutex_
+  const Entry *findLive(const std::string &key) const;
+
+  // whether the record of entry was stored under key, from its pack
+  bool storedUnder(const Entry &entry, const std::string &key) const;
+
+  // append to the log and the log map, under an exclusive mutex_
+  bool appendLog(const Entry &entry);
+
+  // map the index file, under an exclusive mutex_
+  bool mapIndex();
+  void unmapIndex();
+
+  // write entries as the new index, under an exclusive mutex_
+  bool writeIndex(const std::vector<Entry> &entries);
+
+  // every live entry, sorted by key hash, under mutex_
+  std::vector<Entry> liveEntries() const;
+
+  bool checkpointLocked();
+
+  const std::string dir_;
+  const int64_t max_pack_size_;
+  const KeyHash hash_;
+  bool open_{false};
+
+  mutable std::shared_mutex mutex_;
+  // the mapped index
+  const Entry *index_{nullptr};
+  size_t index_count_{0};
+  size_t mapped_size_{0};
+  // entries of index.log by key hash, the newest wins
+  std::unordered_map<uint64_t, Entry> log_;
+  int64_t log_size_{0};
+
+  size_t live_{0};
+  std::atomic<int64_t> dead_bytes_{0};
+
+  // the pack appended to and its size, guarded by append_mutex_ so puts
+  // holding mutex_ shared can reserve their space
+  std::mutex append_mutex_;
+  uint32_t pack_{1};
+  int64_t pack_size_{0};
+  // bumped by compaction, a put that reserved space before has to redo it
+  uint64_t epoch_{0};
+};
+
+/**
+ * collects a download in memory and stores it in a PackStore when it
+ * succeeded, for objects small enough to be held whole. check may reject
+ * the data before it is stored.
+ */
+class PackSink : public Sink {
+public:
+  using Check = std::function<Status(const std::vector<char> &)>;
+
+  PackSink(PackStore &store, std::string key, Check check = nullptr)
+      : store_(store), key_(std::move(key)), check_(std::move(check)) {}
+
+  bool write(int64_t offset, const char *data, size_t size) override;
+
+  void finish(const Status &status) override;
+
+  // the outcome once finish ran, the download's status or why storing failed
+  Status status() const;
+
+private:
+  PackStore &store_;
+  const std::string key_;
+  Check check_;
+  mutable std::mutex mutex_;
+  std::vector<char> data_;
+  Status status_{StatusCode::kPending, ""};
+};
+
+} // namespace mltdl
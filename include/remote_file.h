@@ -0,0 +1,146 @@
+#pragma once
+
+#include "client.h"
+#include "curl_pool.h"
+#include "status.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mltdl {
+
+struct RemoteFileOptions {
+  // the unit of fetching and caching
+  int64_t block_size{1024 * 1024};
+  // blocks kept in memory
+  size_t memory_blocks{64};
+  // keep blocks in this directory too, so they outlive the RemoteFile. Empty
+  // for memory only
+  std::string disk_dir;
+  // blocks kept in disk_dir
+  size_t disk_blocks{1024};
+  // blocks fetched ahead of sequential reads at most, the window doubles
+  // from one block with every read that follows the last one
+  int read_ahead{8};
+  // adjacent missing blocks fetched with one request at most
+  int max_coalesce{16};
+  // connections to the server
+  size_t connections{4};
+  RetryStrategy retry{3, 500, 2, 30000};
+};
+
+/**
+ * reads parts of a remote file without downloading it, like pread on a
+ * local one: a zip central directory, a Parquet footer or a tar index costs
+ * a few range requests instead of the whole file.
+ *
+ * The file is read in blocks, kept in an LRU cache in memory and, with a
+ * disk_dir, in an LRU cache of block files that the next RemoteFile of the
+ * same url and version finds again. The missing blocks of a read are
+ * fetched with as few requests as adjacency allows. Reads that follow each
+ * other are detected and the blocks after them fetched in the same request.
+ *
+ * Every request carries the validator seen by open() in If-Range, a file
+ * that changed on the server fails the read instead of mixing versions.
+ *
+ * Thread safe, a block that several threads miss at once is fetched once.
+ */
+class RemoteFile {
+public:
+  struct Stats {
+    // blocks found in memory
+    std::atomic<uint64_t> hits{0};
+    // blocks found on disk
+    std::atomic<uint64_t> disk_hits{0};
+    // blocks fetched from the server
+    std::atomic<uint64_t> fetched{0};
+    // of them, fetched ahead of the reads
+    std::atomic<uint64_t> read_ahead{0};
+    std::atomic<uint64_t> requests{0};
+  };
+
+  explicit RemoteFile(const std::string &url,
+                      const RemoteFileOptions &options = RemoteFileOptions());
+
+  RemoteFile(const RemoteFile &) = delete;
+  RemoteFile &operator=(const RemoteFile &) = delete;
+
+  // learn the size and the validator of the file
+  Status open();
+
+  bool isOpen() const { return size_ >= 0; }
+
+  const std::string &url() const { return url_; }
+
+  // -1 until it is open
+  int64_t size() const { return size_; }
+
+  // read up to size bytes at offset, the bytes read, 0 at the end of the
+  // file or -1 on error, see lastError
+  int64_t pread(int64_t offset, void *data, size_t size);
+
+  Status lastError() const;
+
+  const Stats &stats() const { return stats_; }
+
+private:
+  using Block = std::shared_ptr<const std::vector<char>>;
+
+  // the blocks first to last, fetched where they are missing, with ahead
+  // more blocks after last fetched along. Empty on error
+  std::vector<Block> blocks(int64_t first, int64_t last, int64_t ahead);
+
+  // fetch count blocks from first on from the server, with one request
+  Status fetch(int64_t first, int64_t count, std::vector<Block> &out);
+
+  // the block from disk_dir, null if it is not there whole
+  Block readDisk(int64_t index);
+
+  // keep the blocks in disk_dir, evicting the least recently used
+  void writeDisk(const std::vector<std::pair<int64_t, Block>> &blocks);
+
+  // remember a block in memory, evicting the least recently used, under
+  // mutex_
+  void remember(int64_t index, const Block &block);
+
+  int64_t blockLength(int64_t index) const;
+
+  std::string diskPath(int64_t index) const;
+
+  const std::string url_;
+  const RemoteFileOptions options_;
+  int64_t size_{-1};
+  std::string validator_;
+  // names the blocks of this version of the file in disk_dir, empty if they
+  // are not kept there
+  std::string disk_key_;
+  std::shared_ptr<Client> client_;
+  CurlPool curls_;
+  Stats stats_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable fetched_;
+  // most recently used first
+  std::list<int64_t> memory_order_;
+  std::unordered_map<int64_t, std::pair<Block, std::list<int64_t>::iterator>>
+      memory_;
+  // the blocks in disk_dir, most recently used first
+  std::list<int64_t> disk_order_;
+  std::unordered_map<int64_t, std::list<int64_t>::iterator> disk_;
+  // blocks some thread is fetching
+  std::set<int64_t> in_flight_;
+  // where the last read ended and the read-ahead window it earned
+  int64_t next_offset_{-1};
+  int64_t window_{0};
+  Status error_;
+};
+
+} // namespace mltdl
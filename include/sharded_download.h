@@ -0,0 +1,188 @@
+#pragma once
+
+#include "status.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace mltdl {
+
+// where a sharded download is, for ShardOptions::on_progress
+struct ShardProgress {
+  int64_t done{0};
+  int64_t total{0};
+  int shards{0};
+  int shards_done{0};
+  // the worker processes running
+  std::vector<pid_t> workers;
+  // workers that died and were replaced
+  int restarts{0};
+};
+
+struct ShardOptions {
+  // worker processes at once
+  int workers{4};
+  // transfers inside each worker
+  int threads{4};
+  int64_t shard_size{256LL * 1024 * 1024};
+  // a worker whose claimed shard has not been written for this long is
+  // killed and its shards are reassigned
+  int64_t stall_timeout_ms{120000};
+  // workers that may die over the whole download before it fails
+  int max_restarts{8};
+  // a shard fails the download after failing this many claims
+  int max_attempts{3};
+  // how often the coordinator looks at the workers and the ledger
+  int64_t poll_ms{50};
+  /**
+   * the command of a worker, the ledger path is appended. The default runs
+   * the program again, its main() has to hand "--shard-worker <ledger>" to
+   * runShardWorker.
+   */
+  std::vector<std::string> worker_command{"/proc/self/exe", "--shard-worker"};
+  /**
+   * fork the coordinator and run the worker in the child instead of
+   * spawning worker_command. Only for single-threaded callers: the child
+   * gets just the forking thread, a lock another thread held stays locked
+   * in it for good.
+   */
+  bool fork_workers{false};
+  // called by the coordinator on every poll
+  std::function<void(const ShardProgress &)> on_progress;
+};
+
+/**
+ * the state of a sharded download in a file that the coordinator and every
+ * worker process map, so they share it without a channel between them. It
+ * lives next to the target as <target>.ledger:
+ *   header     magic, size, shard size and count, threads per worker and
+ *              attempts per shard
+ *   slots      one 64-byte slot per shard
+ *   strings    the url, the validator and the target path
+ *
+ * A worker claims a free shard with a compare-and-swap of its owner and
+ * advances done as its bytes reach the target, so a shard taken from a
+ * worker that died resumes where that one stopped. done counts bytes handed
+ * to the kernel, they survive the death of a process but not of the box.
+ *
+ * The ledger is left behind when the coordinator is interrupted, the next
+ * run of the same download picks it up and only fetches what is missing.
+ */
+class ShardLedger {
+public:
+  enum State : int32_t { kFree = 0, kClaimed, kDone, kFailed };
+
+  struct alignas(64) Slot {
+    int64_t start;
+    // inclusive
+    int64_t end;
+    // bytes from start that are in the target
+    std::atomic<int64_t> done;
+    // CLOCK_MONOTONIC of the owner's last write, the same in every process
+    std::atomic<int64_t> heartbeat_ns;
+    std::atomic<int32_t> state;
+    // pid of the worker holding the claim
+    std::atomic<int32_t> owner;
+    // claims that ended in a failure
+    std::atomic<int32_t> attempts;
+    // the StatusCode of a failed shard
+    std::atomic<int32_t> error;
+  };
+
+  /**
+   * a new ledger for the download, or the one left by an interrupted run of
+   * the same url, size and validator when resume is set, with the claims of
+   * the processes of that run released. The coordinator holds a lock on it
+   * until it goes away. Null if it can't be created or is locked by another
+   * coordinator.
+   */
+  static std::unique_ptr<ShardLedger>
+  create(const std::string &path, const std::string &url,
+         const std::string &validator, const std::string &target,
+         int64_t size, const ShardOptions &options, bool resume);
+
+  // the ledger of a running download, for a worker. Null if it's not one
+  static std::unique_ptr<ShardLedger> open(const std::string &path);
+
+  ~ShardLedger();
+
+  ShardLedger(const ShardLedger &) = delete;
+  ShardLedger &operator=(const ShardLedger &) = delete;
+
+  const std::string &url() const { return url_; }
+  const std::string &validator() const { return validator_; }
+  const std::string &target() const { return target_; }
+  int64_t size() const;
+  int count() const;
+  int threads() const;
+  int maxAttempts() const;
+
+  Slot &slot(int i);
+  const Slot &slot(int i) const;
+
+  // claim a free shard for the worker, -1 if none is free
+  int claim(pid_t owner);
+
+  // free the shards the worker still holds, returns how many
+  int release(pid_t owner);
+
+  // the owner wrote all of the shard
+  void finish(int i);
+
+  // hand a shard that failed back, it is failed for good when the status
+  // is not retryable or after max_attempts failed claims
+  void fail(int i, const Status &status);
+
+  int64_t done() const;
+  int countState(State state) const;
+  bool complete() const { return countState(kDone) == count(); }
+  // the first failed shard, -1 if there is none
+  int failed() const;
+
+  // tells the workers to stop
+  void abort();
+  bool aborted() const;
+
+private:
+  struct Header;
+
+  ShardLedger() = default;
+
+  // map length bytes of fd_, shared with the other processes
+  bool map(size_t length);
+
+  // check the header and read the strings of the mapped ledger
+  bool load();
+
+  Header *header() const;
+
+  int fd_{-1};
+  void *base_{nullptr};
+  size_t length_{0};
+  std::string url_;
+  std::string validator_;
+  std::string target_;
+};
+
+/**
+ * download url into target with several worker processes, so one transfer
+ * is not bound by the cpu, memory and descriptors of a single process. The
+ * target is preallocated and cut into shards, the workers claim shards
+ * through the ledger and write them in place at their offsets.
+ *
+ * The coordinator only watches: a worker that dies or stalls has its
+ * shards handed to a replacement, which resumes them. The ledger is removed
+ * once every shard is in the target.
+ */
+Status shardedDownload(const std::string &url, const std::string &target,
+                       const ShardOptions &options = ShardOptions());
+
+// the body of a worker process, returns its exit code
+int runShardWorker(const std::string &ledger_path);
+
+} // namespace mltdl
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "client.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace mltdl {
+
+/**
+ * a network that is not there: a client for sim:// urls that makes up the
+ * resource and the transfer from a seeded model, with no sockets and, in
+ * virtual time, no waiting. Lets the scheduling, retry and merge logic of
+ * DownloadManager run at tens of thousands of segments a second, and a run
+ * with the same seed fail in the same places every time.
+ *
+ *   sim://<anything>/<name>?size=1048576&seed=7&error_rate=0.1
+ *
+ * The query sets the model, every parameter is optional:
+ *   size        bytes of the resource (default 1 MiB)
+ *   seed        picks the data and every random decision (default 1)
+ *   bandwidth   bytes per second of one transfer, 0 for no limit
+ *   latency_ms  before the first byte of every request
+ *   error_rate  chance an attempt fails, half of the failures are a 503,
+ *               the other half a connection reset somewhere in the body
+ *   stall_rate  chance an attempt stalls for stall_ms before its data
+ *   stall_ms
+ *   status      every transfer is answered with this status code instead,
+ *               the probe still succeeds
+ *   ranges=0    the resource can only be fetched from the first byte
+ *   time=real   really wait for latency, bandwidth, stalls and backoff
+ *               instead of only counting the time in stats()
+ *
+ * Byte i of a resource only depends on seed and i, see fill, and whether an
+ * attempt fails only on the seed, the range and the attempt number, not on
+ * the order the transfers run in.
+ */
+class SimClient : public Client {
+public:
+  // the curl handles are ignored
+  Response get(const std::string &url, const RetryStrategy &rs, CURL *curl,
+               int64_t start, int64_t end, void *userp = nullptr,
+               TransferControl *control = nullptr) override;
+  Response post(const std::string &url, const std::string &post_fields,
+                const RetryStrategy &rs, CURL *curl,
+                void *userp = nullptr) override;
+  Response stream(const std::string &url, const RetryStrategy &rs, CURL *curl,
+                  int64_t start, int64_t end, Sink &sink,
+                  TransferControl *control = nullptr) override;
+  Response put(const std::string &url, const std::string &file_path,
+               int64_t offset, int64_t length,
+               const std::vector<std::string> &headers,
+               const RetryStrategy &rs, CURL *curl,
+               TransferControl *control = nullptr) override;
+  int64_t getFileSize(const std::string &url, CURL *curl) override;
+  ResourceInfo probe(const std::string &url, CURL *curl) override;
+
+  // the bytes of the resource with this seed from offset on
+  static void fill(uint64_t seed, int64_t offset, char *data, size_t size);
+
+  // what every simulated transfer of the process added up to
+  struct Stats {
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> stalls{0};
+    std::atomic<uint64_t> bytes{0};
+    // the time the transfers would have taken on the modelled network, in
+    // microseconds, summed over all of them
+    std::atomic<uint64_t> virtual_us{0};
+
+    void reset();
+  };
+
+  static Stats &stats();
+
+  struct Model {
+    int64_t size{1024 * 1024};
+    uint64_t seed{1};
+    int64_t bandwidth{0};
+    int64_t latency_ms{0};
+    double error_rate{0};
+    double stall_rate{0};
+    int64_t stall_ms{0};
+    long status{0};
+    bool ranges{true};
+    bool real_time{false};
+  };
+
+  // the model of a sim:// url, false if a parameter is malformed
+  static bool parseModel(const std::string &url, Model &model);
+
+private:
+  // the attempts at start..end, every byte goes to writer
+  Response transfer(const std::string &url, const RetryStrategy &rs,
+                    int64_t start, int64_t end, const RangeWriter &writer,
+                    TransferControl *control);
+};
+
+} // namespace mltdl
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "byte_ranges.h"
+#include "memory_budget.h"
+#include "status.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace mltdl {
+
+struct TransferControl;
+
+/**
+ * receives the bytes of a download as they arrive instead of a file. data
+ * points straight into curl's receive buffer and is only valid during the
+ * call, a sink that keeps it has to copy it.
+ *
+ * The segments of a download call write from several threads at once and
+ * in no particular order, wrap the sink in an OrderedSink to get the bytes
+ * one after another from the start of the resource.
+ */
+class Sink {
+public:
+  virtual ~Sink() {}
+
+  // size bytes at offset in the resource, false aborts the download
+  virtual bool write(int64_t offset, const char *data, size_t size) = 0;
+  // a segment is about to fetch [start, end]. A sink that gets some of the
+  // bytes elsewhere narrows the range to what the segment should fetch,
+  // false if it should fetch none. The bytes left out are the sink's to get
+  virtual bool claim(int64_t & /*start*/, int64_t & /*end*/) { return true; }
+
+  // called once when the download is over, with its final status
+  virtual void finish(const Status & /*status*/) {}
+};
+
+// a sink that is just a function, it must be safe to call from many threads
+class FunctionSink : public Sink {
+public:
+  explicit FunctionSink(RangeWriter writer) : writer_(std::move(writer)) {}
+
+  bool write(int64_t offset, const char *data, size_t size) override {
+    return writer_(offset, data, size);
+  }
+
+private:
+  RangeWriter writer_;
+};
+
+/**
+ * hands the bytes to the inner sink in order, from start on, one call at a
+ * time. Data at the next expected offset passes through without a copy,
+ * data that arrives ahead of a gap is copied and held until the gap is
+ * filled. Once max_buffered bytes are held, writers ahead of the gap block,
+ * which stalls their transfers until the one behind catches up.
+ */
+class OrderedSink : public Sink {
+public:
+  static constexpr int64_t kDefaultMaxBuffered = 64LL * 1024 * 1024;
+
+  // a blocked writer gives up once control is cancelled
+  OrderedSink(std::shared_ptr<Sink> inner, int64_t start = 0,
+              int64_t max_buffered = kDefaultMaxBuffered,
+              const TransferControl *control = nullptr,
+              MemoryBudget &budget = MemoryBudget::global());
+  ~OrderedSink();
+
+  bool write(int64_t offset, const char *data, size_t size) override;
+
+  void finish(const Status &status) override;
+
+  // fail every write from now on and wake the blocked ones
+  void cancel();
+
+  // the offset the inner sink expects next
+  int64_t next() const;
+
+  int64_t buffered() const;
+
+private:
+  // pass the data at next_ on, then what it made contiguous, under mutex_
+  bool deliver(const char *data, size_t size);
+
+  bool cancelled() const;
+
+  std::shared_ptr<Sink> inner_;
+  const int64_t max_buffered_;
+  const TransferControl *control_;
+  MemoryBudget &budget_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable advanced_;
+  int64_t next_;
+  int64_t buffered_{0};
+  bool failed_{false};
+  // data ahead of next_ by offset
+  std::map<int64_t, std::vector<char>> pending_;
+};
+
+} // namespace mltdl
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+
+namespace mltdl {
+
+enum class StatusCode {
+  kOk = 0,
+  // the download has been submitted but has not finished yet
+  kPending,
+  // the url is empty or malformed
+  kInvalidArgument,
+  // no client is registered for the protocol of the url
+  kUnsupported,
+  // the transfer failed at the network level, it is worth trying again
+  kNetworkError,
+  // the server answered with a status code that is not a success
+  kHttpError,
+  // a local file could not be created, written or read
+  kIoError,
+  // the transfer finished but the data does not match what was expected
+  kCorrupted,
+  // the download was cancelled by the caller
+  kCancelled,
+};
+
+/**
+ * Result of a download, replaces the raw 0/1/-1 integers that
+ * DownloadManager::download used to return. The code tells the caller what
+ * kind of failure happened, the message carries the cause for humans.
+ */
+class Status {
+public:
+  Status() = default;
+  Status(StatusCode code, std::string message)
+      : code_(code), message_(std::move(message)) {}
+
+  static Status OK() { return Status(); }
+
+  bool ok() const { return code_ == StatusCode::kOk; }
+  bool pending() const { return code_ == StatusCode::kPending; }
+
+  // network failures and corrupted transfers may succeed on a second attempt,
+  // everything else will fail the same way again
+  bool retryable() const {
+    return code_ == StatusCode::kNetworkError ||
+           code_ == StatusCode::kCorrupted;
+  }
+
+  StatusCode code() const { return code_; }
+  const std::string &message() const { return message_; }
+
+  std::string toString() const {
+    if (message_.empty()) {
+      return codeName(code_);
+    }
+    return codeName(code_) + ": " + message_;
+  }
+
+  static std::string codeName(StatusCode code) {
+    switch (code) {
+    case StatusCode::kOk:
+      return "OK";
+    case StatusCode::kPending:
+      return "Pending";
+    case StatusCode::kInvalidArgument:
+      return "InvalidArgument";
+    case StatusCode::kUnsupported:
+      return "Unsupported";
+    case StatusCode::kNetworkError:
+      return "NetworkError";
+    case StatusCode::kHttpError:
+      return "HttpError";
+    case StatusCode::kIoError:
+      return "IoError";
+    case StatusCode::kCorrupted:
+      return "Corrupted";
+    case StatusCode::kCancelled:
+      return "Cancelled";
+    }
+    return "Unknown";
+  }
+
+private:
+  StatusCode code_{StatusCode::kOk};
+  std::string message_;
+};
+
+} // namespace mltdl
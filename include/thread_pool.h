@@ -1,7 +1,11 @@
 #pragma once
 
+#include "work_queue.h"
+
+#include <chrono>
 #include <condition_variable>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <string>
@@ -10,10 +14,17 @@
 
 namespace mltdl {
 
+// cpu ids go from 0 to below this, 0 where pinning is not supported
+int cpuLimit();
+
+// keep the thread on one cpu, false for a cpu id out of range or where that
+// is not supported
+bool pinThread(std::thread &thread, int cpu);
+
 class ThreadPool {
 public:
   // Basic unit of work that our threads do
-  using Work = std::function<void(int32_t)>;
+  using Work = WorkQueue::Work;
 
   ThreadPool(const char *name = "default");
   ThreadPool(int32_t num_thread, const char *name = "default");
@@ -31,8 +42,24 @@ public:
    */
   void enqueue(Work work, bool finished_adding_work = false);
 
+  // same as above, the options choose the priority and fair-share flow
+  void enqueue(Work work, const WorkOptions &options,
+               bool finished_adding_work = false);
+
   // Add a work to the queue and wakes up a thread to do it
   void spawn(Work work);
+  void spawn(Work work, const WorkOptions &options);
+
+  // a lower priority class is served after being passed over this many times
+  void setStarvationLimit(int limit);
+
+  /**
+   * pin thread i to cpus[i % cpus.size()], so a worker keeps its caches,
+   * socket buffers and the memory it touched first on one core. An empty
+   * list spreads the threads over all cpus. False if a thread could not be
+   * pinned.
+   */
+  bool pinThreads(std::vector<int> cpus = {});
 
   /**
    * Wakes up all the threads to complete all the queued work,
@@ -69,7 +96,7 @@ private:
 
   std::string name_;
   std::vector<std::thread> threads_;
-  std::queue<Work> work_queue_;
+  WorkQueue work_queue_;
 
   bool running_;
   bool work_complete_;
@@ -83,4 +110,63 @@ private:
   std::vector<std::queue<std::string>> tl_errors_;
 };
 
+/**
+ * a set of tasks in a ThreadPool that is waited on, cancelled and checked
+ * for errors on its own, so independent users of one pool don't wait for
+ * each other's work the way waitForCompletion does.
+ *
+ * The exceptions of the group's tasks are kept with the group instead of
+ * the pool. Cancelling drops the tasks still queued, they are skipped when
+ * a worker picks them, and the running ones can look at cancelled(). The
+ * destructor waits for the group.
+ */
+class TaskGroup {
+public:
+  using Work = ThreadPool::Work;
+
+  // options are used for every task spawned without options of its own
+  explicit TaskGroup(ThreadPool &pool,
+                     const WorkOptions &options = WorkOptions());
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  void spawn(Work work);
+  void spawn(Work work, const WorkOptions &options);
+
+  // blocks until the running tasks are done and none are queued, dropped
+  // tasks of a cancelled group don't count
+  void wait();
+
+  // false if the group was still busy after timeout
+  bool waitFor(std::chrono::milliseconds timeout);
+
+  void cancel();
+  bool cancelled() const;
+
+  // tasks queued or running
+  size_t pending() const;
+
+  // what the tasks threw, in the order they threw it
+  std::vector<std::string> errors() const;
+
+private:
+  // outlives the group while its dropped tasks are still in the pool's queue
+  struct State {
+    mutable std::mutex mutex;
+    std::condition_variable done;
+    size_t queued{0};
+    size_t running{0};
+    bool cancelled{false};
+    std::vector<std::string> errors;
+
+    bool idle() const { return running == 0 && (queued == 0 || cancelled); }
+  };
+
+  ThreadPool &pool_;
+  const WorkOptions options_;
+  std::shared_ptr<State> state_;
+};
+
 } // namespace mltdl
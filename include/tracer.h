@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mltdl {
+
+/**
+ * records a timeline in the Chrome trace-event format, to be opened in
+ * chrome://tracing or ui.perfetto.dev. Off unless started, then every
+ * thread appends to a buffer of its own, so recording takes no shared lock
+ * and the events are only gathered and formatted when the trace is written.
+ *
+ * Names and categories must be string literals, they are kept as pointers.
+ */
+class Tracer {
+public:
+  static Tracer &global();
+
+  // start recording, stop() writes what was recorded to path
+  void start(const std::string &path);
+
+  // write the trace and stop recording, false if the file can not be written
+  bool stop();
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // microseconds on the steady clock, the time base of every event
+  static int64_t nowUs();
+
+  // a span that started at start_us and lasted dur_us, on the calling thread
+  void complete(const char *name, const char *category, int64_t start_us,
+                int64_t dur_us, std::string args = std::string());
+
+  // a moment on the calling thread
+  void instant(const char *name, const char *category,
+               std::string args = std::string());
+
+  /**
+   * a span that may begin and end on different threads, the id ties the two
+   * together. Spans of the same name and category share a track.
+   */
+  void asyncBegin(const char *name, const char *category, uint64_t id,
+                  std::string args = std::string());
+  void asyncEnd(const char *name, const char *category, uint64_t id,
+                std::string args = std::string());
+
+  // how the calling thread is labelled in the viewer
+  void setThreadName(const std::string &name);
+
+  // the buffers of live threads that recorded or were named while tracing,
+  // and of exited ones not written yet
+  size_t buffers();
+
+  /**
+   * records a complete event from construction to destruction when the
+   * tracer is enabled, costs a relaxed load otherwise
+   */
+  class Span {
+  public:
+    Span(const char *name, const char *category);
+    ~Span();
+
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+    // record the span now instead of at destruction
+    void end();
+
+    // shown with the event, ignored while the tracer is off
+    void arg(const char *key, int64_t value);
+    void arg(const char *key, const std::string &value);
+
+  private:
+    const char *name_;
+    const char *category_;
+    int64_t start_us_{-1};
+    std::string args_;
+  };
+
+  // the args of an event as one JSON object body, "key":value,...
+  static void appendArg(std::string &args, const char *key, int64_t value);
+  static void appendArg(std::string &args, const char *key,
+                        const std::string &value);
+
+private:
+  struct Event {
+    char phase;
+    const char *name;
+    const char *category;
+    int64_t ts;
+    int64_t dur;
+    uint64_t id;
+    std::string args;
+  };
+
+  struct ThreadBuffer {
+    int tid;
+    std::string name;
+    // only contended while the trace is written
+    std::mutex mutex;
+    std::vector<Event> events;
+    // set when the owning thread exits, the next stop() or start() drops it
+    std::atomic<bool> retired{false};
+  };
+
+  // the calling thread's buffer, nullptr if it has none and create is false
+  ThreadBuffer *buffer(bool create);
+
+  void record(Event event);
+
+  std::atomic<bool> enabled_{false};
+  std::mutex mutex_;
+  std::string path_;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+  // threads are numbered from 1 in order of their first event
+  int next_tid_{1};
+};
+
+} // namespace mltdl
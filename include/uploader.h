@@ -0,0 +1,95 @@
+#pragma once
+
+#include "client.h"
+#include "curl_pool.h"
+#include "status.h"
+#include "thread_pool.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mltdl {
+
+// how a file is sent to the server
+enum class UploadMode {
+  // one PUT of the whole file
+  kSingle,
+  // a PUT per part to the url, with a Content-Range header telling where
+  // the part goes
+  kRangedPut,
+  // a PUT per part to part_url, then a POST to complete_url listing the
+  // parts and their ETags, one "<number> <etag>" line each
+  kMultipart,
+};
+
+struct UploadOptions {
+  static constexpr int64_t kDefaultPartSize = 8LL * 1024 * 1024;
+
+  UploadMode mode{UploadMode::kRangedPut};
+  int64_t part_size{kDefaultPartSize};
+  // where part n goes in kMultipart mode, "{part}" is replaced with n, the
+  // default is the url with partNumber={part} added to its query
+  std::string part_url;
+  // the url that completes a kMultipart upload, the url itself by default
+  std::string complete_url;
+  RetryStrategy retry{3, 500, 2, 30000};
+  // send the MD5 of every part as Content-MD5 and compare it to the ETag
+  // the server answers with, when that is an MD5 too
+  bool verify{true};
+};
+
+// a piece of the file and how its upload went
+struct UploadPart {
+  // from 1
+  int number{0};
+  int64_t offset{0};
+  int64_t length{0};
+  // in hex, set when verify is
+  std::string md5;
+  std::string etag;
+  Status status{StatusCode::kPending, ""};
+};
+
+/**
+ * the upload side of DownloadManager: a file is cut into parts that are read
+ * from the disk as they are sent, nothing holds more than curl's buffer of
+ * it, and up to max_parallel parts go out at once, each on a connection of
+ * its own. A part that fails is retried on its own, the upload only fails
+ * when a part runs out of attempts, and then the others are cancelled.
+ */
+class Uploader {
+public:
+  explicit Uploader(size_t max_parallel = 8);
+
+  // let the parts still running finish
+  ~Uploader();
+
+  /**
+   * upload the file to the url and block until it is done. Several uploads
+   * can run at once, their parts share the threads. control, if given,
+   * sees the bytes sent and cancels the upload. parts, if given, receives
+   * the parts and their outcome.
+   */
+  Status upload(const std::string &file_path, const std::string &url,
+                const UploadOptions &options = UploadOptions(),
+                TransferControl *control = nullptr,
+                std::vector<UploadPart> *parts = nullptr);
+
+  // the parts of a file of this size, a single empty part for an empty one
+  static std::vector<UploadPart> split(int64_t size, int64_t part_size);
+
+  // where part number goes, see UploadOptions::part_url
+  static std::string partUrl(const UploadOptions &options,
+                             const std::string &url, int number);
+
+private:
+  Status uploadPart(const std::string &file_path, const std::string &url,
+                    int64_t file_size, const UploadOptions &options,
+                    UploadPart &part, TransferControl *control, int worker);
+
+  ThreadPool thread_pool_;
+  CurlPool curl_pool_;
+};
+
+} // namespace mltdl
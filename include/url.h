@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace mltdl {
+
+/**
+ * the pieces of a url, as views into the string that was parsed, so
+ * splitting a url allocates nothing. The views are only valid as long as
+ * that string is.
+ *
+ *   scheme://host[:port][/path][?query][#fragment]
+ *
+ * An IPv6 host keeps its brackets in host, percent-escapes are left encoded.
+ */
+struct UrlParts {
+  std::string_view scheme;
+  std::string_view host;
+  std::string_view port;
+  std::string_view path;
+  std::string_view query;
+  std::string_view fragment;
+  // 0 when the url has no port
+  uint16_t port_number{0};
+  bool ipv6{false};
+};
+
+/**
+ * split and validate the url in one pass. Only http, https, ftp and sim,
+ * see SimClient, are accepted, the scheme in any case. On failure the parts
+ * found so far are kept, the scheme is set whenever the url has a "://".
+ */
+bool parseUrl(std::string_view url, UrlParts &parts);
+
+/**
+ * decode the percent-escapes of a path or query into out, false if an escape
+ * is malformed
+ */
+bool percentDecode(std::string_view in, std::string &out);
+
+} // namespace mltdl
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 namespace mltdl {
@@ -7,6 +8,11 @@ std::string calculateMd5(const std::string &filepath);
 
 std::string calculateSHA256(const std::string &filepath);
 
+// the same for data already in memory
+std::string calculateMd5(const char *data, size_t size);
+
+std::string calculateSHA256(const char *data, size_t size);
+
 bool isUrlValid(const std::string &url);
 
 std::string getProtocol(const std::string &url);
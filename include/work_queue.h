@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace mltdl {
+
+enum class Priority : int { kHigh = 0, kNormal = 1, kLow = 2 };
+
+struct WorkOptions {
+  Priority priority{Priority::kNormal};
+  // work with the same flow shares one fair-share queue, a flow is usually a
+  // download job or a tenant. Work without a flow shares the default one.
+  std::string flow;
+  // relative share of the flow against the other flows of its priority
+  uint32_t weight{1};
+  // what a work costs its flow, e.g. the bytes a segment will transfer
+  int64_t cost{1};
+};
+
+/**
+ * the queue of the ThreadPool, replaces the plain FIFO so small urgent work
+ * does not sit behind a large backlog.
+ *
+ * Work is picked from the highest priority class that has work, except that a
+ * lower class which has been passed over `starvation_limit` times in a row is
+ * served once, so nothing waits forever.
+ *
+ * Inside a class every flow has its own FIFO and the flows are served by
+ * start-time fair queueing: each work gets a virtual start tag of
+ * max(virtual clock, finish tag of the previous work of its flow), and the
+ * work with the smallest tag goes first. A flow that enqueues a lot of work
+ * therefore only gets its weighted share of the threads, measured in cost.
+ *
+ * The queue is not thread safe, the ThreadPool guards it with its mutex.
+ */
+class WorkQueue {
+public:
+  using Work = std::function<void(int32_t)>;
+
+  explicit WorkQueue(int starvation_limit = 8)
+      : starvation_limit_(starvation_limit) {}
+
+  void push(Work work, const WorkOptions &options = WorkOptions());
+
+  // the queue must not be empty
+  Work pop();
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+  void clear();
+
+  void setStarvationLimit(int limit) { starvation_limit_ = limit; }
+
+private:
+  static constexpr int kNumClasses = 3;
+
+  struct Entry {
+    Work work;
+    double start_tag;
+    uint64_t seq;
+  };
+
+  struct Flow {
+    std::deque<Entry> entries;
+    double last_finish{0.0};
+  };
+
+  struct Class {
+    std::unordered_map<std::string, Flow> flows;
+    // flows that have work, ordered by the start tag of their first entry
+    // and by arrival to keep FIFO order between equal tags
+    std::set<std::pair<std::pair<double, uint64_t>, std::string>> ready;
+    double virtual_time{0.0};
+    size_t size{0};
+    // dispatches in a row that went to a higher class while this one waited
+    int passed_over{0};
+  };
+
+  int pickClass();
+
+  std::array<Class, kNumClasses> classes_;
+  size_t size_{0};
+  uint64_t seq_{0};
+  int starvation_limit_;
+};
+
+} // namespace mltdl
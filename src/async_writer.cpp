@@ -0,0 +1,88 @@
+#include "async_writer.h"
+#include "logger.h"
+#include "thread_pool.h"
+#include "tracer.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+namespace mltdl {
+
+bool AsyncWriter::Stream::drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  drained_.wait(lock, [this] { return pending_ == 0; });
+  return !failed_;
+}
+
+AsyncWriter::AsyncWriter(MemoryBudget &budget)
+    : budget_(budget), thread_(&AsyncWriter::threadMain, this) {}
+
+AsyncWriter::~AsyncWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  condition_.notify_all();
+  thread_.join();
+}
+
+bool AsyncWriter::pin(int cpu) { return pinThread(thread_, cpu); }
+
+void AsyncWriter::submit(Stream &stream, int64_t offset,
+                         std::vector<char> data) {
+  {
+    std::lock_guard<std::mutex> lock(stream.mutex_);
+    ++stream.pending_;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    requests_.push(Request{&stream, offset, std::move(data)});
+  }
+  condition_.notify_one();
+}
+
+void AsyncWriter::threadMain() {
+  Tracer::global().setThreadName("write-behind");
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    condition_.wait(lock, [this] { return !running_ || !requests_.empty(); });
+    if (requests_.empty()) {
+      // only reached once running_ is false and everything was written
+      return;
+    }
+    Request request = std::move(requests_.front());
+    requests_.pop();
+    lock.unlock();
+
+    Tracer::Span span("write", "io");
+    span.arg("offset", request.offset);
+    span.arg("bytes", request.data.size());
+    bool ok = true;
+    size_t written = 0;
+    while (written < request.data.size()) {
+      auto n = ::pwrite(request.stream->fd_, request.data.data() + written,
+                        request.data.size() - written,
+                        request.offset + written);
+      if (n <= 0) {
+        MLTDL_LOG(kError, "write_behind_failed")
+            .code(errno)
+            .message("offset " + std::to_string(request.offset + written));
+        ok = false;
+        break;
+      }
+      written += n;
+    }
+    budget_.release(request.data.size());
+    {
+      auto &stream = *request.stream;
+      std::lock_guard<std::mutex> stream_lock(stream.mutex_);
+      stream.failed_ = stream.failed_ || !ok;
+      if (--stream.pending_ == 0) {
+        stream.drained_.notify_all();
+      }
+    }
+    lock.lock();
+  }
+}
+
+} // namespace mltdl
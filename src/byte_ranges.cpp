@@ -0,0 +1,202 @@
+#include "byte_ranges.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace mltdl {
+
+namespace {
+
+// a header or delimiter line longer than this is not a byteranges body
+constexpr size_t kMaxLine = 8 * 1024;
+
+std::string lower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return s;
+}
+
+std::string trim(const std::string &s) {
+  auto first = s.find_first_not_of(" \t");
+  if (first == std::string::npos) {
+    return "";
+  }
+  auto last = s.find_last_not_of(" \t");
+  return s.substr(first, last - first + 1);
+}
+
+} // namespace
+
+std::vector<ByteRange> normalizeRanges(std::vector<ByteRange> ranges) {
+  std::sort(ranges.begin(), ranges.end(),
+            [](const ByteRange &a, const ByteRange &b) {
+              return a.start < b.start;
+            });
+  std::vector<ByteRange> merged;
+  for (const auto &range : ranges) {
+    if (range.end < range.start) {
+      continue;
+    }
+    if (!merged.empty() && range.start <= merged.back().end + 1) {
+      merged.back().end = std::max(merged.back().end, range.end);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
+}
+
+std::vector<ByteRange> subtractRanges(const std::vector<ByteRange> &wanted,
+                                      const std::vector<ByteRange> &covered) {
+  std::vector<ByteRange> missing;
+  size_t c = 0;
+  for (auto range : wanted) {
+    while (c < covered.size() && covered[c].end < range.start) {
+      ++c;
+    }
+    // cut the covered pieces out of the range from the left
+    for (auto i = c; i < covered.size() && covered[i].start <= range.end;
+         ++i) {
+      if (covered[i].start > range.start) {
+        missing.push_back(ByteRange{range.start, covered[i].start - 1});
+      }
+      range.start = std::max(range.start, covered[i].end + 1);
+      if (range.start > range.end) {
+        break;
+      }
+    }
+    if (range.start <= range.end) {
+      missing.push_back(range);
+    }
+  }
+  return missing;
+}
+
+bool parseContentRange(const std::string &value, ByteRange &range) {
+  auto v = lower(trim(value));
+  if (v.compare(0, 6, "bytes ") != 0) {
+    return false;
+  }
+  auto dash = v.find('-', 6);
+  auto slash = v.find('/', 6);
+  if (dash == std::string::npos || slash == std::string::npos ||
+      slash < dash) {
+    return false;
+  }
+  try {
+    size_t used = 0;
+    auto start_text = trim(v.substr(6, dash - 6));
+    range.start = std::stoll(start_text, &used);
+    if (used != start_text.size()) {
+      return false;
+    }
+    auto end_text = v.substr(dash + 1, slash - dash - 1);
+    range.end = std::stoll(end_text, &used);
+    if (used != end_text.size()) {
+      return false;
+    }
+  } catch (std::exception &) {
+    return false;
+  }
+  return range.start >= 0 && range.end >= range.start;
+}
+
+std::string byterangesBoundary(const std::string &content_type) {
+  auto type = lower(content_type);
+  if (type.compare(0, 20, "multipart/byteranges") != 0) {
+    return "";
+  }
+  auto pos = type.find("boundary=");
+  if (pos == std::string::npos) {
+    return "";
+  }
+  // the boundary is case sensitive, take it from the original
+  auto boundary = content_type.substr(pos + 9);
+  boundary = boundary.substr(0, boundary.find(';'));
+  boundary = trim(boundary);
+  if (boundary.size() >= 2 && boundary.front() == '"' &&
+      boundary.back() == '"') {
+    boundary = boundary.substr(1, boundary.size() - 2);
+  }
+  return boundary;
+}
+
+ByterangesParser::ByterangesParser(std::string boundary, RangeWriter writer)
+    : delimiter_("--" + boundary), writer_(std::move(writer)) {}
+
+bool ByterangesParser::feed(const char *data, size_t size) {
+  size_t pos = 0;
+  while (pos < size && state_ != kError && state_ != kDone) {
+    if (state_ == kBody) {
+      // the part's bytes go to the writer without being copied
+      auto left = part_.length() - part_offset_;
+      auto n = static_cast<size_t>(std::min<int64_t>(left, size - pos));
+      if (!writer_(part_.start + part_offset_, data + pos, n)) {
+        state_ = kError;
+        break;
+      }
+      part_offset_ += n;
+      pos += n;
+      if (part_offset_ == part_.length()) {
+        received_.push_back(part_);
+        state_ = kDelimiter;
+      }
+      continue;
+    }
+    auto newline =
+        static_cast<const char *>(std::memchr(data + pos, '\n', size - pos));
+    if (newline == nullptr) {
+      line_.append(data + pos, size - pos);
+      if (line_.size() > kMaxLine) {
+        state_ = kError;
+      }
+      break;
+    }
+    line_.append(data + pos, newline - (data + pos));
+    pos = newline - data + 1;
+    if (!line_.empty() && line_.back() == '\r') {
+      line_.pop_back();
+    }
+    if (!onLine()) {
+      state_ = kError;
+    }
+    line_.clear();
+  }
+  return state_ != kError;
+}
+
+bool ByterangesParser::onLine() {
+  if (state_ == kDelimiter) {
+    // a delimiter may carry trailing whitespace
+    auto line = line_.substr(0, line_.find_last_not_of(" \t") + 1);
+    if (line == delimiter_) {
+      state_ = kHeaders;
+      has_range_ = false;
+    } else if (line == delimiter_ + "--") {
+      state_ = kDone;
+    } else if (!line.empty() && !received_.empty()) {
+      // only the preamble before the first part may hold other text
+      return false;
+    }
+    return true;
+  }
+  // kHeaders
+  if (line_.empty()) {
+    if (!has_range_) {
+      return false;
+    }
+    state_ = kBody;
+    part_offset_ = 0;
+    return true;
+  }
+  auto colon = line_.find(':');
+  if (colon != std::string::npos &&
+      lower(trim(line_.substr(0, colon))) == "content-range") {
+    has_range_ = parseContentRange(line_.substr(colon + 1), part_);
+    return has_range_;
+  }
+  return true;
+}
+
+} // namespace mltdl
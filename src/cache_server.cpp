@@ -0,0 +1,702 @@
+#include "cache_server.h"
+#include "client_factory.h"
+#include "logger.h"
+#include "tracer.h"
+#include "url.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace mltdl {
+
+namespace {
+
+// the request line and headers may not be longer
+constexpr size_t kMaxRequestHead = 16 * 1024;
+// the bytes read from the file and sent at once
+constexpr size_t kSendChunk = 256 * 1024;
+
+// add range to the sorted, disjoint ranges, merging what it touches
+void addRange(std::vector<ByteRange> &ranges, ByteRange range) {
+  auto it = std::lower_bound(ranges.begin(), ranges.end(), range,
+                             [](const ByteRange &a, const ByteRange &b) {
+                               return a.start < b.start;
+                             });
+  // the one before may overlap or touch it
+  if (it != ranges.begin() && std::prev(it)->end + 1 >= range.start) {
+    --it;
+    range.start = it->start;
+    range.end = std::max(range.end, it->end);
+  } else {
+    it = ranges.insert(it, range);
+  }
+  auto next = std::next(it);
+  while (next != ranges.end() && next->start <= range.end + 1) {
+    range.end = std::max(range.end, next->end);
+    ++next;
+  }
+  *it = range;
+  ranges.erase(std::next(it), next);
+}
+
+// the request head up to the empty line, false if the peer went away
+bool readHead(int fd, std::string &head, const std::atomic<bool> &running) {
+  char chunk[2048];
+  while (head.find("\r\n\r\n") == std::string::npos) {
+    if (head.size() > kMaxRequestHead) {
+      return false;
+    }
+    pollfd pfd{fd, POLLIN, 0};
+    if (::poll(&pfd, 1, 200) <= 0) {
+      if (!running) {
+        return false;
+      }
+      continue;
+    }
+    auto n = ::read(fd, chunk, sizeof(chunk));
+    if (n <= 0) {
+      return false;
+    }
+    head.append(chunk, n);
+  }
+  return true;
+}
+
+bool sendAll(int fd, const char *data, size_t size) {
+  size_t sent = 0;
+  while (sent < size) {
+    // MSG_NOSIGNAL, a consumer that went away must not kill the server
+    auto n = ::send(fd, data + sent, size - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+bool sendStatus(int fd, int code, const char *reason,
+                const std::string &extra = "") {
+  std::string reply = "HTTP/1.1 " + std::to_string(code) + " " + reason +
+                      "\r\nContent-Length: 0\r\n" + extra +
+                      "Connection: close\r\n\r\n";
+  return sendAll(fd, reply.data(), reply.size());
+}
+
+// the value of a header of the request head, empty if it is not there
+std::string headerValue(const std::string &head, const std::string &name) {
+  std::istringstream lines(head);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (line.size() > name.size() && line[name.size()] == ':' &&
+        strncasecmp(line.c_str(), name.c_str(), name.size()) == 0) {
+      auto value = line.substr(name.size() + 1);
+      value.erase(0, value.find_first_not_of(' '));
+      while (!value.empty() &&
+             (value.back() == '\r' || value.back() == ' ')) {
+        value.pop_back();
+      }
+      return value;
+    }
+  }
+  return "";
+}
+
+/**
+ * a Range header of a single range against size. False when there is none
+ * or it is not one this serves, the whole resource is sent then. Sets
+ * unsatisfiable for a range that starts past the end.
+ */
+bool parseRange(const std::string &value, int64_t size, ByteRange &range,
+                bool &unsatisfiable) {
+  unsatisfiable = false;
+  if (value.compare(0, 6, "bytes=") != 0 ||
+      value.find(',') != std::string::npos) {
+    return false;
+  }
+  auto spec = value.substr(6);
+  auto dash = spec.find('-');
+  if (dash == std::string::npos) {
+    return false;
+  }
+  ByteRange parsed;
+  try {
+    if (dash == 0) {
+      // the last n bytes
+      auto n = std::stoll(spec.substr(1));
+      if (n <= 0) {
+        unsatisfiable = true;
+        return false;
+      }
+      parsed = {std::max<int64_t>(size - n, 0), size - 1};
+    } else {
+      parsed.start = std::stoll(spec.substr(0, dash));
+      parsed.end = dash + 1 < spec.size() ? std::stoll(spec.substr(dash + 1))
+                                          : size - 1;
+      if (parsed.start >= size) {
+        unsatisfiable = true;
+        return false;
+      }
+      if (parsed.end < parsed.start) {
+        return false;
+      }
+      parsed.end = std::min(parsed.end, size - 1);
+    }
+  } catch (std::exception &) {
+    return false;
+  }
+  range = parsed;
+  return true;
+}
+
+} // namespace
+
+// hands the bytes of the download to the entry
+class CacheServer::EntrySink : public Sink {
+public:
+  EntrySink(CacheServer *server, std::shared_ptr<Entry> entry)
+      : server_(server), entry_(std::move(entry)) {}
+
+  bool write(int64_t offset, const char *data, size_t size) override {
+    return entry_->write(offset, data, size);
+  }
+
+  bool claim(int64_t &start, int64_t &end) override {
+    return server_->claim(entry_, start, end);
+  }
+
+  void finish(const Status &status) override {
+    server_->finished(entry_, status);
+  }
+
+private:
+  CacheServer *server_;
+  std::shared_ptr<Entry> entry_;
+};
+
+CacheServer::Entry::~Entry() {
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+bool CacheServer::Entry::write(int64_t offset, const char *data,
+                               size_t size) {
+  for (size_t done = 0; done < size;) {
+    auto n = ::pwrite(fd, data + done, size - done, offset + done);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  addRange(have, {offset, offset + static_cast<int64_t>(size) - 1});
+  changed.notify_all();
+  return true;
+}
+
+int64_t CacheServer::Entry::available(int64_t offset) const {
+  auto it = std::upper_bound(
+      have.begin(), have.end(), offset,
+      [](int64_t offset, const ByteRange &range) {
+        return offset < range.start;
+      });
+  if (it == have.begin() || std::prev(it)->end < offset) {
+    return 0;
+  }
+  return std::prev(it)->end - offset + 1;
+}
+
+CacheServer::CacheServer(const std::string &cache_dir,
+                         const CacheServerOptions &options
+                         /*= CacheServerOptions()*/)
+    : cache_dir_(cache_dir), options_(options),
+      demand_pool_(std::max<size_t>(options.demand_threads, 1), "demand"),
+      demand_curls_(std::max<size_t>(options.demand_threads, 1)),
+      manager_(options.num_thread, options.segment_size) {}
+
+CacheServer::~CacheServer() {
+  stop();
+  cancel_.cancelled = true;
+  std::vector<std::shared_ptr<DownloadHandle>> handles;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &item : entries_) {
+      std::lock_guard<std::mutex> entry_lock(item.second->mutex);
+      if (item.second->handle != nullptr) {
+        handles.push_back(item.second->handle);
+      }
+    }
+  }
+  // the downloads still running would hold up the manager's destructor
+  for (auto &handle : handles) {
+    handle->cancel();
+  }
+  demand_pool_.waitForCompletion(false);
+  if (listen_fd_ >= 0) {
+    ::close(listen_fd_);
+  }
+}
+
+bool CacheServer::listen(int port /*= 0*/) {
+  if (!createDir(cache_dir_)) {
+    return false;
+  }
+  listen_fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    MLTDL_LOG(kError, "listen_failed").code(errno).message("socket");
+    return false;
+  }
+  int on = 1;
+  ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  // local consumers only
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  socklen_t length = sizeof(addr);
+  if (::bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      ::listen(listen_fd_, 64) < 0 ||
+      ::getsockname(listen_fd_, (sockaddr *)&addr, &length) < 0) {
+    MLTDL_LOG(kError, "listen_failed")
+        .code(errno)
+        .message("can't bind port " + std::to_string(port));
+    ::close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  port_ = ntohs(addr.sin_port);
+  running_ = true;
+  return true;
+}
+
+void CacheServer::run() {
+  while (running_) {
+    // poll with a timeout so stop() is noticed without a connection
+    pollfd pfd{listen_fd_, POLLIN, 0};
+    if (::poll(&pfd, 1, 200) <= 0) {
+      continue;
+    }
+    int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++active_connections_;
+    }
+    std::thread([this, fd] {
+      serveConnection(fd);
+      ::close(fd);
+      std::lock_guard<std::mutex> lock(mutex_);
+      --active_connections_;
+      connections_cv_.notify_all();
+    }).detach();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  connections_cv_.wait(lock, [this] { return active_connections_ == 0; });
+}
+
+std::string CacheServer::cachePath(const std::string &url) const {
+  return cache_dir_ + "/" + calculateSHA256(url.data(), url.size());
+}
+
+void CacheServer::serveConnection(int fd) {
+  std::string head;
+  if (!readHead(fd, head, running_)) {
+    return;
+  }
+  std::istringstream request_line(head.substr(0, head.find("\r\n")));
+  std::string method, target;
+  request_line >> method >> target;
+  if (method != "GET" && method != "HEAD") {
+    sendStatus(fd, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n");
+    return;
+  }
+  std::string url;
+  auto query = target.find('?');
+  if (query != std::string::npos) {
+    std::istringstream params(target.substr(query + 1));
+    std::string param;
+    while (std::getline(params, param, '&')) {
+      if (param.compare(0, 4, "url=") == 0 &&
+          !percentDecode(param.substr(4), url)) {
+        url.clear();
+      }
+    }
+  }
+  if (url.empty() || !isUrlValid(url)) {
+    sendStatus(fd, 400, "Bad Request");
+    return;
+  }
+
+  Status status;
+  auto entry = this->entry(url, status);
+  if (entry == nullptr) {
+    if (status.code() == StatusCode::kInvalidArgument ||
+        status.code() == StatusCode::kUnsupported) {
+      sendStatus(fd, 400, "Bad Request");
+    } else {
+      sendStatus(fd, 502, "Bad Gateway");
+    }
+    return;
+  }
+  int64_t size;
+  {
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    size = entry->size;
+  }
+  ByteRange range{0, size - 1};
+  bool unsatisfiable = false;
+  bool partial =
+      parseRange(headerValue(head, "Range"), size, range, unsatisfiable);
+  if (unsatisfiable) {
+    sendStatus(fd, 416, "Range Not Satisfiable",
+               "Content-Range: bytes */" + std::to_string(size) + "\r\n");
+    return;
+  }
+  std::string reply = partial ? "HTTP/1.1 206 Partial Content\r\n"
+                              : "HTTP/1.1 200 OK\r\n";
+  reply += "Content-Length: " + std::to_string(range.length()) + "\r\n";
+  if (partial) {
+    reply += "Content-Range: bytes " + std::to_string(range.start) + "-" +
+             std::to_string(range.end) + "/" + std::to_string(size) + "\r\n";
+  }
+  reply += "Accept-Ranges: bytes\r\n"
+           "Content-Type: application/octet-stream\r\n"
+           "Connection: close\r\n\r\n";
+  if (!sendAll(fd, reply.data(), reply.size()) || method == "HEAD") {
+    return;
+  }
+
+  Tracer::Span span("serve", "cache");
+  span.arg("start", range.start);
+  span.arg("end", range.end);
+  std::vector<char> buffer(kSendChunk);
+  for (auto pos = range.start; pos <= range.end;) {
+    auto n = waitFor(entry, pos, range.end);
+    if (n <= 0) {
+      // the download failed, the consumer sees a short body
+      MLTDL_LOG(kWarn, "cache_short")
+          .bytes(pos - range.start)
+          .message(url);
+      return;
+    }
+    n = std::min<int64_t>({n, range.end - pos + 1,
+                           static_cast<int64_t>(buffer.size())});
+    n = ::pread(entry->fd, buffer.data(), n, pos);
+    if (n <= 0 || !sendAll(fd, buffer.data(), n)) {
+      return;
+    }
+    pos += n;
+  }
+}
+
+std::shared_ptr<CacheServer::Entry>
+CacheServer::entry(const std::string &url, Status &status) {
+  std::shared_ptr<Entry> entry;
+  bool first = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &slot = entries_[url];
+    if (slot == nullptr) {
+      slot = std::make_shared<Entry>();
+      slot->url = url;
+      slot->path = cachePath(url);
+      slot->part_path = slot->path + ".part";
+      first = true;
+    }
+    entry = slot;
+  }
+  if (first) {
+    status = start(entry);
+    if (!status.ok()) {
+      {
+        std::lock_guard<std::mutex> lock(entry->mutex);
+        entry->status = status;
+        entry->changed.notify_all();
+      }
+      // the next request tries again
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.erase(url);
+      return nullptr;
+    }
+    return entry;
+  }
+  std::unique_lock<std::mutex> lock(entry->mutex);
+  entry->changed.wait(lock, [&] {
+    return entry->size >= 0 ||
+           (!entry->status.pending() && !entry->status.ok());
+  });
+  if (entry->size < 0) {
+    status = entry->status;
+    return nullptr;
+  }
+  return entry;
+}
+
+Status CacheServer::start(const std::shared_ptr<Entry> &entry) {
+  const auto &url = entry->url;
+  struct stat st;
+  // downloaded before
+  if (::stat(entry->path.c_str(), &st) == 0) {
+    entry->fd = ::open(entry->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (entry->fd < 0) {
+      return Status(StatusCode::kIoError, "can't open " + entry->path);
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    entry->size = st.st_size;
+    if (st.st_size > 0) {
+      entry->have.push_back({0, st.st_size - 1});
+    }
+    entry->status = Status::OK();
+    entry->changed.notify_all();
+    return Status::OK();
+  }
+  auto protocol = getProtocol(url);
+  auto client = get_clients(protocol);
+  if (client == nullptr) {
+    return Status(StatusCode::kUnsupported, "unsupported protocol " + protocol);
+  }
+  ResourceInfo info;
+  {
+    CurlGuard guard(demand_curls_, -1, CurlPool::hostKey(url));
+    info = client->probe(url, guard.handle());
+  }
+  if (info.size < 0) {
+    return Status(StatusCode::kNetworkError,
+                  "failed to get the file size of " + url);
+  }
+  entry->fd = ::open(entry->part_path.c_str(),
+                     O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (entry->fd < 0 || ::ftruncate(entry->fd, info.size) != 0) {
+    return Status(StatusCode::kIoError, "can't create " + entry->part_path);
+  }
+  if (info.size > 0) {
+    ::posix_fallocate(entry->fd, 0, info.size);
+  }
+  MLTDL_LOG(kInfo, "cache_fill").bytes(info.size).message(url);
+  {
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    entry->size = info.size;
+    entry->validator = info.validator();
+    entry->changed.notify_all();
+  }
+  if (info.size == 0) {
+    finished(entry, Status::OK());
+    return Status::OK();
+  }
+  auto handle = manager_.stream(url, std::make_shared<EntrySink>(this, entry));
+  std::lock_guard<std::mutex> lock(entry->mutex);
+  entry->handle = std::move(handle);
+  return Status::OK();
+}
+
+void CacheServer::finished(const std::shared_ptr<Entry> &entry,
+                           const Status &status) {
+  {
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    entry->download_status = status;
+  }
+  settle(entry);
+}
+
+bool CacheServer::claim(const std::shared_ptr<Entry> &entry, int64_t &start,
+                        int64_t &end) {
+  std::vector<ByteRange> gaps;
+  {
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    // what is there or on its way, sorted and merged
+    auto taken = entry->have;
+    for (const auto &range : entry->demanded) {
+      addRange(taken, range);
+    }
+    for (const auto &range : entry->fetching) {
+      addRange(taken, range);
+    }
+    auto from = start;
+    for (const auto &range : taken) {
+      if (range.end < from) {
+        continue;
+      }
+      if (range.start > end) {
+        break;
+      }
+      if (range.start > from) {
+        gaps.push_back({from, range.start - 1});
+      }
+      from = std::max(from, range.end + 1);
+    }
+    if (from <= end) {
+      gaps.push_back({from, end});
+    }
+    if (gaps.empty()) {
+      return false;
+    }
+    // the segment takes the first gap, readers fetched what follows it
+    start = gaps[0].start;
+    end = gaps[0].end;
+    entry->fetching.push_back(gaps[0]);
+    for (size_t i = 1; i < gaps.size(); ++i) {
+      entry->demanded.push_back(gaps[i]);
+    }
+  }
+  // the gaps after that are nobody's, fetched like a reader's
+  for (size_t i = 1; i < gaps.size(); ++i) {
+    demand(entry, gaps[i]);
+  }
+  return true;
+}
+
+void CacheServer::settle(const std::shared_ptr<Entry> &entry) {
+  Status status;
+  {
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if (entry->settled || entry->download_status.pending() ||
+        !entry->demanded.empty()) {
+      return;
+    }
+    entry->settled = true;
+    status = entry->download_status;
+    // the segments left out what the fetches got, a failed one leaves a hole
+    auto whole = entry->size == 0 ||
+                 (entry->have.size() == 1 && entry->have[0].start == 0 &&
+                  entry->have[0].end == entry->size - 1);
+    if (status.ok() && !whole) {
+      status = Status(StatusCode::kNetworkError,
+                      "a fetch of left out bytes failed");
+    }
+  }
+  if (status.ok()) {
+    // the open descriptor keeps working for the readers
+    if (std::rename(entry->part_path.c_str(), entry->path.c_str()) != 0) {
+      MLTDL_LOG(kError, "cache_failed").code(errno).message(entry->path);
+    }
+    MLTDL_LOG(kInfo, "cache_done").bytes(entry->size).message(entry->url);
+  } else {
+    ::unlink(entry->part_path.c_str());
+    MLTDL_LOG(kWarn, "cache_failed").message(status.toString());
+  }
+  {
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    entry->status = status;
+    entry->changed.notify_all();
+  }
+  if (!status.ok()) {
+    // readers that have it finish with what is there, new ones start over
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(entry->url);
+    if (it != entries_.end() && it->second == entry) {
+      entries_.erase(it);
+    }
+  }
+}
+
+int64_t CacheServer::waitFor(const std::shared_ptr<Entry> &entry,
+                             int64_t offset, int64_t end) {
+  std::unique_lock<std::mutex> lock(entry->mutex);
+  auto deadline = std::chrono::steady_clock::now() + options_.demand_after;
+  for (;;) {
+    auto n = entry->available(offset);
+    if (n > 0) {
+      return n;
+    }
+    if ((!entry->status.pending() && !entry->status.ok()) ||
+        (!entry->download_status.pending() &&
+         !entry->download_status.ok()) ||
+        !running_) {
+      return 0;
+    }
+    // on its way already, from a segment or another reader
+    auto contains = [offset](const ByteRange &range) {
+      return range.start <= offset && offset <= range.end;
+    };
+    auto demanded =
+        std::any_of(entry->demanded.begin(), entry->demanded.end(),
+                    contains) ||
+        std::any_of(entry->fetching.begin(), entry->fetching.end(), contains);
+    auto now = std::chrono::steady_clock::now();
+    if (!demanded && now >= deadline) {
+      // up to the window, or to what is already there or being fetched
+      ByteRange range{offset, std::min(end, offset + options_.demand_window -
+                                                1)};
+      for (const auto &other : entry->have) {
+        if (other.start > offset) {
+          range.end = std::min(range.end, other.start - 1);
+          break;
+        }
+      }
+      for (const auto &other : entry->demanded) {
+        if (other.start > offset) {
+          range.end = std::min(range.end, other.start - 1);
+        }
+      }
+      for (const auto &other : entry->fetching) {
+        if (other.start > offset) {
+          range.end = std::min(range.end, other.start - 1);
+        }
+      }
+      entry->demanded.push_back(range);
+      lock.unlock();
+      demand(entry, range);
+      lock.lock();
+      deadline = now + options_.demand_after;
+      continue;
+    }
+    // woken by every write, the timeout notices a stop
+    entry->changed.wait_for(lock, std::chrono::milliseconds(200));
+  }
+}
+
+void CacheServer::demand(const std::shared_ptr<Entry> &entry,
+                         ByteRange range) {
+  ++demand_fetches_;
+  MLTDL_LOG(kDebug, "cache_demand")
+      .bytes(range.length())
+      .message(entry->url + " from " + std::to_string(range.start));
+  demand_pool_.spawn([this, entry, range](int worker) {
+    Tracer::Span span("demand", "cache");
+    span.arg("start", range.start);
+    span.arg("end", range.end);
+    auto client = get_clients(getProtocol(entry->url));
+    if (client != nullptr) {
+      FunctionSink sink([&](int64_t offset, const char *data, size_t size) {
+        return entry->write(offset, data, size);
+      });
+      TransferControl control;
+      control.parent = &cancel_;
+      {
+        std::lock_guard<std::mutex> lock(entry->mutex);
+        control.if_range = entry->validator;
+      }
+      RetryStrategy rs{3, 500, 2, 30000};
+      CurlGuard guard(demand_curls_, worker, CurlPool::hostKey(entry->url));
+      client->stream(entry->url, rs, guard.handle(), range.start, range.end,
+                     sink, &control);
+    }
+    {
+      // a reader still waiting asks again
+      std::lock_guard<std::mutex> lock(entry->mutex);
+      auto it =
+          std::find(entry->demanded.begin(), entry->demanded.end(), range);
+      if (it != entry->demanded.end()) {
+        entry->demanded.erase(it);
+      }
+      entry->changed.notify_all();
+    }
+    settle(entry);
+  });
+}
+
+} // namespace mltdl
@@ -1,18 +1,140 @@
 #include "client.h"
+#include "async_writer.h"
+#include "curl_pool.h"
+#include "file_io.h"
+#include "logger.h"
+#include "tracer.h"
+#include "url.h"
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <iostream>
+#include <random>
 #include <thread>
+#include <unistd.h>
 
 namespace mltdl {
 
 // define a structure to verify that the size of the downloaded data is as
 // expected
 struct WriteData {
-  FILE *file;
+  FILE *file{nullptr};
+  std::vector<char> *body{nullptr};
+  TransferControl *control{nullptr};
+  CURL *curl{nullptr};
   int64_t expected_size{0};
   int64_t actual_size{0};
+  // offset of the first byte requested by the current attempt
+  int64_t offset{0};
+  // offset of the first byte of the whole range
+  int64_t range_start{0};
+  // receives the data when it neither goes to a file nor into memory
+  Sink *sink{nullptr};
+  // the sink refused data, asking again would not change its mind
+  bool refused{false};
+  // the status code of the current attempt has been checked
+  bool checked{false};
+  // the server sent the whole resource instead of the requested range
+  bool range_ignored{false};
+
+  // write-behind: data collects in buffer until it is handed to the writer
+  // to be written at file_base + flushed
+  AsyncWriter::Stream *stream{nullptr};
+  std::vector<char> buffer;
+  int64_t file_base{0};
+  int64_t flushed{0};
+  // the last chunk was refused for lack of memory budget
+  bool paused{false};
+  // charged with the body when the data stays in memory
+  MemoryBudget::Lease *lease{nullptr};
 };
 
+// buffers handed to the writer are about this large, so the disk sees few
+// large writes instead of one per chunk curl delivers
+constexpr size_t kWriteBehindChunk = 256 * 1024;
+
+static void flushWriteBehind(WriteData *write_data) {
+  if (write_data->buffer.empty()) {
+    return;
+  }
+  auto size = write_data->buffer.size();
+  write_data->control->writer->submit(
+      *write_data->stream, write_data->file_base + write_data->flushed,
+      std::move(write_data->buffer));
+  write_data->flushed += size;
+  write_data->buffer = std::vector<char>();
+  write_data->buffer.reserve(kWriteBehindChunk);
+}
+
+bool isPermanentHttpError(long status_code) {
+  // 408 Request Timeout and 429 Too Many Requests are the client errors a
+  // later attempt can get past
+  return status_code >= 400 && status_code < 500 && status_code != 408 &&
+         status_code != 429;
+}
+
+int64_t retryDelay(const RetryStrategy &rs, int attempt,
+                   int64_t retry_after_ms /*= 0*/) {
+  double delay = rs.delay_ms;
+  for (auto i = 0; i < attempt; ++i) {
+    delay *= std::max(rs.delay_factor, 1);
+  }
+  if (rs.max_delay_ms > 0) {
+    delay = std::min<double>(delay, rs.max_delay_ms);
+  }
+  // "equal jitter", keep half of the delay and randomize the other half so
+  // segments that failed together do not come back at the same moment
+  thread_local std::mt19937_64 generator(std::random_device{}());
+  std::uniform_real_distribution<double> distribution(delay / 2, delay);
+  auto jittered = static_cast<int64_t>(delay > 0 ? distribution(generator) : 0);
+  // the server knows best when it will be able to serve us again
+  if (retry_after_ms > jittered) {
+    jittered = retry_after_ms;
+    if (rs.max_delay_ms > 0) {
+      jittered = std::min<int64_t>(jittered, rs.max_delay_ms);
+    }
+  }
+  return jittered;
+}
+
+/**
+ * lay the phases curl measured for the attempt that began at start_us out on
+ * the timeline, as spans nested in the attempt
+ */
+static void traceAttempt(CURL *curl, int64_t start_us) {
+  auto &tracer = Tracer::global();
+  if (!tracer.enabled()) {
+    return;
+  }
+  curl_off_t dns = 0, connect = 0, tls = 0, request = 0, first_byte = 0,
+             total = 0;
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+  curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &request);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+  // each time is from the start of the attempt, zero when the phase did not
+  // happen, a reused connection skips dns, connect and tls
+  auto phase = [&](const char *name, curl_off_t from, curl_off_t to) {
+    if (to > from) {
+      tracer.complete(name, "http", start_us + from, to - from);
+    }
+  };
+  phase("dns", 0, dns);
+  phase("connect", dns, connect);
+  phase("tls", connect, tls);
+  phase("first_byte", std::max(request, std::max(tls, connect)), first_byte);
+  phase("transfer", first_byte, total);
+}
+
+// the host of a url for the log
+static std::string logHost(const std::string &url) {
+  UrlParts parts;
+  parseUrl(url, parts);
+  return std::string(parts.host);
+}
+
 HttpClient::HttpClient() {}
 HttpClient::~HttpClient() {}
 
@@ -20,66 +142,186 @@ HttpClient::~HttpClient() {}
 // before calling the get method
 Response HttpClient::get(const std::string &url, const RetryStrategy &rs,
                          CURL *curl, int64_t start, int64_t end,
-                         void *userp /*= nullptr*/) {
+                         void *userp /*= nullptr*/,
+                         TransferControl *control /*= nullptr*/) {
+  return transfer(url, rs, curl, start, end, (FILE *)userp, nullptr, control);
+}
+
+Response HttpClient::stream(const std::string &url, const RetryStrategy &rs,
+                            CURL *curl, int64_t start, int64_t end,
+                            Sink &sink,
+                            TransferControl *control /*= nullptr*/) {
+  return transfer(url, rs, curl, start, end, nullptr, &sink, control);
+}
+
+Response HttpClient::transfer(const std::string &url, const RetryStrategy &rs,
+                              CURL *curl, int64_t start, int64_t end,
+                              FILE *file, Sink *sink,
+                              TransferControl *control) {
   Response response;
   WriteData write_data;
+  write_data.control = control;
+  write_data.curl = curl;
+  write_data.range_start = start;
 
-  curl_easy_reset(curl);
+  resetHandle(curl);
   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
 
-  if (userp != nullptr) {
-    write_data.file = (FILE *)userp;
-    // add 1 to include both the start and end bytes
-    // even if both start and end are 0
-    write_data.expected_size = end - start + 1;
+  // add 1 to include both the start and end bytes
+  // even if both start and end are 0
+  write_data.expected_size = end - start + 1;
+  // where the data of this range starts in the file, a retry rewinds to it
+  // plus what has been written so far
+  int64_t file_base = 0;
+  std::unique_ptr<AsyncWriter::Stream> stream;
+  if (sink != nullptr) {
+    write_data.sink = sink;
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sinkCallBack);
+  } else if (file != nullptr) {
+    write_data.file = file;
+    file_base = ftell(write_data.file);
+    if (control != nullptr && control->writer != nullptr) {
+      stream = std::make_unique<AsyncWriter::Stream>(fileno(write_data.file));
+      write_data.stream = stream.get();
+      write_data.file_base = file_base;
+      write_data.buffer.reserve(kWriteBehindChunk);
+    }
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallBack2);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_data);
   } else {
+    write_data.body = &response.body;
+    response.lease =
+        std::make_shared<MemoryBudget::Lease>(MemoryBudget::global());
+    write_data.lease = response.lease.get();
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallBack);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.body);
   }
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_data);
+  std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> headers(
+      nullptr, curl_slist_free_all);
+  if (control != nullptr && !control->if_range.empty()) {
+    headers.reset(
+        curl_slist_append(nullptr, ("If-Range: " + control->if_range).c_str()));
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers.get());
+  }
+  if (control != nullptr) {
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progressCallBack);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &write_data);
+  }
+  // an error page must not end up in the file, let curl fail on >= 400
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
   // when it receives a 301 response, it automatically redirect the request to
   // the new url. However, it is worth noting that this may result in the
   // request being sent to an untrusted server.
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-  char range[64];
-  snprintf(range, sizeof(range), "%ld-%ld", start, end);
-  curl_easy_setopt(curl, CURLOPT_RANGE, range);
   // Limit the number of redirects to 10
   curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10L);
   // Specify the redirection protocol as HTTP and HTTPS
   curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS,
                    CURLPROTO_HTTP | CURLPROTO_HTTPS);
 
-  int delay_ms = rs.delay_ms;
-
   for (auto i = 0; i < rs.max_retries; ++i) {
+    // resume right after the last byte that made it to the file
+    write_data.offset = start + write_data.actual_size;
+    write_data.checked = false;
+    char range[64];
+    snprintf(range, sizeof(range), "%ld-%ld", write_data.offset, end);
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+
+    Tracer::Span attempt("attempt", "http");
+    attempt.arg("attempt", i);
+    attempt.arg("range", range);
+    auto attempt_us = Tracer::nowUs();
     CURLcode res = curl_easy_perform(curl);
+    response.status = res;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status_code);
+    traceAttempt(curl, attempt_us);
+    attempt.arg("status", response.status_code);
+    if (stream != nullptr) {
+      // everything counted in actual_size has to be on disk before the
+      // attempt is judged, a retry may truncate the file
+      flushWriteBehind(&write_data);
+      if (!stream->drain()) {
+        response.status = CURLE_WRITE_ERROR;
+        break;
+      }
+    }
 
-    if (res == CURLE_OK) {
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status_code);
-      // curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE,
-      // &response.content_type);
-      if (response.status_code >= 200 && response.status_code < 300) {
-        if (write_data.expected_size != write_data.actual_size) {
-          std::cerr
-              << "The response is correct, but the request size is incorrect"
-              << std::endl;
-        }
+    if (control != nullptr && control->isCancelled()) {
+      // aborted by progressCallBack, retrying would be aborted again
+      break;
+    }
+    if (res == CURLE_OK && response.status_code >= 200 &&
+        response.status_code < 300) {
+      if (write_data.actual_size >= write_data.expected_size) {
         // Request succeeded, break out of the retry loop
         break;
-      } else if (response.status_code == 404) {
-        // Not Found, no sense in retrying
-        std::cerr << "Resource not found, no retries needed" << std::endl;
+      }
+      // the server closed the body early, fetch the rest
+      MLTDL_LOG(kWarn, "short_body")
+          .host(logHost(url))
+          .job(control != nullptr ? control->job_id : 0)
+          .segment(control != nullptr ? control->segment : -1)
+          .bytes(write_data.actual_size)
+          .message("expected " + std::to_string(write_data.expected_size));
+    }
+    if (write_data.refused) {
+      break;
+    }
+    if (write_data.range_ignored) {
+      MLTDL_LOG(kError, "range_ignored")
+          .host(logHost(url))
+          .job(control != nullptr ? control->job_id : 0)
+          .segment(control != nullptr ? control->segment : -1)
+          .message("server ignored the range request, no retries needed");
+      break;
+    }
+    if (isPermanentHttpError(response.status_code)) {
+      // Not Found, Forbidden and the like, no sense in retrying
+      MLTDL_LOG(kError, "http_error")
+          .host(logHost(url))
+          .job(control != nullptr ? control->job_id : 0)
+          .segment(control != nullptr ? control->segment : -1)
+          .code(response.status_code)
+          .message("no retries needed");
+      break;
+    }
+
+    // bytes that reached stdio but were not counted must not survive, the
+    // next attempt writes from offset on
+    if (write_data.file != nullptr) {
+      fflush(write_data.file);
+      auto keep = file_base + write_data.actual_size;
+      if (ftruncate(fileno(write_data.file), keep) != 0 ||
+          fseek(write_data.file, keep, SEEK_SET) != 0) {
+        MLTDL_LOG(kError, "rewind_failed")
+            .job(control != nullptr ? control->job_id : 0)
+            .segment(control != nullptr ? control->segment : -1)
+            .code(errno)
+            .message("failed to rewind the file, no retries possible");
         break;
       }
     }
+    attempt.end();
+    if (i + 1 == rs.max_retries) {
+      break;
+    }
+    curl_off_t retry_after_s = 0;
+    if (response.status_code == 429 || response.status_code == 503) {
+      curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after_s);
+    }
+    auto delay_ms = retryDelay(rs, i, retry_after_s * 1000);
     // Request failed, log the failure and continue the loop
-    std::cerr << "Request failed with error: " << curl_easy_strerror(res)
-              << std::endl;
-    std::cerr << "Retrying after " << delay_ms << " ms ..." << std::endl;
+    MLTDL_LOG(kWarn, "retry")
+        .host(logHost(url))
+        .job(control != nullptr ? control->job_id : 0)
+        .segment(control != nullptr ? control->segment : -1)
+        .bytes(start + write_data.actual_size)
+        .code(response.status_code != 0 ? response.status_code : res)
+        .message(std::string(curl_easy_strerror(res)) + ", retrying after " +
+                 std::to_string(delay_ms) + " ms");
+    Tracer::Span backoff("backoff", "http");
+    backoff.arg("delay_ms", delay_ms);
     std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
-    delay_ms *= rs.delay_factor;
   }
 
   return response;
@@ -91,7 +333,7 @@ Response HttpClient::post(const std::string &url,
   Response response;
   WriteData write_data;
 
-  curl_easy_reset(curl);
+  resetHandle(curl);
   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
 
   // Enable the POST method
@@ -102,35 +344,47 @@ Response HttpClient::post(const std::string &url,
   if (userp != nullptr) {
     write_data.file = (FILE *)userp;
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallBack2);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, userp);
   } else {
+    write_data.body = &response.body;
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallBack);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.body);
   }
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_data);
 
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
   curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10L);
   curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS,
                    CURLPROTO_HTTP | CURLPROTO_HTTPS);
 
-  int delay_ms = rs.delay_ms;
-
   for (auto i = 0; i < rs.max_retries; ++i) {
     CURLcode res = curl_easy_perform(curl);
     if (res == CURLE_OK) {
       curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status_code);
       if (response.status_code >= 200 && response.status_code < 300) {
         break;
-      } else if (response.status_code == 404) {
-        std::cerr << "Resource not found, no retries needed" << std::endl;
+      } else if (isPermanentHttpError(response.status_code)) {
+        MLTDL_LOG(kError, "http_error")
+            .host(logHost(url))
+            .code(response.status_code)
+            .message("no retries needed");
         break;
       }
     }
-    std::cerr << "Request failed with error: " << curl_easy_strerror(res)
-              << std::endl;
-    std::cerr << "Retrying after " << delay_ms << " ms ..." << std::endl;
+    if (i + 1 == rs.max_retries) {
+      break;
+    }
+    curl_off_t retry_after_s = 0;
+    if (response.status_code == 429 || response.status_code == 503) {
+      curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after_s);
+    }
+    auto delay_ms = retryDelay(rs, i, retry_after_s * 1000);
+    MLTDL_LOG(kWarn, "retry")
+        .host(logHost(url))
+        .code(response.status_code != 0 ? response.status_code : res)
+        .message(std::string(curl_easy_strerror(res)) + ", retrying after " +
+                 std::to_string(delay_ms) + " ms");
+    Tracer::Span backoff("backoff", "http");
+    backoff.arg("delay_ms", delay_ms);
     std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
-    delay_ms *= rs.delay_factor;
   }
 
   return response;
@@ -138,7 +392,7 @@ Response HttpClient::post(const std::string &url,
 
 int64_t HttpClient::getFileSize(const std::string &url, CURL *curl) {
   double file_size{0.0};
-  curl_easy_reset(curl);
+  resetHandle(curl);
   curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
   // make a HEAD request
   curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
@@ -148,25 +402,547 @@ int64_t HttpClient::getFileSize(const std::string &url, CURL *curl) {
   if (res == CURLE_OK) {
     curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &file_size);
   } else {
-    std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res)
-              << std::endl;
+    MLTDL_LOG(kError, "probe_failed")
+        .host(logHost(url))
+        .code(res)
+        .message(curl_easy_strerror(res));
     return -1.0;
   }
   return static_cast<int64_t>(file_size);
 }
 
+// the value of a response header of the last request curl made, empty if
+// there was none
+static std::string responseHeader(CURL *curl, const char *name) {
+  struct curl_header *header = nullptr;
+  if (curl_easy_header(curl, name, 0, CURLH_HEADER, -1, &header) !=
+      CURLHE_OK) {
+    return "";
+  }
+  return header->value;
+}
+
+// the state of one multi-range request, the way the body is read is decided
+// on its first chunk
+struct RangesData {
+  CURL *curl{nullptr};
+  const RangeWriter *writer{nullptr};
+  bool checked{false};
+  // multipart/byteranges answer
+  std::unique_ptr<ByterangesParser> parser;
+  // single part answer, the range it covers and how much of it arrived
+  ByteRange part{0, -1};
+  int64_t part_offset{0};
+  // a 200 with the whole resource
+  bool whole{false};
+  // only the wanted ranges of a single part or the whole resource are
+  // written, received is what of them arrived
+  const std::vector<ByteRange> *wanted{nullptr};
+  std::vector<ByteRange> received;
+  // the whole resource went past the last wanted byte, the transfer was
+  // stopped there rather than fetching the rest
+  bool complete{false};
+  // the server answered with something the ranges can't be taken from
+  bool rejected{false};
+  // the writer refused data
+  bool failed{false};
+};
+
+static bool checkRanges(RangesData *data) {
+  long status_code = 0;
+  curl_easy_getinfo(data->curl, CURLINFO_RESPONSE_CODE, &status_code);
+  if (status_code == 200) {
+    // the server ignored the Range header, the ranges are cut out of the
+    // whole resource instead of asking for each of them
+    data->whole = true;
+    return true;
+  }
+  if (status_code != 206) {
+    data->rejected = true;
+    return false;
+  }
+  char *content_type = nullptr;
+  curl_easy_getinfo(data->curl, CURLINFO_CONTENT_TYPE, &content_type);
+  auto boundary =
+      byterangesBoundary(content_type != nullptr ? content_type : "");
+  if (!boundary.empty()) {
+    data->parser =
+        std::make_unique<ByterangesParser>(boundary, *data->writer);
+    return true;
+  }
+  // one part, ranges the server merged or the only one it was willing to
+  // send, its Content-Range says which
+  if (!parseContentRange(responseHeader(data->curl, "Content-Range"),
+                         data->part)) {
+    data->rejected = true;
+    return false;
+  }
+  return true;
+}
+
+// write the parts of the size bytes at offset that were asked for, a merged
+// part or the whole resource carries the gaps between them too
+static bool writeWanted(RangesData *data, int64_t offset, const char *bytes,
+                        size_t size) {
+  ByteRange chunk{offset, offset + static_cast<int64_t>(size) - 1};
+  // the wanted ranges are sorted, start at the first one reaching chunk
+  auto it = std::lower_bound(
+      data->wanted->begin(), data->wanted->end(), chunk.start,
+      [](const ByteRange &range, int64_t pos) { return range.end < pos; });
+  for (; it != data->wanted->end() && it->start <= chunk.end; ++it) {
+    auto start = std::max(it->start, chunk.start);
+    auto end = std::min(it->end, chunk.end);
+    if (!(*data->writer)(start, bytes + (start - chunk.start),
+                         end - start + 1)) {
+      data->failed = true;
+      return false;
+    }
+    data->received.push_back(ByteRange{start, end});
+  }
+  return true;
+}
+
+static size_t rangesCallBack(void *ptr, size_t size, size_t nmemb,
+                             void *userp) {
+  auto data = static_cast<RangesData *>(userp);
+  auto bytes = static_cast<const char *>(ptr);
+  size_t total = size * nmemb;
+  if (!data->checked) {
+    data->checked = true;
+    if (!checkRanges(data)) {
+      return 0;
+    }
+  }
+  if (data->parser != nullptr) {
+    if (!data->parser->feed(bytes, total)) {
+      data->failed = true;
+      return 0;
+    }
+    return total;
+  }
+  if (data->whole) {
+    if (!writeWanted(data, data->part_offset, bytes, total)) {
+      return 0;
+    }
+    data->part_offset += total;
+    if (data->part_offset > data->wanted->back().end) {
+      data->complete = true;
+      return 0;
+    }
+    return total;
+  }
+  // anything past the announced range is not ours to write
+  auto n = static_cast<size_t>(std::min<int64_t>(
+      total, data->part.length() - data->part_offset));
+  if (!writeWanted(data, data->part.start + data->part_offset, bytes, n)) {
+    return 0;
+  }
+  data->part_offset += n;
+  return total;
+}
+
+Response HttpClient::getRanges(const std::string &url,
+                               const RetryStrategy &rs, CURL *curl,
+                               const std::vector<ByteRange> &ranges,
+                               const RangeWriter &writer,
+                               std::vector<ByteRange> *missing /*= nullptr*/) {
+  Response response;
+  auto wanted = normalizeRanges(ranges);
+  std::vector<ByteRange> covered;
+  bool failed = false;
+
+  // a single range gains nothing from the multipart path
+  for (size_t first = 0; wanted.size() > 1 && first < wanted.size();
+       first += kMaxRangesPerRequest) {
+    auto last = std::min(wanted.size(), first + kMaxRangesPerRequest);
+    std::string spec;
+    for (auto i = first; i < last; ++i) {
+      if (i > first) {
+        spec += ',';
+      }
+      spec += std::to_string(wanted[i].start) + "-" +
+              std::to_string(wanted[i].end);
+    }
+
+    RangesData data;
+    data.curl = curl;
+    data.writer = &writer;
+    data.wanted = &wanted;
+    resetHandle(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_RANGE, spec.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, rangesCallBack);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &data);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10L);
+    curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS,
+                     CURLPROTO_HTTP | CURLPROTO_HTTPS);
+
+    Tracer::Span attempt("multi_range", "http");
+    attempt.arg("ranges", static_cast<int64_t>(last - first));
+    CURLcode res = curl_easy_perform(curl);
+    if (data.complete) {
+      // aborted on purpose, see RangesData::complete
+      res = CURLE_OK;
+    }
+    response.status = res;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status_code);
+    attempt.arg("status", response.status_code);
+
+    // parts that arrived whole count even if the transfer broke off later
+    if (data.parser != nullptr) {
+      const auto &received = data.parser->received();
+      covered.insert(covered.end(), received.begin(), received.end());
+    } else {
+      covered.insert(covered.end(), data.received.begin(),
+                     data.received.end());
+    }
+    // a malformed multipart body leaves the rest to the requests below, a
+    // writer that refuses data would refuse it there too
+    if (data.failed && data.parser == nullptr) {
+      failed = true;
+      break;
+    }
+    if (data.whole) {
+      // everything that was wanted came with it
+      break;
+    }
+    if (data.rejected) {
+      MLTDL_LOG(kInfo, "multirange_rejected")
+          .host(logHost(url))
+          .message("fetching the ranges one by one");
+      break;
+    }
+  }
+
+  // one request per range the multi-range requests did not bring
+  auto left = subtractRanges(wanted, normalizeRanges(covered));
+  for (const auto &range : left) {
+    if (failed) {
+      break;
+    }
+    auto single = get(url, rs, curl, range.start, range.end);
+    response.status = single.status;
+    response.status_code = single.status_code;
+    if (single.status != CURLE_OK ||
+        static_cast<int64_t>(single.body.size()) < range.length()) {
+      continue;
+    }
+    if (!writer(range.start, single.body.data(), range.length())) {
+      failed = true;
+      break;
+    }
+    covered.push_back(range);
+  }
+
+  left = subtractRanges(wanted, normalizeRanges(covered));
+  if (failed) {
+    response.status = CURLE_WRITE_ERROR;
+  } else if (!left.empty() && response.status == CURLE_OK) {
+    response.status = CURLE_PARTIAL_FILE;
+  }
+  if (missing != nullptr) {
+    *missing = std::move(left);
+  }
+  return response;
+}
+
+ResourceInfo HttpClient::probe(const std::string &url, CURL *curl) {
+  ResourceInfo info;
+  resetHandle(curl);
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10L);
+  curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS,
+                   CURLPROTO_HTTP | CURLPROTO_HTTPS);
+
+  Tracer::Span span("probe", "http");
+  auto start_us = Tracer::nowUs();
+  CURLcode res = curl_easy_perform(curl);
+  traceAttempt(curl, start_us);
+  if (res != CURLE_OK) {
+    MLTDL_LOG(kError, "probe_failed")
+        .host(logHost(url))
+        .code(res)
+        .message(curl_easy_strerror(res));
+    return info;
+  }
+  curl_off_t size = -1;
+  curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+  info.size = size;
+  info.etag = responseHeader(curl, "ETag");
+  info.last_modified = responseHeader(curl, "Last-Modified");
+  auto accept_ranges = responseHeader(curl, "Accept-Ranges");
+  info.accept_ranges = accept_ranges != "none";
+  span.arg("size", info.size);
+  return info;
+}
+
+// the part of a file put sends, read as curl asks for it
+struct UploadData {
+  const std::string *path;
+  int64_t offset;
+  int64_t length;
+  // bytes handed to curl by the current attempt
+  int64_t sent{0};
+  TransferControl *control{nullptr};
+  bool read_failed{false};
+};
+
+static size_t uploadReadCallBack(char *buffer, size_t size, size_t nitems,
+                                 void *userp) {
+  auto data = static_cast<UploadData *>(userp);
+  if (data->control != nullptr && data->control->isCancelled()) {
+    return CURL_READFUNC_ABORT;
+  }
+  auto n = std::min<int64_t>(size * nitems, data->length - data->sent);
+  if (n <= 0) {
+    return 0;
+  }
+  auto got = FileIO::instance().pread(*data->path, data->offset + data->sent,
+                                      buffer, n);
+  if (got <= 0) {
+    // a file shorter than promised would make curl wait for the rest
+    data->read_failed = true;
+    return CURL_READFUNC_ABORT;
+  }
+  data->sent += got;
+  if (data->control != nullptr) {
+    data->control->add(got);
+  }
+  return got;
+}
+
+// curl rewinds the body when it has to send it again, after a redirect
+static int uploadSeekCallBack(void *userp, curl_off_t offset, int origin) {
+  auto data = static_cast<UploadData *>(userp);
+  if (origin != SEEK_SET || offset < 0 || offset > data->length) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  if (data->control != nullptr) {
+    data->control->add(offset - data->sent);
+  }
+  data->sent = offset;
+  return CURL_SEEKFUNC_OK;
+}
+
+Response HttpClient::put(const std::string &url, const std::string &file_path,
+                         int64_t offset, int64_t length,
+                         const std::vector<std::string> &headers,
+                         const RetryStrategy &rs, CURL *curl,
+                         TransferControl *control /*= nullptr*/) {
+  Response response;
+  WriteData write_data;
+  write_data.body = &response.body;
+  UploadData upload{&file_path, offset, length};
+  upload.control = control;
+
+  resetHandle(curl);
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+  curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)length);
+  curl_easy_setopt(curl, CURLOPT_READFUNCTION, uploadReadCallBack);
+  curl_easy_setopt(curl, CURLOPT_READDATA, &upload);
+  curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, uploadSeekCallBack);
+  curl_easy_setopt(curl, CURLOPT_SEEKDATA, &upload);
+  // fewer, larger reads from the disk
+  curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, 256L * 1024);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallBack);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_data);
+  std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> list(
+      nullptr, curl_slist_free_all);
+  for (const auto &header : headers) {
+    list.reset(curl_slist_append(list.release(), header.c_str()));
+  }
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list.get());
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10L);
+  curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS,
+                   CURLPROTO_HTTP | CURLPROTO_HTTPS);
+
+  for (auto i = 0; i < rs.max_retries; ++i) {
+    // every attempt sends the whole body again
+    if (control != nullptr) {
+      control->add(-upload.sent);
+    }
+    upload.sent = 0;
+    response.body.clear();
+    response.status_code = 0;
+
+    Tracer::Span attempt("upload", "http");
+    attempt.arg("attempt", i);
+    attempt.arg("bytes", length);
+    auto attempt_us = Tracer::nowUs();
+    CURLcode res = curl_easy_perform(curl);
+    response.status = res;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status_code);
+    traceAttempt(curl, attempt_us);
+    attempt.arg("status", response.status_code);
+    if (res == CURLE_OK && response.status_code >= 200 &&
+        response.status_code < 300) {
+      response.etag = responseHeader(curl, "ETag");
+      break;
+    }
+    if ((control != nullptr && control->isCancelled()) ||
+        upload.read_failed) {
+      break;
+    }
+    if (isPermanentHttpError(response.status_code)) {
+      MLTDL_LOG(kError, "upload_http_error")
+          .host(logHost(url))
+          .bytes(offset)
+          .code(response.status_code)
+          .message("no retries needed");
+      break;
+    }
+    attempt.end();
+    if (i + 1 == rs.max_retries) {
+      break;
+    }
+    curl_off_t retry_after_s = 0;
+    if (response.status_code == 429 || response.status_code == 503) {
+      curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after_s);
+    }
+    auto delay_ms = retryDelay(rs, i, retry_after_s * 1000);
+    MLTDL_LOG(kWarn, "upload_retry")
+        .host(logHost(url))
+        .bytes(offset)
+        .code(response.status_code != 0 ? response.status_code : res)
+        .message(std::string(curl_easy_strerror(res)) + ", retrying after " +
+                 std::to_string(delay_ms) + " ms");
+    Tracer::Span backoff("backoff", "http");
+    backoff.arg("delay_ms", delay_ms);
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+  }
+  if (upload.read_failed) {
+    MLTDL_LOG(kError, "upload_read_failed")
+        .host(logHost(url))
+        .bytes(offset)
+        .message("can't read " + file_path);
+  }
+  return response;
+}
+
+/**
+ * a server that does not support ranges answers 200 with the whole resource,
+ * which is only what we asked for if we asked from the first byte. Checked on
+ * the first chunk of every attempt, before anything is written.
+ */
+static bool acceptAttempt(WriteData *write_data) {
+  if (write_data->checked || write_data->curl == nullptr) {
+    return true;
+  }
+  write_data->checked = true;
+  long status_code = 0;
+  curl_easy_getinfo(write_data->curl, CURLINFO_RESPONSE_CODE, &status_code);
+  if (status_code == 200 && write_data->offset > 0) {
+    write_data->range_ignored = true;
+    return false;
+  }
+  return true;
+}
+
 size_t HttpClient::writeCallBack(void *contents, size_t size, size_t nmemb,
-                                 std::vector<char> *out) {
+                                 void *userp) {
+  WriteData *write_data = (WriteData *)userp;
+  if (!acceptAttempt(write_data)) {
+    // returning less than given makes curl fail with CURLE_WRITE_ERROR
+    return 0;
+  }
   size_t total_size = size * nmemb;
-  out->insert(out->end(), (char *)contents, (char *)contents + total_size);
+  // the body is charged but never paused, it only shrinks once the transfer
+  // is over, so pausing it could wait forever
+  if (write_data->lease != nullptr) {
+    write_data->lease->add(total_size);
+  }
+  write_data->body->insert(write_data->body->end(), (char *)contents,
+                           (char *)contents + total_size);
+  write_data->actual_size += total_size;
+  if (write_data->control != nullptr) {
+    write_data->control->add(total_size);
+  }
   return total_size;
 }
 size_t HttpClient::writeCallBack2(void *ptr, size_t size, size_t nmemb,
                                   void *stream) {
   WriteData *write_data = (WriteData *)stream;
+  if (!acceptAttempt(write_data)) {
+    return 0;
+  }
+  if (write_data->stream != nullptr) {
+    size_t total_size = size * nmemb;
+    if (!write_data->control->writer->budget().tryAcquire(total_size)) {
+      // hand over what we hold, a paused transfer sitting on its buffer
+      // could keep every other transfer waiting. curl keeps the chunk and
+      // delivers it again once unpaused
+      flushWriteBehind(write_data);
+      write_data->paused = true;
+      return CURL_WRITEFUNC_PAUSE;
+    }
+    write_data->paused = false;
+    write_data->buffer.insert(write_data->buffer.end(), (char *)ptr,
+                              (char *)ptr + total_size);
+    write_data->actual_size += total_size;
+    write_data->control->add(total_size);
+    if (write_data->buffer.size() >= kWriteBehindChunk) {
+      flushWriteBehind(write_data);
+    }
+    return total_size;
+  }
+  Tracer::Span span("write", "io");
+  span.arg("bytes", size * nmemb);
   size_t written = fwrite(ptr, size, nmemb, write_data->file);
   write_data->actual_size += written;
+  if (write_data->control != nullptr) {
+    write_data->control->add(written);
+  }
   return written;
 }
 
+size_t HttpClient::sinkCallBack(void *ptr, size_t size, size_t nmemb,
+                                void *userp) {
+  WriteData *write_data = (WriteData *)userp;
+  if (!acceptAttempt(write_data)) {
+    return 0;
+  }
+  size_t total_size = size * nmemb;
+  // a server that ignored the range may send more than was asked for
+  auto n = static_cast<size_t>(std::min<int64_t>(
+      total_size, write_data->expected_size - write_data->actual_size));
+  if (n > 0 &&
+      !write_data->sink->write(write_data->range_start +
+                                   write_data->actual_size,
+                               (const char *)ptr, n)) {
+    write_data->refused = true;
+    return 0;
+  }
+  write_data->actual_size += n;
+  if (write_data->control != nullptr) {
+    write_data->control->add(n);
+  }
+  return total_size;
+}
+
+int HttpClient::progressCallBack(void *clientp, curl_off_t /*dltotal*/,
+                                 curl_off_t /*dlnow*/, curl_off_t /*ultotal*/,
+                                 curl_off_t /*ulnow*/) {
+  WriteData *write_data = (WriteData *)clientp;
+  TransferControl *control = write_data->control;
+  if (control->on_progress) {
+    control->on_progress();
+  }
+  if (write_data->paused &&
+      write_data->control->writer->budget().fits(CURL_MAX_WRITE_SIZE)) {
+    // curl delivers the held chunk from inside this call, the write
+    // callback pauses again if the chunk does not fit after all
+    write_data->paused = false;
+    curl_easy_pause(write_data->curl, CURLPAUSE_CONT);
+  }
+  // a non-zero return makes curl abort with CURLE_ABORTED_BY_CALLBACK
+  return control->isCancelled() ? 1 : 0;
+}
+
 } // namespace mltdl
\ No newline at end of file
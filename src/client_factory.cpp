@@ -1,5 +1,6 @@
 #include "client_factory.h"
 #include "client.h"
+#include "sim_client.h"
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -14,6 +15,7 @@ public:
   ClientFactory() {
     registerProtocol("http", [] { return std::make_shared<HttpClient>(); });
     registerProtocol("https", [] { return std::make_shared<HttpClient>(); });
+    registerProtocol("sim", [] { return std::make_shared<SimClient>(); });
   }
   ~ClientFactory() = default;
 
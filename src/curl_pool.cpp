@@ -1,45 +1,275 @@
 #include "curl_pool.h"
+#include "tracer.h"
+#include "url.h"
+
+#include <algorithm>
+#include <cctype>
 
 namespace mltdl {
-CurlPool::CurlPool(int num_curl) {
-  for (auto i = 0; i <= num_curl; ++i) {
-    CURL *curl = curl_easy_init();
-    curls_.push(curl);
+
+namespace {
+
+/**
+ * a process wide share handle, a TLS session resumed or a host name resolved
+ * by one handle is reused by every other handle instead of starting cold.
+ * Connections stay in the cache of the handle that opened them.
+ */
+class CurlShare {
+public:
+  CurlShare() {
+    share_ = curl_share_init();
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+  ~CurlShare() { curl_share_cleanup(share_); }
+
+  CURLSH *handle() const { return share_; }
+
+private:
+  static void lock(CURL *, curl_lock_data data, curl_lock_access, void *userp) {
+    ((CurlShare *)userp)->mutexes_[data].lock();
   }
+  static void unlock(CURL *, curl_lock_data data, void *userp) {
+    ((CurlShare *)userp)->mutexes_[data].unlock();
+  }
+
+  CURLSH *share_;
+  std::mutex mutexes_[CURL_LOCK_DATA_LAST];
+};
+
+CURLSH *sharedHandle() {
+  static CurlShare share;
+  return share.handle();
+}
+
+} // namespace
+
+void resetHandle(CURL *curl) {
+  curl_easy_reset(curl);
+  curl_easy_setopt(curl, CURLOPT_SHARE, sharedHandle());
 }
+CurlPool::CurlPool(int num_curl) : slots_(std::max(num_curl, 0)) {}
 
 CurlPool::~CurlPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+    prewarm_cv_.notify_all();
+    // the HEAD requests still running use the pool
+    prewarm_cv_.wait(lock, [this] { return warm_ups_ == 0; });
+  }
+  if (prewarm_thread_.joinable()) {
+    prewarm_thread_.join();
+  }
+  for (auto &warm : warm_) {
+    for (auto &entry : warm.second) {
+      curl_easy_cleanup(entry.curl);
+    }
+  }
+  for (auto &slot : slots_) {
+    if (slot.curl != nullptr) {
+      curl_easy_cleanup(slot.curl);
+    }
+  }
   while (!curls_.empty()) {
     curl_easy_cleanup(curls_.front());
     curls_.pop();
   }
 }
 
+CURL *CurlPool::create() {
+  ++created_;
+  return curl_easy_init();
+}
+
 /**
  * make sure that each thread has a CURL handle available, even if the
  * number of threads equals the size of the CURL queue.
  * In extreme cases, the thread may not return the CURL handle to the handle
  * pool because of an exception or error.
  */
-CURL *CurlPool::acquire() {
+CURL *CurlPool::acquire(int worker /*= -1*/,
+                        const std::string &host /*= ""*/) {
+  Tracer::Span span("curl_acquire", "pool");
+  if (worker >= 0 && worker < static_cast<int>(slots_.size()) &&
+      !slots_[worker].in_use) {
+    // only the worker itself gets here for its slot, no lock needed
+    auto &slot = slots_[worker];
+    if (!host.empty() && slot.host != host) {
+      // the worker's handle is connected elsewhere, take a warm one over
+      // for good and leave the old one to the callers sharing handles
+      if (auto warm = takeWarm(host)) {
+        if (slot.curl != nullptr) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          curls_.push(slot.curl);
+        }
+        slot.curl = warm;
+        span.arg("warm", 1);
+      }
+      slot.host = host;
+    }
+    if (slot.curl == nullptr) {
+      slot.curl = create();
+    }
+    slot.in_use = true;
+    return slot.curl;
+  }
+  if (!host.empty()) {
+    if (auto warm = takeWarm(host)) {
+      return warm;
+    }
+  }
   std::lock_guard<std::mutex> lock(mutex_);
   if (curls_.empty()) {
-    return curl_easy_init();
+    return create();
   }
   CURL *curl = curls_.front();
   curls_.pop();
   return curl;
 }
 
-void CurlPool::release(CURL *curl) {
+void CurlPool::release(CURL *curl, int worker /*= -1*/) {
+  if (worker >= 0 && worker < static_cast<int>(slots_.size()) &&
+      slots_[worker].curl == curl) {
+    slots_[worker].in_use = false;
+    return;
+  }
   std::lock_guard<std::mutex> lock(mutex_);
   curls_.push(curl);
 }
 
-CurlGuard::CurlGuard(CurlPool &pool) : pool_(pool), curl_(pool.acquire()) {}
+std::string CurlPool::hostKey(const std::string &url) {
+  UrlParts parts;
+  if (!parseUrl(url, parts)) {
+    return "";
+  }
+  std::string key(parts.scheme);
+  std::transform(key.begin(), key.end(), key.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  if (key != "http" && key != "https") {
+    return "";
+  }
+  std::string host(parts.host);
+  std::transform(host.begin(), host.end(), host.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  auto port = parts.port_number != 0 ? parts.port_number
+                                     : (key == "https" ? 443 : 80);
+  return key + "://" + host + ":" + std::to_string(port);
+}
+
+void CurlPool::setPrewarm(const PrewarmOptions &options) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  options_ = options;
+}
+
+void CurlPool::prewarm(const std::string &url, size_t n) {
+  auto host = hostKey(url);
+  if (host.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!options_.enabled || stopping_) {
+    return;
+  }
+  auto &warming = warming_[host];
+  auto have = std::min(warm_[host].size() + warming, options_.max_per_host);
+  n = std::min(n, options_.max_per_host - have);
+  for (size_t i = 0; i < n; ++i) {
+    ++warming;
+    ++warm_ups_;
+    // the destructor waits for warm_ups_ to drop to zero
+    std::thread(&CurlPool::warmUp, this, url, host).detach();
+  }
+  if (n > 0 && !prewarm_thread_.joinable()) {
+    prewarm_thread_ = std::thread(&CurlPool::prewarmMain, this);
+  }
+}
+
+void CurlPool::warmUp(const std::string &url, const std::string &host) {
+  auto curl = create();
+  resetHandle(curl);
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 10L);
+  auto res = curl_easy_perform(curl);
+  // the transfers are redirected too, their connection is to the last host
+  std::string final_host;
+  char *effective = nullptr;
+  if (res == CURLE_OK &&
+      curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective) ==
+          CURLE_OK &&
+      effective != nullptr) {
+    final_host = hostKey(effective);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  --warming_[host];
+  if (!final_host.empty() && !stopping_ &&
+      warm_[final_host].size() < options_.max_per_host) {
+    warm_[final_host].push_back(Warm{curl, std::chrono::steady_clock::now()});
+  } else {
+    curl_easy_cleanup(curl);
+  }
+  --warm_ups_;
+  prewarm_cv_.notify_all();
+}
+
+size_t CurlPool::warm(const std::string &host) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = warm_.find(host);
+  return it == warm_.end() ? 0 : it->second.size();
+}
+
+size_t CurlPool::warmingUp() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return warm_ups_;
+}
+
+CURL *CurlPool::takeWarm(const std::string &host) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = warm_.find(host);
+  if (it == warm_.end() || it->second.empty()) {
+    return nullptr;
+  }
+  // the most recently warmed is the least likely to be closed by the server
+  auto curl = it->second.back().curl;
+  it->second.pop_back();
+  return curl;
+}
+
+void CurlPool::prewarmMain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    auto timeout = std::min<std::chrono::milliseconds>(
+        options_.idle_timeout, std::chrono::seconds(1));
+    prewarm_cv_.wait_for(lock, timeout);
+    // a connection the server may have closed already is no use
+    auto now = std::chrono::steady_clock::now();
+    for (auto &warm : warm_) {
+      auto &entries = warm.second;
+      auto idle = std::remove_if(
+          entries.begin(), entries.end(), [&](const Warm &entry) {
+            if (now - entry.since < options_.idle_timeout) {
+              return false;
+            }
+            curl_easy_cleanup(entry.curl);
+            return true;
+          });
+      entries.erase(idle, entries.end());
+    }
+  }
+}
+
+CurlGuard::CurlGuard(CurlPool &pool, int worker /*= -1*/,
+                     const std::string &host /*= ""*/)
+    : pool_(pool), worker_(worker), curl_(pool.acquire(worker, host)) {}
 CurlGuard::~CurlGuard() {
   if (curl_) {
-    pool_.release(curl_);
+    pool_.release(curl_, worker_);
   }
 };
 
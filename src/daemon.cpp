@@ -0,0 +1,298 @@
+#include "daemon.h"
+
+#include <chrono>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace mltdl {
+
+namespace {
+
+// finished jobs kept around so their status can still be queried
+constexpr size_t kMaxFinishedJobs = 10000;
+
+bool fillAddress(const std::string &socket_path, sockaddr_un &addr) {
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "socket path is too long : " << socket_path << std::endl;
+    return false;
+  }
+  addr = sockaddr_un{};
+  addr.sun_family = AF_UNIX;
+  socket_path.copy(addr.sun_path, socket_path.size());
+  return true;
+}
+
+// read one line from the socket, false once the peer closed it or running
+// turned false while waiting
+bool readLine(int fd, std::string &buffer, std::string &line,
+              const std::atomic<bool> *running = nullptr) {
+  char chunk[512];
+  for (;;) {
+    auto pos = buffer.find('\n');
+    if (pos != std::string::npos) {
+      line = buffer.substr(0, pos);
+      buffer.erase(0, pos + 1);
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      return true;
+    }
+    if (running != nullptr) {
+      pollfd pfd{fd, POLLIN, 0};
+      if (::poll(&pfd, 1, 200) <= 0) {
+        if (!*running) {
+          return false;
+        }
+        continue;
+      }
+    }
+    auto n = ::read(fd, chunk, sizeof(chunk));
+    if (n <= 0) {
+      return false;
+    }
+    buffer.append(chunk, n);
+  }
+}
+
+bool writeAll(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    // MSG_NOSIGNAL, a client that went away must not kill the daemon
+    auto n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+bool parsePriority(const std::string &name, Priority &priority) {
+  if (name == "high") {
+    priority = Priority::kHigh;
+  } else if (name == "normal") {
+    priority = Priority::kNormal;
+  } else if (name == "low") {
+    priority = Priority::kLow;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+DownloadDaemon::DownloadDaemon(const std::string &socket_path,
+                               const std::string &download_dir,
+                               size_t num_thread)
+    : socket_path_(socket_path), download_dir_(download_dir),
+      manager_(num_thread) {}
+
+DownloadDaemon::~DownloadDaemon() {
+  stop();
+  if (listen_fd_ >= 0) {
+    ::close(listen_fd_);
+    ::unlink(socket_path_.c_str());
+  }
+}
+
+bool DownloadDaemon::listen() {
+  sockaddr_un addr;
+  if (!fillAddress(socket_path_, addr)) {
+    return false;
+  }
+  listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    std::cerr << "create socket failed" << std::endl;
+    return false;
+  }
+  // a daemon that was killed leaves its socket file behind
+  ::unlink(socket_path_.c_str());
+  if (::bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      ::listen(listen_fd_, 64) < 0) {
+    std::cerr << "bind socket failed : " << socket_path_ << std::endl;
+    ::close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  running_ = true;
+  return true;
+}
+
+void DownloadDaemon::run() {
+  while (running_) {
+    // poll with a timeout so stop() is noticed without a connection
+    pollfd pfd{listen_fd_, POLLIN, 0};
+    if (::poll(&pfd, 1, 200) <= 0) {
+      continue;
+    }
+    int fd = ::accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++active_connections_;
+    }
+    std::thread([this, fd] {
+      serveConnection(fd);
+      ::close(fd);
+      std::lock_guard<std::mutex> lock(mutex_);
+      --active_connections_;
+      connections_cv_.notify_all();
+    }).detach();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  connections_cv_.wait(lock, [this] { return active_connections_ == 0; });
+}
+
+void DownloadDaemon::serveConnection(int fd) {
+  std::string buffer;
+  std::string line;
+  while (readLine(fd, buffer, line, &running_)) {
+    if (!writeAll(fd, handleCommand(line) + "\n")) {
+      break;
+    }
+  }
+}
+
+std::string DownloadDaemon::handleCommand(const std::string &line) {
+  std::istringstream iss(line);
+  std::string command;
+  iss >> command;
+
+  if (command == "SUBMIT") {
+    std::string url, priority_name, tenant;
+    iss >> url >> priority_name >> tenant;
+    if (url.empty()) {
+      return "ERR missing url";
+    }
+    DownloadOptions options;
+    if (!priority_name.empty() &&
+        !parsePriority(priority_name, options.priority)) {
+      return "ERR unknown priority " + priority_name;
+    }
+    options.tenant = tenant;
+    uint64_t id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = next_id_++;
+    }
+    auto handle = manager_.submit(url, download_dir_, options);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_[id] = handle;
+    }
+    // registered once the job is in the table, the callback may run at once
+    handle->onComplete([this, id](const DownloadHandle &) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_.push_back(id);
+      pruneFinished();
+    });
+    return "OK " + std::to_string(id);
+  }
+
+  if (command == "STATUS" || command == "WAIT" || command == "CANCEL") {
+    uint64_t id = 0;
+    if (!(iss >> id)) {
+      return "ERR missing job id";
+    }
+    std::shared_ptr<DownloadHandle> handle;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = jobs_.find(id);
+      if (it != jobs_.end()) {
+        handle = it->second;
+      }
+    }
+    if (handle == nullptr) {
+      return "ERR unknown job " + std::to_string(id);
+    }
+    if (command == "CANCEL") {
+      handle->cancel();
+      return "OK " + std::to_string(id);
+    }
+    if (command == "WAIT") {
+      while (running_ && !handle->waitFor(std::chrono::milliseconds(200))) {
+      }
+    }
+    return describe(id, *handle);
+  }
+
+  if (command == "SHUTDOWN") {
+    stop();
+    return "OK";
+  }
+  return "ERR unknown command " + command;
+}
+
+std::string DownloadDaemon::describe(uint64_t id,
+                                     const DownloadHandle &handle) const {
+  auto status = handle.status();
+  auto progress = handle.progress();
+  auto path = handle.filePath();
+
+  std::ostringstream oss;
+  oss << "OK " << id << " ";
+  if (status.pending()) {
+    oss << "running";
+  } else if (status.ok()) {
+    oss << "done";
+  } else {
+    oss << "failed";
+  }
+  oss << " " << progress.downloaded << "/" << progress.total << " "
+      << (path.empty() ? "-" : path);
+  if (!status.ok() && !status.pending()) {
+    oss << " " << status.toString();
+  }
+  return oss.str();
+}
+
+void DownloadDaemon::pruneFinished() {
+  while (finished_.size() > kMaxFinishedJobs) {
+    jobs_.erase(finished_.front());
+    finished_.pop_front();
+  }
+}
+
+std::string daemonJobState(const std::string &reply) {
+  std::istringstream iss(reply);
+  std::string ok, id, state;
+  iss >> ok >> id >> state;
+  if (ok != "OK" ||
+      (state != "running" && state != "done" && state != "failed")) {
+    return "";
+  }
+  return state;
+}
+
+std::string sendDaemonCommand(const std::string &socket_path,
+                              const std::string &line) {
+  sockaddr_un addr;
+  if (!fillAddress(socket_path, addr)) {
+    return "ERR bad socket path";
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return "ERR create socket failed";
+  }
+  if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    ::close(fd);
+    return "ERR can't connect to " + socket_path;
+  }
+  std::string reply;
+  std::string buffer;
+  if (!writeAll(fd, line + "\n") || !readLine(fd, buffer, reply)) {
+    reply = "ERR connection closed";
+  }
+  ::close(fd);
+  return reply;
+}
+
+} // namespace mltdl
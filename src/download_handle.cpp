@@ -0,0 +1,80 @@
+#include "download_handle.h"
+
+#include <algorithm>
+
+namespace mltdl {
+
+DownloadHandle::DownloadHandle(std::string url) : url_(std::move(url)) {}
+
+std::string DownloadHandle::filePath() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return file_path_;
+}
+
+void DownloadHandle::setFilePath(const std::string &file_path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  file_path_ = file_path;
+}
+
+bool DownloadHandle::done() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !status_.pending();
+}
+
+Status DownloadHandle::wait() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return !status_.pending(); });
+  return status_;
+}
+
+bool DownloadHandle::waitFor(std::chrono::milliseconds timeout) const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return done_cv_.wait_for(lock, timeout,
+                           [this] { return !status_.pending(); });
+}
+
+Status DownloadHandle::status() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return status_;
+}
+
+DownloadHandle::Progress DownloadHandle::progress() const {
+  auto total = total_.load();
+  auto downloaded = control_.bytes.load();
+  // hedged segments fetch some bytes twice
+  if (total >= 0) {
+    downloaded = std::min(downloaded, total);
+  }
+  return Progress{downloaded, total};
+}
+
+void DownloadHandle::onComplete(Callback callback) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (status_.pending()) {
+    callbacks_.push_back(std::move(callback));
+    return;
+  }
+  lock.unlock();
+  callback(*this);
+}
+
+void DownloadHandle::cancel() { control_.cancelled = true; }
+
+void DownloadHandle::complete(Status status) {
+  std::vector<Callback> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!status_.pending()) {
+      return;
+    }
+    status_ = std::move(status);
+    callbacks.swap(callbacks_);
+  }
+  done_cv_.notify_all();
+  // run the callbacks without the lock, they may query the handle
+  for (auto &callback : callbacks) {
+    callback(*this);
+  }
+}
+
+} // namespace mltdl
@@ -2,43 +2,418 @@
 #include "client.h"
 #include "client_factory.h"
 #include "file_guard.h"
-#include "file_handler.h"
+#include "file_io.h"
+#include "logger.h"
+#include "tracer.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <unistd.h>
 
 namespace mltdl {
 
-/**
- * 0: the download failed, but normal exit does not require retry
- * 1: the download success
- * -1: there is probably a network problem and it is worth trying again
- *
- * to be more reasonable, it should define a Status class to represent different
- * states
- */
-int DownloadManager::download(const std::string &url,
-                              const std::string &file_dir) {
-  CurlGuard guard(curl_pool_);
-  auto curl = guard.handle();
+template <typename Step>
+bool DownloadManager::guarded(const std::shared_ptr<Job> &job, Step step) {
+  try {
+    return step();
+  } catch (std::exception &e) {
+    job->handle->complete(Status(StatusCode::kInvalidArgument, e.what()));
+    return false;
+  }
+}
+
+DownloadManager::DownloadManager(size_t max_concurrent_tasks /*= 8*/,
+                                 int64_t max_segment_size
+                                 /*= kDefaultMaxSegmentSize*/,
+                                 size_t lookahead /*= kDefaultLookahead*/)
+    : thread_pool_(max_concurrent_tasks), curl_pool_(max_concurrent_tasks),
+      num_thread_(max_concurrent_tasks), max_segment_size_(max_segment_size),
+      lookahead_(lookahead) {
+  if (lookahead > 0) {
+    probe_pool_ = std::make_unique<ThreadPool>(lookahead, "probe");
+    probe_curls_ = std::make_unique<CurlPool>(lookahead);
+  }
+}
+
+DownloadManager::~DownloadManager() {
+  // the probes dispatch segments to the workers and the turns of the jobs on
+  // the workers start probes, until neither started anything new
+  if (probe_pool_ == nullptr) {
+    thread_pool_.waitForCompletion(false);
+    return;
+  }
+  while (true) {
+    probe_pool_->waitForCompletion(false);
+    auto started = probes_started_.load();
+    auto probing = probing_.load();
+    thread_pool_.waitForCompletion(false);
+    if (probing == 0 && started == probes_started_) {
+      break;
+    }
+  }
+}
+
+void DownloadManager::setWriteBehind(bool enabled) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (enabled && writer_ == nullptr) {
+    writer_ = std::make_unique<AsyncWriter>();
+  }
+  // a writer that is switched off stays alive for the jobs already using it
+  write_behind_ = enabled;
+}
+
+bool DownloadManager::pinThreads(const std::vector<int> &cpus) {
+  auto list = cpus;
+  for (unsigned i = 0; list.empty() && i < std::thread::hardware_concurrency();
+       ++i) {
+    list.push_back(i);
+  }
+  auto pinned = thread_pool_.pinThreads(list);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (writer_ != nullptr && !list.empty()) {
+    pinned = writer_->pin(list[num_thread_ % list.size()]) && pinned;
+  }
+  return pinned;
+}
+
+Status DownloadManager::download(const std::string &url,
+                                 const std::string &file_dir) {
+  return submit(url, file_dir)->wait();
+}
+
+std::shared_ptr<DownloadHandle>
+DownloadManager::submit(const std::string &url, const std::string &file_dir,
+                        DownloadHandle::Callback callback /*= nullptr*/) {
+  return submit(url, file_dir, DownloadOptions(), std::move(callback));
+}
+
+std::shared_ptr<DownloadHandle>
+DownloadManager::submit(const std::string &url, const std::string &file_dir,
+                        const DownloadOptions &options,
+                        DownloadHandle::Callback callback /*= nullptr*/) {
+  auto handle = std::make_shared<DownloadHandle>(url);
+  if (options.coalesce) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key = flightKey(url, options);
+    auto it = flights_.find(key);
+    if (it != flights_.end()) {
+      if (callback) {
+        handle->onComplete(std::move(callback));
+      }
+      it->second.push_back(Follower{handle, file_dir, options});
+      return handle;
+    }
+    flights_[key];
+  }
+  lead(handle, file_dir, options, std::move(callback));
+  return handle;
+}
+
+void DownloadManager::lead(const std::shared_ptr<DownloadHandle> &handle,
+                           const std::string &file_dir,
+                           const DownloadOptions &options,
+                           DownloadHandle::Callback callback) {
+  auto job = std::make_shared<Job>();
+  job->handle = handle;
+  job->file_dir = file_dir;
+  if (options.coalesce) {
+    // the followers get their result before the caller of the leader
+    callback = [this, key = flightKey(handle->url(), options),
+                callback = std::move(callback)](const DownloadHandle &done) {
+      land(key, done);
+      if (callback) {
+        callback(done);
+      }
+    };
+  }
+  dispatch(job, options, std::move(callback));
+}
+
+std::string DownloadManager::flightKey(const std::string &url,
+                                       const DownloadOptions &options) {
+  return url + '\n' + options.validator;
+}
+
+void DownloadManager::land(const std::string &key,
+                           const DownloadHandle &leader) {
+  std::vector<Follower> followers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = flights_.find(key);
+    if (it == flights_.end()) {
+      return;
+    }
+    followers = std::move(it->second);
+    flights_.erase(it);
+  }
+  auto status = leader.status();
+  std::vector<Follower> waiting;
+  for (auto &follower : followers) {
+    if (follower.handle->control()->cancelled) {
+      follower.handle->complete(
+          Status(StatusCode::kCancelled, "cancelled by the caller"));
+    } else if (status.code() == StatusCode::kCancelled) {
+      // only the leader's caller gave up, the others still want the file
+      waiting.push_back(std::move(follower));
+    } else if (!status.ok()) {
+      follower.handle->complete(status);
+    } else {
+      follower.handle->setTotal(leader.progress().total);
+      follower.handle->control()->bytes = leader.progress().total;
+      follower.handle->complete(shareFile(leader, follower));
+    }
+  }
+  if (waiting.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = flights_.find(key);
+    if (it != flights_.end()) {
+      // a new transfer started meanwhile, ride along with that one
+      it->second.insert(it->second.end(), waiting.begin(), waiting.end());
+      return;
+    }
+    flights_[key].assign(waiting.begin() + 1, waiting.end());
+  }
+  MLTDL_LOG(kInfo, "flight_restart")
+      .message("download was cancelled, restarting it for " +
+               std::to_string(waiting.size()) + " more callers");
+  lead(waiting[0].handle, waiting[0].file_dir, waiting[0].options, nullptr);
+}
+
+Status DownloadManager::shareFile(const DownloadHandle &leader,
+                                  const Follower &follower) {
+  auto source = leader.filePath();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto target = adjustFilepath(follower.file_dir, leader.url());
+  // a link costs neither bandwidth nor a write, a copy at least no transfer
+  if (::link(source.c_str(), target.c_str()) != 0) {
+    std::error_code ec;
+    std::filesystem::copy_file(source, target, ec);
+    if (ec) {
+      MLTDL_LOG(kError, "share_failed")
+          .code(ec.value())
+          .message("can't share " + source + " as " + target + ": " +
+                   ec.message());
+      return Status(StatusCode::kIoError, "failed to copy " + source);
+    }
+  }
+  follower.handle->setFilePath(target);
+  return Status::OK();
+}
+
+std::shared_ptr<DownloadHandle>
+DownloadManager::stream(const std::string &url, std::shared_ptr<Sink> sink,
+                        Delivery delivery /*= Delivery::kUnordered*/,
+                        const DownloadOptions &options /*= DownloadOptions()*/,
+                        DownloadHandle::Callback callback /*= nullptr*/) {
+  auto job = std::make_shared<Job>();
+  job->handle = std::make_shared<DownloadHandle>(url);
+  if (delivery == Delivery::kOrdered) {
+    job->ordered = std::make_shared<OrderedSink>(
+        std::move(sink), 0, OrderedSink::kDefaultMaxBuffered,
+        job->handle->control());
+    job->sink = job->ordered;
+  } else {
+    job->sink = std::move(sink);
+  }
+  // registered first, so the sink is done before any other callback runs
+  job->handle->onComplete([sink = job->sink](const DownloadHandle &handle) {
+    sink->finish(handle.status());
+  });
+  auto stream_options = options;
+  stream_options.hedge.enabled = false;
+  return dispatch(job, stream_options, std::move(callback));
+}
+
+std::shared_ptr<DownloadHandle>
+DownloadManager::dispatch(const std::shared_ptr<Job> &job,
+                          const DownloadOptions &options,
+                          DownloadHandle::Callback callback) {
+  const auto &url = job->handle->url();
+  job->work_options.priority = options.priority;
+  job->work_options.weight = options.weight;
+  job->hedge = options.hedge;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job->writer = write_behind_ ? writer_.get() : nullptr;
+  }
+  // from 1, the log leaves a job of 0 out
+  auto job_id = ++next_job_id_;
+  job->id = job_id;
+  job->work_options.flow = options.tenant.empty()
+                               ? "job-" + std::to_string(job_id)
+                               : "tenant-" + options.tenant;
+  auto &tracer = Tracer::global();
+  if (tracer.enabled()) {
+    std::string args;
+    Tracer::appendArg(args, "url", url);
+    tracer.asyncBegin("job", "download", job_id, std::move(args));
+    // registered first, so the job ends before the callbacks run
+    job->handle->onComplete([job_id](const DownloadHandle &handle) {
+      std::string args;
+      Tracer::appendArg(args, "status", handle.status().toString());
+      Tracer::global().asyncEnd("job", "download", job_id, std::move(args));
+    });
+  }
+  if (callback) {
+    job->handle->onComplete(std::move(callback));
+  }
+  // the size probe is a network round trip, keep it off the caller's thread
+  if (probe_pool_ == nullptr) {
+    thread_pool_.spawn(
+        [this, job](int worker) {
+          guarded(job, [&] {
+            if (probe(job, curl_pool_, worker)) {
+              prepare(job);
+            }
+            return true;
+          });
+        },
+        job->work_options);
+    return job->handle;
+  }
+  // with a look-ahead pool it is off the download workers too. The jobs
+  // next in line are probed while the workers are busy with segments, what
+  // the workers pick is only the job's turn
+  {
+    std::lock_guard<std::mutex> lock(lookahead_mutex_);
+    waiting_.push_back(job);
+  }
+  fillWindow();
+  thread_pool_.spawn([this, job](int /*worker*/) { turn(job); },
+                     job->work_options);
+  return job->handle;
+}
+
+void DownloadManager::turn(const std::shared_ptr<Job> &job) {
+  bool probe_now = false;
+  bool prepare_now = false;
+  {
+    std::lock_guard<std::mutex> lock(lookahead_mutex_);
+    job->turn = true;
+    if (job->in_window) {
+      job->in_window = false;
+      --in_window_;
+    }
+    if (job->probe_state == Job::kUnprobed) {
+      // it did not make it into the window, its probe can't wait any longer
+      job->probe_state = Job::kProbing;
+      probe_now = true;
+    } else if (job->probe_state == Job::kProbed) {
+      prepare_now = job->probe_ok;
+    }
+  }
+  if (probe_now) {
+    startProbe(job);
+  } else {
+    fillWindow();
+  }
+  if (prepare_now) {
+    guarded(job, [&] {
+      prepare(job);
+      return true;
+    });
+  }
+}
+
+void DownloadManager::fillWindow() {
+  std::vector<std::shared_ptr<Job>> next;
+  {
+    std::lock_guard<std::mutex> lock(lookahead_mutex_);
+    while (in_window_ < lookahead_ && !waiting_.empty()) {
+      auto job = std::move(waiting_.front());
+      waiting_.pop_front();
+      if (job->probe_state != Job::kUnprobed) {
+        continue;
+      }
+      job->probe_state = Job::kProbing;
+      job->in_window = true;
+      ++in_window_;
+      next.push_back(std::move(job));
+    }
+  }
+  for (const auto &job : next) {
+    startProbe(job);
+  }
+}
+
+void DownloadManager::startProbe(const std::shared_ptr<Job> &job) {
+  ++probes_started_;
+  ++probing_;
+  probe_pool_->spawn([this, job](int worker) {
+    auto ok = guarded(job,
+                      [&] { return probe(job, *probe_curls_, worker); });
+    bool prepare_now;
+    bool left_window = false;
+    {
+      std::lock_guard<std::mutex> lock(lookahead_mutex_);
+      job->probe_state = Job::kProbed;
+      job->probe_ok = ok;
+      prepare_now = ok && job->turn;
+      // a failed job is over, its place goes to the next one
+      if (!ok && job->in_window) {
+        job->in_window = false;
+        --in_window_;
+        left_window = true;
+      }
+    }
+    if (left_window) {
+      fillWindow();
+    }
+    if (prepare_now) {
+      guarded(job, [&] {
+        prepare(job);
+        return true;
+      });
+    }
+    --probing_;
+  });
+}
+
+bool DownloadManager::probe(const std::shared_ptr<Job> &job, CurlPool &curls,
+                            int worker) {
+  const auto &url = job->handle->url();
   if (url.empty()) {
-    std::cout << "url is empty!" << std::endl;
-    return 0;
+    MLTDL_LOG(kError, "invalid_url").job(job->id).message("url is empty");
+    job->handle->complete(Status(StatusCode::kInvalidArgument, "url is empty"));
+    return false;
   }
   auto valid = isUrlValid(url);
   if (!valid) {
-    std::cout << url << " url is invalid!" << std::endl;
-    return 0;
+    MLTDL_LOG(kError, "invalid_url").job(job->id).message(url);
+    job->handle->complete(
+        Status(StatusCode::kInvalidArgument, url + " url is invalid"));
+    return false;
   }
   auto protocol = getProtocol(url);
   auto client = get_clients(protocol);
-  if (curl == nullptr) {
-    return 0;
+  if (client == nullptr) {
+    job->handle->complete(Status(StatusCode::kUnsupported,
+                                 "unsupported protocol " + protocol));
+    return false;
+  }
+  // the connections for the segments are opened while the probe runs
+  curl_pool_.prewarm(url, num_thread_);
+  ResourceInfo info;
+  {
+    CurlGuard guard(curls, worker);
+    auto curl = guard.handle();
+    if (curl == nullptr) {
+      job->handle->complete(
+          Status(StatusCode::kNetworkError, "no CURL handle available"));
+      return false;
+    }
+    info = client->probe(url, curl);
   }
-  auto file_size = client->getFileSize(url, curl);
-  if (file_size < 0) {
+  if (info.size < 0) {
     /**
      * If the file size of the resource cannot be obtained, do I need to return
      * to single-threaded download?
@@ -50,65 +425,363 @@ int DownloadManager::download(const std::string &url,
      * We may need to manually verify the MD5 and SHA of the resource after the
      * download is complete
      */
-    return -1;
-  }
-  auto part_size = file_size / num_thread_;
-  auto file_path = adjustFilepath(file_dir, url);
-  createFile(file_path);
-  std::vector<std::string> temp_file_paths(num_thread_);
-  for (auto i = 0; i < num_thread_; ++i) {
-    auto temp_file_path = adjustFilepath(file_dir, url);
-    temp_file_paths[i] = temp_file_path;
-    createFile(temp_file_path);
-  }
-  for (auto i = 0; i < num_thread_; ++i) {
-    int64_t start = i * part_size;
-    int64_t end = ((i + 1) * part_size) - 1;
-    if (i == num_thread_ - 1) {
-      end = file_size - 1;
-    }
-    thread_pool_.enqueue([this, url, start, end, temp_file_paths, i](int) {
-      this->downloadFile(url, temp_file_paths[i], start, end);
-    });
+    job->handle->complete(Status(StatusCode::kNetworkError,
+                                 "failed to get the file size of " + url));
+    return false;
   }
-  // start all task and wait them complete
-  std::cout << "Download start, please wait ---------" << std::endl;
-  start();
-  auto merge_size = fileMerge(file_path, temp_file_paths);
-  if (merge_size != file_size) {
-    std::cerr << "merge file failed" << std::endl;
-    std::remove(file_path.c_str());
-    return -1;
-  }
-  auto md5 = calculateMd5(file_path);
-  auto sha256 = calculateSHA256(file_path);
-  std::cout << "md5: " << md5 << std::endl;
-  std::cout << "sha256: " << sha256 << std::endl;
-  std::cout << "file save to :" << file_path << std::endl;
-  return 1;
-}
-
-void DownloadManager::downloadFile(const std::string &url,
-                                   const std::string &file_path, int64_t start,
-                                   int64_t end) {
-  CurlGuard guard(curl_pool_);
-  FileGuard file_guard(file_path, "wb");
-  auto curl = guard.handle();
-  auto file = file_guard.handle();
-  if (!file) {
-    std::cerr << "file open failed" << file_path << std::endl;
+  job->info = info;
+  job->file_size = info.size;
+  job->handle->setTotal(info.size);
+  if (job->sink != nullptr && info.size == 0) {
+    // nothing to stream, and no segment to finish the job
+    job->handle->complete(Status::OK());
+    return false;
+  }
+  return true;
+}
+
+void DownloadManager::prepare(const std::shared_ptr<Job> &job) {
+  const auto &url = job->handle->url();
+  auto file_size = job->file_size;
+  // one segment per thread, or more when the segments would be too large
+  int64_t num_segment = num_thread_;
+  if (!job->info.accept_ranges) {
+    // the server said it ignores ranges, any segment but the first would
+    // get the whole file
+    num_segment = 1;
+  } else if (max_segment_size_ > 0) {
+    num_segment = std::max<int64_t>(
+        num_segment, (file_size + max_segment_size_ - 1) / max_segment_size_);
+  }
+  auto part_size = file_size / num_segment;
+  job->segments.resize(num_segment);
+  {
+    // adjustFilepath picks the first free name, so two jobs must not pick
+    // names at the same time
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (job->sink == nullptr) {
+      job->file_path = adjustFilepath(job->file_dir, url);
+      createFile(job->file_path);
+    }
+    for (auto i = 0; i < num_segment; ++i) {
+      auto segment = std::make_unique<Segment>();
+      if (job->sink == nullptr) {
+        segment->file_path = adjustFilepath(job->file_dir, url);
+        createFile(segment->file_path);
+      }
+      segment->start = i * part_size;
+      segment->end = ((i + 1) * part_size) - 1;
+      if (i == num_segment - 1) {
+        segment->end = file_size - 1;
+      }
+      segment->control.parent = job->handle->control();
+      segment->hedge_control.parent = job->handle->control();
+      segment->control.writer = job->writer;
+      segment->hedge_control.writer = job->writer;
+      segment->control.if_range = job->info.validator();
+      segment->hedge_control.if_range = job->info.validator();
+      segment->control.job_id = job->id;
+      segment->hedge_control.job_id = job->id;
+      segment->control.segment = i;
+      segment->hedge_control.segment = i;
+      job->segments[i] = std::move(segment);
+    }
+  }
+  job->handle->setFilePath(job->file_path);
+  job->pending = num_segment;
+  job->queued = num_segment;
+  for (auto i = 0; i < num_segment; ++i) {
+    auto *segment = job->segments[i].get();
+    if (job->hedge.enabled) {
+      // the job owns the segment, a shared_ptr in here would keep it alive
+      // forever
+      std::weak_ptr<Job> weak_job = job;
+      segment->control.on_progress = [this, weak_job, segment] {
+        if (auto job = weak_job.lock()) {
+          maybeHedge(job, segment);
+        }
+      };
+    }
+    // charge the flow for the bytes of the segment, so a tenant gets its
+    // share of bandwidth and not just its share of dispatches
+    auto work_options = job->work_options;
+    work_options.cost = segment->end - segment->start + 1;
+    thread_pool_.spawn(
+        [this, job, segment](int worker) {
+          segment->started_ns = nowNs();
+          --job->queued;
+          auto status = this->downloadFile(job, segment->file_path,
+                                           segment->start, segment->end,
+                                           &segment->control, worker);
+          this->segmentDone(job, segment, Segment::kPrimary, status);
+          if (--job->pending == 0) {
+            this->finish(job);
+          }
+        },
+        work_options);
+  }
+  MLTDL_LOG(kInfo, "start")
+      .job(job->id)
+      .bytes(file_size)
+      .message(std::to_string(num_segment) + " segments of " + url);
+}
+
+int64_t DownloadManager::nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * called from the progress callback of a running segment. A segment is
+ * hedged once every segment of the job has started, when the time it is
+ * projected to take at its current rate is `slowdown` times the median time
+ * the finished segments took. The hedge fetches what the segment has not
+ * received yet on another connection, the first of the two to finish wins.
+ */
+void DownloadManager::maybeHedge(const std::shared_ptr<Job> &job,
+                                 Segment *segment) {
+  if (segment->hedged || segment->winner != Segment::kNone ||
+      job->queued > 0) {
+    return;
+  }
+  auto now = nowNs();
+  // the median is only worth computing a few times a second per segment
+  if (now - segment->checked_ns < 100000000) {
+    return;
+  }
+  segment->checked_ns = now;
+
+  int64_t median_ns;
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->durations_ns.empty()) {
+      return;
+    }
+    auto durations = job->durations_ns;
+    auto mid = durations.begin() + durations.size() / 2;
+    std::nth_element(durations.begin(), mid, durations.end());
+    median_ns = *mid;
+  }
+  auto length = segment->end - segment->start + 1;
+  auto received = segment->control.bytes.load();
+  auto remaining = length - received;
+  auto elapsed_ns = now - segment->started_ns;
+  // too young to tell a slow segment from a slow start
+  if (remaining <= 0 ||
+      elapsed_ns < job->hedge.slowdown * static_cast<double>(median_ns) / 2) {
+    return;
+  }
+  // a stalled segment is projected to take forever
+  double projected_ns =
+      received > 0 ? static_cast<double>(elapsed_ns) * length / received
+                   : std::numeric_limits<double>::infinity();
+  if (projected_ns < job->hedge.slowdown * median_ns) {
+    return;
+  }
+  // the hedges of a job may not fetch more than budget * file size
+  auto limit = static_cast<int64_t>(job->hedge.budget * job->file_size);
+  auto spent = job->hedge_bytes.fetch_add(remaining);
+  if (spent + remaining > limit) {
+    job->hedge_bytes -= remaining;
+    return;
+  }
+  if (segment->hedged.exchange(true)) {
+    job->hedge_bytes -= remaining;
+    return;
+  }
+  segment->hedge_cut = segment->start + received;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    segment->hedge_path = adjustFilepath(job->file_dir, job->handle->url());
+    createFile(segment->hedge_path);
+  }
+  MLTDL_LOG(kInfo, "hedge")
+      .job(job->id)
+      .segment(segment->control.segment)
+      .bytes(remaining)
+      .message("hedging bytes " + std::to_string(segment->hedge_cut) + "-" +
+               std::to_string(segment->end) + " of a slow segment");
+  // the segment still runs, so pending can not drop to zero in between
+  ++job->pending;
+  auto work_options = job->work_options;
+  work_options.priority = Priority::kHigh;
+  work_options.cost = remaining;
+  thread_pool_.spawn(
+      [this, job, segment](int worker) {
+        auto status = this->downloadFile(job, segment->hedge_path,
+                                         segment->hedge_cut, segment->end,
+                                         &segment->hedge_control, worker);
+        this->segmentDone(job, segment, Segment::kHedge, status);
+        if (--job->pending == 0) {
+          this->finish(job);
+        }
+      },
+      work_options);
+}
+
+void DownloadManager::segmentDone(const std::shared_ptr<Job> &job,
+                                  Segment *segment, int side,
+                                  const Status &status) {
+  if (status.ok()) {
+    int expected = Segment::kNone;
+    if (segment->winner.compare_exchange_strong(expected, side)) {
+      // stop the slower of the two, its bytes are not needed anymore
+      if (side == Segment::kPrimary) {
+        segment->hedge_control.cancelled = true;
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->durations_ns.push_back(nowNs() - segment->started_ns);
+      } else {
+        segment->control.cancelled = true;
+      }
+    }
+    return;
+  }
+  // a failed hedge leaves the segment to its primary, and the loser of the
+  // race fails because it was cancelled
+  if (side == Segment::kHedge || segment->winner != Segment::kNone) {
     return;
   }
+  if (job->ordered != nullptr) {
+    // the gap this segment leaves is never filled, release the writers
+    // waiting behind it
+    job->ordered->cancel();
+  }
+  std::lock_guard<std::mutex> lock(job->mutex);
+  if (segment->error.ok()) {
+    segment->error = status;
+  }
+}
+
+Status DownloadManager::downloadFile(const std::shared_ptr<Job> &job,
+                                     const std::string &file_path,
+                                     int64_t start, int64_t end,
+                                     TransferControl *control,
+                                     int worker) {
+  const auto &url = job->handle->url();
+  Tracer::Span span("segment", "download");
+  span.arg("start", start);
+  span.arg("end", end);
+  if (control->isCancelled()) {
+    return Status(StatusCode::kCancelled, "cancelled");
+  }
+  CurlGuard guard(curl_pool_, worker, CurlPool::hostKey(url));
+  auto curl = guard.handle();
   auto protocol = getProtocol(url);
   auto client = get_clients(protocol);
   if (client == nullptr) {
-    std::cerr << "Download file failed" << std::endl;
-    return;
+    MLTDL_LOG(kError, "unsupported").job(job->id).message(protocol);
+    return Status(StatusCode::kUnsupported, "unsupported protocol " + protocol);
   }
   Response response;
-  RetryStrategy rs{3, 500, 2};
+  RetryStrategy rs{3, 500, 2, 30000};
+
+  if (job->sink != nullptr) {
+    if (!job->sink->claim(start, end)) {
+      return Status::OK();
+    }
+    response = client->stream(url, rs, curl, start, end, *job->sink, control);
+  } else {
+    FileGuard file_guard(file_path, "wb");
+    auto file = file_guard.handle();
+    if (!file) {
+      MLTDL_LOG(kError, "open_failed")
+          .job(job->id)
+          .code(errno)
+          .message(file_path);
+      return Status(StatusCode::kIoError, "failed to open " + file_path);
+    }
+    response = client->get(url, rs, curl, start, end, file, control);
+  }
+  if (control->isCancelled()) {
+    return Status(StatusCode::kCancelled, "cancelled");
+  }
+  if (response.status_code >= 300 ||
+      (response.status == CURLE_OK && response.status_code < 200)) {
+    // a server side error may go away, a client side one will not
+    return Status(isPermanentHttpError(response.status_code)
+                      ? StatusCode::kHttpError
+                      : StatusCode::kNetworkError,
+                  "server replied " + std::to_string(response.status_code));
+  } else if (response.status != CURLE_OK) {
+    return Status(StatusCode::kNetworkError,
+                  curl_easy_strerror((CURLcode)response.status));
+  }
+  return Status::OK();
+}
 
-  response = client->get(url, rs, curl, start, end, file);
+void DownloadManager::finish(const std::shared_ptr<Job> &job) {
+  auto &handle = job->handle;
+  Status error;
+  std::vector<FilePiece> pieces;
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    for (const auto &segment : job->segments) {
+      switch (segment->winner) {
+      case Segment::kPrimary:
+        pieces.push_back({segment->file_path, -1});
+        break;
+      case Segment::kHedge:
+        // the primary got at least up to the cut before the hedge started
+        pieces.push_back(
+            {segment->file_path, segment->hedge_cut - segment->start});
+        pieces.push_back({segment->hedge_path, -1});
+        break;
+      default:
+        if (error.ok()) {
+          error = segment->error.ok()
+                      ? Status(StatusCode::kNetworkError, "segment failed")
+                      : segment->error;
+        }
+      }
+    }
+  }
+  if (handle->control()->cancelled) {
+    error = Status(StatusCode::kCancelled, "cancelled by the caller");
+  }
+  if (job->sink != nullptr) {
+    // the data is with the sink already, there is nothing to merge
+    handle->complete(error);
+    return;
+  }
+  if (!error.ok()) {
+    removeSegmentFiles(job);
+    std::remove(job->file_path.c_str());
+    handle->complete(error);
+    return;
+  }
+  auto merge_size = fileMerge(job->file_path, pieces);
+  removeSegmentFiles(job);
+  if (merge_size != job->file_size) {
+    MLTDL_LOG(kError, "merge_failed")
+        .job(job->id)
+        .bytes(merge_size)
+        .message("expected " + std::to_string(job->file_size) + " bytes");
+    std::remove(job->file_path.c_str());
+    handle->complete(Status(StatusCode::kCorrupted,
+                            "merged " + std::to_string(merge_size) + " of " +
+                                std::to_string(job->file_size) + " bytes"));
+    return;
+  }
+  // the digests are only computed when they are logged, they read the file
+  MLTDL_LOG(kDebug, "digest")
+      .job(job->id)
+      .message("md5 " + calculateMd5(job->file_path) + " sha256 " +
+               calculateSHA256(job->file_path));
+  MLTDL_LOG(kInfo, "done")
+      .job(job->id)
+      .bytes(job->file_size)
+      .message(job->file_path);
+  handle->complete(Status::OK());
+}
+
+void DownloadManager::removeSegmentFiles(const std::shared_ptr<Job> &job) {
+  for (const auto &segment : job->segments) {
+    std::remove(segment->file_path.c_str());
+    if (!segment->hedge_path.empty()) {
+      std::remove(segment->hedge_path.c_str());
+    }
+  }
 }
 
 /**
@@ -128,39 +801,44 @@ void DownloadManager::downloadFile(const std::string &url,
  * should be written.
  */
 
-int64_t
-DownloadManager::fileMerge(const std::string file_path,
-                           const std::vector<std::string> &temp_file_paths) {
-  FileGuard output_file(file_path, "wb");
+int64_t DownloadManager::fileMerge(const std::string file_path,
+                                   const std::vector<FilePiece> &pieces) {
+  Tracer::Span span("merge", "io");
+  span.arg("pieces", pieces.size());
+  auto &io = FileIO::instance();
   int64_t merge_size = 0;
-  if (!output_file.handle()) {
-    std::cerr << "Failed to open output file" << std::endl;
+  if (!io.truncate(file_path, 0)) {
+    MLTDL_LOG(kError, "merge_failed").code(errno).message(file_path);
     return merge_size;
   }
-  char buffer[1024];
-  for (auto i = 0; i < num_thread_; ++i) {
-    FileGuard input_file(temp_file_paths[i], "rb");
-    if (!input_file.handle()) {
-      std::cerr << "Failed to open input file: " << temp_file_paths[i]
-                << std::endl;
-      continue;
-    }
-    while (!feof(input_file.handle())) {
-      size_t read_size = fread(buffer, 1, sizeof(buffer), input_file.handle());
-      if (ferror(input_file.handle())) {
-        std::cerr << "Error reading input file: " << temp_file_paths[i]
-                  << std::endl;
+  std::vector<char> buffer(1024 * 1024);
+  for (const auto &piece : pieces) {
+    // a piece with a length only contributes its first length bytes
+    int64_t left = piece.length < 0 ? std::numeric_limits<int64_t>::max()
+                                    : piece.length;
+    int64_t offset = 0;
+    while (left > 0) {
+      size_t want = std::min<int64_t>(buffer.size(), left);
+      auto read_size = io.pread(piece.path, offset, buffer.data(), want);
+      if (read_size < 0) {
+        MLTDL_LOG(kError, "merge_failed").code(errno).message(piece.path);
         break;
       }
-      merge_size += read_size;
-      fwrite(buffer, 1, read_size, output_file.handle());
-      if (ferror(output_file.handle())) {
-        std::cerr << "Error writing to output file" << std::endl;
+      if (read_size == 0) {
         break;
       }
+      if (!io.pwrite(file_path, merge_size, buffer.data(), read_size)) {
+        MLTDL_LOG(kError, "merge_failed").code(errno).message(file_path);
+        break;
+      }
+      offset += read_size;
+      merge_size += read_size;
+      left -= read_size;
     }
-    std::remove(temp_file_paths[i].c_str());
+    // the pieces are removed next, a cached descriptor would outlive them
+    io.close(piece.path);
   }
+  io.close(file_path);
   return merge_size;
 }
-} // namespace mltdl
\ No newline at end of file
+} // namespace mltdl
@@ -0,0 +1,182 @@
+#include "file_io.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mltdl {
+
+FileIO::Descriptor::~Descriptor() { ::close(fd_); }
+
+FileIO &FileIO::instance() {
+  static FileIO file_io;
+  return file_io;
+}
+
+FileIO::FileIO(size_t max_open) : max_open_(std::max<size_t>(max_open, 1)) {}
+
+std::shared_ptr<FileIO::Descriptor> FileIO::open(const std::string &path,
+                                                 bool writable) {
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = open_.find(path);
+    if (it != open_.end() && (it->second->writable() || !writable)) {
+      it->second->last_used.store(++clock_, std::memory_order_relaxed);
+      return it->second;
+    }
+  }
+  // open outside the lock, only the insert has to be exclusive
+  int fd = writable ? ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)
+                    : ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  auto descriptor = std::make_shared<Descriptor>(fd, writable);
+  descriptor->last_used = ++clock_;
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  auto &slot = open_[path];
+  if (slot != nullptr && (slot->writable() || !writable)) {
+    // another thread opened it meanwhile, ours is closed on return
+    return slot;
+  }
+  slot = descriptor;
+  if (open_.size() > max_open_) {
+    evict();
+  }
+  return descriptor;
+}
+
+void FileIO::evict() {
+  while (open_.size() > max_open_) {
+    auto oldest = open_.begin();
+    for (auto it = open_.begin(); it != open_.end(); ++it) {
+      if (it->second->last_used < oldest->second->last_used) {
+        oldest = it;
+      }
+    }
+    open_.erase(oldest);
+  }
+}
+
+bool FileIO::pwrite(const std::string &path, int64_t offset, const void *data,
+                    size_t size) {
+  auto descriptor = open(path, true);
+  if (descriptor == nullptr) {
+    MLTDL_LOG(kError, "open_failed").code(errno).message(path);
+    return false;
+  }
+  auto bytes = static_cast<const char *>(data);
+  size_t written = 0;
+  while (written < size) {
+    auto n = ::pwrite(descriptor->fd(), bytes + written, size - written,
+                      offset + written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      MLTDL_LOG(kError, "write_failed")
+          .code(errno)
+          .message(path + " at offset " +
+                   std::to_string(offset + written));
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+int64_t FileIO::pread(const std::string &path, int64_t offset, void *data,
+                      size_t size) {
+  auto descriptor = open(path, false);
+  if (descriptor == nullptr) {
+    return -1;
+  }
+  auto bytes = static_cast<char *>(data);
+  size_t done = 0;
+  while (done < size) {
+    auto n =
+        ::pread(descriptor->fd(), bytes + done, size - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      // end of file
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+bool FileIO::write(const std::string &path, const std::vector<char> &data) {
+  return truncate(path, 0) && pwrite(path, 0, data.data(), data.size());
+}
+
+std::vector<char> FileIO::read(const std::string &path) {
+  auto file_size = size(path);
+  if (file_size < 0) {
+    return {};
+  }
+  std::vector<char> data(file_size);
+  auto n = pread(path, 0, data.data(), data.size());
+  if (n < 0) {
+    return {};
+  }
+  data.resize(n);
+  return data;
+}
+
+bool FileIO::preallocate(const std::string &path, int64_t size) {
+  auto descriptor = open(path, true);
+  if (descriptor == nullptr) {
+    MLTDL_LOG(kError, "open_failed").code(errno).message(path);
+    return false;
+  }
+  if (::ftruncate(descriptor->fd(), size) != 0) {
+    return false;
+  }
+  // reserve the blocks where the file system supports it, a sparse file
+  // from ftruncate works everywhere else
+  if (size > 0) {
+    ::posix_fallocate(descriptor->fd(), 0, size);
+  }
+  return true;
+}
+
+bool FileIO::truncate(const std::string &path, int64_t size) {
+  auto descriptor = open(path, true);
+  return descriptor != nullptr && ::ftruncate(descriptor->fd(), size) == 0;
+}
+
+int64_t FileIO::size(const std::string &path) {
+  auto descriptor = open(path, false);
+  struct stat st;
+  if (descriptor == nullptr || ::fstat(descriptor->fd(), &st) != 0) {
+    return -1;
+  }
+  return st.st_size;
+}
+
+bool FileIO::sync(const std::string &path) {
+  auto descriptor = open(path, true);
+  return descriptor != nullptr && ::fdatasync(descriptor->fd()) == 0;
+}
+
+void FileIO::close(const std::string &path) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  open_.erase(path);
+}
+
+size_t FileIO::openCount() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return open_.size();
+}
+
+} // namespace mltdl
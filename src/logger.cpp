@@ -0,0 +1,255 @@
+#include "logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <pthread.h>
+
+namespace mltdl {
+
+namespace {
+
+// how long a record may wait for the flusher, errors wake it at once
+constexpr auto kFlushInterval = std::chrono::milliseconds(20);
+
+void appendQuoted(std::string &line, const std::string &value) {
+  line += '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      line += '\\';
+      line += c;
+    } else if (c == '\n') {
+      line += "\\n";
+    } else {
+      line += c;
+    }
+  }
+  line += '"';
+}
+
+} // namespace
+
+const char *toString(LogLevel level) {
+  switch (level) {
+  case LogLevel::kDebug:
+    return "debug";
+  case LogLevel::kInfo:
+    return "info";
+  case LogLevel::kWarn:
+    return "warn";
+  case LogLevel::kError:
+    return "error";
+  default:
+    return "off";
+  }
+}
+
+Logger &Logger::global() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger() {
+  // the flusher is not in the child, it writes its records with flush()
+  pthread_atfork(
+      [] {
+        auto &logger = global();
+        logger.drain_mutex_.lock();
+        logger.mutex_.lock();
+      },
+      [] {
+        auto &logger = global();
+        logger.mutex_.unlock();
+        logger.drain_mutex_.unlock();
+      },
+      [] {
+        // what the parent submitted is the parent's to write
+        auto &logger = global();
+        for (auto &ring : logger.rings_) {
+          ring->tail.store(ring->head.load());
+        }
+        logger.mutex_.unlock();
+        logger.drain_mutex_.unlock();
+      });
+}
+
+Logger::~Logger() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  if (flusher_.joinable()) {
+    flusher_.join();
+  }
+  drain();
+  std::lock_guard<std::mutex> lock(drain_mutex_);
+  if (out_ != stderr) {
+    fclose(out_);
+  }
+}
+
+bool Logger::setOutput(const std::string &path) {
+  FILE *out = stderr;
+  if (!path.empty()) {
+    out = fopen(path.c_str(), "a");
+    if (out == nullptr) {
+      std::cerr << "can't open log file: " << path << std::endl;
+      return false;
+    }
+  }
+  // what was logged before goes where it was meant to
+  drain();
+  std::lock_guard<std::mutex> lock(drain_mutex_);
+  if (out_ != stderr) {
+    fclose(out_);
+  }
+  out_ = out;
+  return true;
+}
+
+Logger::Ring &Logger::ring() {
+  // retires the ring when the thread exits, it stays registered until its
+  // last records are written. Touches only the ring, the logger may be gone
+  struct Holder {
+    std::shared_ptr<Ring> ring;
+    ~Holder() {
+      if (ring != nullptr) {
+        ring->retired.store(true, std::memory_order_release);
+      }
+    }
+  };
+  thread_local Holder local;
+  if (local.ring == nullptr) {
+    local.ring = std::make_shared<Ring>();
+    std::lock_guard<std::mutex> lock(mutex_);
+    local.ring->tid = next_tid_++;
+    rings_.push_back(local.ring);
+  }
+  return *local.ring;
+}
+
+size_t Logger::rings() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return rings_.size();
+}
+
+void Logger::submit(LogRecord record) {
+  std::call_once(started_, [this] {
+    flusher_ = std::thread(&Logger::flusherMain, this);
+  });
+  auto &local = ring();
+  auto head = local.head.load(std::memory_order_relaxed);
+  if (head - local.tail.load(std::memory_order_acquire) == kRingSize) {
+    ++dropped_;
+    return;
+  }
+  record.tid = local.tid;
+  record.ts_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                     .count();
+  auto level = record.level;
+  local.slots[head % kRingSize] = std::move(record);
+  local.head.store(head + 1, std::memory_order_release);
+  if (level >= LogLevel::kError) {
+    wake_.notify_one();
+  }
+}
+
+void Logger::flush() { drain(); }
+
+void Logger::drain() {
+  std::vector<std::shared_ptr<Ring>> rings;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rings = rings_;
+  }
+  std::lock_guard<std::mutex> lock(drain_mutex_);
+  std::vector<LogRecord> records;
+  std::vector<std::shared_ptr<Ring>> retired;
+  for (auto &ring : rings) {
+    // read before head, a retired ring gets no more records
+    if (ring->retired.load(std::memory_order_acquire)) {
+      retired.push_back(ring);
+    }
+    auto tail = ring->tail.load(std::memory_order_relaxed);
+    auto head = ring->head.load(std::memory_order_acquire);
+    for (auto i = tail; i != head; ++i) {
+      records.push_back(std::move(ring->slots[i % kRingSize]));
+    }
+    ring->tail.store(head, std::memory_order_release);
+  }
+  if (!retired.empty()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &ring : retired) {
+      rings_.erase(std::find(rings_.begin(), rings_.end(), ring));
+    }
+  }
+  if (records.empty()) {
+    return;
+  }
+  // each ring is in order already, the batch is put in order across them
+  std::stable_sort(records.begin(), records.end(),
+                   [](const LogRecord &a, const LogRecord &b) {
+                     return a.ts_us < b.ts_us;
+                   });
+  std::string batch;
+  for (const auto &record : records) {
+    batch += format(record);
+    batch += '\n';
+  }
+  fwrite(batch.data(), 1, batch.size(), out_);
+  fflush(out_);
+}
+
+void Logger::flusherMain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    wake_.wait_for(lock, kFlushInterval);
+    lock.unlock();
+    drain();
+    lock.lock();
+  }
+}
+
+std::string Logger::format(const LogRecord &record) {
+  std::string line;
+  line.reserve(160);
+  char ts[64];
+  time_t seconds = record.ts_us / 1000000;
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  auto n = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &utc);
+  snprintf(ts + n, sizeof(ts) - n, ".%06dZ",
+           static_cast<int>(record.ts_us % 1000000));
+  line += "ts=";
+  line += ts;
+  line += " level=";
+  line += toString(record.level);
+  line += " event=";
+  line += record.event;
+  if (record.job != 0) {
+    line += " job=" + std::to_string(record.job);
+  }
+  if (record.segment >= 0) {
+    line += " segment=" + std::to_string(record.segment);
+  }
+  if (!record.host.empty()) {
+    line += " host=" + record.host;
+  }
+  if (record.bytes >= 0) {
+    line += " bytes=" + std::to_string(record.bytes);
+  }
+  if (record.code != 0) {
+    line += " code=" + std::to_string(record.code);
+  }
+  line += " tid=" + std::to_string(record.tid);
+  if (!record.message.empty()) {
+    line += " msg=";
+    appendQuoted(line, record.message);
+  }
+  return line;
+}
+
+} // namespace mltdl
@@ -0,0 +1,271 @@
+#include "manifest.h"
+#include "logger.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+namespace mltdl {
+
+namespace fs = std::filesystem;
+
+// FNV-1a, a stable hash so the keys in a results log stay valid across runs
+static uint64_t fnv1a(uint64_t hash, const std::string &data) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t ManifestEntry::key() const {
+  auto hash = fnv1a(14695981039346656037ULL, url);
+  // the separator keeps "a b" and "ab " apart
+  hash = fnv1a(hash, std::string(1, '\0'));
+  return fnv1a(hash, dest);
+}
+
+bool ManifestReader::next(ManifestEntry &entry) {
+  while (std::getline(in_, line_)) {
+    ++line_number_;
+    if (!line_.empty() && line_.back() == '\r') {
+      line_.pop_back();
+    }
+    std::istringstream fields(line_);
+    std::string url;
+    if (!(fields >> url) || url[0] == '#') {
+      continue;
+    }
+    std::string dest;
+    std::string checksum;
+    fields >> dest >> checksum;
+    entry.url = std::move(url);
+    entry.dest = dest == "-" ? "" : std::move(dest);
+    entry.checksum = checksum == "-" ? "" : std::move(checksum);
+    return true;
+  }
+  return false;
+}
+
+ResultsLog::ResultsLog(const std::string &path) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    // a line cut short by a crash is ignored
+    if (line.size() < 19 || line.compare(16, 4, " ok ") != 0) {
+      continue;
+    }
+    try {
+      completed_.insert(std::stoull(line.substr(0, 16), nullptr, 16));
+    } catch (std::exception &) {
+    }
+  }
+  out_.open(path, std::ios::app);
+  if (!out_.is_open()) {
+    MLTDL_LOG(kError, "open_failed").code(errno).message(path);
+  }
+}
+
+bool ResultsLog::completed(uint64_t key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return completed_.count(key) > 0;
+}
+
+size_t ResultsLog::completedCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return completed_.size();
+}
+
+void ResultsLog::record(const ManifestEntry &entry, const Status &status) {
+  char key[17];
+  std::snprintf(key, sizeof(key), "%016llx",
+                static_cast<unsigned long long>(entry.key()));
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (status.ok()) {
+    completed_.insert(entry.key());
+  }
+  out_ << key << (status.ok() ? " ok " : " fail ") << entry.url << std::endl;
+}
+
+// compute is given the algorithm, md5 or sha256, and returns the digest
+static Status
+checkDigest(const std::string &checksum,
+            const std::function<std::string(const std::string &)> &compute) {
+  if (checksum.empty()) {
+    return Status::OK();
+  }
+  auto expected = checksum;
+  std::transform(expected.begin(), expected.end(), expected.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  std::string algorithm;
+  auto colon = expected.find(':');
+  if (colon != std::string::npos) {
+    algorithm = expected.substr(0, colon);
+    expected = expected.substr(colon + 1);
+  } else if (expected.size() == 32) {
+    algorithm = "md5";
+  } else if (expected.size() == 64) {
+    algorithm = "sha256";
+  }
+  if (algorithm != "md5" && algorithm != "sha256") {
+    return Status(StatusCode::kInvalidArgument,
+                  "unknown checksum " + checksum);
+  }
+  auto actual = compute(algorithm);
+  if (actual != expected) {
+    return Status(StatusCode::kCorrupted,
+                  algorithm + " mismatch, expected " + expected + " got " +
+                      actual);
+  }
+  return Status::OK();
+}
+
+Status verifyChecksum(const std::string &file_path,
+                      const std::string &checksum) {
+  return checkDigest(checksum, [&](const std::string &algorithm) {
+    return algorithm == "md5" ? calculateMd5(file_path)
+                              : calculateSHA256(file_path);
+  });
+}
+
+Status verifyChecksum(const char *data, size_t size,
+                      const std::string &checksum) {
+  return checkDigest(checksum, [&](const std::string &algorithm) {
+    return algorithm == "md5" ? calculateMd5(data, size)
+                              : calculateSHA256(data, size);
+  });
+}
+
+ManifestRunner::ManifestRunner(DownloadManager &manager,
+                               const std::string &download_dir,
+                               size_t max_in_flight, ResultsLog *log)
+    : manager_(manager), download_dir_(download_dir),
+      max_in_flight_(std::max<size_t>(max_in_flight, 1)), log_(log) {}
+
+ManifestRunner::Summary ManifestRunner::run(std::istream &in) {
+  ManifestReader reader(in);
+  // only a 64-bit key is kept per distinct entry, not the entry itself
+  std::unordered_set<uint64_t> seen;
+  ManifestEntry entry;
+  while (reader.next(entry)) {
+    auto key = entry.key();
+    if (!seen.insert(key).second) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++summary_.duplicates;
+      continue;
+    }
+    if (log_ != nullptr && log_->completed(key)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++summary_.skipped;
+      continue;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      slot_free_.wait(lock, [this] { return in_flight_ < max_in_flight_; });
+      ++in_flight_;
+    }
+    submit(entry);
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  slot_free_.wait(lock, [this] { return in_flight_ == 0; });
+  return summary_;
+}
+
+void ManifestRunner::resolve(const ManifestEntry &entry, std::string &dir,
+                             std::string &target) const {
+  target.clear();
+  if (entry.dest.empty()) {
+    dir = download_dir_;
+    return;
+  }
+  fs::path dest(entry.dest);
+  if (dest.is_relative()) {
+    dest = fs::path(download_dir_) / dest;
+  }
+  if (entry.dest.back() == '/') {
+    dir = dest.string();
+    // drop the trailing separator
+    dir.pop_back();
+    return;
+  }
+  dir = dest.parent_path().string();
+  target = dest.string();
+}
+
+void ManifestRunner::submit(const ManifestEntry &entry) {
+  if (pack_store_ != nullptr) {
+    submitToPack(entry);
+    return;
+  }
+  std::string dir;
+  std::string target;
+  resolve(entry, dir, target);
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+
+  auto finished = [this, entry, target](const DownloadHandle &handle) {
+    auto status = handle.status();
+    auto path = handle.filePath();
+    if (status.ok()) {
+      status = verifyChecksum(path, entry.checksum);
+      if (!status.ok()) {
+        // a rerun downloads it again under the same name
+        std::error_code ec;
+        fs::remove(path, ec);
+      }
+    }
+    if (status.ok() && !target.empty() && path != target) {
+      std::error_code ec;
+      fs::rename(path, target, ec);
+      if (ec) {
+        status = Status(StatusCode::kIoError,
+                        "can't move " + path + " to " + target + ": " +
+                            ec.message());
+      }
+    }
+    done(entry, status);
+  };
+  manager_.submit(entry.url, dir, finished);
+}
+
+void ManifestRunner::submitToPack(const ManifestEntry &entry) {
+  auto checksum = entry.checksum;
+  auto sink = std::make_shared<PackSink>(
+      *pack_store_, entry.dest.empty() ? entry.url : entry.dest,
+      [checksum](const std::vector<char> &data) {
+        return verifyChecksum(data.data(), data.size(), checksum);
+      });
+  // the sink has stored the data, or failed to, before this runs
+  auto finished = [this, entry, sink](const DownloadHandle &handle) {
+    auto status = handle.status();
+    if (status.ok()) {
+      status = sink->status();
+    }
+    done(entry, status);
+  };
+  manager_.stream(entry.url, sink, Delivery::kUnordered, DownloadOptions(),
+                  finished);
+}
+
+void ManifestRunner::done(const ManifestEntry &entry, const Status &status) {
+  if (!status.ok()) {
+    MLTDL_LOG(kError, "entry_failed")
+        .code(static_cast<int64_t>(status.code()))
+        .message(entry.url + " " + status.toString());
+  }
+  if (log_ != nullptr) {
+    log_->record(entry, status);
+  }
+  // notified under the lock, run() may return and destroy us right after
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++(status.ok() ? summary_.succeeded : summary_.failed);
+  --in_flight_;
+  slot_free_.notify_all();
+}
+
+} // namespace mltdl
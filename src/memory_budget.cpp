@@ -0,0 +1,25 @@
+#include "memory_budget.h"
+
+namespace mltdl {
+
+MemoryBudget &MemoryBudget::global() {
+  static MemoryBudget budget;
+  return budget;
+}
+
+bool MemoryBudget::tryAcquire(int64_t n) {
+  auto capacity = capacity_.load();
+  if (capacity <= 0) {
+    used_ += n;
+    return true;
+  }
+  auto used = used_.load();
+  do {
+    if (used + n > capacity && used > 0) {
+      return false;
+    }
+  } while (!used_.compare_exchange_weak(used, used + n));
+  return true;
+}
+
+} // namespace mltdl
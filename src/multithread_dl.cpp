@@ -1,5 +1,20 @@
+#include "cache_server.h"
+#include "daemon.h"
 #include "download_manager.h"
+#include "logger.h"
+#include "manifest.h"
+#include "sharded_download.h"
+#include "thread_pool.h"
+#include "tracer.h"
+#include "uploader.h"
 #include "utils.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <unordered_map>
@@ -21,12 +36,361 @@ Args parse_args(int argc, char *argv[]) {
 
 // A help document
 void printHelp() {
-  std::cout << "Usage: prog [--url url]" << std::endl;
+  std::cout << "Usage: prog [--url url] [--manifest file|-] [--daemon socket] "
+               "[--socket socket (--url url | --job id)] [--trace file]"
+            << std::endl;
   std::cout << "Options:" << std::endl;
   std::cout << "\t--url\t\t(default: \"\")" << std::endl;
+  std::cout << "\t--upload\tupload this file to --url instead of "
+               "downloading it"
+            << std::endl;
+  std::cout << "\t--upload-mode\tsingle, ranged (a PUT with Content-Range "
+               "per part) or multipart (default: ranged)"
+            << std::endl;
+  std::cout << "\t--part-size\tMiB per uploaded part (default: 8)"
+            << std::endl;
+  std::cout << "\t--manifest\tdownload every line of the file, or of stdin "
+               "for -, as: url [destination] [checksum]"
+            << std::endl;
+  std::cout << "\t--results\tlog of finished manifest entries, the ones "
+               "that succeeded are skipped by the next run (default: "
+               "<manifest>.results)"
+            << std::endl;
+  std::cout << "\t--pack\t\tstore the manifest entries in a pack store in "
+               "this directory instead of files of their own"
+            << std::endl;
+  std::cout << "\t--jobs\t\tmanifest entries downloading at once "
+               "(default: 32)"
+            << std::endl;
+  std::cout << "\t--pin-cpus\tpin the worker threads to these cpus, like "
+               "0-7,16 or all"
+            << std::endl;
+  std::cout << "\t--prewarm\topen up to this many connections per host "
+               "while the size is probed (default: 0, off)"
+            << std::endl;
+  std::cout << "\t--trace\t\twrite a Chrome trace-event timeline of the run "
+               "to this file"
+            << std::endl;
+  std::cout << "\t--shards\tdownload --url with this many worker processes "
+               "into a preallocated file (default: 0, off)"
+            << std::endl;
+  std::cout << "\t--shard-size\tMiB per shard the workers claim "
+               "(default: 256)"
+            << std::endl;
+  std::cout << "\t--log-level\tdebug, info, warn, error or off "
+               "(default: info)"
+            << std::endl;
+  std::cout << "\t--log-file\tappend the log to this file instead of stderr"
+            << std::endl;
+  std::cout << "\t--daemon\tkeep running and take jobs on this unix socket"
+            << std::endl;
+  std::cout << "\t--serve\t\tserve downloads to local consumers over HTTP on "
+               "this port, while they are still downloading"
+            << std::endl;
+  std::cout << "\t--cache-dir\twhere --serve keeps the files "
+               "(default: download/cache)"
+            << std::endl;
+  std::cout << "\t--socket\tsend the --url or the --job status query to a "
+               "running daemon"
+            << std::endl;
+  std::cout << "\t--memory-budget\tMiB of data in flight to the disk, "
+               "enables write-behind (default: 0, off)"
+            << std::endl;
 }
 
+bool parseLogLevel(const std::string &name, LogLevel &level) {
+  for (auto candidate : {LogLevel::kDebug, LogLevel::kInfo, LogLevel::kWarn,
+                         LogLevel::kError, LogLevel::kOff}) {
+    if (name == toString(candidate)) {
+      level = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// a whole decimal number from min to max, nothing before or after it
+bool parseNumber(const std::string &text, int64_t min, int64_t max,
+                 int64_t &value) {
+  if (text.empty() || std::isspace(static_cast<unsigned char>(text[0]))) {
+    return false;
+  }
+  char *end = nullptr;
+  errno = 0;
+  auto number = std::strtoll(text.c_str(), &end, 10);
+  if (errno != 0 || *end != '\0' || number < min || number > max) {
+    return false;
+  }
+  value = number;
+  return true;
+}
+
+// the number of the option, false after a usage error if it is not one
+bool numberArg(Args &args, const std::string &name, int64_t min, int64_t max,
+               int64_t &value) {
+  if (parseNumber(args[name], min, max, value)) {
+    return true;
+  }
+  std::cerr << name << " wants a number from " << min << " to " << max
+            << ", not \"" << args[name] << "\"" << std::endl;
+  return false;
+}
+
+// MiB options are kept in bytes
+constexpr int64_t kMaxMiB = INT64_MAX / (1024 * 1024);
+
+// "all" or a list of cpus and ranges, like 0-3,8
+bool parseCpuList(const std::string &list, std::vector<int> &cpus) {
+  cpus.clear();
+  if (list == "all") {
+    return true;
+  }
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    auto comma = list.find(',', pos);
+    auto item = list.substr(pos, comma == std::string::npos ? std::string::npos
+                                                            : comma - pos);
+    auto dash = item.find('-');
+    int64_t first, last;
+    auto max = static_cast<int64_t>(cpuLimit()) - 1;
+    if (!parseNumber(item.substr(0, dash), 0, max, first) ||
+        (dash != std::string::npos &&
+         !parseNumber(item.substr(dash + 1), first, max, last))) {
+      // a reversed range would pin nothing
+      std::cerr << "--pin-cpus wants cpus from 0 to " << max
+                << " and ascending ranges like 0-3,8, not \"" << item << "\""
+                << std::endl;
+      return false;
+    }
+    if (dash == std::string::npos) {
+      last = first;
+    }
+    for (auto cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    if (comma == std::string::npos) {
+      break;
+    }
+    pos = comma + 1;
+  }
+  return true;
+}
+
+// apply the options every mode shares to a manager, false after a usage
+// error
+bool configure(DownloadManager &dm, Args &args) {
+  dm.setWriteBehind(MemoryBudget::global().capacity() > 0);
+  if (args.count("--pin-cpus") > 0) {
+    std::vector<int> cpus;
+    if (!parseCpuList(args["--pin-cpus"], cpus)) {
+      return false;
+    }
+    if (!dm.pinThreads(cpus)) {
+      std::cerr << "could not pin every thread" << std::endl;
+    }
+  }
+  if (args.count("--prewarm") > 0) {
+    int64_t per_host;
+    if (!numberArg(args, "--prewarm", 0, INT_MAX, per_host)) {
+      return false;
+    }
+    PrewarmOptions prewarm;
+    prewarm.max_per_host = per_host;
+    prewarm.enabled = prewarm.max_per_host > 0;
+    dm.setPrewarm(prewarm);
+  }
+  return true;
+}
+
+DownloadDaemon *g_daemon = nullptr;
+
+void stopDaemon(int) {
+  if (g_daemon != nullptr) {
+    g_daemon->stop();
+  }
+}
+
+int runDaemon(const std::string &socket_path, const std::string &download_dir,
+              Args &args) {
+  DownloadDaemon daemon(socket_path, download_dir, DEFAULT_NUM_THREAD);
+  if (!configure(daemon.manager(), args) || !daemon.listen()) {
+    return -1;
+  }
+  g_daemon = &daemon;
+  std::signal(SIGINT, stopDaemon);
+  std::signal(SIGTERM, stopDaemon);
+  std::cout << "daemon listening on " << socket_path << std::endl;
+  daemon.run();
+  g_daemon = nullptr;
+  return 0;
+}
+
+CacheServer *g_cache_server = nullptr;
+
+void stopCacheServer(int) {
+  if (g_cache_server != nullptr) {
+    g_cache_server->stop();
+  }
+}
+
+int runCacheServer(int port, const std::string &cache_dir) {
+  CacheServerOptions options;
+  options.num_thread = DEFAULT_NUM_THREAD;
+  CacheServer server(cache_dir, options);
+  if (!server.listen(port)) {
+    return -1;
+  }
+  g_cache_server = &server;
+  std::signal(SIGINT, stopCacheServer);
+  std::signal(SIGTERM, stopCacheServer);
+  std::cout << "serving on http://127.0.0.1:" << server.port()
+            << "/?url=<url>" << std::endl;
+  server.run();
+  g_cache_server = nullptr;
+  return 0;
+}
+
+// submit the url to a running daemon and wait for it, or query a job
+int runRemote(const std::string &socket_path, Args &args) {
+  std::string reply;
+  if (args.count("--url") > 0) {
+    reply = sendDaemonCommand(socket_path, "SUBMIT " + args["--url"]);
+    if (reply.rfind("OK ", 0) == 0) {
+      reply = sendDaemonCommand(socket_path, "WAIT " + reply.substr(3));
+    }
+  } else if (args.count("--job") > 0) {
+    reply = sendDaemonCommand(socket_path, "STATUS " + args["--job"]);
+  } else {
+    printHelp();
+    return 0;
+  }
+  std::cout << reply << std::endl;
+  auto state = daemonJobState(reply);
+  return state == "done" || state == "running" ? 0 : -1;
+}
+
+// download the entries of a manifest, reading it as the jobs drain
+int runManifest(Args &args, const std::string &download_dir) {
+  const auto &manifest = args["--manifest"];
+  std::ifstream file;
+  if (manifest != "-") {
+    file.open(manifest);
+    if (!file.is_open()) {
+      std::cerr << "can't open manifest: " << manifest << std::endl;
+      return -1;
+    }
+  }
+  std::istream &in = manifest == "-" ? std::cin : file;
+
+  std::unique_ptr<ResultsLog> log;
+  auto results = args.count("--results") > 0 ? args["--results"]
+                 : manifest != "-"           ? manifest + ".results"
+                                             : "";
+  if (!results.empty()) {
+    log = std::make_unique<ResultsLog>(results);
+    if (!log->isOpen()) {
+      return -1;
+    }
+  }
+  int64_t jobs = 32;
+  if (args.count("--jobs") > 0 &&
+      !numberArg(args, "--jobs", 1, INT_MAX, jobs)) {
+    return -1;
+  }
+
+  DownloadManager dm(DEFAULT_NUM_THREAD);
+  if (!configure(dm, args)) {
+    return -1;
+  }
+  ManifestRunner runner(dm, download_dir, jobs, log.get());
+  std::unique_ptr<PackStore> packs;
+  if (args.count("--pack") > 0) {
+    packs = std::make_unique<PackStore>(args["--pack"]);
+    if (!packs->isOpen()) {
+      return -1;
+    }
+    runner.setPackStore(packs.get());
+  }
+  auto summary = runner.run(in);
+  std::cout << "manifest done: " << summary.succeeded << " succeeded, "
+            << summary.failed << " failed, " << summary.skipped
+            << " skipped, " << summary.duplicates << " duplicates"
+            << std::endl;
+  return summary.failed == 0 ? 0 : -1;
+}
+
+// download --url with --shards worker processes, each one is this program
+// run with --shard-worker
+int runSharded(Args &args, const std::string &download_dir) {
+  ShardOptions options;
+  int64_t workers;
+  if (!numberArg(args, "--shards", 1, 1024, workers)) {
+    return -1;
+  }
+  options.workers = workers;
+  options.threads = std::max<int>(DEFAULT_NUM_THREAD / 2, 1);
+  if (args.count("--shard-size") > 0) {
+    int64_t mib;
+    if (!numberArg(args, "--shard-size", 1, kMaxMiB, mib)) {
+      return -1;
+    }
+    options.shard_size = mib * 1024 * 1024;
+  }
+  const auto &url = args["--url"];
+  // a fixed name, so an interrupted run is resumed by the next one
+  auto target = download_dir + "/" + getUrlName(url);
+  auto status = shardedDownload(url, target, options);
+  if (!status.ok()) {
+    std::cout << "Download failed : " << status.toString() << std::endl;
+    return -1;
+  }
+  std::cout << "Download success" << std::endl;
+  return 0;
+}
+
+// upload the file of --upload to --url in parts
+int runUpload(Args &args) {
+  UploadOptions options;
+  const auto &mode = args["--upload-mode"];
+  if (mode == "single") {
+    options.mode = UploadMode::kSingle;
+  } else if (mode == "multipart") {
+    options.mode = UploadMode::kMultipart;
+  } else if (!mode.empty() && mode != "ranged") {
+    std::cerr << "unknown upload mode: " << mode << std::endl;
+    return -1;
+  }
+  if (args.count("--part-size") > 0) {
+    int64_t mib;
+    if (!numberArg(args, "--part-size", 1, kMaxMiB, mib)) {
+      return -1;
+    }
+    options.part_size = mib * 1024 * 1024;
+  }
+  Uploader uploader(DEFAULT_NUM_THREAD);
+  auto status = uploader.upload(args["--upload"], args["--url"], options);
+  if (!status.ok()) {
+    std::cout << "Upload failed : " << status.toString() << std::endl;
+    return -1;
+  }
+  std::cout << "Upload success" << std::endl;
+  return 0;
+}
+
+// writes the trace on every way out of main
+struct TraceGuard {
+  ~TraceGuard() {
+    if (Tracer::global().enabled()) {
+      Tracer::global().stop();
+    }
+  }
+};
+
 int main(int argc, char *argv[]) {
+  // started by runSharded, the rest of the arguments are not ours
+  if (argc == 3 && std::string(argv[1]) == "--shard-worker") {
+    return runShardWorker(argv[2]);
+  }
   const auto cur_path = getCurPath();
   const auto download_dir = cur_path + "/download";
   auto success = createDir(download_dir);
@@ -35,6 +399,55 @@ int main(int argc, char *argv[]) {
     return -1;
   }
   auto args = parse_args(argc, argv);
+  TraceGuard trace_guard;
+  if (args.count("--trace") > 0) {
+    Tracer::global().start(args["--trace"]);
+  }
+  if (args.count("--log-level") > 0) {
+    LogLevel level;
+    if (!parseLogLevel(args["--log-level"], level)) {
+      std::cerr << "unknown log level: " << args["--log-level"] << std::endl;
+      return -1;
+    }
+    Logger::global().setLevel(level);
+  }
+  if (args.count("--log-file") > 0 &&
+      !Logger::global().setOutput(args["--log-file"])) {
+    return -1;
+  }
+  // in MiB, bounds the data held in memory between the network and the disk
+  if (args.count("--memory-budget") > 0) {
+    int64_t mib;
+    if (!numberArg(args, "--memory-budget", 0, kMaxMiB, mib)) {
+      return -1;
+    }
+    MemoryBudget::global().setCapacity(mib * 1024 * 1024);
+  }
+  if (args.count("--daemon") > 0) {
+    return runDaemon(args["--daemon"], download_dir, args);
+  }
+  if (args.count("--serve") > 0) {
+    int64_t port;
+    if (!numberArg(args, "--serve", 0, 65535, port)) {
+      return -1;
+    }
+    return runCacheServer(port,
+                          args.count("--cache-dir") > 0
+                              ? args["--cache-dir"]
+                              : download_dir + "/cache");
+  }
+  if (args.count("--socket") > 0) {
+    return runRemote(args["--socket"], args);
+  }
+  if (args.count("--manifest") > 0) {
+    return runManifest(args, download_dir);
+  }
+  if (args.count("--shards") > 0 && args.count("--url") > 0) {
+    return runSharded(args, download_dir);
+  }
+  if (args.count("--upload") > 0 && args.count("--url") > 0) {
+    return runUpload(args);
+  }
   if (args.count("--url") > 0) {
     auto url = args["--url"];
     auto retry{2};
@@ -53,16 +466,20 @@ int main(int argc, char *argv[]) {
      */
     while (retry--) {
       DownloadManager dm(num_thread);
+      if (!configure(dm, args)) {
+        return -1;
+      }
       num_thread /= 2;
       auto status = dm.download(url, download_dir);
-      if (status == 1) {
+      if (status.ok()) {
         std::cout << "Download success" << std::endl;
         break;
-      } else if (status == 0) {
-        std::cout << "Download failed" << std::endl;
+      } else if (!status.retryable()) {
+        std::cout << "Download failed : " << status.toString() << std::endl;
         break;
       } else {
-        std::cout << "Download failed -------retrying" << std::endl;
+        std::cout << "Download failed : " << status.toString()
+                  << " -------retrying" << std::endl;
       }
     }
   } else {
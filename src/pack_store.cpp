@@ -0,0 +1,541 @@
+#include "pack_store.h"
+#include "file_io.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <openssl/evp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mltdl {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char kIndexMagic[8] = {'M', 'L', 'P', 'K', 'I', 'D', 'X', '1'};
+constexpr uint32_t kRecordMagic = 0x314b504d; // "MPK1"
+constexpr size_t kIndexHeader = 16;
+// the log is merged into the index once it has this many entries, or a
+// quarter of the index if that is more
+constexpr size_t kMinCheckpoint = 64 * 1024;
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t key_length;
+  uint64_t data_length;
+};
+
+std::string toHex(const unsigned char *bytes, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(size * 2);
+  for (size_t i = 0; i < size; ++i) {
+    hex += digits[bytes[i] >> 4];
+    hex += digits[bytes[i] & 0xf];
+  }
+  return hex;
+}
+
+void sha256(const char *data, size_t size, unsigned char *digest) {
+  EVP_Digest(data, size, digest, nullptr, EVP_sha256(), nullptr);
+}
+
+} // namespace
+
+PackStore::PackStore(const std::string &dir, int64_t max_pack_size,
+                     KeyHash hash)
+    : dir_(dir), max_pack_size_(max_pack_size), hash_(hash) {
+  std::error_code ec;
+  fs::create_directories(dir_, ec);
+  if (!fs::is_directory(dir_, ec)) {
+    std::cerr << "can't create pack store: " << dir_ << std::endl;
+    return;
+  }
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  if (fs::exists(dir_ + "/index") && !mapIndex()) {
+    return;
+  }
+  auto &io = FileIO::instance();
+  auto log = io.read(dir_ + "/index.log");
+  // a torn last entry from a crash is dropped
+  log_size_ = log.size() / sizeof(Entry) * sizeof(Entry);
+  for (int64_t pos = 0; pos < log_size_; pos += sizeof(Entry)) {
+    Entry entry;
+    std::memcpy(&entry, log.data() + pos, sizeof(entry));
+    log_[entry.key_hash] = entry;
+  }
+  if (static_cast<int64_t>(log.size()) != log_size_) {
+    io.truncate(dir_ + "/index.log", log_size_);
+  }
+  // appends go to the newest pack
+  int64_t pack_bytes = 0;
+  for (const auto &file : fs::directory_iterator(dir_, ec)) {
+    unsigned pack = 0;
+    auto name = file.path().filename().string();
+    if (std::sscanf(name.c_str(), "pack-%u.pack", &pack) == 1) {
+      auto size = static_cast<int64_t>(file.file_size(ec));
+      pack_bytes += size;
+      if (pack >= pack_) {
+        pack_ = pack;
+        pack_size_ = size;
+      }
+    }
+  }
+  auto live = liveEntries();
+  live_ = live.size();
+  int64_t live_bytes = 0;
+  for (const auto &entry : live) {
+    live_bytes += recordSize(entry);
+  }
+  dead_bytes_ = pack_bytes - live_bytes;
+  open_ = true;
+}
+
+PackStore::~PackStore() {
+  if (open_) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (!log_.empty()) {
+      checkpointLocked();
+    }
+  }
+  unmapIndex();
+  // the descriptors of a store that is gone are not needed anymore
+  auto &io = FileIO::instance();
+  io.close(dir_ + "/index.log");
+  for (uint32_t pack = 1; pack <= pack_; ++pack) {
+    io.close(packPath(pack));
+  }
+}
+
+uint64_t PackStore::hashKey(const std::string &key) {
+  // stable across runs since the hashes are stored
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : key) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+int64_t PackStore::recordSize(const Entry &entry) {
+  return sizeof(RecordHeader) + entry.key_length + entry.length;
+}
+
+std::string PackStore::packPath(uint32_t pack) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "/pack-%06u.pack", pack);
+  return dir_ + name;
+}
+
+bool PackStore::mapIndex() {
+  auto path = dir_ + "/index";
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(kIndexHeader)) {
+    ::close(fd);
+    std::cerr << "pack index is too short: " << path << std::endl;
+    return false;
+  }
+  void *base = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // the mapping stays valid without the descriptor
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  uint64_t count = 0;
+  std::memcpy(&count, static_cast<char *>(base) + sizeof(kIndexMagic),
+              sizeof(count));
+  if (std::memcmp(base, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+      kIndexHeader + count * sizeof(Entry) >
+          static_cast<uint64_t>(st.st_size)) {
+    ::munmap(base, st.st_size);
+    std::cerr << "not a pack index: " << path << std::endl;
+    return false;
+  }
+  // the entries are looked up in place, nothing is copied to the heap
+  madvise(base, st.st_size, MADV_RANDOM);
+  index_ = reinterpret_cast<const Entry *>(static_cast<char *>(base) +
+                                           kIndexHeader);
+  index_count_ = count;
+  mapped_size_ = st.st_size;
+  return true;
+}
+
+void PackStore::unmapIndex() {
+  if (index_ != nullptr) {
+    ::munmap(const_cast<char *>(reinterpret_cast<const char *>(index_)) -
+                 kIndexHeader,
+             mapped_size_);
+    index_ = nullptr;
+    index_count_ = 0;
+    mapped_size_ = 0;
+  }
+}
+
+const PackStore::Entry *PackStore::find(uint64_t key_hash) const {
+  auto it = log_.find(key_hash);
+  if (it != log_.end()) {
+    return &it->second;
+  }
+  auto end = index_ + index_count_;
+  auto found = std::lower_bound(
+      index_, end, key_hash,
+      [](const Entry &entry, uint64_t hash) { return entry.key_hash < hash; });
+  if (found != end && found->key_hash == key_hash) {
+    return found;
+  }
+  return nullptr;
+}
+
+const PackStore::Entry *PackStore::findLive(const std::string &key) const {
+  auto entry = find(hash_(key));
+  if (entry == nullptr || !(entry->flags & kLive) ||
+      !storedUnder(*entry, key)) {
+    return nullptr;
+  }
+  return entry;
+}
+
+bool PackStore::storedUnder(const Entry &entry, const std::string &key) const {
+  if (entry.key_length != key.size()) {
+    return false;
+  }
+  std::vector<char> head(sizeof(RecordHeader) + key.size());
+  auto n = FileIO::instance().pread(packPath(entry.pack), entry.offset,
+                                    head.data(), head.size());
+  return n == static_cast<int64_t>(head.size()) &&
+         key.compare(0, key.size(), head.data() + sizeof(RecordHeader),
+                     key.size()) == 0;
+}
+
+bool PackStore::appendLog(const Entry &entry) {
+  if (!FileIO::instance().pwrite(dir_ + "/index.log", log_size_, &entry,
+                                 sizeof(entry))) {
+    return false;
+  }
+  log_size_ += sizeof(entry);
+  log_[entry.key_hash] = entry;
+  return true;
+}
+
+bool PackStore::put(const std::string &key, const char *data, size_t size) {
+  if (!open_ || key.size() > UINT16_MAX) {
+    return false;
+  }
+  Entry entry{};
+  entry.key_hash = hash_(key);
+  entry.flags = kLive;
+  entry.key_length = key.size();
+  entry.length = size;
+  sha256(data, size, entry.digest);
+  RecordHeader header{kRecordMagic, static_cast<uint32_t>(key.size()), size};
+  std::vector<char> head(sizeof(header) + key.size());
+  std::memcpy(head.data(), &header, sizeof(header));
+  std::memcpy(head.data() + sizeof(header), key.data(), key.size());
+  auto record = recordSize(entry);
+
+  auto &io = FileIO::instance();
+  while (true) {
+    uint64_t epoch;
+    {
+      // the data is written in parallel with other puts and with reads,
+      // only compaction has to wait for it
+      std::shared_lock<std::shared_mutex> shared(mutex_);
+      {
+        std::lock_guard<std::mutex> append(append_mutex_);
+        if (pack_size_ > 0 && pack_size_ + record > max_pack_size_) {
+          ++pack_;
+          pack_size_ = 0;
+        }
+        entry.pack = pack_;
+        entry.offset = pack_size_;
+        pack_size_ += record;
+        epoch = epoch_;
+      }
+      auto path = packPath(entry.pack);
+      if (!io.pwrite(path, entry.offset, head.data(), head.size()) ||
+          !io.pwrite(path, entry.offset + head.size(), data, size)) {
+        dead_bytes_ += record;
+        return false;
+      }
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (epoch != epoch_) {
+      // a compaction ran in between and dropped the pack written to
+      continue;
+    }
+    auto old = find(entry.key_hash);
+    bool replaced = old != nullptr && (old->flags & kLive);
+    if (replaced && !storedUnder(*old, key)) {
+      // the other key keeps its object, the bytes just written are dead
+      dead_bytes_ += record;
+      std::cerr << "pack store key hash collision, not storing " << key
+                << std::endl;
+      return false;
+    }
+    auto old_size = replaced ? recordSize(*old) : 0;
+    if (!appendLog(entry)) {
+      dead_bytes_ += record;
+      return false;
+    }
+    dead_bytes_ += old_size;
+    if (!replaced) {
+      ++live_;
+    }
+    if (log_.size() >= std::max(kMinCheckpoint, index_count_ / 4)) {
+      checkpointLocked();
+    }
+    return true;
+  }
+}
+
+bool PackStore::contains(const std::string &key) const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return findLive(key) != nullptr;
+}
+
+bool PackStore::lookup(const std::string &key, Location &location) const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  auto entry = findLive(key);
+  if (entry == nullptr) {
+    return false;
+  }
+  location.pack = entry->pack;
+  location.offset = entry->offset + sizeof(RecordHeader) + entry->key_length;
+  location.length = entry->length;
+  location.digest = toHex(entry->digest, sizeof(entry->digest));
+  return true;
+}
+
+bool PackStore::read(const std::string &key, std::vector<char> &data,
+                     bool verify /*= false*/) const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  auto found = find(hash_(key));
+  if (found == nullptr || !(found->flags & kLive)) {
+    return false;
+  }
+  auto entry = *found;
+  // header, key and data in one read
+  std::vector<char> record(recordSize(entry));
+  auto n = FileIO::instance().pread(packPath(entry.pack), entry.offset,
+                                    record.data(), record.size());
+  if (n != static_cast<int64_t>(record.size())) {
+    std::cerr << "short read from " << packPath(entry.pack) << std::endl;
+    return false;
+  }
+  RecordHeader header;
+  std::memcpy(&header, record.data(), sizeof(header));
+  if (header.magic != kRecordMagic || header.key_length != key.size() ||
+      header.data_length != entry.length ||
+      key.compare(0, key.size(), record.data() + sizeof(header),
+                  key.size()) != 0) {
+    // another key with the same hash, or a damaged pack
+    return false;
+  }
+  auto begin = record.begin() + sizeof(header) + key.size();
+  if (verify) {
+    unsigned char digest[32];
+    sha256(&*begin, entry.length, digest);
+    if (std::memcmp(digest, entry.digest, sizeof(digest)) != 0) {
+      std::cerr << "digest mismatch for " << key << std::endl;
+      return false;
+    }
+  }
+  data.assign(begin, record.end());
+  return true;
+}
+
+bool PackStore::remove(const std::string &key) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  auto found = findLive(key);
+  if (!open_ || found == nullptr) {
+    return false;
+  }
+  auto entry = *found;
+  entry.flags = kRemoved;
+  if (!appendLog(entry)) {
+    return false;
+  }
+  dead_bytes_ += recordSize(entry);
+  --live_;
+  return true;
+}
+
+size_t PackStore::size() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return live_;
+}
+
+int64_t PackStore::deadBytes() const { return dead_bytes_; }
+
+std::vector<PackStore::Entry> PackStore::liveEntries() const {
+  std::vector<Entry> entries;
+  entries.reserve(index_count_ + log_.size());
+  for (size_t i = 0; i < index_count_; ++i) {
+    if (log_.count(index_[i].key_hash) == 0) {
+      entries.push_back(index_[i]);
+    }
+  }
+  for (const auto &logged : log_) {
+    if (logged.second.flags & kLive) {
+      entries.push_back(logged.second);
+    }
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.key_hash < b.key_hash;
+            });
+  return entries;
+}
+
+bool PackStore::writeIndex(const std::vector<Entry> &entries) {
+  auto &io = FileIO::instance();
+  auto tmp = dir_ + "/index.tmp";
+  char header[kIndexHeader];
+  uint64_t count = entries.size();
+  std::memcpy(header, kIndexMagic, sizeof(kIndexMagic));
+  std::memcpy(header + sizeof(kIndexMagic), &count, sizeof(count));
+  bool ok = io.truncate(tmp, 0) && io.pwrite(tmp, 0, header, sizeof(header)) &&
+            io.pwrite(tmp, sizeof(header), entries.data(),
+                      entries.size() * sizeof(Entry)) &&
+            io.sync(tmp);
+  io.close(tmp);
+  if (!ok) {
+    std::cerr << "can't write pack index: " << tmp << std::endl;
+    return false;
+  }
+  std::error_code ec;
+  fs::rename(tmp, dir_ + "/index", ec);
+  return !ec;
+}
+
+bool PackStore::checkpoint() {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  return open_ && checkpointLocked();
+}
+
+bool PackStore::checkpointLocked() {
+  // the packs have to hold what the new index points to
+  auto &io = FileIO::instance();
+  for (const auto &logged : log_) {
+    io.sync(packPath(logged.second.pack));
+  }
+  if (!writeIndex(liveEntries())) {
+    return false;
+  }
+  unmapIndex();
+  log_.clear();
+  log_size_ = 0;
+  io.truncate(dir_ + "/index.log", 0);
+  return mapIndex();
+}
+
+bool PackStore::compact() {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  if (!open_) {
+    return false;
+  }
+  auto entries = liveEntries();
+  // copied in the order they were written, so reading them back in that
+  // order stays sequential
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.pack != b.pack ? a.pack < b.pack : a.offset < b.offset;
+            });
+  auto &io = FileIO::instance();
+  uint32_t old_last;
+  {
+    std::lock_guard<std::mutex> append(append_mutex_);
+    old_last = pack_;
+  }
+  uint32_t pack = old_last + 1;
+  int64_t pack_size = 0;
+  std::vector<char> record;
+  for (auto &entry : entries) {
+    record.resize(recordSize(entry));
+    auto n = io.pread(packPath(entry.pack), entry.offset, record.data(),
+                      record.size());
+    if (n != static_cast<int64_t>(record.size())) {
+      std::cerr << "compaction failed to read " << packPath(entry.pack)
+                << std::endl;
+      return false;
+    }
+    if (pack_size > 0 &&
+        pack_size + static_cast<int64_t>(record.size()) > max_pack_size_) {
+      io.sync(packPath(pack));
+      ++pack;
+      pack_size = 0;
+    }
+    if (!io.pwrite(packPath(pack), pack_size, record.data(), record.size())) {
+      return false;
+    }
+    entry.pack = pack;
+    entry.offset = pack_size;
+    pack_size += record.size();
+  }
+  io.sync(packPath(pack));
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.key_hash < b.key_hash;
+            });
+  // the new index is in place before anything old goes away, a crash
+  // leaves either the old or the new state
+  if (!writeIndex(entries)) {
+    return false;
+  }
+  unmapIndex();
+  log_.clear();
+  log_size_ = 0;
+  io.truncate(dir_ + "/index.log", 0);
+  for (uint32_t old = 1; old <= old_last; ++old) {
+    io.close(packPath(old));
+    std::error_code ec;
+    fs::remove(packPath(old), ec);
+  }
+  {
+    std::lock_guard<std::mutex> append(append_mutex_);
+    pack_ = pack;
+    pack_size_ = pack_size;
+    ++epoch_;
+  }
+  live_ = entries.size();
+  dead_bytes_ = 0;
+  return mapIndex();
+}
+
+bool PackSink::write(int64_t offset, const char *data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (data_.size() < offset + size) {
+    data_.resize(offset + size);
+  }
+  std::memcpy(data_.data() + offset, data, size);
+  return true;
+}
+
+void PackSink::finish(const Status &status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  status_ = status;
+  if (status_.ok() && check_) {
+    status_ = check_(data_);
+  }
+  if (status_.ok() && !store_.put(key_, data_.data(), data_.size())) {
+    status_ = Status(StatusCode::kIoError, "can't store " + key_);
+  }
+  data_ = std::vector<char>();
+}
+
+Status PackSink::status() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return status_;
+}
+
+} // namespace mltdl
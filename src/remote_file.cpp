@@ -0,0 +1,356 @@
+#include "remote_file.h"
+#include "client_factory.h"
+#include "file_io.h"
+#include "logger.h"
+#include "tracer.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <map>
+
+namespace mltdl {
+
+RemoteFile::RemoteFile(const std::string &url,
+                       const RemoteFileOptions &options)
+    : url_(url), options_(options),
+      curls_(std::max<size_t>(options.connections, 1)) {}
+
+Status RemoteFile::open() {
+  if (url_.empty() || !isUrlValid(url_)) {
+    return Status(StatusCode::kInvalidArgument, "invalid url " + url_);
+  }
+  if (options_.block_size <= 0) {
+    return Status(StatusCode::kInvalidArgument, "invalid block size");
+  }
+  auto protocol = getProtocol(url_);
+  client_ = get_clients(protocol);
+  if (client_ == nullptr) {
+    return Status(StatusCode::kUnsupported, "unsupported protocol " + protocol);
+  }
+  ResourceInfo info;
+  {
+    CurlGuard guard(curls_, -1, CurlPool::hostKey(url_));
+    info = client_->probe(url_, guard.handle());
+  }
+  if (info.size < 0) {
+    return Status(StatusCode::kNetworkError,
+                  "failed to get the file size of " + url_);
+  }
+  validator_ = info.validator();
+  // without a validator another version of the file would find the blocks
+  // of this one
+  if (!options_.disk_dir.empty() && !validator_.empty()) {
+    auto version = url_ + "\n" + validator_ + "\n" +
+                   std::to_string(info.size) + "\n" +
+                   std::to_string(options_.block_size);
+    disk_key_ = calculateSHA256(version.data(), version.size());
+    std::error_code ec;
+    std::filesystem::create_directories(options_.disk_dir, ec);
+    // what an earlier reader of the file left, the newest first
+    std::vector<std::pair<std::filesystem::file_time_type, int64_t>> found;
+    auto prefix = disk_key_ + "-";
+    for (std::filesystem::directory_iterator it(options_.disk_dir, ec), end;
+         !ec && it != end; it.increment(ec)) {
+      auto name = it->path().filename().string();
+      if (name.compare(0, prefix.size(), prefix) != 0) {
+        continue;
+      }
+      char *rest = nullptr;
+      auto index = std::strtoll(name.c_str() + prefix.size(), &rest, 10);
+      if (*rest != '\0') {
+        continue;
+      }
+      std::error_code time_ec;
+      found.emplace_back(it->last_write_time(time_ec), index);
+    }
+    std::sort(found.begin(), found.end(),
+              [](const auto &a, const auto &b) { return a.first > b.first; });
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &file : found) {
+      disk_order_.push_back(file.second);
+      disk_[file.second] = std::prev(disk_order_.end());
+    }
+  }
+  size_ = info.size;
+  MLTDL_LOG(kDebug, "remote_open").bytes(size_).message(url_);
+  return Status::OK();
+}
+
+int64_t RemoteFile::pread(int64_t offset, void *data, size_t size) {
+  if (!isOpen()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    error_ = Status(StatusCode::kInvalidArgument, "not open");
+    return -1;
+  }
+  if (offset < 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    error_ = Status(StatusCode::kInvalidArgument, "negative offset");
+    return -1;
+  }
+  if (offset >= size_ || size == 0) {
+    return 0;
+  }
+  auto end = std::min<int64_t>(offset + size, size_);
+  auto first = offset / options_.block_size;
+  auto last = (end - 1) / options_.block_size;
+  int64_t ahead = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (offset == next_offset_ && options_.read_ahead > 0) {
+      window_ = std::min<int64_t>(std::max<int64_t>(window_ * 2, 1),
+                                  options_.read_ahead);
+    } else {
+      window_ = 0;
+    }
+    next_offset_ = end;
+    ahead = window_;
+  }
+  auto count = (size_ + options_.block_size - 1) / options_.block_size;
+  ahead = std::min(ahead, count - 1 - last);
+
+  auto got = blocks(first, last, ahead);
+  if (got.empty()) {
+    return -1;
+  }
+  auto out = static_cast<char *>(data);
+  for (auto index = first; index <= last; ++index) {
+    auto block_start = index * options_.block_size;
+    auto from = std::max(offset, block_start) - block_start;
+    auto to = std::min<int64_t>(end - block_start, got[index - first]->size());
+    std::memcpy(out, got[index - first]->data() + from, to - from);
+    out += to - from;
+  }
+  return end - offset;
+}
+
+Status RemoteFile::lastError() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return error_;
+}
+
+std::vector<RemoteFile::Block> RemoteFile::blocks(int64_t first, int64_t last,
+                                                  int64_t ahead) {
+  std::vector<Block> out(last - first + 1);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // take what is in memory, what others are fetching is waited for
+    std::vector<int64_t> missing;
+    bool waiting = false;
+    for (auto index = first; index <= last; ++index) {
+      if (out[index - first] != nullptr) {
+        continue;
+      }
+      auto it = memory_.find(index);
+      if (it != memory_.end()) {
+        memory_order_.splice(memory_order_.begin(), memory_order_,
+                             it->second.second);
+        out[index - first] = it->second.first;
+        ++stats_.hits;
+      } else if (in_flight_.count(index) != 0) {
+        waiting = true;
+      } else {
+        missing.push_back(index);
+      }
+    }
+    if (missing.empty()) {
+      if (!waiting) {
+        return out;
+      }
+      fetched_.wait(lock);
+      continue;
+    }
+    // the blocks ahead ride along with the run of the read's last block, a
+    // request of their own would make the reader wait for them
+    for (auto index = last + 1; index <= last + ahead; ++index) {
+      if (missing.back() != index - 1 || memory_.count(index) != 0 ||
+          in_flight_.count(index) != 0) {
+        break;
+      }
+      missing.push_back(index);
+    }
+    std::vector<bool> on_disk(missing.size());
+    for (size_t i = 0; i < missing.size(); ++i) {
+      in_flight_.insert(missing[i]);
+      on_disk[i] = disk_.count(missing[i]) != 0;
+    }
+    lock.unlock();
+
+    std::map<int64_t, Block> found;
+    std::vector<int64_t> remote;
+    for (size_t i = 0; i < missing.size(); ++i) {
+      auto block = on_disk[i] ? readDisk(missing[i]) : nullptr;
+      if (block != nullptr) {
+        found[missing[i]] = block;
+      } else {
+        remote.push_back(missing[i]);
+      }
+    }
+    // adjacent blocks go in one request
+    Status status;
+    std::vector<std::pair<int64_t, Block>> downloaded;
+    size_t begin = 0;
+    while (status.ok() && begin < remote.size()) {
+      auto end = begin + 1;
+      while (end < remote.size() && remote[end] == remote[end - 1] + 1 &&
+             static_cast<int64_t>(end - begin) <
+                 std::max(options_.max_coalesce, 1)) {
+        ++end;
+      }
+      std::vector<Block> run;
+      status = fetch(remote[begin], end - begin, run);
+      for (size_t i = 0; status.ok() && i < run.size(); ++i) {
+        found[remote[begin] + i] = run[i];
+        downloaded.emplace_back(remote[begin] + i, run[i]);
+        if (remote[begin] + static_cast<int64_t>(i) > last) {
+          ++stats_.read_ahead;
+        }
+      }
+      begin = end;
+    }
+    if (!disk_key_.empty() && !downloaded.empty()) {
+      writeDisk(downloaded);
+    }
+
+    lock.lock();
+    for (auto index : missing) {
+      in_flight_.erase(index);
+    }
+    for (const auto &block : found) {
+      remember(block.first, block.second);
+      // kept here too, the memory may not hold all of a long read
+      if (block.first <= last) {
+        out[block.first - first] = block.second;
+      }
+    }
+    fetched_.notify_all();
+    if (!status.ok()) {
+      error_ = status;
+      return {};
+    }
+  }
+}
+
+Status RemoteFile::fetch(int64_t first, int64_t count,
+                         std::vector<Block> &out) {
+  auto start = first * options_.block_size;
+  auto end = std::min(size_, (first + count) * options_.block_size) - 1;
+  Tracer::Span span("fetch", "remote");
+  span.arg("start", start);
+  span.arg("end", end);
+  TransferControl control;
+  // a file that changed since open comes back whole and is refused below
+  control.if_range = validator_;
+  Response response;
+  {
+    CurlGuard guard(curls_, -1, CurlPool::hostKey(url_));
+    response = client_->get(url_, options_.retry, guard.handle(), start, end,
+                            nullptr, &control);
+  }
+  ++stats_.requests;
+  if (response.status_code >= 300 ||
+      (response.status == CURLE_OK && response.status_code < 200)) {
+    return Status(isPermanentHttpError(response.status_code)
+                      ? StatusCode::kHttpError
+                      : StatusCode::kNetworkError,
+                  "server replied " + std::to_string(response.status_code));
+  } else if (response.status != CURLE_OK) {
+    return Status(StatusCode::kNetworkError,
+                  curl_easy_strerror((CURLcode)response.status));
+  }
+  if (static_cast<int64_t>(response.body.size()) != end - start + 1 ||
+      (response.status_code == 200 && start > 0)) {
+    MLTDL_LOG(kWarn, "remote_changed")
+        .bytes(response.body.size())
+        .code(response.status_code)
+        .message(url_);
+    return Status(StatusCode::kCorrupted,
+                  "the file changed on the server or the range was ignored");
+  }
+  for (int64_t i = 0; i < count; ++i) {
+    auto from = response.body.begin() + i * options_.block_size;
+    auto to = from + blockLength(first + i);
+    out.push_back(std::make_shared<const std::vector<char>>(from, to));
+    ++stats_.fetched;
+  }
+  return Status::OK();
+}
+
+RemoteFile::Block RemoteFile::readDisk(int64_t index) {
+  auto path = diskPath(index);
+  auto &io = FileIO::instance();
+  auto data = io.read(path);
+  // the descriptor cache is for the files being downloaded
+  io.close(path);
+  if (static_cast<int64_t>(data.size()) != blockLength(index)) {
+    // cut short by a crash, fetched and written again
+    return nullptr;
+  }
+  ++stats_.disk_hits;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = disk_.find(index);
+  if (it != disk_.end()) {
+    disk_order_.splice(disk_order_.begin(), disk_order_, it->second);
+  }
+  return std::make_shared<const std::vector<char>>(std::move(data));
+}
+
+void RemoteFile::writeDisk(
+    const std::vector<std::pair<int64_t, Block>> &blocks) {
+  auto &io = FileIO::instance();
+  std::vector<int64_t> written;
+  for (const auto &block : blocks) {
+    auto path = diskPath(block.first);
+    if (io.write(path, *block.second)) {
+      written.push_back(block.first);
+    } else {
+      MLTDL_LOG(kWarn, "remote_cache_failed").message(path);
+    }
+    io.close(path);
+  }
+  std::vector<int64_t> evicted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto index : written) {
+      auto it = disk_.find(index);
+      if (it != disk_.end()) {
+        disk_order_.erase(it->second);
+      }
+      disk_order_.push_front(index);
+      disk_[index] = disk_order_.begin();
+    }
+    while (disk_order_.size() > std::max<size_t>(options_.disk_blocks, 1)) {
+      evicted.push_back(disk_order_.back());
+      disk_.erase(disk_order_.back());
+      disk_order_.pop_back();
+    }
+  }
+  for (auto index : evicted) {
+    std::remove(diskPath(index).c_str());
+  }
+}
+
+void RemoteFile::remember(int64_t index, const Block &block) {
+  auto it = memory_.find(index);
+  if (it != memory_.end()) {
+    memory_order_.erase(it->second.second);
+  }
+  memory_order_.push_front(index);
+  memory_[index] = {block, memory_order_.begin()};
+  while (memory_order_.size() > std::max<size_t>(options_.memory_blocks, 1)) {
+    memory_.erase(memory_order_.back());
+    memory_order_.pop_back();
+  }
+}
+
+int64_t RemoteFile::blockLength(int64_t index) const {
+  return std::min(options_.block_size, size_ - index * options_.block_size);
+}
+
+std::string RemoteFile::diskPath(int64_t index) const {
+  return options_.disk_dir + "/" + disk_key_ + "-" + std::to_string(index);
+}
+
+} // namespace mltdl
@@ -0,0 +1,609 @@
+#include "sharded_download.h"
+#include "client.h"
+#include "client_factory.h"
+#include "curl_pool.h"
+#include "file_io.h"
+#include "logger.h"
+#include "sink.h"
+#include "thread_pool.h"
+#include "tracer.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <new>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace mltdl {
+
+namespace {
+
+constexpr char kLedgerMagic[8] = {'M', 'L', 'S', 'H', 'A', 'R', 'D', '1'};
+// the slots start here, after the header
+constexpr size_t kSlotsOffset = 64;
+
+// how long the workers of a finished download get to exit on their own
+constexpr auto kExitGrace = std::chrono::seconds(5);
+
+static_assert(sizeof(ShardLedger::Slot) == 64, "a slot is a cache line");
+static_assert(std::atomic<int64_t>::is_always_lock_free &&
+                  std::atomic<int32_t>::is_always_lock_free,
+              "the slots are shared between processes");
+
+int64_t monotonicNs() {
+  // steady_clock is CLOCK_MONOTONIC, comparable across processes
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+Status responseStatus(const Response &response) {
+  if (response.status_code >= 300 ||
+      (response.status == CURLE_OK && response.status_code < 200)) {
+    return Status(isPermanentHttpError(response.status_code)
+                      ? StatusCode::kHttpError
+                      : StatusCode::kNetworkError,
+                  "server replied " + std::to_string(response.status_code));
+  } else if (response.status != CURLE_OK) {
+    return Status(StatusCode::kNetworkError,
+                  curl_easy_strerror((CURLcode)response.status));
+  }
+  return Status::OK();
+}
+
+} // namespace
+
+struct ShardLedger::Header {
+  char magic[8];
+  int64_t size;
+  int64_t shard_size;
+  int32_t count;
+  int32_t threads;
+  int32_t max_attempts;
+  int32_t url_length;
+  int32_t validator_length;
+  int32_t target_length;
+  std::atomic<int32_t> aborted;
+};
+
+std::unique_ptr<ShardLedger>
+ShardLedger::create(const std::string &path, const std::string &url,
+                    const std::string &validator, const std::string &target,
+                    int64_t size, const ShardOptions &options, bool resume) {
+  static_assert(sizeof(Header) <= kSlotsOffset, "the header fits before");
+  std::unique_ptr<ShardLedger> ledger(new ShardLedger());
+  ledger->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (ledger->fd_ < 0) {
+    MLTDL_LOG(kError, "ledger_failed").code(errno).message(path);
+    return nullptr;
+  }
+  // one coordinator per download
+  if (::flock(ledger->fd_, LOCK_EX | LOCK_NB) != 0) {
+    MLTDL_LOG(kError, "ledger_busy")
+        .message(path + " is in use by another download");
+    return nullptr;
+  }
+  struct stat st;
+  if (resume && ::fstat(ledger->fd_, &st) == 0 && st.st_size > 0 &&
+      ledger->map(st.st_size) && ledger->load() && ledger->url_ == url &&
+      ledger->validator_ == validator && ledger->target_ == target &&
+      ledger->size() == size) {
+    // the processes of the last run are gone, what they held is free
+    int resumed = 0;
+    for (int i = 0; i < ledger->count(); ++i) {
+      auto &slot = ledger->slot(i);
+      if (slot.state != kDone) {
+        slot.owner = 0;
+        slot.attempts = 0;
+        slot.error = 0;
+        slot.state = kFree;
+        resumed += slot.done > 0;
+      }
+    }
+    ledger->header()->aborted = 0;
+    MLTDL_LOG(kInfo, "shard_resume")
+        .bytes(ledger->done())
+        .message(std::to_string(resumed) + " shards resumed from " + path);
+    return ledger;
+  }
+  if (ledger->base_ != nullptr) {
+    ::munmap(ledger->base_, ledger->length_);
+    ledger->base_ = nullptr;
+  }
+
+  auto shard_size = std::max<int64_t>(options.shard_size, 1);
+  int count = std::max<int64_t>((size + shard_size - 1) / shard_size, 1);
+  auto length = kSlotsOffset + count * sizeof(Slot) + url.size() +
+                validator.size() + target.size();
+  // zeroed from scratch
+  if (::ftruncate(ledger->fd_, 0) != 0 ||
+      ::ftruncate(ledger->fd_, length) != 0 || !ledger->map(length)) {
+    MLTDL_LOG(kError, "ledger_failed").code(errno).message(path);
+    return nullptr;
+  }
+  auto header = new (ledger->base_) Header();
+  header->size = size;
+  header->shard_size = shard_size;
+  header->count = count;
+  header->threads = std::max(options.threads, 1);
+  header->max_attempts = std::max(options.max_attempts, 1);
+  header->url_length = url.size();
+  header->validator_length = validator.size();
+  header->target_length = target.size();
+  auto slots = static_cast<char *>(ledger->base_) + kSlotsOffset;
+  for (int i = 0; i < count; ++i) {
+    auto slot = new (slots + i * sizeof(Slot)) Slot();
+    slot->start = i * shard_size;
+    slot->end = std::min(slot->start + shard_size, size) - 1;
+    // an empty resource has one empty shard, nothing to fetch
+    slot->state = slot->end < slot->start ? kDone : kFree;
+  }
+  auto strings = slots + count * sizeof(Slot);
+  std::memcpy(strings, url.data(), url.size());
+  strings += url.size();
+  std::memcpy(strings, validator.data(), validator.size());
+  strings += validator.size();
+  std::memcpy(strings, target.data(), target.size());
+  // the magic last, a ledger cut short is not taken for one
+  std::memcpy(header->magic, kLedgerMagic, sizeof(kLedgerMagic));
+  ledger->url_ = url;
+  ledger->validator_ = validator;
+  ledger->target_ = target;
+  return ledger;
+}
+
+std::unique_ptr<ShardLedger> ShardLedger::open(const std::string &path) {
+  std::unique_ptr<ShardLedger> ledger(new ShardLedger());
+  ledger->fd_ = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  struct stat st;
+  if (ledger->fd_ < 0 || ::fstat(ledger->fd_, &st) != 0 ||
+      !ledger->map(st.st_size) || !ledger->load()) {
+    MLTDL_LOG(kError, "ledger_invalid").message(path);
+    return nullptr;
+  }
+  return ledger;
+}
+
+ShardLedger::~ShardLedger() {
+  if (base_ != nullptr) {
+    ::munmap(base_, length_);
+  }
+  if (fd_ >= 0) {
+    // drops the lock of the coordinator
+    ::close(fd_);
+  }
+}
+
+bool ShardLedger::map(size_t length) {
+  if (length < kSlotsOffset) {
+    return false;
+  }
+  auto base =
+      ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  base_ = base;
+  length_ = length;
+  return true;
+}
+
+bool ShardLedger::load() {
+  auto header = this->header();
+  if (std::memcmp(header->magic, kLedgerMagic, sizeof(kLedgerMagic)) != 0 ||
+      header->count <= 0 || header->url_length < 0 ||
+      header->validator_length < 0 || header->target_length < 0) {
+    return false;
+  }
+  auto strings = kSlotsOffset + header->count * sizeof(Slot);
+  if (strings + header->url_length + header->validator_length +
+          header->target_length >
+      length_) {
+    return false;
+  }
+  auto data = static_cast<const char *>(base_) + strings;
+  url_.assign(data, header->url_length);
+  data += header->url_length;
+  validator_.assign(data, header->validator_length);
+  data += header->validator_length;
+  target_.assign(data, header->target_length);
+  return true;
+}
+
+ShardLedger::Header *ShardLedger::header() const {
+  return static_cast<Header *>(base_);
+}
+
+int64_t ShardLedger::size() const { return header()->size; }
+
+int ShardLedger::count() const { return header()->count; }
+
+int ShardLedger::threads() const { return header()->threads; }
+
+int ShardLedger::maxAttempts() const { return header()->max_attempts; }
+
+ShardLedger::Slot &ShardLedger::slot(int i) {
+  return reinterpret_cast<Slot *>(static_cast<char *>(base_) +
+                                  kSlotsOffset)[i];
+}
+
+const ShardLedger::Slot &ShardLedger::slot(int i) const {
+  return const_cast<ShardLedger *>(this)->slot(i);
+}
+
+int ShardLedger::claim(pid_t owner) {
+  for (int i = 0; i < count(); ++i) {
+    auto &slot = this->slot(i);
+    int32_t nobody = 0;
+    // the owner is taken first, a worker that dies before the state is set
+    // still has its claim released by its pid
+    if (slot.state != kFree ||
+        !slot.owner.compare_exchange_strong(nobody, owner)) {
+      continue;
+    }
+    if (slot.state != kFree) {
+      slot.owner = 0;
+      continue;
+    }
+    slot.heartbeat_ns = monotonicNs();
+    slot.state = kClaimed;
+    return i;
+  }
+  return -1;
+}
+
+int ShardLedger::release(pid_t owner) {
+  int released = 0;
+  for (int i = 0; i < count(); ++i) {
+    auto &slot = this->slot(i);
+    if (slot.owner == owner && slot.state != kDone &&
+        slot.state != kFailed) {
+      slot.state = kFree;
+      slot.owner = 0;
+      ++released;
+    }
+  }
+  return released;
+}
+
+void ShardLedger::finish(int i) {
+  auto &slot = this->slot(i);
+  slot.done = slot.end - slot.start + 1;
+  slot.owner = 0;
+  slot.state = kDone;
+}
+
+void ShardLedger::fail(int i, const Status &status) {
+  auto &slot = this->slot(i);
+  auto attempts = ++slot.attempts;
+  slot.owner = 0;
+  if (!status.retryable() || attempts >= maxAttempts()) {
+    slot.error = static_cast<int32_t>(status.code());
+    slot.state = kFailed;
+  } else {
+    slot.state = kFree;
+  }
+}
+
+int64_t ShardLedger::done() const {
+  int64_t done = 0;
+  for (int i = 0; i < count(); ++i) {
+    done += slot(i).done;
+  }
+  return done;
+}
+
+int ShardLedger::countState(State state) const {
+  int n = 0;
+  for (int i = 0; i < count(); ++i) {
+    n += slot(i).state == state;
+  }
+  return n;
+}
+
+int ShardLedger::failed() const {
+  for (int i = 0; i < count(); ++i) {
+    if (slot(i).state == kFailed) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void ShardLedger::abort() { header()->aborted = 1; }
+
+bool ShardLedger::aborted() const { return header()->aborted != 0; }
+
+namespace {
+
+// fetch what is missing of shard i into the target, on a worker thread
+Status fetchShard(ShardLedger &ledger, int i, Client &client,
+                  CurlPool &curls, int worker) {
+  Tracer::Span span("shard", "download");
+  span.arg("shard", i);
+  auto &slot = ledger.slot(i);
+  auto from = slot.start + slot.done;
+  if (from > slot.end) {
+    return Status::OK();
+  }
+  auto &io = FileIO::instance();
+  const auto &target = ledger.target();
+  // a single range arrives in order, done follows the last byte written
+  FunctionSink sink([&](int64_t offset, const char *data, size_t size) {
+    if (ledger.aborted() || !io.pwrite(target, offset, data, size)) {
+      return false;
+    }
+    auto done = offset + static_cast<int64_t>(size) - slot.start;
+    if (done > slot.done) {
+      slot.done = done;
+    }
+    slot.heartbeat_ns = monotonicNs();
+    return true;
+  });
+  TransferControl control;
+  control.if_range = ledger.validator();
+  control.segment = i;
+  RetryStrategy rs{3, 500, 2, 30000};
+  CurlGuard guard(curls, worker, CurlPool::hostKey(ledger.url()));
+  auto response = client.stream(ledger.url(), rs, guard.handle(), from,
+                                slot.end, sink, &control);
+  if (ledger.aborted()) {
+    return Status(StatusCode::kCancelled, "cancelled");
+  }
+  auto status = responseStatus(response);
+  if (status.ok() && slot.done < slot.end - slot.start + 1) {
+    status = Status(StatusCode::kNetworkError,
+                    "shard " + std::to_string(i) + " came back short");
+  }
+  return status;
+}
+
+pid_t spawnWorker(const std::string &ledger_path,
+                  const ShardOptions &options) {
+  if (options.fork_workers) {
+    auto pid = ::fork();
+    if (pid == 0) {
+      auto code = runShardWorker(ledger_path);
+      Logger::global().flush();
+      // none of the coordinator's state is torn down in the child
+      ::_exit(code);
+    }
+    return pid;
+  }
+  std::vector<std::string> args = options.worker_command;
+  args.push_back(ledger_path);
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+  pid_t pid = -1;
+  if (::posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ) !=
+      0) {
+    return -1;
+  }
+  return pid;
+}
+
+// stop and reap the workers, at once or after they had a while to exit
+void stopWorkers(std::vector<pid_t> &workers, bool kill_now) {
+  auto deadline = std::chrono::steady_clock::now() + kExitGrace;
+  while (!workers.empty()) {
+    if (kill_now || std::chrono::steady_clock::now() > deadline) {
+      for (auto pid : workers) {
+        ::kill(pid, SIGKILL);
+      }
+    }
+    workers.erase(std::remove_if(workers.begin(), workers.end(),
+                                 [](pid_t pid) {
+                                   return ::waitpid(pid, nullptr, WNOHANG) !=
+                                          0;
+                                 }),
+                  workers.end());
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+} // namespace
+
+Status shardedDownload(const std::string &url, const std::string &target,
+                       const ShardOptions &options /*= ShardOptions()*/) {
+  Tracer::Span span("sharded", "download");
+  if (!isUrlValid(url)) {
+    return Status(StatusCode::kInvalidArgument, url + " url is invalid");
+  }
+  auto protocol = getProtocol(url);
+  auto client = get_clients(protocol);
+  if (client == nullptr) {
+    return Status(StatusCode::kUnsupported, "unsupported protocol " + protocol);
+  }
+  ResourceInfo info;
+  {
+    CurlPool curls(1);
+    CurlGuard guard(curls);
+    info = client->probe(url, guard.handle());
+  }
+  if (info.size < 0) {
+    return Status(StatusCode::kNetworkError,
+                  "failed to get the file size of " + url);
+  }
+  if (!info.accept_ranges) {
+    return Status(StatusCode::kUnsupported,
+                  url + " is not served in ranges, it can't be sharded");
+  }
+
+  // what an interrupted run left is only trusted while the target is there
+  std::error_code ec;
+  auto resume =
+      static_cast<int64_t>(std::filesystem::file_size(target, ec)) ==
+          info.size &&
+      !ec;
+  auto ledger_path = target + ".ledger";
+  auto ledger = ShardLedger::create(ledger_path, url, info.validator(),
+                                    target, info.size, options, resume);
+  if (ledger == nullptr) {
+    return Status(StatusCode::kIoError, "can't create " + ledger_path);
+  }
+  auto &io = FileIO::instance();
+  if (!io.preallocate(target, info.size)) {
+    return Status(StatusCode::kIoError, "can't create " + target);
+  }
+  // the workers open it themselves
+  io.close(target);
+  span.arg("shards", ledger->count());
+  MLTDL_LOG(kInfo, "shard_start")
+      .bytes(info.size)
+      .message(std::to_string(ledger->count()) + " shards of " + url);
+
+  ShardProgress progress;
+  progress.total = info.size;
+  progress.shards = ledger->count();
+  auto &workers = progress.workers;
+  Status status;
+  for (;;) {
+    // a worker that exits cleanly found nothing left to claim
+    for (auto it = workers.begin(); it != workers.end();) {
+      int wstatus = 0;
+      auto reaped = ::waitpid(*it, &wstatus, WNOHANG);
+      if (reaped == 0) {
+        ++it;
+        continue;
+      }
+      if (reaped < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        auto released = ledger->release(*it);
+        ++progress.restarts;
+        MLTDL_LOG(kWarn, "worker_died")
+            .code(WIFSIGNALED(wstatus) ? WTERMSIG(wstatus)
+                                       : WEXITSTATUS(wstatus))
+            .message("worker " + std::to_string(*it) + " died, " +
+                     std::to_string(released) + " shards reassigned");
+      }
+      it = workers.erase(it);
+    }
+    auto failed = ledger->failed();
+    if (failed >= 0) {
+      auto code = static_cast<StatusCode>(ledger->slot(failed).error.load());
+      status = Status(code, "shard " + std::to_string(failed) + " of " + url +
+                                " failed");
+      break;
+    }
+    if (ledger->complete()) {
+      break;
+    }
+    if (progress.restarts > options.max_restarts) {
+      status = Status(StatusCode::kNetworkError,
+                      std::to_string(progress.restarts) +
+                          " workers died downloading " + url);
+      break;
+    }
+
+    // a worker stuck on a shard is killed and reaped like a dead one
+    auto now = monotonicNs();
+    for (int i = 0; i < ledger->count(); ++i) {
+      auto &slot = ledger->slot(i);
+      pid_t owner = slot.owner;
+      if (slot.state == ShardLedger::kClaimed && owner > 0 &&
+          now - slot.heartbeat_ns > options.stall_timeout_ms * 1000000 &&
+          std::find(workers.begin(), workers.end(), owner) != workers.end()) {
+        MLTDL_LOG(kWarn, "worker_stalled")
+            .segment(i)
+            .message("killing worker " + std::to_string(owner));
+        ::kill(owner, SIGKILL);
+      }
+    }
+
+    // no more workers than shards that are not done
+    auto open = ledger->countState(ShardLedger::kFree) +
+                ledger->countState(ShardLedger::kClaimed);
+    while (static_cast<int>(workers.size()) <
+           std::min(std::max(options.workers, 1), open)) {
+      auto pid = spawnWorker(ledger_path, options);
+      if (pid < 0) {
+        status = Status(StatusCode::kIoError, "can't start a worker");
+        break;
+      }
+      workers.push_back(pid);
+    }
+    if (!status.ok()) {
+      break;
+    }
+    if (options.on_progress) {
+      progress.done = ledger->done();
+      progress.shards_done = ledger->countState(ShardLedger::kDone);
+      options.on_progress(progress);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(options.poll_ms));
+  }
+  if (!status.ok()) {
+    ledger->abort();
+  }
+  stopWorkers(workers, !status.ok());
+  if (options.on_progress) {
+    progress.done = ledger->done();
+    progress.shards_done = ledger->countState(ShardLedger::kDone);
+    options.on_progress(progress);
+  }
+  if (!status.ok()) {
+    // kept, the next run resumes from it
+    return status;
+  }
+  if (!io.sync(target)) {
+    return Status(StatusCode::kIoError, "can't sync " + target);
+  }
+  io.close(target);
+  std::filesystem::remove(ledger_path, ec);
+  MLTDL_LOG(kInfo, "done").bytes(info.size).message(target);
+  return Status::OK();
+}
+
+int runShardWorker(const std::string &ledger_path) {
+  auto ledger = ShardLedger::open(ledger_path);
+  if (ledger == nullptr) {
+    return 2;
+  }
+  auto protocol = getProtocol(ledger->url());
+  auto client = get_clients(protocol);
+  if (client == nullptr) {
+    MLTDL_LOG(kError, "unsupported").message(protocol);
+    return 2;
+  }
+  auto threads = std::max(ledger->threads(), 1);
+  ThreadPool pool(threads, "shard");
+  CurlPool curls(threads);
+  auto self = ::getpid();
+  {
+    TaskGroup group(pool);
+    for (int t = 0; t < threads; ++t) {
+      group.spawn([&](int worker) {
+        for (int i; !ledger->aborted() && (i = ledger->claim(self)) >= 0;) {
+          auto status = fetchShard(*ledger, i, *client, curls, worker);
+          if (status.ok()) {
+            ledger->finish(i);
+          } else if (status.code() != StatusCode::kCancelled) {
+            MLTDL_LOG(kWarn, "shard_failed")
+                .segment(i)
+                .message(status.toString());
+            ledger->fail(i, status);
+          }
+        }
+      });
+    }
+    group.wait();
+  }
+  FileIO::instance().close(ledger->target());
+  return 0;
+}
+
+} // namespace mltdl
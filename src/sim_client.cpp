@@ -0,0 +1,339 @@
+#include "sim_client.h"
+#include "file_io.h"
+#include "url.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+namespace mltdl {
+
+namespace {
+
+// the bytes written to a target at once, like a chunk curl delivers
+constexpr size_t kChunk = 64 * 1024;
+
+uint64_t splitmix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// draws of an attempt, the same for the same seed, range and attempt
+class Draws {
+public:
+  Draws(uint64_t seed, int64_t start, int64_t end, int attempt)
+      : state_(splitmix64(splitmix64(splitmix64(seed) ^ start) ^ end) ^
+               attempt) {}
+
+  // uniform in [0, 1)
+  double next() {
+    state_ = splitmix64(state_);
+    return (state_ >> 11) * (1.0 / (1ULL << 53));
+  }
+
+private:
+  uint64_t state_;
+};
+
+// let the modelled time pass, or only count it
+void elapse(const SimClient::Model &model, int64_t us) {
+  if (us <= 0) {
+    return;
+  }
+  SimClient::stats().virtual_us += us;
+  if (model.real_time) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+}
+
+int64_t transferUs(const SimClient::Model &model, int64_t bytes) {
+  return model.bandwidth > 0 ? bytes * 1000000 / model.bandwidth : 0;
+}
+
+} // namespace
+
+void SimClient::Stats::reset() {
+  requests = 0;
+  failures = 0;
+  stalls = 0;
+  bytes = 0;
+  virtual_us = 0;
+}
+
+SimClient::Stats &SimClient::stats() {
+  static Stats stats;
+  return stats;
+}
+
+void SimClient::fill(uint64_t seed, int64_t offset, char *data, size_t size) {
+  auto key = splitmix64(seed);
+  size_t i = 0;
+  while (i < size) {
+    auto pos = offset + static_cast<int64_t>(i);
+    auto word = splitmix64(key ^ (pos / 8));
+    for (auto b = pos % 8; b < 8 && i < size; ++b, ++i) {
+      data[i] = static_cast<char>(word >> (8 * b));
+    }
+  }
+}
+
+bool SimClient::parseModel(const std::string &url, Model &model) {
+  UrlParts parts;
+  if (!parseUrl(url, parts)) {
+    return false;
+  }
+  std::string query(parts.query);
+  size_t pos = 0;
+  while (pos < query.size()) {
+    auto amp = query.find('&', pos);
+    if (amp == std::string::npos) {
+      amp = query.size();
+    }
+    auto pair = query.substr(pos, amp - pos);
+    pos = amp + 1;
+    auto eq = pair.find('=');
+    if (eq == std::string::npos) {
+      continue;
+    }
+    auto name = pair.substr(0, eq);
+    auto value = pair.substr(eq + 1);
+    try {
+      if (name == "size") {
+        model.size = std::stoll(value);
+      } else if (name == "seed") {
+        model.seed = std::stoull(value);
+      } else if (name == "bandwidth") {
+        model.bandwidth = std::stoll(value);
+      } else if (name == "latency_ms") {
+        model.latency_ms = std::stoll(value);
+      } else if (name == "error_rate") {
+        model.error_rate = std::stod(value);
+      } else if (name == "stall_rate") {
+        model.stall_rate = std::stod(value);
+      } else if (name == "stall_ms") {
+        model.stall_ms = std::stoll(value);
+      } else if (name == "status") {
+        model.status = std::stol(value);
+      } else if (name == "ranges") {
+        model.ranges = value != "0";
+      } else if (name == "time") {
+        model.real_time = value == "real";
+      }
+    } catch (std::exception &) {
+      std::cerr << "bad sim parameter " << pair << " in " << url << std::endl;
+      return false;
+    }
+  }
+  return model.size >= 0;
+}
+
+Response SimClient::transfer(const std::string &url, const RetryStrategy &rs,
+                             int64_t start, int64_t end,
+                             const RangeWriter &writer,
+                             TransferControl *control) {
+  Response response;
+  Model model;
+  if (!parseModel(url, model)) {
+    response.status = CURLE_URL_MALFORMAT;
+    return response;
+  }
+  auto &stats = SimClient::stats();
+  end = std::min(end, model.size - 1);
+  if (end < start && start == 0) {
+    // nothing to send of an empty resource
+    response.status_code = 200;
+    return response;
+  }
+  int64_t done = 0;
+  std::vector<char> chunk(kChunk);
+  for (auto i = 0; i < std::max(rs.max_retries, 1); ++i) {
+    ++stats.requests;
+    Draws draws(model.seed, start, end, i);
+    auto offset = start + done;
+    response.status = CURLE_OK;
+    elapse(model, model.latency_ms * 1000);
+    if (model.status != 0) {
+      response.status_code = model.status;
+    } else if (start > model.size - 1 ||
+               (!model.ranges && offset > 0)) {
+      response.status_code = 416;
+    } else {
+      response.status_code = 206;
+    }
+    bool reset = false;
+    int64_t stop = end;
+    if (response.status_code == 206 && draws.next() < model.error_rate) {
+      ++stats.failures;
+      if (draws.next() < 0.5) {
+        response.status_code = 503;
+      } else {
+        // somewhere in what is left of the range
+        reset = true;
+        stop = offset + static_cast<int64_t>(draws.next() *
+                                             (end - offset + 1)) - 1;
+      }
+    }
+    if (response.status_code >= 300) {
+      response.status = CURLE_HTTP_RETURNED_ERROR;
+    } else {
+      if (draws.next() < model.stall_rate) {
+        ++stats.stalls;
+        elapse(model, model.stall_ms * 1000);
+      }
+      while (offset <= stop) {
+        if (control != nullptr && control->isCancelled()) {
+          response.status = CURLE_ABORTED_BY_CALLBACK;
+          return response;
+        }
+        auto n = static_cast<size_t>(
+            std::min<int64_t>(chunk.size(), stop - offset + 1));
+        fill(model.seed, offset, chunk.data(), n);
+        elapse(model, transferUs(model, n));
+        if (!writer(offset, chunk.data(), n)) {
+          response.status = CURLE_WRITE_ERROR;
+          return response;
+        }
+        offset += n;
+        done += n;
+        stats.bytes += n;
+        if (control != nullptr) {
+          control->add(n);
+          if (control->on_progress) {
+            control->on_progress();
+          }
+        }
+      }
+      if (!reset) {
+        return response;
+      }
+      response.status = CURLE_RECV_ERROR;
+    }
+    if (isPermanentHttpError(response.status_code) ||
+        i + 1 >= rs.max_retries) {
+      break;
+    }
+    elapse(model, retryDelay(rs, i) * 1000);
+  }
+  return response;
+}
+
+Response SimClient::get(const std::string &url, const RetryStrategy &rs,
+                        CURL * /*curl*/, int64_t start, int64_t end,
+                        void *userp /*= nullptr*/,
+                        TransferControl *control /*= nullptr*/) {
+  std::vector<char> body;
+  auto file = static_cast<FILE *>(userp);
+  // a file gets the range at its current position, like from curl
+  auto response = transfer(
+      url, rs, start, end,
+      [&](int64_t, const char *data, size_t size) {
+        if (file != nullptr) {
+          return fwrite(data, 1, size, file) == size;
+        }
+        body.insert(body.end(), data, data + size);
+        return true;
+      },
+      control);
+  response.body = std::move(body);
+  return response;
+}
+
+Response SimClient::stream(const std::string &url, const RetryStrategy &rs,
+                           CURL * /*curl*/, int64_t start, int64_t end,
+                           Sink &sink,
+                           TransferControl *control /*= nullptr*/) {
+  return transfer(
+      url, rs, start, end,
+      [&](int64_t offset, const char *data, size_t size) {
+        return sink.write(offset, data, size);
+      },
+      control);
+}
+
+Response SimClient::post(const std::string &url,
+                         const std::string & /*post_fields*/,
+                         const RetryStrategy & /*rs*/, CURL * /*curl*/,
+                         void * /*userp*/) {
+  Response response;
+  Model model;
+  if (!parseModel(url, model)) {
+    response.status = CURLE_URL_MALFORMAT;
+    return response;
+  }
+  ++stats().requests;
+  elapse(model, model.latency_ms * 1000);
+  response.status_code = model.status != 0 ? model.status : 200;
+  return response;
+}
+
+Response SimClient::put(const std::string &url, const std::string &file_path,
+                        int64_t offset, int64_t length,
+                        const std::vector<std::string> & /*headers*/,
+                        const RetryStrategy &rs, CURL * /*curl*/,
+                        TransferControl *control /*= nullptr*/) {
+  Response response;
+  Model model;
+  if (!parseModel(url, model)) {
+    response.status = CURLE_URL_MALFORMAT;
+    return response;
+  }
+  std::vector<char> data(length);
+  if (FileIO::instance().pread(file_path, offset, data.data(), length) !=
+      length) {
+    response.status = CURLE_READ_ERROR;
+    return response;
+  }
+  auto &stats = SimClient::stats();
+  for (auto i = 0; i < std::max(rs.max_retries, 1); ++i) {
+    ++stats.requests;
+    Draws draws(model.seed, offset, offset + length, i);
+    elapse(model, model.latency_ms * 1000 + transferUs(model, length));
+    response.status = CURLE_OK;
+    response.status_code = model.status != 0 ? model.status : 200;
+    if (response.status_code == 200 && draws.next() < model.error_rate) {
+      ++stats.failures;
+      response.status_code = 503;
+    }
+    if (response.status_code < 300) {
+      stats.bytes += length;
+      if (control != nullptr) {
+        control->add(length);
+      }
+      // the MD5 like an object store would answer
+      response.etag = "\"" + calculateMd5(data.data(), data.size()) + "\"";
+      break;
+    }
+    if (isPermanentHttpError(response.status_code) ||
+        i + 1 >= rs.max_retries) {
+      break;
+    }
+    elapse(model, retryDelay(rs, i) * 1000);
+  }
+  return response;
+}
+
+int64_t SimClient::getFileSize(const std::string &url, CURL *curl) {
+  return probe(url, curl).size;
+}
+
+ResourceInfo SimClient::probe(const std::string &url, CURL * /*curl*/) {
+  ResourceInfo info;
+  Model model;
+  if (!parseModel(url, model)) {
+    return info;
+  }
+  ++stats().requests;
+  elapse(model, model.latency_ms * 1000);
+  info.size = model.size;
+  info.accept_ranges = model.ranges;
+  info.etag = "\"sim-" + std::to_string(model.seed) + "-" +
+              std::to_string(model.size) + "\"";
+  return info;
+}
+
+} // namespace mltdl
@@ -0,0 +1,114 @@
+#include "sink.h"
+#include "client.h"
+
+#include <chrono>
+
+namespace mltdl {
+
+OrderedSink::OrderedSink(std::shared_ptr<Sink> inner, int64_t start,
+                         int64_t max_buffered, const TransferControl *control,
+                         MemoryBudget &budget)
+    : inner_(std::move(inner)), max_buffered_(max_buffered),
+      control_(control), budget_(budget), next_(start) {}
+
+OrderedSink::~OrderedSink() { budget_.release(buffered_); }
+
+bool OrderedSink::cancelled() const {
+  return failed_ || (control_ != nullptr && control_->isCancelled());
+}
+
+bool OrderedSink::write(int64_t offset, const char *data, size_t size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    if (cancelled()) {
+      failed_ = true;
+      advanced_.notify_all();
+      return false;
+    }
+    auto end = offset + static_cast<int64_t>(size);
+    if (end <= next_) {
+      // a hedge or a retry sent it again
+      return true;
+    }
+    if (offset <= next_) {
+      auto skip = next_ - offset;
+      return deliver(data + skip, size - skip);
+    }
+    auto it = pending_.find(offset);
+    if (it != pending_.end() && it->second.size() >= size) {
+      return true;
+    }
+    // one chunk is always taken, or a single writer ahead could never go on
+    if (buffered_ == 0 ||
+        buffered_ + static_cast<int64_t>(size) <= max_buffered_) {
+      if (it != pending_.end()) {
+        buffered_ -= it->second.size();
+        budget_.release(it->second.size());
+      }
+      pending_[offset].assign(data, data + size);
+      buffered_ += size;
+      budget_.acquire(size);
+      return true;
+    }
+    // the wait is bounded so a cancelled control is noticed
+    advanced_.wait_for(lock, std::chrono::milliseconds(50));
+  }
+}
+
+bool OrderedSink::deliver(const char *data, size_t size) {
+  if (!inner_->write(next_, data, size)) {
+    failed_ = true;
+    advanced_.notify_all();
+    return false;
+  }
+  next_ += size;
+  while (!pending_.empty() && pending_.begin()->first <= next_) {
+    auto node = pending_.extract(pending_.begin());
+    auto &held = node.mapped();
+    buffered_ -= held.size();
+    budget_.release(held.size());
+    auto end = node.key() + static_cast<int64_t>(held.size());
+    if (end <= next_) {
+      continue;
+    }
+    auto skip = next_ - node.key();
+    if (!inner_->write(next_, held.data() + skip, held.size() - skip)) {
+      failed_ = true;
+      break;
+    }
+    next_ = end;
+  }
+  advanced_.notify_all();
+  return !failed_;
+}
+
+void OrderedSink::finish(const Status &status) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_.release(buffered_);
+    buffered_ = 0;
+    pending_.clear();
+    // writers still blocked belong to a download that is over
+    failed_ = true;
+    advanced_.notify_all();
+  }
+  inner_->finish(status);
+}
+
+void OrderedSink::cancel() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  failed_ = true;
+  advanced_.notify_all();
+}
+
+int64_t OrderedSink::next() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return next_;
+}
+
+int64_t OrderedSink::buffered() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return buffered_;
+}
+
+} // namespace mltdl
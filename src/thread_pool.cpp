@@ -1,9 +1,39 @@
 #include "thread_pool.h"
+#include "tracer.h"
 
 #include <iostream>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace mltdl {
 
+int cpuLimit() {
+#ifdef __linux__
+  return CPU_SETSIZE;
+#else
+  return 0;
+#endif
+}
+
+bool pinThread(std::thread &thread, int cpu) {
+  if (cpu < 0 || cpu >= cpuLimit()) {
+    return false;
+  }
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) ==
+         0;
+#else
+  (void)thread;
+  (void)cpu;
+  return false;
+#endif
+}
+
 ThreadPool::ThreadPool(const char *name /*=""*/)
     : name_(name), running_(true), work_complete_(true), adding_work_(false),
       active_threads_(0) {}
@@ -28,23 +58,50 @@ bool ThreadPool::init(int32_t num_thread) {
 }
 
 void ThreadPool::enqueue(Work work, bool finished_adding_work) {
+  enqueue(std::move(work), WorkOptions(), finished_adding_work);
+}
+
+void ThreadPool::enqueue(Work work, const WorkOptions &options,
+                         bool finished_adding_work) {
   std::lock_guard<std::mutex> lock(mutex_);
-  work_queue_.push(std::move(work));
+  work_queue_.push(std::move(work), options);
   work_complete_ = false;
   adding_work_ = !finished_adding_work;
 }
 
-void ThreadPool::spawn(Work work) {
-  enqueue(std::move(work), true);
+void ThreadPool::spawn(Work work) { spawn(std::move(work), WorkOptions()); }
+
+void ThreadPool::spawn(Work work, const WorkOptions &options) {
+  enqueue(std::move(work), options, true);
   // Signal a thread to complete the work
   condition_.notify_one();
 }
 
+void ThreadPool::setStarvationLimit(int limit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  work_queue_.setStarvationLimit(limit);
+}
+
+bool ThreadPool::pinThreads(std::vector<int> cpus) {
+  if (cpus.empty()) {
+    for (unsigned i = 0; i < std::thread::hardware_concurrency(); ++i) {
+      cpus.push_back(i);
+    }
+  }
+  if (cpus.empty()) {
+    return false;
+  }
+  bool pinned = true;
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    pinned = pinThread(threads_[i], cpus[i % cpus.size()]) && pinned;
+  }
+  return pinned;
+}
+
 // abort all work and shutdown all threads
 void ThreadPool::abort() {
   std::unique_lock<std::mutex> lock(mutex_);
-  while (!work_queue_.empty())
-    work_queue_.pop();
+  work_queue_.clear();
 }
 
 bool ThreadPool::queueempty() { return work_queue_.empty(); }
@@ -106,12 +163,18 @@ std::vector<std::thread::id> ThreadPool::thread_ids() const {
 
 void ThreadPool::threadMain(int thread_id) {
   // DeviceGuard g(device_id);
+  auto &tracer = Tracer::global();
+  tracer.setThreadName(name_ + "-" + std::to_string(thread_id));
   while (running_) {
     // Block on the condition to wait for work
     std::unique_lock<std::mutex> lock(mutex_);
+    auto idle_us = tracer.enabled() ? Tracer::nowUs() : -1;
     condition_.wait(lock, [this] {
       return !running_ || (!work_queue_.empty() && !adding_work_);
     });
+    if (idle_us >= 0) {
+      tracer.complete("idle", "pool", idle_us, Tracer::nowUs() - idle_us);
+    }
 
     // If we're no longer running, exit the run loop
     if (!running_) {
@@ -120,8 +183,7 @@ void ThreadPool::threadMain(int thread_id) {
 
     // Get work from the queue & mark
     // this thread as active
-    Work work = std::move(work_queue_.front());
-    work_queue_.pop();
+    Work work = work_queue_.pop();
     bool should_wake_next = !work_queue_.empty();
     ++active_threads_;
 
@@ -136,6 +198,7 @@ void ThreadPool::threadMain(int thread_id) {
     // waitForCompletion is called, we will check for any errors
     // in the threads and return an error if one occurs.
     try {
+      Tracer::Span span("task", "pool");
       work(thread_id);
     } catch (std::exception &e) {
       lock.lock();
@@ -157,4 +220,83 @@ void ThreadPool::threadMain(int thread_id) {
   }
 }
 
+TaskGroup::TaskGroup(ThreadPool &pool,
+                     const WorkOptions &options /*= WorkOptions()*/)
+    : pool_(pool), options_(options), state_(std::make_shared<State>()) {}
+
+TaskGroup::~TaskGroup() { wait(); }
+
+void TaskGroup::spawn(Work work) { spawn(std::move(work), options_); }
+
+void TaskGroup::spawn(Work work, const WorkOptions &options) {
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    ++state_->queued;
+  }
+  pool_.spawn(
+      [state = state_, work = std::move(work)](int32_t thread_id) {
+        {
+          std::lock_guard<std::mutex> lock(state->mutex);
+          --state->queued;
+          if (state->cancelled) {
+            state->done.notify_all();
+            return;
+          }
+          ++state->running;
+        }
+        std::string error;
+        try {
+          work(thread_id);
+        } catch (std::exception &e) {
+          error = e.what();
+        } catch (...) {
+          error = "Caught unknown exception";
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!error.empty()) {
+          state->errors.push_back(std::move(error));
+        }
+        --state->running;
+        if (state->idle()) {
+          state->done.notify_all();
+        }
+      },
+      options);
+}
+
+void TaskGroup::wait() {
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  state_->done.wait(lock, [this] { return state_->idle(); });
+}
+
+bool TaskGroup::waitFor(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  return state_->done.wait_for(lock, timeout,
+                               [this] { return state_->idle(); });
+}
+
+void TaskGroup::cancel() {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  state_->cancelled = true;
+  if (state_->idle()) {
+    state_->done.notify_all();
+  }
+}
+
+bool TaskGroup::cancelled() const {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->cancelled;
+}
+
+size_t TaskGroup::pending() const {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->cancelled ? state_->running
+                           : state_->queued + state_->running;
+}
+
+std::vector<std::string> TaskGroup::errors() const {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->errors;
+}
+
 } // namespace mltdl
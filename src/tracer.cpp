@@ -0,0 +1,246 @@
+#include "tracer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+namespace mltdl {
+
+namespace {
+
+void appendEscaped(std::string &out, const std::string &value) {
+  for (unsigned char c : value) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+}
+
+// set before the thread has a buffer, it is named when it gets one
+thread_local std::string thread_name;
+
+} // namespace
+
+Tracer &Tracer::global() {
+  static Tracer tracer;
+  return tracer;
+}
+
+int64_t Tracer::nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Tracer::start(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  path_ = path;
+  // threads that exited since the last trace was written
+  buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(),
+                                [](const std::shared_ptr<ThreadBuffer> &b) {
+                                  return b->retired.load(
+                                      std::memory_order_acquire);
+                                }),
+                 buffers_.end());
+  for (auto &buffer : buffers_) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    buffer->events.clear();
+  }
+  enabled_ = true;
+}
+
+bool Tracer::stop() {
+  enabled_ = false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ofstream out(path_);
+  if (!out.is_open()) {
+    std::cerr << "can't write trace: " << path_ << std::endl;
+    return false;
+  }
+  const auto pid = std::to_string(getpid());
+  out << "{\"traceEvents\":[\n";
+  bool first = true;
+  std::string line;
+  std::vector<std::shared_ptr<ThreadBuffer>> live;
+  for (auto &buffer : buffers_) {
+    // read before the events, a retired buffer gets no more of them
+    if (!buffer->retired.load(std::memory_order_acquire)) {
+      live.push_back(buffer);
+    }
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    const auto tid = std::to_string(buffer->tid);
+    if (!buffer->name.empty()) {
+      line = "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + pid +
+             ",\"tid\":" + tid + ",\"args\":{\"name\":\"";
+      appendEscaped(line, buffer->name);
+      line += "\"}}";
+      out << (first ? "" : ",\n") << line;
+      first = false;
+    }
+    for (const auto &event : buffer->events) {
+      line = "{\"name\":\"";
+      line += event.name;
+      line += "\",\"cat\":\"";
+      line += event.category;
+      line += "\",\"ph\":\"";
+      line += event.phase;
+      line += "\",\"ts\":" + std::to_string(event.ts);
+      if (event.phase == 'X') {
+        line += ",\"dur\":" + std::to_string(event.dur);
+      } else if (event.phase == 'b' || event.phase == 'e') {
+        line += ",\"id\":\"" + std::to_string(event.id) + "\"";
+      } else if (event.phase == 'i') {
+        line += ",\"s\":\"t\"";
+      }
+      line += ",\"pid\":" + pid + ",\"tid\":" + tid;
+      if (!event.args.empty()) {
+        line += ",\"args\":{" + event.args + "}";
+      }
+      line += "}";
+      out << (first ? "" : ",\n") << line;
+      first = false;
+    }
+    buffer->events.clear();
+  }
+  // the exited threads are written, their buffers go
+  buffers_.swap(live);
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return out.good();
+}
+
+Tracer::ThreadBuffer *Tracer::buffer(bool create) {
+  // retires the buffer when the thread exits, it stays registered until its
+  // events are written. Touches only the buffer, the tracer may be gone
+  struct Holder {
+    std::shared_ptr<ThreadBuffer> buffer;
+    ~Holder() {
+      if (buffer != nullptr) {
+        buffer->retired.store(true, std::memory_order_release);
+      }
+    }
+  };
+  thread_local Holder local;
+  if (local.buffer == nullptr && create) {
+    local.buffer = std::make_shared<ThreadBuffer>();
+    local.buffer->name = thread_name;
+    std::lock_guard<std::mutex> lock(mutex_);
+    local.buffer->tid = next_tid_++;
+    buffers_.push_back(local.buffer);
+  }
+  return local.buffer.get();
+}
+
+size_t Tracer::buffers() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return buffers_.size();
+}
+
+void Tracer::record(Event event) {
+  auto local = buffer(true);
+  std::lock_guard<std::mutex> lock(local->mutex);
+  local->events.push_back(std::move(event));
+}
+
+void Tracer::complete(const char *name, const char *category,
+                      int64_t start_us, int64_t dur_us, std::string args) {
+  if (!enabled()) {
+    return;
+  }
+  record(Event{'X', name, category, start_us, dur_us, 0, std::move(args)});
+}
+
+void Tracer::instant(const char *name, const char *category,
+                     std::string args) {
+  if (!enabled()) {
+    return;
+  }
+  record(Event{'i', name, category, nowUs(), 0, 0, std::move(args)});
+}
+
+void Tracer::asyncBegin(const char *name, const char *category, uint64_t id,
+                        std::string args) {
+  if (!enabled()) {
+    return;
+  }
+  record(Event{'b', name, category, nowUs(), 0, id, std::move(args)});
+}
+
+void Tracer::asyncEnd(const char *name, const char *category, uint64_t id,
+                      std::string args) {
+  if (!enabled()) {
+    return;
+  }
+  record(Event{'e', name, category, nowUs(), 0, id, std::move(args)});
+}
+
+void Tracer::setThreadName(const std::string &name) {
+  thread_name = name;
+  // a thread gets a buffer only while tracing, pools name every thread
+  if (auto local = buffer(enabled())) {
+    std::lock_guard<std::mutex> lock(local->mutex);
+    local->name = name;
+  }
+}
+
+void Tracer::appendArg(std::string &args, const char *key, int64_t value) {
+  if (!args.empty()) {
+    args += ',';
+  }
+  args += '"';
+  args += key;
+  args += "\":";
+  args += std::to_string(value);
+}
+
+void Tracer::appendArg(std::string &args, const char *key,
+                       const std::string &value) {
+  if (!args.empty()) {
+    args += ',';
+  }
+  args += '"';
+  args += key;
+  args += "\":\"";
+  appendEscaped(args, value);
+  args += '"';
+}
+
+Tracer::Span::Span(const char *name, const char *category)
+    : name_(name), category_(category) {
+  if (Tracer::global().enabled()) {
+    start_us_ = nowUs();
+  }
+}
+
+Tracer::Span::~Span() { end(); }
+
+void Tracer::Span::end() {
+  if (start_us_ >= 0) {
+    Tracer::global().complete(name_, category_, start_us_,
+                              nowUs() - start_us_, std::move(args_));
+    start_us_ = -1;
+  }
+}
+
+void Tracer::Span::arg(const char *key, int64_t value) {
+  if (start_us_ >= 0) {
+    appendArg(args_, key, value);
+  }
+}
+
+void Tracer::Span::arg(const char *key, const std::string &value) {
+  if (start_us_ >= 0) {
+    appendArg(args_, key, value);
+  }
+}
+
+} // namespace mltdl
@@ -0,0 +1,256 @@
+#include "uploader.h"
+#include "client_factory.h"
+#include "file_io.h"
+#include "logger.h"
+#include "tracer.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <openssl/evp.h>
+#include <openssl/md5.h>
+#include <sstream>
+
+namespace mltdl {
+
+namespace {
+
+// the MD5 of a part in hex and in base64, for Content-MD5
+bool partDigest(const std::string &file_path, int64_t offset, int64_t length,
+                std::string &hex, std::string &base64) {
+  auto &io = FileIO::instance();
+  MD5_CTX context;
+  MD5_Init(&context);
+  std::vector<char> buffer(256 * 1024);
+  for (int64_t pos = 0; pos < length;) {
+    auto n = io.pread(file_path, offset + pos, buffer.data(),
+                      std::min<int64_t>(buffer.size(), length - pos));
+    if (n <= 0) {
+      return false;
+    }
+    MD5_Update(&context, buffer.data(), n);
+    pos += n;
+  }
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  MD5_Final(digest, &context);
+  std::ostringstream oss;
+  for (auto byte : digest) {
+    oss << std::hex << std::setw(2) << std::setfill('0')
+        << static_cast<int>(byte);
+  }
+  hex = oss.str();
+  unsigned char encoded[4 * ((MD5_DIGEST_LENGTH + 2) / 3) + 1];
+  EVP_EncodeBlock(encoded, digest, MD5_DIGEST_LENGTH);
+  base64 = reinterpret_cast<char *>(encoded);
+  return true;
+}
+
+// the MD5 an ETag stands for, empty if it is something else
+std::string etagMd5(std::string etag) {
+  if (etag.compare(0, 2, "W/") == 0) {
+    return "";
+  }
+  etag.erase(std::remove(etag.begin(), etag.end(), '"'), etag.end());
+  if (etag.size() != 32 ||
+      !std::all_of(etag.begin(), etag.end(),
+                   [](unsigned char c) { return std::isxdigit(c); })) {
+    return "";
+  }
+  std::transform(etag.begin(), etag.end(), etag.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return etag;
+}
+
+Status responseStatus(const Response &response) {
+  if (response.status == CURLE_OK && response.status_code >= 200 &&
+      response.status_code < 300) {
+    return Status::OK();
+  }
+  if (response.status_code >= 300 ||
+      (response.status == CURLE_OK && response.status_code < 200)) {
+    return Status(isPermanentHttpError(response.status_code)
+                      ? StatusCode::kHttpError
+                      : StatusCode::kNetworkError,
+                  "server replied " + std::to_string(response.status_code));
+  }
+  return Status(StatusCode::kNetworkError,
+                curl_easy_strerror((CURLcode)response.status));
+}
+
+} // namespace
+
+Uploader::Uploader(size_t max_parallel /*= 8*/)
+    : thread_pool_(std::max<size_t>(max_parallel, 1), "upload"),
+      curl_pool_(std::max<size_t>(max_parallel, 1)) {}
+
+Uploader::~Uploader() { thread_pool_.waitForCompletion(false); }
+
+std::vector<UploadPart> Uploader::split(int64_t size, int64_t part_size) {
+  std::vector<UploadPart> parts;
+  part_size = std::max<int64_t>(part_size, 1);
+  int64_t offset = 0;
+  do {
+    UploadPart part;
+    part.number = parts.size() + 1;
+    part.offset = offset;
+    part.length = std::min(part_size, size - offset);
+    parts.push_back(part);
+    offset += part.length;
+  } while (offset < size);
+  return parts;
+}
+
+std::string Uploader::partUrl(const UploadOptions &options,
+                              const std::string &url, int number) {
+  auto pattern = options.part_url;
+  if (pattern.empty()) {
+    pattern = url + (url.find('?') == std::string::npos ? "?" : "&") +
+              "partNumber={part}";
+  }
+  auto pos = pattern.find("{part}");
+  if (pos != std::string::npos) {
+    pattern.replace(pos, 6, std::to_string(number));
+  }
+  return pattern;
+}
+
+Status Uploader::upload(const std::string &file_path, const std::string &url,
+                        const UploadOptions &options /*= UploadOptions()*/,
+                        TransferControl *control /*= nullptr*/,
+                        std::vector<UploadPart> *parts_out /*= nullptr*/) {
+  Tracer::Span span("upload", "upload");
+  if (!isUrlValid(url)) {
+    return Status(StatusCode::kInvalidArgument, "invalid url " + url);
+  }
+  auto size = FileIO::instance().size(file_path);
+  if (size < 0) {
+    return Status(StatusCode::kIoError, "can't open " + file_path);
+  }
+  auto parts = split(size, options.mode == UploadMode::kSingle
+                               ? std::max<int64_t>(size, 1)
+                               : options.part_size);
+  span.arg("parts", parts.size());
+
+  // cancelled when a part fails for good, the parts still queued are
+  // dropped and the running ones stop with it
+  TransferControl upload_control;
+  upload_control.parent = control;
+  TaskGroup group(thread_pool_);
+  for (auto &part : parts) {
+    // marked as dropped until the part runs
+    part.status = Status(StatusCode::kCancelled, "cancelled");
+    group.spawn([&, size](int worker) {
+      part.status = uploadPart(file_path, url, size, options, part,
+                               &upload_control, worker);
+      if (!part.status.ok() &&
+          part.status.code() != StatusCode::kCancelled) {
+        upload_control.cancelled = true;
+        group.cancel();
+      }
+    });
+  }
+  group.wait();
+  // the descriptor cache is for the files being downloaded
+  FileIO::instance().close(file_path);
+
+  Status status;
+  for (const auto &part : parts) {
+    // the part that failed first rather than the ones it cancelled
+    if (!part.status.ok() && (status.ok() || status.code() ==
+                                                 StatusCode::kCancelled)) {
+      status = part.status;
+    }
+  }
+  if (control != nullptr && control->isCancelled()) {
+    status = Status(StatusCode::kCancelled, "cancelled by the caller");
+  }
+  if (status.ok() && options.mode == UploadMode::kMultipart) {
+    std::string body;
+    for (const auto &part : parts) {
+      body += std::to_string(part.number) + " " + part.etag + "\n";
+    }
+    auto complete_url =
+        options.complete_url.empty() ? url : options.complete_url;
+    auto client = get_clients(getProtocol(complete_url));
+    if (client == nullptr) {
+      status = Status(StatusCode::kUnsupported,
+                      "unsupported protocol " + getProtocol(complete_url));
+    } else {
+      CurlGuard guard(curl_pool_);
+      status = responseStatus(
+          client->post(complete_url, body, options.retry, guard.handle()));
+    }
+  }
+  if (parts_out != nullptr) {
+    *parts_out = std::move(parts);
+  }
+  return status;
+}
+
+Status Uploader::uploadPart(const std::string &file_path,
+                            const std::string &url, int64_t file_size,
+                            const UploadOptions &options, UploadPart &part,
+                            TransferControl *control, int worker) {
+  Tracer::Span span("part", "upload");
+  span.arg("offset", part.offset);
+  span.arg("length", part.length);
+  if (control->isCancelled()) {
+    return Status(StatusCode::kCancelled, "cancelled");
+  }
+  auto part_url = options.mode == UploadMode::kMultipart
+                      ? partUrl(options, url, part.number)
+                      : url;
+  auto protocol = getProtocol(part_url);
+  auto client = get_clients(protocol);
+  if (client == nullptr) {
+    return Status(StatusCode::kUnsupported, "unsupported protocol " + protocol);
+  }
+  std::vector<std::string> headers;
+  if (options.mode == UploadMode::kRangedPut && part.length > 0) {
+    headers.push_back("Content-Range: bytes " + std::to_string(part.offset) +
+                      "-" + std::to_string(part.offset + part.length - 1) +
+                      "/" + std::to_string(file_size));
+  }
+  if (options.verify) {
+    std::string base64;
+    if (!partDigest(file_path, part.offset, part.length, part.md5, base64)) {
+      return Status(StatusCode::kIoError, "can't read " + file_path);
+    }
+    headers.push_back("Content-MD5: " + base64);
+  }
+
+  CurlGuard guard(curl_pool_, worker, CurlPool::hostKey(part_url));
+  Status status;
+  // the client retries failed requests, a part the server got wrong is sent
+  // again here
+  for (int attempt = 0; attempt < std::max(options.retry.max_retries, 1);
+       ++attempt) {
+    auto response =
+        client->put(part_url, file_path, part.offset, part.length, headers,
+                    options.retry, guard.handle(), control);
+    if (control->isCancelled()) {
+      return Status(StatusCode::kCancelled, "cancelled");
+    }
+    status = responseStatus(response);
+    if (!status.ok()) {
+      return status;
+    }
+    part.etag = response.etag;
+    auto md5 = etagMd5(part.etag);
+    if (!options.verify || md5.empty() || md5 == part.md5) {
+      return Status::OK();
+    }
+    status = Status(StatusCode::kCorrupted,
+                    "part " + std::to_string(part.number) + " md5 " +
+                        part.md5 + " but the server has " + md5);
+    MLTDL_LOG(kWarn, "upload_corrupted")
+        .job(control->job_id)
+        .segment(part.number)
+        .bytes(part.length)
+        .message(status.toString() + ", sending it again");
+  }
+  return status;
+}
+
+} // namespace mltdl
@@ -0,0 +1,244 @@
+#include "url.h"
+
+namespace mltdl {
+
+namespace {
+
+enum : uint8_t {
+  kHostChar = 1,  // letters, digits and '-' of a host name label
+  kPathChar = 2,  // pchar and '/', without the percent sign
+  kQueryChar = 4, // path chars and '?'
+  kHexChar = 8,
+};
+
+// one lookup per character instead of a chain of comparisons
+struct CharTable {
+  uint8_t flags[256]{};
+
+  constexpr CharTable() {
+    // unreserved, sub-delims, ':', '@' and '/'
+    const char *path = "-._~!$&'()*+,;=:@/";
+    for (auto p = path; *p != '\0'; ++p) {
+      flags[static_cast<unsigned char>(*p)] |= kPathChar | kQueryChar;
+    }
+    flags[static_cast<unsigned char>('?')] |= kQueryChar;
+    for (int c = 0; c < 256; ++c) {
+      bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+      bool digit = c >= '0' && c <= '9';
+      if (alpha || digit) {
+        flags[c] |= kHostChar | kPathChar | kQueryChar;
+      }
+      if (digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
+        flags[c] |= kHexChar;
+      }
+    }
+    flags[static_cast<unsigned char>('-')] |= kHostChar;
+  }
+
+  bool is(char c, uint8_t flag) const {
+    return flags[static_cast<unsigned char>(c)] & flag;
+  }
+};
+
+constexpr CharTable kChars;
+
+bool equalsLower(std::string_view s, std::string_view lower) {
+  if (s.size() != lower.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < s.size(); ++i) {
+    char c = s[i];
+    if (c >= 'A' && c <= 'Z') {
+      c = static_cast<char>(c - 'A' + 'a');
+    }
+    if (c != lower[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// the characters allowed by flag, or a well formed percent-escape
+bool validComponent(std::string_view s, uint8_t flag) {
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '%') {
+      if (i + 2 >= s.size() || !kChars.is(s[i + 1], kHexChar) ||
+          !kChars.is(s[i + 2], kHexChar)) {
+        return false;
+      }
+      i += 2;
+    } else if (!kChars.is(s[i], flag)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// dot separated labels of letters, digits and '-', none of them empty
+bool validHostName(std::string_view host) {
+  if (host.empty() || host.size() > 253) {
+    return false;
+  }
+  size_t label = 0;
+  for (char c : host) {
+    if (c == '.') {
+      if (label == 0) {
+        return false;
+      }
+      label = 0;
+    } else if (kChars.is(c, kHostChar)) {
+      ++label;
+    } else {
+      return false;
+    }
+  }
+  return label > 0;
+}
+
+// "[...]" with hex digits and ':', and dots for an embedded IPv4 address
+bool validIpv6(std::string_view host) {
+  if (host.size() < 4 || host.size() > 47) {
+    return false;
+  }
+  bool colon = false;
+  for (auto c : host.substr(1, host.size() - 2)) {
+    if (c == ':') {
+      colon = true;
+    } else if (c != '.' && !kChars.is(c, kHexChar)) {
+      return false;
+    }
+  }
+  return colon;
+}
+
+} // namespace
+
+bool parseUrl(std::string_view url, UrlParts &parts) {
+  parts = UrlParts();
+  auto scheme_end = url.find("://");
+  if (scheme_end == std::string_view::npos || scheme_end == 0) {
+    return false;
+  }
+  parts.scheme = url.substr(0, scheme_end);
+  if (!equalsLower(parts.scheme, "http") &&
+      !equalsLower(parts.scheme, "https") &&
+      !equalsLower(parts.scheme, "ftp") &&
+      !equalsLower(parts.scheme, "sim")) {
+    return false;
+  }
+
+  auto rest = url.substr(scheme_end + 3);
+  auto authority_end = rest.find_first_of("/?#");
+  auto authority = rest.substr(0, authority_end);
+  rest = authority_end == std::string_view::npos ? std::string_view()
+                                                 : rest.substr(authority_end);
+
+  std::string_view port;
+  if (!authority.empty() && authority.front() == '[') {
+    auto close = authority.find(']');
+    if (close == std::string_view::npos) {
+      return false;
+    }
+    parts.host = authority.substr(0, close + 1);
+    parts.ipv6 = true;
+    if (!validIpv6(parts.host)) {
+      return false;
+    }
+    auto after = authority.substr(close + 1);
+    if (!after.empty()) {
+      if (after.front() != ':') {
+        return false;
+      }
+      port = after.substr(1);
+      parts.port = port;
+      if (port.empty()) {
+        return false;
+      }
+    }
+  } else {
+    auto colon = authority.find(':');
+    parts.host = authority.substr(0, colon);
+    if (!validHostName(parts.host)) {
+      return false;
+    }
+    if (colon != std::string_view::npos) {
+      port = authority.substr(colon + 1);
+      parts.port = port;
+      if (port.empty()) {
+        return false;
+      }
+    }
+  }
+  if (!port.empty()) {
+    if (port.size() > 5) {
+      return false;
+    }
+    uint32_t number = 0;
+    for (auto c : port) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      number = number * 10 + (c - '0');
+    }
+    if (number == 0 || number > 65535) {
+      return false;
+    }
+    parts.port_number = static_cast<uint16_t>(number);
+  }
+
+  auto fragment = rest.find('#');
+  if (fragment != std::string_view::npos) {
+    parts.fragment = rest.substr(fragment + 1);
+    rest = rest.substr(0, fragment);
+    if (!validComponent(parts.fragment, kQueryChar)) {
+      return false;
+    }
+  }
+  auto query = rest.find('?');
+  if (query != std::string_view::npos) {
+    parts.query = rest.substr(query + 1);
+    rest = rest.substr(0, query);
+    if (!validComponent(parts.query, kQueryChar)) {
+      return false;
+    }
+  }
+  parts.path = rest;
+  return validComponent(parts.path, kPathChar);
+}
+
+bool percentDecode(std::string_view in, std::string &out) {
+  out.clear();
+  out.reserve(in.size());
+  for (size_t i = 0; i < in.size(); ++i) {
+    if (in[i] != '%') {
+      out += in[i];
+      continue;
+    }
+    if (i + 2 >= in.size()) {
+      return false;
+    }
+    auto high = hexValue(in[i + 1]);
+    auto low = hexValue(in[i + 2]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    out += static_cast<char>(high * 16 + low);
+    i += 2;
+  }
+  return true;
+}
+
+} // namespace mltdl
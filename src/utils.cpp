@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "url.h"
 
 #include <algorithm>
 #include <cctype>
@@ -9,7 +10,6 @@
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 #include <random>
-#include <regex>
 #include <sstream>
 #include <vector>
 
@@ -75,33 +75,42 @@ std::string calculateSHA256(const std::string &filepath) {
   return shaStr.str();
 }
 
-bool isUrlValid(const std::string &url) {
-  /*
-   * This regular expression cannot cover all cases
-   * One solution is to introduce an open source library
-   * https://github.com/cpp-netlib/uri.git
-   * url = network::uri::parse(url_str);
-   * if the url_str is invalid , it will throw an exception
-   */
-  std::regex g_url_regex(
-      R"(^(http|https|ftp)://([a-z0-9.-]+)(:[0-9]+)?(/[\w-./?%&=]*)?$)");
-  if (std::regex_match(url, g_url_regex)) {
-    return true;
-  } else {
-    return false;
+static std::string toHex(const unsigned char *bytes, size_t size) {
+  std::ostringstream oss;
+  for (size_t i = 0; i < size; ++i) {
+    oss << std::hex << std::setw(2) << std::setfill('0')
+        << static_cast<int>(bytes[i]);
   }
+  return oss.str();
+}
+
+std::string calculateMd5(const char *data, size_t size) {
+  unsigned char result[MD5_DIGEST_LENGTH];
+  MD5(reinterpret_cast<const unsigned char *>(data), size, result);
+  return toHex(result, sizeof(result));
+}
+
+std::string calculateSHA256(const char *data, size_t size) {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char *>(data), size, hash);
+  return toHex(hash, sizeof(hash));
+}
+
+bool isUrlValid(const std::string &url) {
+  UrlParts parts;
+  return parseUrl(url, parts);
 }
 
 std::string getProtocol(const std::string &url) {
-  std::size_t protocol_end_pos = url.find("://");
-  if (protocol_end_pos != std::string::npos) {
-    auto protocol = url.substr(0, protocol_end_pos);
-    std::transform(protocol.begin(), protocol.end(), protocol.begin(),
-                   [](unsigned char c) { return std::tolower(c); });
-    return protocol;
-  } else {
+  UrlParts parts;
+  parseUrl(url, parts);
+  if (parts.scheme.empty()) {
     throw std::runtime_error("URL does not contain a protocol");
   }
+  std::string protocol(parts.scheme);
+  std::transform(protocol.begin(), protocol.end(), protocol.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return protocol;
 }
 
 std::string adjustFilepath(const std::string &filedir, const std::string &url) {
@@ -166,6 +175,19 @@ std::string getUrlName(const std::string &url) {
     return "";
   }
 
+  UrlParts parts;
+  if (parseUrl(url, parts)) {
+    // the last path segment, decoded, unless that leaves no usable name
+    auto segment = parts.path.substr(parts.path.find_last_of('/') + 1);
+    std::string filename;
+    if (segment.empty() || !percentDecode(segment, filename) ||
+        filename == "." || filename == ".." ||
+        filename.find_first_of(std::string("/\0", 2)) != std::string::npos) {
+      return randomStrign(15U);
+    }
+    return filename;
+  }
+
   // find the last '/' position
   auto last_slash_pos = url.find_last_of('/');
 
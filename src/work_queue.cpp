@@ -0,0 +1,89 @@
+#include "work_queue.h"
+
+#include <algorithm>
+
+namespace mltdl {
+
+void WorkQueue::push(Work work, const WorkOptions &options) {
+  auto &cls = classes_[static_cast<int>(options.priority)];
+  auto &flow = cls.flows[options.flow];
+  auto weight = std::max<uint32_t>(options.weight, 1);
+  auto cost = std::max<int64_t>(options.cost, 1);
+
+  // a flow that was idle starts at the current virtual time, so it can not
+  // claim the share it did not use while it was idle
+  double start_tag = std::max(cls.virtual_time, flow.last_finish);
+  flow.last_finish = start_tag + static_cast<double>(cost) / weight;
+
+  auto seq = seq_++;
+  if (flow.entries.empty()) {
+    cls.ready.insert({{start_tag, seq}, options.flow});
+  }
+  flow.entries.push_back(Entry{std::move(work), start_tag, seq});
+  ++cls.size;
+  ++size_;
+}
+
+int WorkQueue::pickClass() {
+  int top = -1;
+  for (int c = 0; c < kNumClasses; ++c) {
+    if (classes_[c].size > 0) {
+      top = c;
+      break;
+    }
+  }
+  // serve the lower class that has been waiting the longest once it reached
+  // the limit, the others keep counting
+  int chosen = top;
+  for (int c = kNumClasses - 1; c > top; --c) {
+    if (classes_[c].size > 0 && starvation_limit_ > 0 &&
+        classes_[c].passed_over >= starvation_limit_) {
+      chosen = c;
+      break;
+    }
+  }
+  for (int c = 0; c < kNumClasses; ++c) {
+    if (c == chosen) {
+      classes_[c].passed_over = 0;
+    } else if (c > chosen && classes_[c].size > 0) {
+      ++classes_[c].passed_over;
+    }
+  }
+  return chosen;
+}
+
+WorkQueue::Work WorkQueue::pop() {
+  auto &cls = classes_[pickClass()];
+
+  auto first = cls.ready.begin();
+  auto flow_it = cls.flows.find(first->second);
+  cls.ready.erase(first);
+
+  auto &flow = flow_it->second;
+  Entry entry = std::move(flow.entries.front());
+  flow.entries.pop_front();
+  cls.virtual_time = std::max(cls.virtual_time, entry.start_tag);
+
+  if (flow.entries.empty()) {
+    // forget idle flows, otherwise every finished job would stay in the map
+    cls.flows.erase(flow_it);
+  } else {
+    const auto &next = flow.entries.front();
+    cls.ready.insert({{next.start_tag, next.seq}, flow_it->first});
+  }
+  --cls.size;
+  --size_;
+  return std::move(entry.work);
+}
+
+void WorkQueue::clear() {
+  for (auto &cls : classes_) {
+    cls.flows.clear();
+    cls.ready.clear();
+    cls.size = 0;
+    cls.passed_over = 0;
+  }
+  size_ = 0;
+}
+
+} // namespace mltdl
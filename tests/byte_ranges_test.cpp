@@ -0,0 +1,129 @@
+#include "byte_ranges.h"
+#include <gtest/gtest.h>
+
+namespace mltdl {
+
+namespace {
+
+// a multipart/byteranges body for the given parts of content
+std::string multipartBody(const std::string &content,
+                          const std::vector<ByteRange> &parts,
+                          const std::string &boundary) {
+  std::string body = "preamble to be ignored\r\n";
+  for (const auto &part : parts) {
+    body += "--" + boundary + "\r\n";
+    body += "Content-Type: application/octet-stream\r\n";
+    body += "Content-Range: bytes " + std::to_string(part.start) + "-" +
+            std::to_string(part.end) + "/" + std::to_string(content.size()) +
+            "\r\n\r\n";
+    body += content.substr(part.start, part.length());
+    body += "\r\n";
+  }
+  body += "--" + boundary + "--\r\n";
+  return body;
+}
+
+} // namespace
+
+TEST(ByteRanges, normalize) {
+  auto ranges = normalizeRanges({{50, 59}, {0, 9}, {10, 19}, {55, 70}, {5, 3}});
+  ASSERT_EQ(ranges.size(), 2);
+  EXPECT_EQ(ranges[0], (ByteRange{0, 19}));
+  EXPECT_EQ(ranges[1], (ByteRange{50, 70}));
+  EXPECT_TRUE(normalizeRanges({}).empty());
+}
+
+TEST(ByteRanges, subtract) {
+  auto missing =
+      subtractRanges({{0, 99}, {200, 299}}, {{10, 19}, {50, 249}, {290, 400}});
+  ASSERT_EQ(missing.size(), 3);
+  EXPECT_EQ(missing[0], (ByteRange{0, 9}));
+  EXPECT_EQ(missing[1], (ByteRange{20, 49}));
+  EXPECT_EQ(missing[2], (ByteRange{250, 289}));
+
+  EXPECT_TRUE(subtractRanges({{0, 99}}, {{0, 99}}).empty());
+  EXPECT_EQ(subtractRanges({{0, 99}}, {}).size(), 1);
+}
+
+TEST(ByteRanges, contentRange) {
+  ByteRange range{0, -1};
+  EXPECT_TRUE(parseContentRange(" bytes 100-199/1000", range));
+  EXPECT_EQ(range, (ByteRange{100, 199}));
+  EXPECT_TRUE(parseContentRange("Bytes 0-0/*", range));
+  EXPECT_EQ(range, (ByteRange{0, 0}));
+
+  EXPECT_FALSE(parseContentRange("bytes */1000", range));
+  EXPECT_FALSE(parseContentRange("bytes 9-5/1000", range));
+  EXPECT_FALSE(parseContentRange("bytes 1x-5/1000", range));
+  EXPECT_FALSE(parseContentRange("items 0-5/10", range));
+}
+
+TEST(ByteRanges, boundary) {
+  EXPECT_EQ(byterangesBoundary("multipart/byteranges; boundary=AbC123"),
+            "AbC123");
+  EXPECT_EQ(byterangesBoundary("Multipart/Byteranges; boundary=\"x y\"; a=b"),
+            "x y");
+  EXPECT_EQ(byterangesBoundary("application/octet-stream"), "");
+  EXPECT_EQ(byterangesBoundary("multipart/byteranges"), "");
+}
+
+TEST(ByteRanges, parser) {
+  std::string content;
+  for (int i = 0; i < 1000; ++i) {
+    content += static_cast<char>('a' + i % 26);
+  }
+  std::vector<ByteRange> parts{{0, 9}, {100, 355}, {999, 999}};
+  auto body = multipartBody(content, parts, "3d6b6a416f9b5");
+
+  // whole, then one byte at a time to cross every boundary
+  for (size_t step : {body.size(), size_t{1}, size_t{7}}) {
+    std::string out(content.size(), '.');
+    ByterangesParser parser("3d6b6a416f9b5", [&](int64_t offset,
+                                                 const char *data,
+                                                 size_t size) {
+      out.replace(offset, size, data, size);
+      return true;
+    });
+    for (size_t pos = 0; pos < body.size(); pos += step) {
+      ASSERT_TRUE(
+          parser.feed(body.data() + pos, std::min(step, body.size() - pos)));
+    }
+    EXPECT_TRUE(parser.done());
+    ASSERT_EQ(parser.received().size(), parts.size());
+    for (size_t i = 0; i < parts.size(); ++i) {
+      EXPECT_EQ(parser.received()[i], parts[i]);
+      EXPECT_EQ(out.substr(parts[i].start, parts[i].length()),
+                content.substr(parts[i].start, parts[i].length()));
+    }
+    EXPECT_EQ(out[10], '.');
+  }
+}
+
+TEST(ByteRanges, malformed) {
+  auto writer = [](int64_t, const char *, size_t) { return true; };
+
+  // a part without Content-Range
+  std::string body = "--b\r\nContent-Type: text/plain\r\n\r\nxx";
+  ByterangesParser no_range("b", writer);
+  EXPECT_FALSE(no_range.feed(body.data(), body.size()));
+
+  // garbage where the next delimiter should be
+  body = "--b\r\nContent-Range: bytes 0-1/2\r\n\r\nxxjunk\r\n";
+  ByterangesParser junk("b", writer);
+  EXPECT_FALSE(junk.feed(body.data(), body.size()));
+  EXPECT_EQ(junk.received().size(), 1);
+
+  // an endless header line
+  ByterangesParser endless("b", writer);
+  std::string line(64 * 1024, 'h');
+  EXPECT_FALSE(endless.feed(line.data(), line.size()));
+
+  // the writer refusing data stops the parser
+  ByterangesParser refused(
+      "b", [](int64_t, const char *, size_t) { return false; });
+  body = "--b\r\nContent-Range: bytes 0-1/2\r\n\r\nxx\r\n--b--\r\n";
+  EXPECT_FALSE(refused.feed(body.data(), body.size()));
+  EXPECT_FALSE(refused.done());
+}
+
+} // namespace mltdl
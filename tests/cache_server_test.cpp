@@ -0,0 +1,198 @@
+#include "cache_server.h"
+#include "client_factory.h"
+#include "sim_client.h"
+#include "utils.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <filesystem>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace mltdl {
+
+namespace {
+
+// runs the server on a thread of its own while it is in scope
+class RunningServer {
+public:
+  RunningServer(const std::string &dir, const CacheServerOptions &options)
+      : server_(dir, options) {
+    EXPECT_TRUE(server_.listen());
+    thread_ = std::thread([this] { server_.run(); });
+  }
+  ~RunningServer() {
+    server_.stop();
+    thread_.join();
+  }
+
+  CacheServer &server() { return server_; }
+
+  std::string url(const std::string &origin) {
+    auto escaped = curl_easy_escape(nullptr, origin.c_str(), origin.size());
+    std::string url = "http://127.0.0.1:" + std::to_string(server_.port()) +
+                      "/?url=" + escaped;
+    curl_free(escaped);
+    return url;
+  }
+
+  // the whole reply to a raw request
+  std::string request(const std::string &text) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(server_.port());
+    std::string reply;
+    if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+        ::send(fd, text.data(), text.size(), 0) ==
+            static_cast<ssize_t>(text.size())) {
+      char chunk[4096];
+      ssize_t n;
+      while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) {
+        reply.append(chunk, n);
+      }
+    }
+    ::close(fd);
+    return reply;
+  }
+
+private:
+  CacheServer server_;
+  std::thread thread_;
+};
+
+std::vector<char> expected(uint64_t seed, int64_t start, int64_t end) {
+  std::vector<char> data(end - start + 1);
+  SimClient::fill(seed, start, data.data(), data.size());
+  return data;
+}
+
+Response fetch(const std::string &url, int64_t start, int64_t end) {
+  CurlPool curls(1);
+  CurlGuard guard(curls);
+  RetryStrategy rs{1, 0, 1, 0};
+  return get_clients("http")->get(url, rs, guard.handle(), start, end);
+}
+
+} // namespace
+
+TEST(CacheServer, servesWhileDownloading) {
+  auto dir = testDir("serve");
+  CacheServerOptions options;
+  options.num_thread = 4;
+  RunningServer running(dir, options);
+  const int64_t size = 3 << 20;
+  auto origin = "sim://host/big?seed=6&time=real&bandwidth=4000000&size=" +
+                std::to_string(size);
+  auto url = running.url(origin);
+  SimClient::stats().reset();
+
+  // consumers at once, from the start and from the middle
+  std::vector<Response> responses(4);
+  std::vector<std::pair<int64_t, int64_t>> ranges = {
+      {0, size - 1}, {0, size - 1}, {size / 2, size / 2 + 99999},
+      {size - 1000, size - 1}};
+  std::vector<std::thread> consumers;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    consumers.emplace_back([&, i] {
+      responses[i] = fetch(url, ranges[i].first, ranges[i].second);
+    });
+  }
+  for (auto &consumer : consumers) {
+    consumer.join();
+  }
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    EXPECT_EQ(responses[i].status, CURLE_OK) << i;
+    EXPECT_EQ(responses[i].status_code, 206) << i;
+    EXPECT_TRUE(responses[i].body ==
+                expected(6, ranges[i].first, ranges[i].second))
+        << i;
+  }
+  // the origin sent every byte once, not once per consumer, the segments
+  // left out what the consumers ahead of them fetched
+  EXPECT_EQ(SimClient::stats().bytes.load(), size);
+
+  // once complete it is a file of the cache, served without the origin
+  auto path = running.server().cachePath(origin);
+  ASSERT_TRUE(eventually([&] { return std::filesystem::exists(path); }));
+  EXPECT_FALSE(std::filesystem::exists(path + ".part"));
+  auto bytes = SimClient::stats().bytes.load();
+  auto again = fetch(url, 100, 199);
+  EXPECT_TRUE(again.body == expected(6, 100, 199));
+  EXPECT_EQ(SimClient::stats().bytes.load(), bytes);
+}
+
+TEST(CacheServer, demandFetch) {
+  auto dir = testDir("demand");
+  CacheServerOptions options;
+  options.num_thread = 2;
+  options.segment_size = 1 << 20;
+  options.demand_after = std::chrono::milliseconds(10);
+  RunningServer running(dir, options);
+  // each segment takes a second, the end of the file comes last
+  const int64_t size = 8 << 20;
+  auto origin = "sim://host/slow?seed=1&time=real&bandwidth=1000000&size=" +
+                std::to_string(size);
+  auto url = running.url(origin);
+  SimClient::stats().reset();
+  auto began = std::chrono::steady_clock::now();
+  auto tail = fetch(url, size - 65536, size - 1);
+  auto took = std::chrono::steady_clock::now() - began;
+  EXPECT_TRUE(tail.body == expected(1, size - 65536, size - 1));
+  EXPECT_GE(running.server().demandFetches(), 1U);
+  EXPECT_LT(took, std::chrono::seconds(2));
+
+  // the segment of the tail started after the fetch and left it out
+  auto path = running.server().cachePath(origin);
+  ASSERT_TRUE(eventually([&] { return std::filesystem::exists(path); },
+                         std::chrono::seconds(10)));
+  EXPECT_EQ(SimClient::stats().bytes.load(), size);
+  std::vector<char> data(size);
+  SimClient::fill(1, 0, data.data(), data.size());
+  EXPECT_EQ(calculateMd5(path), calculateMd5(data.data(), data.size()));
+}
+
+TEST(CacheServer, requests) {
+  auto dir = testDir("requests");
+  RunningServer running(dir, CacheServerOptions());
+  auto origin = "sim://host/small?seed=3&size=1000";
+  auto target = running.url(origin);
+  target = target.substr(target.find("/?"));
+
+  auto head =
+      running.request("HEAD " + target + " HTTP/1.1\r\nHost: x\r\n\r\n");
+  EXPECT_EQ(head.rfind("HTTP/1.1 200 OK\r\n", 0), 0U) << head;
+  EXPECT_NE(head.find("Content-Length: 1000\r\n"), std::string::npos);
+  EXPECT_NE(head.find("Accept-Ranges: bytes\r\n"), std::string::npos);
+
+  auto suffix = running.request("GET " + target +
+                                " HTTP/1.1\r\nRange: bytes=-10\r\n\r\n");
+  EXPECT_EQ(suffix.rfind("HTTP/1.1 206", 0), 0U) << suffix;
+  EXPECT_NE(suffix.find("Content-Range: bytes 990-999/1000\r\n"),
+            std::string::npos);
+  auto body = suffix.substr(suffix.find("\r\n\r\n") + 4);
+  EXPECT_TRUE(std::vector<char>(body.begin(), body.end()) ==
+              expected(3, 990, 999));
+
+  auto past = running.request("GET " + target +
+                              " HTTP/1.1\r\nRange: bytes=1000-\r\n\r\n");
+  EXPECT_EQ(past.rfind("HTTP/1.1 416", 0), 0U) << past;
+  EXPECT_EQ(running.request("GET /nothing HTTP/1.1\r\n\r\n").rfind(
+                "HTTP/1.1 400", 0),
+            0U);
+  EXPECT_EQ(running.request("POST " + target + " HTTP/1.1\r\n\r\n")
+                .rfind("HTTP/1.1 405", 0),
+            0U);
+  // an origin that can't be reached
+  auto gone = running.url("http://127.0.0.1:1/gone");
+  gone = gone.substr(gone.find("/?"));
+  EXPECT_EQ(running.request("GET " + gone + " HTTP/1.1\r\n\r\n")
+                .rfind("HTTP/1.1 502", 0),
+            0U);
+}
+
+} // namespace mltdl
@@ -0,0 +1,216 @@
+#include "client.h"
+#include "async_writer.h"
+#include "sim_client.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+namespace mltdl {
+
+namespace {
+
+std::vector<char> readAll(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::vector<char>((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+}
+
+// the reply with its body cut off after n bytes and the connection closed
+std::string cutOff(std::string reply, size_t n) {
+  const std::string close = "Connection: close\r\n";
+  auto body = reply.find("\r\n\r\n");
+  reply.insert(body + 2, close);
+  return reply.substr(0, body + 4 + close.size() + n);
+}
+
+// the ranges of a "bytes=a-b,c-d" header
+std::vector<ByteRange> rangesOf(const TestRequest &request) {
+  std::vector<ByteRange> ranges;
+  auto spec = request.header("Range").substr(6);
+  size_t pos = 0;
+  while (pos < spec.size()) {
+    auto comma = std::min(spec.find(',', pos), spec.size());
+    auto item = spec.substr(pos, comma - pos);
+    auto dash = item.find('-');
+    ranges.push_back(ByteRange{std::stoll(item.substr(0, dash)),
+                               std::stoll(item.substr(dash + 1))});
+    pos = comma + 1;
+  }
+  return ranges;
+}
+
+std::string reply206(const std::string &headers, const std::string &body) {
+  return "HTTP/1.1 206 Partial Content\r\n" + headers +
+         "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" +
+         body;
+}
+
+// what getRanges wrote, by offset
+struct Collected {
+  std::map<int64_t, std::string> writes;
+
+  RangeWriter writer() {
+    return [this](int64_t offset, const char *data, size_t size) {
+      writes[offset] += std::string(data, size);
+      return true;
+    };
+  }
+
+  // true if exactly the ranges of data were written
+  bool holds(const std::vector<char> &data,
+             const std::vector<ByteRange> &ranges) const {
+    std::map<int64_t, std::string> expected;
+    for (const auto &range : ranges) {
+      expected[range.start] =
+          std::string(data.begin() + range.start, data.begin() + range.end + 1);
+    }
+    // writes that continue each other are one range
+    std::map<int64_t, std::string> merged;
+    for (const auto &write : writes) {
+      if (!merged.empty()) {
+        auto &last = *merged.rbegin();
+        if (last.first + static_cast<int64_t>(last.second.size()) ==
+            write.first) {
+          last.second += write.second;
+          continue;
+        }
+      }
+      merged.insert(write);
+    }
+    return merged == expected;
+  }
+};
+
+} // namespace
+
+TEST(HttpClient, resumesAfterAShortBody) {
+  std::vector<char> data(100000);
+  SimClient::fill(2, 0, data.data(), data.size());
+  const std::string prefix = "kept before the range";
+  for (bool write_behind : {false, true}) {
+    std::atomic<int> gets{0};
+    LoopbackServer server([&](const TestRequest &request) {
+      auto reply = serveBytes(data, request);
+      // the first two answers stop partway
+      return ++gets <= 2 ? cutOff(reply, 30000) : reply;
+    });
+    auto path = testDir("resume") + "/file";
+    auto file = std::fopen(path.c_str(), "wb+");
+    ASSERT_NE(file, nullptr);
+    std::fwrite(prefix.data(), 1, prefix.size(), file);
+
+    MemoryBudget budget;
+    AsyncWriter writer(budget);
+    TransferControl control;
+    control.writer = write_behind ? &writer : nullptr;
+    HttpClient client;
+    CURL *curl = curl_easy_init();
+    auto response = client.get(server.url(), RetryStrategy{4, 0, 1, 0}, curl,
+                               1000, data.size() - 1, file, &control);
+    curl_easy_cleanup(curl);
+    std::fclose(file);
+    EXPECT_EQ(response.status, CURLE_OK);
+    EXPECT_EQ(response.status_code, 206);
+
+    // every attempt asks for the first byte still missing
+    auto requests = server.requests();
+    ASSERT_EQ(requests.size(), 3U);
+    EXPECT_EQ(requests[0].header("Range"), "bytes=1000-99999");
+    EXPECT_EQ(requests[1].header("Range"), "bytes=31000-99999");
+    EXPECT_EQ(requests[2].header("Range"), "bytes=61000-99999");
+    // the bytes before the range are kept, none is written twice
+    std::vector<char> expected(prefix.begin(), prefix.end());
+    expected.insert(expected.end(), data.begin() + 1000, data.end());
+    EXPECT_TRUE(readAll(path) == expected) << "write-behind " << write_behind;
+  }
+}
+
+TEST(HttpClient, getRanges) {
+  std::vector<char> data(200000);
+  SimClient::fill(5, 0, data.data(), data.size());
+  const std::vector<ByteRange> ranges = {
+      {10, 99}, {5000, 5999}, {150000, 150099}};
+  auto total = std::to_string(data.size());
+  auto bytes = [&](const ByteRange &range) {
+    return std::string(data.begin() + range.start,
+                       data.begin() + range.end + 1);
+  };
+  auto contentRange = [&](const ByteRange &range) {
+    return "Content-Range: bytes " + std::to_string(range.start) + "-" +
+           std::to_string(range.end) + "/" + total + "\r\n";
+  };
+  // a multipart/byteranges answer
+  auto multipart = [&](const TestRequest &request) {
+    std::string body;
+    for (const auto &range : rangesOf(request)) {
+      body += "--XYZ\r\nContent-Type: application/octet-stream\r\n" +
+              contentRange(range) + "\r\n" + bytes(range) + "\r\n";
+    }
+    body += "--XYZ--\r\n";
+    return reply206("Content-Type: multipart/byteranges; boundary=XYZ\r\n",
+                    body);
+  };
+  // one part from the first to the last byte asked for
+  auto merged = [&](const TestRequest &request) {
+    auto asked = rangesOf(request);
+    ByteRange range{asked.front().start, asked.back().end};
+    return reply206(contentRange(range), bytes(range));
+  };
+  // the Range header is ignored
+  auto whole = [&](const TestRequest &request) {
+    TestRequest plain = request;
+    plain.head = request.head.substr(0, request.head.find("\r\n") + 2);
+    return serveBytes(data, plain);
+  };
+
+  for (const auto &handler :
+       std::vector<LoopbackServer::Handler>{multipart, merged, whole}) {
+    LoopbackServer server(handler);
+    Collected collected;
+    std::vector<ByteRange> missing;
+    HttpClient client;
+    CURL *curl = curl_easy_init();
+    auto response = client.getRanges(server.url(), RetryStrategy{1, 0, 1, 0},
+                                     curl, ranges, collected.writer(),
+                                     &missing);
+    curl_easy_cleanup(curl);
+    EXPECT_EQ(response.status, CURLE_OK);
+    EXPECT_TRUE(missing.empty());
+    EXPECT_TRUE(collected.holds(data, ranges));
+    // all of them with the one request
+    EXPECT_EQ(server.requests().size(), 1U);
+  }
+}
+
+TEST(HttpClient, getRangesStopsAfterTheLastWantedByte) {
+  // a large resource from a server that ignores Range
+  std::vector<char> data(16 << 20);
+  SimClient::fill(6, 0, data.data(), data.size());
+  LoopbackServer server([&](const TestRequest &request) {
+    TestRequest plain = request;
+    plain.head = request.head.substr(0, request.head.find("\r\n") + 2);
+    return serveBytes(data, plain);
+  });
+  const std::vector<ByteRange> ranges = {{10, 99}, {40000, 49999}};
+  Collected collected;
+  HttpClient client;
+  CURL *curl = curl_easy_init();
+  auto response = client.getRanges(server.url(), RetryStrategy{1, 0, 1, 0},
+                                   curl, ranges, collected.writer());
+  curl_off_t received = 0;
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+  curl_easy_cleanup(curl);
+  EXPECT_EQ(response.status, CURLE_OK);
+  EXPECT_EQ(response.status_code, 200);
+  EXPECT_TRUE(collected.holds(data, ranges));
+  EXPECT_EQ(server.requests().size(), 1U);
+  // not the rest of the resource
+  EXPECT_LT(received, 1 << 20);
+}
+
+} // namespace mltdl
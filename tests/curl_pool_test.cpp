@@ -0,0 +1,89 @@
+#include "curl_pool.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+namespace mltdl {
+
+TEST(CurlPool, lazy) {
+  CurlPool pool(4);
+  EXPECT_EQ(pool.created(), 0U);
+  {
+    CurlGuard guard(pool, 2);
+    EXPECT_NE(guard.handle(), nullptr);
+  }
+  EXPECT_EQ(pool.created(), 1U);
+}
+
+TEST(CurlPool, worker) {
+  CurlPool pool(2);
+  CURL *first = nullptr;
+  {
+    CurlGuard guard(pool, 1);
+    first = guard.handle();
+    // a second handle for the same worker while the first is out
+    CurlGuard nested(pool, 1);
+    EXPECT_NE(nested.handle(), first);
+  }
+  {
+    // the worker gets its own handle back, with its connections
+    CurlGuard guard(pool, 1);
+    EXPECT_EQ(guard.handle(), first);
+  }
+  {
+    CurlGuard guard(pool, 0);
+    EXPECT_NE(guard.handle(), first);
+  }
+  // callers that are not workers share the rest
+  CurlGuard shared(pool);
+  CurlGuard outside(pool, 7);
+  EXPECT_NE(shared.handle(), outside.handle());
+  EXPECT_EQ(pool.created(), 4U);
+}
+
+TEST(CurlPool, hostKey) {
+  EXPECT_EQ(CurlPool::hostKey("https://Example.com/a/b"),
+            "https://example.com:443");
+  EXPECT_EQ(CurlPool::hostKey("HTTP://example.com:8080"),
+            "http://example.com:8080");
+  EXPECT_EQ(CurlPool::hostKey("http://[::1]/x"), "http://[::1]:80");
+  EXPECT_EQ(CurlPool::hostKey("ftp://example.com/x"), "");
+  EXPECT_EQ(CurlPool::hostKey("not a url"), "");
+}
+
+TEST(CurlPool, prewarmUnreachable) {
+  CurlPool pool(2);
+  // nothing is warmed while it is off
+  pool.prewarm("http://127.0.0.1:1/file", 4);
+  EXPECT_EQ(pool.created(), 0U);
+
+  PrewarmOptions options;
+  options.enabled = true;
+  options.max_per_host = 2;
+  pool.setPrewarm(options);
+  pool.prewarm("http://127.0.0.1:1/file", 4);
+  // the refused connections are not kept, and the pool goes away cleanly
+  ASSERT_TRUE(eventually(
+      [&] { return pool.created() == 2 && pool.warmingUp() == 0; }));
+  EXPECT_EQ(pool.created(), 2U);
+  EXPECT_EQ(pool.warm("http://127.0.0.1:1"), 0U);
+}
+
+TEST(CurlPool, prewarmFollowsRedirects) {
+  LoopbackServer origin("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+  LoopbackServer redirect("HTTP/1.1 302 Found\r\nLocation: " + origin.url() +
+                       "\r\nContent-Length: 0\r\n\r\n");
+  CurlPool pool(2);
+  PrewarmOptions options;
+  options.enabled = true;
+  pool.setPrewarm(options);
+  pool.prewarm(redirect.url(), 1);
+  // kept for the host the transfers will end up talking to
+  ASSERT_TRUE(eventually([&] { return pool.warmingUp() == 0; }));
+  EXPECT_EQ(pool.warm(CurlPool::hostKey(origin.url())), 1U);
+  EXPECT_EQ(pool.warm(CurlPool::hostKey(redirect.url())), 0U);
+}
+
+} // namespace mltdl
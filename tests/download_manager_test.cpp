@@ -0,0 +1,190 @@
+#include "download_manager.h"
+#include "sim_client.h"
+#include "utils.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <sys/stat.h>
+#include <thread>
+
+namespace mltdl {
+
+namespace {
+
+std::string expectedMd5(uint64_t seed, int64_t size) {
+  std::vector<char> data(size);
+  SimClient::fill(seed, 0, data.data(), data.size());
+  return calculateMd5(data.data(), data.size());
+}
+
+// true once nothing but the caller holds the handle, the job that held it
+// is gone then
+bool released(const std::shared_ptr<DownloadHandle> &handle) {
+  return eventually([&] { return handle.use_count() == 1; });
+}
+
+DownloadOptions coalesced() {
+  DownloadOptions options;
+  options.coalesce = true;
+  return options;
+}
+
+// about a second at this bandwidth, long enough for the others to attach
+const std::string kSlow =
+    "sim://host/file?seed=4&time=real&bandwidth=262144&size=262144";
+
+} // namespace
+
+TEST(DownloadManager, hedgedJobIsReleased) {
+  auto dir = testDir("hedge");
+  DownloadManager dm(4, 4096);
+  DownloadOptions options;
+  options.hedge.enabled = true;
+  auto handle = dm.submit("sim://host/file?seed=1&size=65536", dir, options);
+  ASSERT_TRUE(handle->wait().ok());
+  EXPECT_EQ(calculateMd5(handle->filePath()), expectedMd5(1, 65536));
+  EXPECT_TRUE(released(handle));
+}
+
+TEST(DownloadManager, coalesceIsOptIn) {
+  auto dir = testDir("opt_in");
+  DownloadManager dm(4, 65536);
+  SimClient::stats().reset();
+  auto first = dm.submit(kSlow, dir);
+  auto second = dm.submit(kSlow, dir);
+  ASSERT_TRUE(first->wait().ok());
+  ASSERT_TRUE(second->wait().ok());
+  // two transfers of the whole file
+  EXPECT_EQ(SimClient::stats().bytes.load(), 2 * 262144);
+}
+
+TEST(DownloadManager, followersShareTheFile) {
+  auto dir = testDir("share");
+  auto other_dir = testDir("share_other");
+  DownloadManager dm(4, 65536);
+  SimClient::stats().reset();
+  auto leader = dm.submit(kSlow, dir, coalesced());
+  auto linked = dm.submit(kSlow, dir, coalesced());
+  auto other = dm.submit(kSlow, other_dir, coalesced());
+  ASSERT_TRUE(leader->wait().ok());
+  ASSERT_TRUE(linked->wait().ok());
+  ASSERT_TRUE(other->wait().ok());
+  EXPECT_EQ(SimClient::stats().bytes.load(), 262144);
+  // a name of its own, the same inode
+  EXPECT_NE(linked->filePath(), leader->filePath());
+  struct stat a, b;
+  ASSERT_EQ(::stat(leader->filePath().c_str(), &a), 0);
+  ASSERT_EQ(::stat(linked->filePath().c_str(), &b), 0);
+  EXPECT_EQ(a.st_ino, b.st_ino);
+  EXPECT_EQ(calculateMd5(other->filePath()), expectedMd5(4, 262144));
+}
+
+TEST(DownloadManager, followerGetsACopy) {
+  // a link can't cross file systems
+  auto dir = testDir("copy");
+  std::string shm = "/dev/shm/dm_test_copy";
+  struct stat a, b;
+  if (::stat("/dev/shm", &b) != 0 || ::stat(dir.c_str(), &a) != 0 ||
+      a.st_dev == b.st_dev) {
+    GTEST_SKIP() << "no second file system";
+  }
+  std::filesystem::remove_all(shm);
+  std::filesystem::create_directories(shm);
+  DownloadManager dm(4, 65536);
+  auto leader = dm.submit(kSlow, dir, coalesced());
+  auto copied = dm.submit(kSlow, shm, coalesced());
+  ASSERT_TRUE(leader->wait().ok());
+  ASSERT_TRUE(copied->wait().ok());
+  EXPECT_EQ(copied->filePath().rfind(shm, 0), 0U);
+  EXPECT_EQ(calculateMd5(copied->filePath()), expectedMd5(4, 262144));
+  std::filesystem::remove_all(shm);
+}
+
+TEST(DownloadManager, leaderFails) {
+  auto dir = testDir("fails");
+  DownloadManager dm(4, 65536);
+  auto url = "sim://host/gone?time=real&latency_ms=200&status=403";
+  SimClient::stats().reset();
+  EXPECT_EQ(dm.download(url, dir).code(), StatusCode::kHttpError);
+  auto alone = SimClient::stats().requests.load();
+  SimClient::stats().reset();
+  auto leader = dm.submit(url, dir, coalesced());
+  auto follower = dm.submit(url, dir, coalesced());
+  EXPECT_EQ(leader->wait().code(), StatusCode::kHttpError);
+  EXPECT_EQ(follower->wait().code(), StatusCode::kHttpError);
+  // nothing was asked for the follower
+  EXPECT_EQ(SimClient::stats().requests.load(), alone);
+}
+
+TEST(DownloadManager, followerTakesOver) {
+  auto dir = testDir("take_over");
+  DownloadManager dm(4, 65536);
+  auto leader = dm.submit(kSlow, dir, coalesced());
+  auto first = dm.submit(kSlow, dir, coalesced());
+  auto second = dm.submit(kSlow, dir, coalesced());
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  leader->cancel();
+  EXPECT_EQ(leader->wait().code(), StatusCode::kCancelled);
+  // the first follower restarts the transfer, the second rides along
+  ASSERT_TRUE(first->wait().ok());
+  ASSERT_TRUE(second->wait().ok());
+  EXPECT_EQ(calculateMd5(first->filePath()), expectedMd5(4, 262144));
+  struct stat a, b;
+  ASSERT_EQ(::stat(first->filePath().c_str(), &a), 0);
+  ASSERT_EQ(::stat(second->filePath().c_str(), &b), 0);
+  EXPECT_EQ(a.st_ino, b.st_ino);
+}
+
+TEST(DownloadManager, lookaheadWindow) {
+  auto dir = testDir("window");
+  auto queued_dir = testDir("window_queued");
+  auto &stats = SimClient::stats();
+  // one worker, busy with a single segment for about two seconds
+  DownloadManager dm(1, 0, 2);
+  stats.reset();
+  auto busy = dm.submit(
+      "sim://host/file?seed=4&time=real&bandwidth=131072&size=262144", dir);
+  // probed and transferring
+  ASSERT_TRUE(eventually(
+      [&] { return stats.requests.load() == 2 && stats.bytes.load() > 0; }));
+  stats.reset();
+  std::vector<std::shared_ptr<DownloadHandle>> handles;
+  for (int i = 0; i < 8; ++i) {
+    handles.push_back(dm.submit("sim://host/f" + std::to_string(i) +
+                                    "?time=real&latency_ms=50&size=1000&seed=" +
+                                    std::to_string(i),
+                                queued_dir));
+  }
+  // the two next in line are probed, give a third the time of another probe
+  ASSERT_TRUE(eventually([&] { return stats.requests.load() >= 2; }));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  auto probed = stats.requests.load();
+  auto started = !std::filesystem::is_empty(queued_dir);
+  // only meaningful while the worker is still busy
+  ASSERT_FALSE(busy->done());
+  EXPECT_EQ(probed, 2U);
+  EXPECT_FALSE(started);
+
+  ASSERT_TRUE(busy->wait().ok());
+  for (size_t i = 0; i < handles.size(); ++i) {
+    ASSERT_TRUE(handles[i]->wait().ok());
+    EXPECT_EQ(calculateMd5(handles[i]->filePath()), expectedMd5(i, 1000));
+  }
+  // a probe and a segment each, none probed twice
+  EXPECT_EQ(stats.requests.load(), 16U);
+}
+
+TEST(DownloadManager, noRangesOneSegment) {
+  auto dir = testDir("no_ranges");
+  DownloadManager dm(4, 4096);
+  auto url = "sim://host/file?time=real&latency_ms=50&ranges=0&size=100000";
+  SimClient::stats().reset();
+  auto handle = dm.submit(url, dir);
+  ASSERT_TRUE(handle->wait().ok());
+  // the probe and one request for the whole file
+  EXPECT_EQ(SimClient::stats().requests.load(), 2);
+  EXPECT_EQ(calculateMd5(handle->filePath()), expectedMd5(1, 100000));
+}
+
+} // namespace mltdl
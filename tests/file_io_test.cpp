@@ -0,0 +1,74 @@
+#include "file_io.h"
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mltdl {
+
+TEST(FileIO, whole) {
+  const std::string path = "/tmp/mltdl_file_io_whole";
+  FileIO io;
+  std::vector<char> data{'a', 'b', 'c', 'd'};
+  ASSERT_TRUE(io.write(path, data));
+  EXPECT_EQ(io.read(path), data);
+  // a shorter write replaces the content
+  ASSERT_TRUE(io.write(path, std::vector<char>{'x'}));
+  EXPECT_EQ(io.read(path), std::vector<char>{'x'});
+  EXPECT_TRUE(io.read("/tmp/mltdl_file_io_missing").empty());
+  io.close(path);
+  std::remove(path.c_str());
+}
+
+TEST(FileIO, regions) {
+  const std::string path = "/tmp/mltdl_file_io_regions";
+  constexpr int kThreads = 8;
+  constexpr int kRegion = 64 * 1024;
+  FileIO io;
+  ASSERT_TRUE(io.preallocate(path, kThreads * kRegion));
+  EXPECT_EQ(io.size(path), kThreads * kRegion);
+  // every thread fills its own region, in small writes
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&io, &path, t] {
+      std::vector<char> block(1024, static_cast<char>('a' + t));
+      for (int offset = 0; offset < kRegion; offset += block.size()) {
+        io.pwrite(path, t * kRegion + offset, block.data(), block.size());
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto content = io.read(path);
+  ASSERT_EQ(content.size(), size_t(kThreads * kRegion));
+  for (int t = 0; t < kThreads; ++t) {
+    EXPECT_EQ(content[t * kRegion], 'a' + t);
+    EXPECT_EQ(content[(t + 1) * kRegion - 1], 'a' + t);
+  }
+  char tail[16];
+  EXPECT_EQ(io.pread(path, kThreads * kRegion - 4, tail, sizeof(tail)), 4);
+  io.close(path);
+  std::remove(path.c_str());
+}
+
+TEST(FileIO, cache) {
+  FileIO io(2);
+  std::vector<std::string> paths;
+  for (int i = 0; i < 4; ++i) {
+    paths.push_back("/tmp/mltdl_file_io_cache" + std::to_string(i));
+    ASSERT_TRUE(io.write(paths.back(), std::vector<char>{'0'}));
+  }
+  EXPECT_EQ(io.openCount(), 2U);
+  // the evicted files are opened again on demand
+  EXPECT_EQ(io.read(paths[0]), std::vector<char>{'0'});
+  for (const auto &path : paths) {
+    io.close(path);
+    std::remove(path.c_str());
+  }
+  EXPECT_EQ(io.openCount(), 0U);
+}
+
+} // namespace mltdl
@@ -0,0 +1,145 @@
+#include "logger.h"
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+namespace mltdl {
+
+static std::string readFile(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+static size_t countLines(const std::string &text, const std::string &part) {
+  size_t count = 0;
+  std::istringstream in(text);
+  for (std::string line; std::getline(in, line);) {
+    if (line.find(part) != std::string::npos) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+TEST(Logger, format) {
+  LogRecord record;
+  record.level = LogLevel::kWarn;
+  record.ts_us = 1000000LL * 86400 + 42;
+  record.event = "retry";
+  record.tid = 3;
+  record.job = 7;
+  record.segment = 2;
+  record.host = "example.com";
+  record.bytes = 100;
+  record.code = 503;
+  record.message = "said \"no\"\nagain";
+  EXPECT_EQ(Logger::format(record),
+            "ts=1970-01-02T00:00:00.000042Z level=warn event=retry job=7 "
+            "segment=2 host=example.com bytes=100 code=503 tid=3 "
+            "msg=\"said \\\"no\\\"\\nagain\"");
+
+  // fields that are not set are left out
+  LogRecord bare;
+  bare.event = "start";
+  bare.tid = 1;
+  EXPECT_EQ(Logger::format(bare),
+            "ts=1970-01-01T00:00:00.000000Z level=info event=start tid=1");
+}
+
+TEST(Logger, levels) {
+  const std::string path = "/tmp/mltdl_logger_levels.log";
+  std::remove(path.c_str());
+  auto &logger = Logger::global();
+  ASSERT_TRUE(logger.setOutput(path));
+  logger.setLevel(LogLevel::kWarn);
+  int evaluated = 0;
+  auto argument = [&] {
+    ++evaluated;
+    return std::string("expensive");
+  };
+  MLTDL_LOG(kDebug, "skipped").message(argument());
+  MLTDL_LOG(kInfo, "skipped").message(argument());
+  MLTDL_LOG(kWarn, "kept").message(argument());
+  MLTDL_LOG(kError, "kept").code(5);
+  // the arguments of a dropped record are never evaluated
+  EXPECT_EQ(evaluated, 1);
+  logger.setLevel(LogLevel::kOff);
+  MLTDL_LOG(kError, "skipped").message(argument());
+  EXPECT_EQ(evaluated, 1);
+  logger.flush();
+
+  auto log = readFile(path);
+  EXPECT_EQ(countLines(log, "event=kept"), 2U);
+  EXPECT_EQ(countLines(log, "event=skipped"), 0U);
+  EXPECT_EQ(countLines(log, "level=warn event=kept"), 1U);
+  logger.setLevel(LogLevel::kInfo);
+  ASSERT_TRUE(logger.setOutput(""));
+}
+
+TEST(Logger, threads) {
+  const std::string path = "/tmp/mltdl_logger_threads.log";
+  std::remove(path.c_str());
+  auto &logger = Logger::global();
+  ASSERT_TRUE(logger.setOutput(path));
+  auto dropped = logger.dropped();
+  const int threads = 8;
+  const int records = 5000;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([t] {
+      for (int i = 0; i < records; ++i) {
+        MLTDL_LOG(kInfo, "record").job(t + 1).segment(i);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  logger.flush();
+  ASSERT_TRUE(logger.setOutput(""));
+
+  // every record is written or counted as dropped, none is torn
+  auto log = readFile(path);
+  auto written = countLines(log, "event=record");
+  EXPECT_EQ(written + (logger.dropped() - dropped),
+            static_cast<uint64_t>(threads * records));
+  EXPECT_EQ(countLines(log, ""), written);
+
+  // a thread's records keep their order
+  int64_t last = -1;
+  std::istringstream in(log);
+  for (std::string line; std::getline(in, line);) {
+    if (line.find(" job=1 ") == std::string::npos) {
+      continue;
+    }
+    auto pos = line.find("segment=");
+    ASSERT_NE(pos, std::string::npos);
+    auto segment = std::stoll(line.substr(pos + 8));
+    EXPECT_GT(segment, last);
+    last = segment;
+  }
+}
+
+TEST(Logger, exitedThreads) {
+  const std::string path = "/tmp/mltdl_logger_exited.log";
+  std::remove(path.c_str());
+  auto &logger = Logger::global();
+  ASSERT_TRUE(logger.setOutput(path));
+  logger.flush();
+  auto rings = logger.rings();
+  // short lived threads, like those of a pool that is resized
+  for (int t = 0; t < 200; ++t) {
+    std::thread([t] { MLTDL_LOG(kInfo, "exited").job(t + 1); }).join();
+  }
+  logger.flush();
+  ASSERT_TRUE(logger.setOutput(""));
+  // their rings are gone, their records were written first
+  EXPECT_LE(logger.rings(), rings);
+  EXPECT_EQ(countLines(readFile(path), "event=exited"), 200U);
+}
+
+} // namespace mltdl
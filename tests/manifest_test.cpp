@@ -0,0 +1,102 @@
+#include "manifest.h"
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace mltdl {
+
+TEST(Manifest, reader) {
+  std::istringstream in("# comment\n"
+                        "\n"
+                        "http://example.com/a.bin\n"
+                        "http://example.com/b.bin\tdata/b.bin\tmd5:abc\r\n"
+                        "  http://example.com/c.bin - sha256:def\n");
+  ManifestReader reader(in);
+  ManifestEntry entry;
+  ASSERT_TRUE(reader.next(entry));
+  EXPECT_EQ(entry.url, "http://example.com/a.bin");
+  EXPECT_EQ(entry.dest, "");
+  EXPECT_EQ(entry.checksum, "");
+  ASSERT_TRUE(reader.next(entry));
+  EXPECT_EQ(entry.dest, "data/b.bin");
+  EXPECT_EQ(entry.checksum, "md5:abc");
+  ASSERT_TRUE(reader.next(entry));
+  EXPECT_EQ(entry.url, "http://example.com/c.bin");
+  EXPECT_EQ(entry.dest, "");
+  EXPECT_EQ(entry.checksum, "sha256:def");
+  EXPECT_EQ(reader.lineNumber(), 5U);
+  EXPECT_FALSE(reader.next(entry));
+}
+
+TEST(Manifest, key) {
+  ManifestEntry a{"http://example.com/a", "x", "md5:1"};
+  ManifestEntry b{"http://example.com/a", "x", "md5:2"};
+  ManifestEntry c{"http://example.com/ax", "", ""};
+  // the checksum does not make an entry distinct
+  EXPECT_EQ(a.key(), b.key());
+  EXPECT_NE(a.key(), c.key());
+}
+
+TEST(Manifest, results) {
+  const std::string path = "/tmp/mltdl_manifest_test.results";
+  std::remove(path.c_str());
+  ManifestEntry ok{"http://example.com/ok", "", ""};
+  ManifestEntry failed{"http://example.com/failed", "", ""};
+  {
+    ResultsLog log(path);
+    ASSERT_TRUE(log.isOpen());
+    log.record(ok, Status::OK());
+    log.record(failed, Status(StatusCode::kHttpError, "404"));
+  }
+  // a torn line from an interrupted run
+  std::ofstream(path, std::ios::app) << "0123";
+  ResultsLog log(path);
+  EXPECT_TRUE(log.completed(ok.key()));
+  EXPECT_FALSE(log.completed(failed.key()));
+  EXPECT_EQ(log.completedCount(), 1U);
+  std::remove(path.c_str());
+}
+
+TEST(Manifest, checksum) {
+  const std::string path = "/tmp/mltdl_manifest_test.txt";
+  std::ofstream(path) << "hello";
+  EXPECT_TRUE(verifyChecksum(path, "").ok());
+  EXPECT_TRUE(verifyChecksum(path, "5d41402abc4b2a76b9719d911017c592").ok());
+  EXPECT_TRUE(verifyChecksum(path, "MD5:5D41402ABC4B2A76B9719D911017C592").ok());
+  EXPECT_TRUE(verifyChecksum(path, "sha256:2cf24dba5fb0a30e26e83b2ac5b9e29e1b"
+                                   "161e5c1fa7425e73043362938b9824")
+                  .ok());
+  EXPECT_EQ(verifyChecksum(path, "md5:00").code(), StatusCode::kCorrupted);
+  EXPECT_EQ(verifyChecksum(path, "crc:00").code(),
+            StatusCode::kInvalidArgument);
+  std::remove(path.c_str());
+}
+
+TEST(Manifest, runner) {
+  const std::string path = "/tmp/mltdl_manifest_runner.results";
+  std::remove(path.c_str());
+  ManifestEntry done{"http://127.0.0.1:1/done", "", ""};
+  {
+    ResultsLog log(path);
+    log.record(done, Status::OK());
+  }
+  ResultsLog log(path);
+  // nothing listens on port 1, every submitted entry fails fast
+  std::istringstream in("http://127.0.0.1:1/done\n"
+                        "http://127.0.0.1:1/a\n"
+                        "http://127.0.0.1:1/a\n"
+                        "http://127.0.0.1:1/b\n"
+                        "http://127.0.0.1:1/c\n");
+  DownloadManager dm(2);
+  ManifestRunner runner(dm, "/tmp", 1, &log);
+  auto summary = runner.run(in);
+  EXPECT_EQ(summary.skipped, 1U);
+  EXPECT_EQ(summary.duplicates, 1U);
+  EXPECT_EQ(summary.succeeded + summary.failed, 3U);
+  EXPECT_EQ(summary.failed, 3U);
+  std::remove(path.c_str());
+}
+
+} // namespace mltdl
@@ -0,0 +1,111 @@
+#include "memory_budget.h"
+#include "async_writer.h"
+#include "download_manager.h"
+#include "sim_client.h"
+#include "test_util.h"
+#include "utils.h"
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+namespace mltdl {
+
+TEST(MemoryBudget, tryAcquire) {
+  MemoryBudget budget(100);
+  EXPECT_TRUE(budget.tryAcquire(60));
+  EXPECT_FALSE(budget.tryAcquire(50));
+  EXPECT_FALSE(budget.exhausted());
+  EXPECT_TRUE(budget.tryAcquire(40));
+  EXPECT_TRUE(budget.exhausted());
+  EXPECT_FALSE(budget.tryAcquire(1));
+  budget.release(60);
+  EXPECT_TRUE(budget.fits(50));
+  EXPECT_TRUE(budget.tryAcquire(50));
+  EXPECT_EQ(budget.used(), 90);
+  budget.release(90);
+
+  // more than the whole budget only while nothing else is held
+  EXPECT_TRUE(budget.tryAcquire(500));
+  EXPECT_FALSE(budget.tryAcquire(1));
+  budget.release(500);
+
+  MemoryBudget unlimited;
+  EXPECT_TRUE(unlimited.tryAcquire(1LL << 40));
+  EXPECT_FALSE(unlimited.exhausted());
+}
+
+TEST(AsyncWriter, drain) {
+  auto path = testDir("drain") + "/file";
+  int fd = ::open(path.c_str(), O_CREAT | O_RDWR, 0644);
+  ASSERT_GE(fd, 0);
+  MemoryBudget budget(1 << 20);
+  std::vector<char> data(300000);
+  SimClient::fill(3, 0, data.data(), data.size());
+  {
+    AsyncWriter writer(budget);
+    AsyncWriter::Stream stream(fd);
+    // out of order, each at its offset
+    const int64_t chunk = 70000;
+    for (int64_t offset = (data.size() - 1) / chunk * chunk; offset >= 0;
+         offset -= chunk) {
+      auto end = std::min<int64_t>(offset + chunk, data.size());
+      budget.acquire(end - offset);
+      writer.submit(stream, offset,
+                    std::vector<char>(data.begin() + offset,
+                                      data.begin() + end));
+    }
+    EXPECT_TRUE(stream.drain());
+    // the writer gave back what the buffers held
+    EXPECT_EQ(budget.used(), 0);
+  }
+  ::close(fd);
+  std::ifstream in(path, std::ios::binary);
+  std::vector<char> written((std::istreambuf_iterator<char>(in)),
+                            std::istreambuf_iterator<char>());
+  EXPECT_TRUE(written == data);
+
+  // a descriptor that can't be written to fails the stream
+  fd = ::open(path.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  {
+    AsyncWriter writer(budget);
+    AsyncWriter::Stream stream(fd);
+    budget.acquire(10);
+    writer.submit(stream, 0, std::vector<char>(10, 'x'));
+    EXPECT_FALSE(stream.drain());
+    EXPECT_EQ(budget.used(), 0);
+  }
+  ::close(fd);
+}
+
+TEST(MemoryBudget, writeBehindPausesAndResumes) {
+  const int64_t size = 1 << 20;
+  std::vector<char> data(size);
+  SimClient::fill(7, 0, data.data(), data.size());
+  LoopbackServer server(
+      [&](const TestRequest &request) { return serveBytes(data, request); });
+  auto dir = testDir("write_behind");
+  // a budget far below a segment, the transfers pause until the writer
+  // gives some back
+  auto &budget = MemoryBudget::global();
+  budget.setCapacity(64 * 1024);
+  Status status;
+  std::string file_path;
+  {
+    DownloadManager dm(4, 256 * 1024);
+    dm.setWriteBehind(true);
+    auto handle = dm.submit(server.url(), dir);
+    status = handle->wait();
+    file_path = handle->filePath();
+  }
+  budget.setCapacity(0);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  EXPECT_EQ(calculateMd5(file_path),
+            calculateMd5(data.data(), data.size()));
+  EXPECT_EQ(budget.used(), 0);
+}
+
+} // namespace mltdl
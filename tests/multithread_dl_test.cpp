@@ -1,8 +1,8 @@
 #include "client.h"
 #include "client_factory.h"
+#include "daemon.h"
 #include "download_manager.h"
 #include "file_guard.h"
-#include "file_handler.h"
 #include "utils.h"
 #include <curl/curl.h>
 
@@ -77,4 +77,63 @@ TEST(Download, download_manager) {
   // }
 }
 
-} // namespace mltdl
\ No newline at end of file
+TEST(Download, submit) {
+  DownloadManager dm(2);
+  std::atomic<bool> called{false};
+  auto handle = dm.submit("", "download", [&called](const DownloadHandle &h) {
+    EXPECT_TRUE(h.done());
+    called = true;
+  });
+  auto status = handle->wait();
+  EXPECT_TRUE(status.code() == StatusCode::kInvalidArgument);
+  EXPECT_FALSE(status.retryable());
+  EXPECT_TRUE(handle->done());
+  EXPECT_TRUE(called);
+
+  // registering after completion runs the callback at once
+  bool late = false;
+  handle->onComplete([&late](const DownloadHandle &) { late = true; });
+  EXPECT_TRUE(late);
+}
+
+TEST(Download, daemon) {
+  DownloadDaemon daemon("/tmp/mltdl_test.sock", "download", 2);
+  EXPECT_TRUE(daemon.listen());
+  EXPECT_TRUE(daemon.handleCommand("SUBMIT") == "ERR missing url");
+  EXPECT_TRUE(daemon.handleCommand("SUBMIT http://x urgent") ==
+              "ERR unknown priority urgent");
+  EXPECT_TRUE(daemon.handleCommand("SUBMIT http:// high") == "OK 1");
+  auto reply = daemon.handleCommand("WAIT 1");
+  EXPECT_TRUE(reply.rfind("OK 1 failed", 0) == 0);
+  EXPECT_EQ(daemonJobState(reply), "failed");
+  // only the status token counts, not what the path or message say
+  EXPECT_EQ(daemonJobState("OK 3 done 5/5 /tmp/ failed /x"), "done");
+  EXPECT_EQ(daemonJobState("OK 3"), "");
+  EXPECT_EQ(daemonJobState("ERR unknown job 3"), "");
+  EXPECT_TRUE(daemon.handleCommand("STATUS 2") == "ERR unknown job 2");
+  EXPECT_TRUE(daemon.handleCommand("SHUTDOWN") == "OK");
+}
+
+TEST(Download, retry) {
+  EXPECT_TRUE(isPermanentHttpError(404));
+  EXPECT_TRUE(isPermanentHttpError(416));
+  EXPECT_FALSE(isPermanentHttpError(408));
+  EXPECT_FALSE(isPermanentHttpError(429));
+  EXPECT_FALSE(isPermanentHttpError(503));
+
+  RetryStrategy backoff{5, 100, 2, 1000};
+  for (int i = 0; i < 100; ++i) {
+    auto first = retryDelay(backoff, 0);
+    EXPECT_TRUE(first >= 50 && first <= 100);
+    auto third = retryDelay(backoff, 2);
+    EXPECT_TRUE(third >= 200 && third <= 400);
+    // capped by max_delay_ms
+    auto tenth = retryDelay(backoff, 9);
+    EXPECT_TRUE(tenth >= 500 && tenth <= 1000);
+  }
+  // Retry-After wins over a shorter backoff but is capped as well
+  EXPECT_EQ(retryDelay(backoff, 0, 800), 800);
+  EXPECT_EQ(retryDelay(backoff, 0, 5000), 1000);
+}
+
+} // namespace mltdl
@@ -0,0 +1,215 @@
+#include "pack_store.h"
+#include "utils.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <thread>
+
+namespace mltdl {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string readString(const PackStore &store, const std::string &key) {
+  std::vector<char> data;
+  if (!store.read(key, data, true)) {
+    return "<missing>";
+  }
+  return std::string(data.begin(), data.end());
+}
+
+} // namespace
+
+TEST(PackStore, putReadRemove) {
+  PackStore store(testDir("basic"));
+  ASSERT_TRUE(store.isOpen());
+  std::string a = "first object";
+  ASSERT_TRUE(store.put("a", a.data(), a.size()));
+  ASSERT_TRUE(store.put("b", "second", 6));
+  EXPECT_EQ(store.size(), 2);
+  EXPECT_EQ(readString(store, "a"), a);
+  EXPECT_EQ(readString(store, "b"), "second");
+  EXPECT_FALSE(store.contains("c"));
+
+  PackStore::Location location;
+  ASSERT_TRUE(store.lookup("a", location));
+  EXPECT_EQ(location.length, static_cast<int64_t>(a.size()));
+  EXPECT_EQ(location.digest, calculateSHA256(a.data(), a.size()));
+
+  // replacing leaves the old bytes dead
+  EXPECT_EQ(store.deadBytes(), 0);
+  ASSERT_TRUE(store.put("a", "new", 3));
+  EXPECT_EQ(readString(store, "a"), "new");
+  EXPECT_EQ(store.size(), 2);
+  EXPECT_GT(store.deadBytes(), static_cast<int64_t>(a.size()));
+
+  ASSERT_TRUE(store.remove("b"));
+  EXPECT_FALSE(store.contains("b"));
+  EXPECT_FALSE(store.remove("b"));
+  EXPECT_EQ(store.size(), 1);
+
+  // an empty object is an object
+  ASSERT_TRUE(store.put("empty", "", 0));
+  EXPECT_EQ(readString(store, "empty"), "");
+}
+
+TEST(PackStore, hashCollision) {
+  // every key of a length collides
+  auto by_length = [](const std::string &key) -> uint64_t {
+    return key.size();
+  };
+  auto dir = testDir("collision");
+  {
+    PackStore store(dir, PackStore::kDefaultMaxPackSize, by_length);
+    ASSERT_TRUE(store.put("ab", "first", 5));
+    auto dead = store.deadBytes();
+    // refused, the object of the other key is neither replaced nor dead
+    EXPECT_FALSE(store.put("cd", "second", 6));
+    EXPECT_EQ(store.size(), 1);
+    EXPECT_EQ(readString(store, "ab"), "first");
+    EXPECT_GT(store.deadBytes(), dead);
+    EXPECT_FALSE(store.contains("cd"));
+    PackStore::Location location;
+    EXPECT_FALSE(store.lookup("cd", location));
+    EXPECT_EQ(readString(store, "cd"), "<missing>");
+    EXPECT_FALSE(store.remove("cd"));
+    EXPECT_TRUE(store.contains("ab"));
+    // the key itself still replaces its object
+    ASSERT_TRUE(store.put("ab", "again", 5));
+    EXPECT_EQ(readString(store, "ab"), "again");
+  }
+  PackStore reopened(dir, PackStore::kDefaultMaxPackSize, by_length);
+  EXPECT_FALSE(reopened.contains("cd"));
+  EXPECT_FALSE(reopened.put("cd", "second", 6));
+  EXPECT_EQ(readString(reopened, "ab"), "again");
+}
+
+TEST(PackStore, reopen) {
+  auto dir = testDir("reopen");
+  {
+    PackStore store(dir);
+    for (int i = 0; i < 100; ++i) {
+      auto value = "value " + std::to_string(i);
+      ASSERT_TRUE(store.put("key" + std::to_string(i), value.data(),
+                            value.size()));
+    }
+    ASSERT_TRUE(store.checkpoint());
+    EXPECT_EQ(fs::file_size(dir + "/index.log"), 0);
+  }
+  {
+    // these stay in the log, kept as they were before the destructor
+    // checkpoints, like after a crash
+    PackStore store(dir);
+    ASSERT_TRUE(store.remove("key3"));
+    ASSERT_TRUE(store.put("key4", "changed", 7));
+    ASSERT_TRUE(store.put("key100", "logged", 6));
+    fs::copy_file(dir + "/index", dir + "/index.crash");
+    fs::copy_file(dir + "/index.log", dir + "/index.log.crash");
+  }
+  fs::rename(dir + "/index.crash", dir + "/index");
+  fs::rename(dir + "/index.log.crash", dir + "/index.log");
+  PackStore store(dir);
+  ASSERT_TRUE(store.isOpen());
+  EXPECT_EQ(store.size(), 100);
+  EXPECT_EQ(readString(store, "key0"), "value 0");
+  EXPECT_EQ(readString(store, "key99"), "value 99");
+  EXPECT_EQ(readString(store, "key4"), "changed");
+  EXPECT_EQ(readString(store, "key100"), "logged");
+  EXPECT_FALSE(store.contains("key3"));
+}
+
+TEST(PackStore, compact) {
+  auto dir = testDir("compact");
+  // small packs so the objects spread over several
+  PackStore store(dir, 1024);
+  std::string value(200, 'x');
+  for (int i = 0; i < 20; ++i) {
+    value[0] = 'a' + i;
+    ASSERT_TRUE(store.put("k" + std::to_string(i), value.data(),
+                          value.size()));
+  }
+  size_t packs = 0;
+  for (const auto &file : fs::directory_iterator(dir)) {
+    packs += file.path().extension() == ".pack";
+  }
+  EXPECT_GT(packs, 3);
+  for (int i = 0; i < 20; i += 2) {
+    ASSERT_TRUE(store.remove("k" + std::to_string(i)));
+  }
+  EXPECT_GT(store.deadBytes(), 10 * 200);
+
+  ASSERT_TRUE(store.compact());
+  EXPECT_EQ(store.deadBytes(), 0);
+  EXPECT_EQ(store.size(), 10);
+  uintmax_t total = 0;
+  for (const auto &file : fs::directory_iterator(dir)) {
+    if (file.path().extension() == ".pack") {
+      total += file.file_size();
+    }
+  }
+  EXPECT_LT(total, 10u * 300);
+  for (int i = 1; i < 20; i += 2) {
+    value[0] = 'a' + i;
+    EXPECT_EQ(readString(store, "k" + std::to_string(i)), value);
+  }
+  EXPECT_FALSE(store.contains("k0"));
+
+  // appends continue after the compacted packs
+  ASSERT_TRUE(store.put("after", "x", 1));
+  EXPECT_EQ(readString(store, "after"), "x");
+}
+
+TEST(PackStore, parallelPuts) {
+  PackStore store(testDir("parallel"), 64 * 1024);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 200; ++i) {
+        auto key = std::to_string(t) + "/" + std::to_string(i);
+        ASSERT_TRUE(store.put(key, key.data(), key.size()));
+        if (t == 0 && i % 50 == 0) {
+          ASSERT_TRUE(store.compact());
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(store.size(), 8 * 200);
+  for (int t = 0; t < 8; ++t) {
+    auto key = std::to_string(t) + "/199";
+    EXPECT_EQ(readString(store, key), key);
+  }
+}
+
+TEST(PackStore, sink) {
+  PackStore store(testDir("sink"));
+  {
+    PackSink sink(store, "obj");
+    // out of order, like the segments of a download
+    ASSERT_TRUE(sink.write(5, "fghij", 5));
+    ASSERT_TRUE(sink.write(0, "abcde", 5));
+    EXPECT_FALSE(store.contains("obj"));
+    sink.finish(Status::OK());
+    EXPECT_TRUE(sink.status().ok());
+  }
+  EXPECT_EQ(readString(store, "obj"), "abcdefghij");
+
+  PackSink rejected(store, "bad", [](const std::vector<char> &) {
+    return Status(StatusCode::kCorrupted, "no");
+  });
+  ASSERT_TRUE(rejected.write(0, "x", 1));
+  rejected.finish(Status::OK());
+  EXPECT_EQ(rejected.status().code(), StatusCode::kCorrupted);
+  EXPECT_FALSE(store.contains("bad"));
+
+  PackSink failed(store, "failed");
+  failed.finish(Status(StatusCode::kNetworkError, "down"));
+  EXPECT_EQ(failed.status().code(), StatusCode::kNetworkError);
+  EXPECT_FALSE(store.contains("failed"));
+}
+
+} // namespace mltdl
@@ -0,0 +1,200 @@
+#include "remote_file.h"
+#include "sim_client.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <random>
+#include <thread>
+
+namespace mltdl {
+
+namespace {
+
+std::vector<char> expected(uint64_t seed, int64_t offset, size_t size) {
+  std::vector<char> data(size);
+  SimClient::fill(seed, offset, data.data(), data.size());
+  return data;
+}
+
+RemoteFileOptions smallBlocks() {
+  RemoteFileOptions options;
+  options.block_size = 4096;
+  options.memory_blocks = 16;
+  return options;
+}
+
+} // namespace
+
+TEST(RemoteFile, randomReads) {
+  const int64_t size = 1000003;
+  RemoteFile file("sim://host/file?seed=5&error_rate=0.05&size=" +
+                      std::to_string(size),
+                  smallBlocks());
+  ASSERT_TRUE(file.open().ok());
+  EXPECT_EQ(file.size(), size);
+  std::mt19937 random(1);
+  std::vector<char> data(20000);
+  for (int i = 0; i < 200; ++i) {
+    auto offset = static_cast<int64_t>(random() % size);
+    auto length = random() % data.size() + 1;
+    auto n = file.pread(offset, data.data(), length);
+    auto want = std::min<int64_t>(length, size - offset);
+    ASSERT_EQ(n, want) << offset;
+    ASSERT_TRUE(std::equal(data.begin(), data.begin() + n,
+                           expected(5, offset, n).begin()))
+        << offset << " " << length;
+  }
+  // the end of the file
+  EXPECT_EQ(file.pread(size - 3, data.data(), 10), 3);
+  EXPECT_EQ(file.pread(size, data.data(), 10), 0);
+  EXPECT_EQ(file.pread(-1, data.data(), 10), -1);
+}
+
+TEST(RemoteFile, coalescesAndCaches) {
+  SimClient::stats().reset();
+  auto options = smallBlocks();
+  options.read_ahead = 0;
+  options.max_coalesce = 4;
+  RemoteFile file("sim://host/file?seed=2&size=100000", options);
+  ASSERT_TRUE(file.open().ok());
+  std::vector<char> data(100000);
+  // 10 blocks missing, in requests of 4 at most
+  ASSERT_EQ(file.pread(100, data.data(), 10 * 4096 - 200), 10 * 4096 - 200);
+  EXPECT_EQ(file.stats().requests.load(), 3U);
+  EXPECT_EQ(file.stats().fetched.load(), 10U);
+  // all in memory now
+  ASSERT_EQ(file.pread(5000, data.data(), 20000), 20000);
+  EXPECT_EQ(file.stats().requests.load(), 3U);
+  EXPECT_TRUE(std::equal(data.begin(), data.begin() + 20000,
+                         expected(2, 5000, 20000).begin()));
+  // a hole between cached blocks is fetched alone
+  ASSERT_EQ(file.pread(12 * 4096, data.data(), 1), 1);
+  ASSERT_EQ(file.pread(9 * 4096, data.data(), 5 * 4096), 5 * 4096);
+  EXPECT_EQ(file.stats().requests.load(), 6U);
+  EXPECT_TRUE(std::equal(data.begin(), data.begin() + 5 * 4096,
+                         expected(2, 9 * 4096, 5 * 4096).begin()));
+
+  // the least recently used are evicted, a read longer than the memory
+  // still comes back whole
+  ASSERT_EQ(file.pread(0, data.data(), data.size()),
+            static_cast<int64_t>(data.size()));
+  EXPECT_TRUE(data == expected(2, 0, data.size()));
+  auto requests = file.stats().requests.load();
+  ASSERT_EQ(file.pread(0, data.data(), 1), 1);
+  EXPECT_EQ(file.stats().requests.load(), requests + 1);
+}
+
+TEST(RemoteFile, readAhead) {
+  const int64_t size = 64 * 4096;
+  auto url = "sim://host/file?seed=3&size=" + std::to_string(size);
+  std::vector<char> data(1000);
+  auto read = [&](const RemoteFileOptions &options) {
+    RemoteFile file(url, options);
+    EXPECT_TRUE(file.open().ok());
+    std::vector<char> all;
+    int64_t n;
+    while ((n = file.pread(all.size(), data.data(), data.size())) > 0) {
+      all.insert(all.end(), data.begin(), data.begin() + n);
+    }
+    EXPECT_TRUE(all == expected(3, 0, size));
+    return file.stats().requests.load();
+  };
+  auto options = smallBlocks();
+  options.read_ahead = 0;
+  EXPECT_EQ(read(options), 64U);
+  options.read_ahead = 8;
+  // a request for the first block, then the window grows to 8 blocks
+  EXPECT_LE(read(options), 10U);
+
+  // reads that jump around earn no window
+  RemoteFile file(url, options);
+  ASSERT_TRUE(file.open().ok());
+  for (int64_t offset = size - 4096; offset >= 0; offset -= 4096) {
+    ASSERT_EQ(file.pread(offset, data.data(), data.size()), 1000);
+  }
+  EXPECT_EQ(file.stats().read_ahead.load(), 0U);
+}
+
+TEST(RemoteFile, diskCache) {
+  auto dir = testDir("disk");
+  const int64_t size = 30 * 4096;
+  auto url = "sim://host/file?seed=7&size=" + std::to_string(size);
+  auto options = smallBlocks();
+  options.disk_dir = dir;
+  options.disk_blocks = 20;
+  std::vector<char> data(size);
+  {
+    RemoteFile file(url, options);
+    ASSERT_TRUE(file.open().ok());
+    ASSERT_EQ(file.pread(0, data.data(), size), size);
+  }
+  // the first 10 blocks were evicted from the disk
+  size_t files = 0;
+  for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+    (void)entry;
+    ++files;
+  }
+  EXPECT_EQ(files, 20U);
+
+  RemoteFile again(url, options);
+  ASSERT_TRUE(again.open().ok());
+  ASSERT_EQ(again.pread(10 * 4096, data.data(), 20 * 4096), 20 * 4096);
+  EXPECT_EQ(again.stats().requests.load(), 0U);
+  EXPECT_EQ(again.stats().disk_hits.load(), 20U);
+  EXPECT_TRUE(std::equal(data.begin(), data.begin() + 20 * 4096,
+                         expected(7, 10 * 4096, 20 * 4096).begin()));
+
+  // another version of the file does not see them
+  RemoteFile other("sim://host/file?seed=8&size=" + std::to_string(size),
+                   options);
+  ASSERT_TRUE(other.open().ok());
+  ASSERT_EQ(other.pread(10 * 4096, data.data(), 100), 100);
+  EXPECT_EQ(other.stats().disk_hits.load(), 0U);
+  EXPECT_TRUE(std::equal(data.begin(), data.begin() + 100,
+                         expected(8, 10 * 4096, 100).begin()));
+}
+
+TEST(RemoteFile, concurrentReaders) {
+  const int64_t size = 256 * 1024;
+  auto options = smallBlocks();
+  options.memory_blocks = 64;
+  RemoteFile file("sim://host/file?seed=9&time=real&latency_ms=5&size=" +
+                      std::to_string(size),
+                  options);
+  ASSERT_TRUE(file.open().ok());
+  std::vector<std::thread> readers;
+  std::atomic<int> bad{0};
+  for (int t = 0; t < 8; ++t) {
+    readers.emplace_back([&] {
+      std::vector<char> data(size);
+      if (file.pread(0, data.data(), size) != size ||
+          data != expected(9, 0, size)) {
+        ++bad;
+      }
+    });
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(bad.load(), 0);
+  // every block was fetched once
+  EXPECT_EQ(file.stats().fetched.load(), 64U);
+}
+
+TEST(RemoteFile, errors) {
+  std::vector<char> data(10);
+  RemoteFile unopened("sim://host/file?size=100");
+  EXPECT_EQ(unopened.pread(0, data.data(), 10), -1);
+  EXPECT_EQ(unopened.lastError().code(), StatusCode::kInvalidArgument);
+
+  RemoteFile missing("sim://host/file?size=100&status=404");
+  ASSERT_TRUE(missing.open().ok());
+  EXPECT_EQ(missing.pread(0, data.data(), 10), -1);
+  EXPECT_EQ(missing.lastError().code(), StatusCode::kHttpError);
+
+  EXPECT_EQ(RemoteFile("not a url").open().code(),
+            StatusCode::kInvalidArgument);
+}
+
+} // namespace mltdl
@@ -0,0 +1,200 @@
+#include "file_io.h"
+#include "sharded_download.h"
+#include "sim_client.h"
+#include "utils.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+
+#include <csignal>
+#include <filesystem>
+
+namespace mltdl {
+
+namespace {
+
+std::string expectedMd5(uint64_t seed, int64_t size) {
+  std::vector<char> data(size);
+  SimClient::fill(seed, 0, data.data(), data.size());
+  return calculateMd5(data.data(), data.size());
+}
+
+ShardOptions smallShards() {
+  ShardOptions options;
+  options.workers = 3;
+  options.threads = 2;
+  options.shard_size = 128 * 1024;
+  options.poll_ms = 10;
+  // the test binary has no --shard-worker, see spawnedWorkers
+  options.fork_workers = true;
+  return options;
+}
+
+} // namespace
+
+TEST(ShardLedger, claims) {
+  auto dir = testDir("ledger");
+  auto path = dir + "/f.ledger";
+  ShardOptions options;
+  options.shard_size = 100;
+  options.max_attempts = 2;
+  auto ledger = ShardLedger::create(path, "sim://h/f", "v", dir + "/f", 250,
+                                    options, false);
+  ASSERT_NE(ledger, nullptr);
+  ASSERT_EQ(ledger->count(), 3);
+  EXPECT_EQ(ledger->slot(2).start, 200);
+  EXPECT_EQ(ledger->slot(2).end, 249);
+  // a second coordinator can't have it
+  EXPECT_EQ(ShardLedger::create(path, "sim://h/f", "v", dir + "/f", 250,
+                                options, true),
+            nullptr);
+
+  // a worker sees what the coordinator wrote
+  auto worker = ShardLedger::open(path);
+  ASSERT_NE(worker, nullptr);
+  EXPECT_EQ(worker->url(), "sim://h/f");
+  EXPECT_EQ(worker->target(), dir + "/f");
+  EXPECT_EQ(worker->claim(10), 0);
+  EXPECT_EQ(worker->claim(11), 1);
+  EXPECT_EQ(ledger->slot(1).owner.load(), 11);
+  worker->slot(1).done = 40;
+  worker->finish(0);
+  EXPECT_EQ(ledger->done(), 140);
+
+  // a dead worker's shard is free again and keeps its progress
+  EXPECT_EQ(ledger->release(11), 1);
+  EXPECT_EQ(ledger->countState(ShardLedger::kFree), 2);
+  EXPECT_EQ(ledger->slot(1).done.load(), 40);
+
+  // retried once, then failed for good
+  EXPECT_EQ(worker->claim(12), 1);
+  worker->fail(1, Status(StatusCode::kNetworkError, "reset"));
+  EXPECT_EQ(ledger->failed(), -1);
+  EXPECT_EQ(worker->claim(12), 1);
+  worker->fail(1, Status(StatusCode::kNetworkError, "reset"));
+  EXPECT_EQ(ledger->failed(), 1);
+  EXPECT_EQ(ledger->slot(1).error.load(),
+            static_cast<int32_t>(StatusCode::kNetworkError));
+
+  // reopened by the next run, the claims are gone and done is kept
+  ledger.reset();
+  ledger = ShardLedger::create(path, "sim://h/f", "v", dir + "/f", 250,
+                               options, true);
+  ASSERT_NE(ledger, nullptr);
+  EXPECT_EQ(ledger->countState(ShardLedger::kDone), 1);
+  EXPECT_EQ(ledger->countState(ShardLedger::kFree), 2);
+  EXPECT_EQ(ledger->done(), 140);
+  // another resource starts over
+  ledger.reset();
+  ledger = ShardLedger::create(path, "sim://h/f", "w", dir + "/f", 250,
+                               options, true);
+  ASSERT_NE(ledger, nullptr);
+  EXPECT_EQ(ledger->done(), 0);
+}
+
+TEST(ShardedDownload, workers) {
+  auto dir = testDir("workers");
+  auto target = dir + "/file";
+  const int64_t size = (2 << 20) + 333;
+  auto url = "sim://host/file?seed=8&error_rate=0.02&size=" +
+             std::to_string(size);
+  int max_workers = 0;
+  auto options = smallShards();
+  options.on_progress = [&](const ShardProgress &progress) {
+    max_workers = std::max<int>(max_workers, progress.workers.size());
+  };
+  auto status = shardedDownload(url, target, options);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  EXPECT_EQ(max_workers, 3);
+  EXPECT_EQ(calculateMd5(target), expectedMd5(8, size));
+  EXPECT_FALSE(std::filesystem::exists(target + ".ledger"));
+}
+
+TEST(ShardedDownload, spawnedWorkers) {
+  // the program, built next to the tests, runs the workers
+  auto program = std::filesystem::absolute("multithread_dl").string();
+  if (!std::filesystem::exists(program)) {
+    GTEST_SKIP() << program << " is not built";
+  }
+  auto dir = testDir("spawned");
+  auto target = dir + "/file";
+  const int64_t size = (1 << 20) + 77;
+  auto url = "sim://host/file?seed=9&size=" + std::to_string(size);
+  auto options = smallShards();
+  options.fork_workers = false;
+  options.worker_command = {program, "--shard-worker"};
+  auto status = shardedDownload(url, target, options);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  EXPECT_EQ(calculateMd5(target), expectedMd5(9, size));
+}
+
+TEST(ShardedDownload, workerDies) {
+  auto dir = testDir("dies");
+  auto target = dir + "/file";
+  const int64_t size = 4 << 20;
+  // slow enough to kill a worker in the middle of its shards
+  auto url = "sim://host/file?seed=2&time=real&bandwidth=4000000&size=" +
+             std::to_string(size);
+  auto options = smallShards();
+  options.shard_size = 512 * 1024;
+  bool killed = false;
+  int restarts = 0;
+  options.on_progress = [&](const ShardProgress &progress) {
+    if (!killed && progress.done > 0 && !progress.workers.empty()) {
+      kill(progress.workers.front(), SIGKILL);
+      killed = true;
+    }
+    restarts = progress.restarts;
+  };
+  auto status = shardedDownload(url, target, options);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  EXPECT_TRUE(killed);
+  EXPECT_EQ(restarts, 1);
+  EXPECT_EQ(calculateMd5(target), expectedMd5(2, size));
+}
+
+TEST(ShardedDownload, resume) {
+  auto dir = testDir("resume");
+  auto target = dir + "/file";
+  const int64_t size = 1 << 20;
+  auto url = "sim://host/file?seed=4&size=" + std::to_string(size);
+  auto options = smallShards();
+  // what an interrupted run left: the first shard done, the second half of
+  // the way, with bytes the next run must not fetch again
+  {
+    auto ledger = ShardLedger::create(target + ".ledger", url,
+                                      "\"sim-4-" + std::to_string(size) + "\"",
+                                      target, size, options, false);
+    ASSERT_NE(ledger, nullptr);
+    std::vector<char> kept(options.shard_size + 1000, 'x');
+    ASSERT_TRUE(FileIO::instance().preallocate(target, size));
+    ASSERT_TRUE(FileIO::instance().pwrite(target, 0, kept.data(),
+                                          kept.size()));
+    FileIO::instance().close(target);
+    ledger->finish(0);
+    ledger->slot(1).done = 1000;
+    ledger->claim(12345);
+  }
+  auto status = shardedDownload(url, target, options);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  auto data = FileIO::instance().read(target);
+  ASSERT_EQ(static_cast<int64_t>(data.size()), size);
+  auto from = options.shard_size + 1000;
+  EXPECT_EQ(std::count(data.begin(), data.begin() + from, 'x'), from);
+  std::vector<char> expected(size);
+  SimClient::fill(4, 0, expected.data(), expected.size());
+  EXPECT_TRUE(std::equal(data.begin() + from, data.end(),
+                         expected.begin() + from));
+}
+
+TEST(ShardedDownload, failure) {
+  auto dir = testDir("failure");
+  auto target = dir + "/file";
+  auto status =
+      shardedDownload("sim://host/gone?size=100000&status=403", target,
+                      smallShards());
+  EXPECT_EQ(status.code(), StatusCode::kHttpError);
+  // kept for the next run
+  EXPECT_TRUE(std::filesystem::exists(target + ".ledger"));
+}
+
+} // namespace mltdl
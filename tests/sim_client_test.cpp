@@ -0,0 +1,111 @@
+#include "client_factory.h"
+#include "download_manager.h"
+#include "sim_client.h"
+#include "utils.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+
+#include <filesystem>
+
+namespace mltdl {
+
+namespace {
+
+// the md5 of the whole resource with this seed and size
+std::string expectedMd5(uint64_t seed, int64_t size) {
+  std::vector<char> data(size);
+  SimClient::fill(seed, 0, data.data(), data.size());
+  return calculateMd5(data.data(), data.size());
+}
+
+} // namespace
+
+TEST(SimClient, deterministic) {
+  auto client = get_clients("sim");
+  ASSERT_NE(client, nullptr);
+  RetryStrategy rs{3, 0, 1, 0};
+  auto url = "sim://host/a?size=1000&seed=9";
+  EXPECT_EQ(client->getFileSize(url, nullptr), 1000);
+  auto whole = client->get(url, rs, nullptr, 0, 999);
+  ASSERT_EQ(whole.body.size(), 1000);
+  // any range is the same bytes as that part of the whole
+  auto part = client->get(url, rs, nullptr, 13, 500);
+  EXPECT_EQ(part.status_code, 206);
+  EXPECT_TRUE(std::equal(part.body.begin(), part.body.end(),
+                         whole.body.begin() + 13));
+  // another seed is another resource
+  auto other = client->get("sim://host/a?size=1000&seed=10", rs, nullptr, 0,
+                           999);
+  EXPECT_NE(other.body, whole.body);
+}
+
+TEST(SimClient, retries) {
+  auto client = get_clients("sim");
+  SimClient::stats().reset();
+  RetryStrategy rs{10, 100, 2, 1000};
+  // fails often, in the same places every time
+  auto url = "sim://host/a?size=100000&seed=3&error_rate=0.5";
+  auto fetch = [&] {
+    std::vector<char> data;
+    for (int64_t start = 0; start < 100000; start += 1000) {
+      auto response = client->get(url, rs, nullptr, start, start + 999);
+      EXPECT_EQ(response.status, CURLE_OK);
+      data.insert(data.end(), response.body.begin(), response.body.end());
+    }
+    return data;
+  };
+  auto first = fetch();
+  auto failures = SimClient::stats().failures.load();
+  EXPECT_GT(failures, 20);
+  // the backoff is counted, not waited for
+  EXPECT_GT(SimClient::stats().virtual_us.load(), 0);
+  auto second = fetch();
+  EXPECT_EQ(SimClient::stats().failures.load(), 2 * failures);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(calculateMd5(first.data(), first.size()), expectedMd5(3, 100000));
+
+  // a status that won't change is not asked for again
+  SimClient::stats().reset();
+  auto gone = client->get("sim://host/a?status=404", rs, nullptr, 0, 9);
+  EXPECT_EQ(gone.status_code, 404);
+  EXPECT_EQ(SimClient::stats().requests.load(), 1);
+}
+
+TEST(SimClient, downloadManager) {
+  auto dir = testDir("dm");
+  // small segments, many of them fail on the way
+  DownloadManager dm(8, 4096);
+  const int64_t size = 1 << 20;
+  auto url = "sim://host/file?size=" + std::to_string(size) +
+             "&seed=5&error_rate=0.05&stall_rate=0.1&stall_ms=100";
+  auto status = dm.download(url, dir);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  int files = 0;
+  for (const auto &file : std::filesystem::directory_iterator(dir)) {
+    ++files;
+    EXPECT_EQ(calculateMd5(file.path().string()), expectedMd5(5, size));
+  }
+  EXPECT_EQ(files, 1);
+}
+
+TEST(SimClient, manyDownloads) {
+  auto dir = testDir("many");
+  DownloadManager dm(8, 1024);
+  std::vector<std::shared_ptr<DownloadHandle>> handles;
+  for (int i = 0; i < 200; ++i) {
+    handles.push_back(dm.submit("sim://host/f" + std::to_string(i) +
+                                    "?size=20000&error_rate=0.05&seed=" +
+                                    std::to_string(i),
+                                dir));
+  }
+  for (size_t i = 0; i < handles.size(); ++i) {
+    auto status = handles[i]->wait();
+    ASSERT_TRUE(status.ok()) << status.toString();
+    EXPECT_EQ(calculateMd5(handles[i]->filePath()), expectedMd5(i, 20000));
+  }
+  // a permanent error fails the download without a retry
+  auto status = dm.download("sim://host/gone?status=403", dir);
+  EXPECT_EQ(status.code(), StatusCode::kHttpError);
+}
+
+} // namespace mltdl
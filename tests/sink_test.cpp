@@ -0,0 +1,104 @@
+#include "sink.h"
+#include <gtest/gtest.h>
+
+#include <thread>
+
+namespace mltdl {
+
+namespace {
+
+// collects what it is given and checks the calls come in order
+class CollectSink : public Sink {
+public:
+  bool write(int64_t offset, const char *data, size_t size) override {
+    if (offset != static_cast<int64_t>(out.size())) {
+      in_order = false;
+    }
+    last_data = data;
+    out.append(data, size);
+    return true;
+  }
+  void finish(const Status &status) override { finished = status; }
+
+  std::string out;
+  const char *last_data{nullptr};
+  bool in_order{true};
+  Status finished{StatusCode::kPending, ""};
+};
+
+} // namespace
+
+TEST(Sink, orderedPassThrough) {
+  auto inner = std::make_shared<CollectSink>();
+  OrderedSink sink(inner);
+  std::string data = "0123456789";
+  // in order data is not copied
+  ASSERT_TRUE(sink.write(0, data.data(), 4));
+  EXPECT_EQ(inner->last_data, data.data());
+  // ahead of the gap it is held
+  ASSERT_TRUE(sink.write(7, data.data() + 7, 3));
+  EXPECT_EQ(sink.buffered(), 3);
+  EXPECT_EQ(inner->out, "0123");
+  // a repeat of delivered bytes is dropped, an overlap is cut
+  ASSERT_TRUE(sink.write(0, data.data(), 2));
+  ASSERT_TRUE(sink.write(2, data.data() + 2, 5));
+  EXPECT_EQ(inner->out, data);
+  EXPECT_EQ(sink.buffered(), 0);
+  EXPECT_EQ(sink.next(), 10);
+  EXPECT_TRUE(inner->in_order);
+
+  sink.finish(Status::OK());
+  EXPECT_TRUE(inner->finished.ok());
+}
+
+TEST(Sink, orderedFromThreads) {
+  std::string data;
+  for (int i = 0; i < 64 * 1024; ++i) {
+    data += static_cast<char>(i * 31);
+  }
+  auto inner = std::make_shared<CollectSink>();
+  // small enough that the writers ahead have to wait
+  OrderedSink sink(inner, 0, 4096);
+  const int segments = 8;
+  const int64_t length = data.size() / segments;
+  std::vector<std::thread> threads;
+  for (int i = segments - 1; i >= 0; --i) {
+    threads.emplace_back([&, i] {
+      for (int64_t pos = 0; pos < length; pos += 1000) {
+        auto n = std::min<int64_t>(1000, length - pos);
+        ASSERT_TRUE(sink.write(i * length + pos, data.data() + i * length + pos,
+                               n));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_TRUE(inner->in_order);
+  EXPECT_EQ(inner->out, data);
+}
+
+TEST(Sink, cancelReleasesWriters) {
+  auto inner = std::make_shared<CollectSink>();
+  OrderedSink sink(inner, 0, 10);
+  std::string data(10, 'x');
+  ASSERT_TRUE(sink.write(100, data.data(), 10));
+  std::thread blocked([&] { EXPECT_FALSE(sink.write(200, data.data(), 10)); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  sink.cancel();
+  blocked.join();
+  EXPECT_FALSE(sink.write(0, data.data(), 10));
+  EXPECT_TRUE(inner->out.empty());
+}
+
+TEST(Sink, function) {
+  int64_t total = 0;
+  FunctionSink sink([&](int64_t, const char *, size_t size) {
+    total += size;
+    return total < 10;
+  });
+  EXPECT_TRUE(sink.write(0, "abcd", 4));
+  EXPECT_FALSE(sink.write(4, "efghijk", 7));
+}
+
+} // namespace mltdl
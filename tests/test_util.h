@@ -0,0 +1,239 @@
+#pragma once
+
+// helpers shared by the tests, header only since every test is a binary of
+// its own
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace mltdl {
+
+/**
+ * an empty directory of its own for the running test, named after its suite
+ * so the test binaries can run at once without sharing one
+ */
+inline std::string testDir(const std::string &name) {
+  std::string suite = "test";
+  if (auto info = ::testing::UnitTest::GetInstance()->current_test_info()) {
+    suite = info->test_suite_name();
+  }
+  auto dir = std::filesystem::temp_directory_path() / ("mltdl_" + suite + "_" +
+                                                       name);
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  return dir.string();
+}
+
+// true once done() is, false if that takes longer than timeout
+inline bool eventually(const std::function<bool()> &done,
+                       std::chrono::milliseconds timeout =
+                           std::chrono::seconds(5)) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return true;
+}
+
+// a request as a LoopbackServer got it
+struct TestRequest {
+  std::string method;
+  std::string target;
+  // the request line and the headers
+  std::string head;
+  std::string body;
+
+  // the value of a header, empty if there is none
+  std::string header(const std::string &name) const {
+    auto lower = [](std::string text) {
+      for (auto &c : text) {
+        c = std::tolower(static_cast<unsigned char>(c));
+      }
+      return text;
+    };
+    auto head_lower = lower(head);
+    auto pos = head_lower.find("\r\n" + lower(name) + ":");
+    if (pos == std::string::npos) {
+      return "";
+    }
+    pos += name.size() + 3;
+    auto end = head.find("\r\n", pos);
+    auto value = head.substr(pos, end - pos);
+    value.erase(0, value.find_first_not_of(' '));
+    return value;
+  }
+};
+
+/**
+ * an HTTP server on the loopback interface that answers every request with
+ * what the handler returns, as it is sent on the wire. A reply with
+ * "Connection: close" closes the connection once it is sent, so a body
+ * shorter than its Content-Length is cut off there. Every connection is
+ * served by a thread of its own, the requests are kept.
+ */
+class LoopbackServer {
+public:
+  using Handler = std::function<std::string(const TestRequest &)>;
+
+  explicit LoopbackServer(Handler handler) : handler_(std::move(handler)) {
+    fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    ::bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    ::listen(fd_, 16);
+    ::getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &length);
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread([this] { acceptMain(); });
+  }
+
+  // the same reply to every request
+  explicit LoopbackServer(const std::string &reply)
+      : LoopbackServer([reply](const TestRequest &) { return reply; }) {}
+
+  ~LoopbackServer() {
+    ::shutdown(fd_, SHUT_RDWR);
+    thread_.join();
+    ::close(fd_);
+    std::vector<std::thread> connections;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto fd : open_) {
+        ::shutdown(fd, SHUT_RDWR);
+      }
+      connections.swap(connections_);
+    }
+    for (auto &connection : connections) {
+      connection.join();
+    }
+  }
+
+  std::string url(const std::string &path = "/file") const {
+    return "http://127.0.0.1:" + std::to_string(port_) + path;
+  }
+
+  std::vector<TestRequest> requests() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_;
+  }
+
+private:
+  void acceptMain() {
+    int connection;
+    while ((connection = ::accept(fd_, nullptr, nullptr)) >= 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      open_.push_back(connection);
+      connections_.emplace_back([this, connection] { serve(connection); });
+    }
+  }
+
+  void serve(int connection) {
+    std::string input;
+    char buffer[65536];
+    ssize_t n = 1;
+    while (n > 0) {
+      auto end = input.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        n = ::recv(connection, buffer, sizeof(buffer), 0);
+        input.append(buffer, std::max<ssize_t>(n, 0));
+        continue;
+      }
+      TestRequest request;
+      request.head = input.substr(0, end + 2);
+      request.method = request.head.substr(0, request.head.find(' '));
+      auto target = request.method.size() + 1;
+      request.target =
+          request.head.substr(target, request.head.find(' ', target) - target);
+      auto length = request.header("Content-Length");
+      size_t body = length.empty() ? 0 : std::stoull(length);
+      if (request.header("Expect") == "100-continue") {
+        std::string go_on = "HTTP/1.1 100 Continue\r\n\r\n";
+        ::send(connection, go_on.data(), go_on.size(), MSG_NOSIGNAL);
+      }
+      while (n > 0 && input.size() < end + 4 + body) {
+        n = ::recv(connection, buffer, sizeof(buffer), 0);
+        input.append(buffer, std::max<ssize_t>(n, 0));
+      }
+      if (n <= 0) {
+        break;
+      }
+      request.body = input.substr(end + 4, body);
+      input.erase(0, end + 4 + body);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        requests_.push_back(request);
+      }
+      auto reply = handler_(request);
+      ::send(connection, reply.data(), reply.size(), MSG_NOSIGNAL);
+      auto head = reply.substr(0, reply.find("\r\n\r\n"));
+      if (head.find("\r\nConnection: close") != std::string::npos) {
+        break;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_.erase(std::find(open_.begin(), open_.end(), connection));
+    ::close(connection);
+  }
+
+  Handler handler_;
+  int fd_;
+  int port_{0};
+  std::thread thread_;
+  mutable std::mutex mutex_;
+  std::vector<int> open_;
+  std::vector<std::thread> connections_;
+  std::vector<TestRequest> requests_;
+};
+
+/**
+ * the reply of a server with data at every url: HEAD, GET and a single
+ * Range of GET, like "bytes=10-99" or "bytes=10-"
+ */
+inline std::string serveBytes(const std::vector<char> &data,
+                              const TestRequest &request) {
+  int64_t size = data.size();
+  int64_t start = 0;
+  int64_t end = size - 1;
+  auto range = request.header("Range");
+  bool partial = range.rfind("bytes=", 0) == 0 &&
+                 range.find(',') == std::string::npos;
+  if (partial) {
+    auto dash = range.find('-');
+    start = std::stoll(range.substr(6, dash - 6));
+    if (dash + 1 < range.size()) {
+      end = std::min<int64_t>(end, std::stoll(range.substr(dash + 1)));
+    }
+  }
+  std::string reply = partial ? "HTTP/1.1 206 Partial Content\r\n"
+                              : "HTTP/1.1 200 OK\r\n";
+  reply += "Accept-Ranges: bytes\r\nContent-Length: " +
+           std::to_string(end - start + 1) + "\r\n";
+  if (partial) {
+    reply += "Content-Range: bytes " + std::to_string(start) + "-" +
+             std::to_string(end) + "/" + std::to_string(size) + "\r\n";
+  }
+  reply += "\r\n";
+  if (request.method != "HEAD") {
+    reply.append(data.data() + start, end - start + 1);
+  }
+  return reply;
+}
+
+} // namespace mltdl
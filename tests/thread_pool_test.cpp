@@ -0,0 +1,166 @@
+#include "thread_pool.h"
+#include "work_queue.h"
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mltdl {
+
+TEST(WorkQueue, priority) {
+  WorkQueue queue;
+  std::vector<std::string> order;
+  auto record = [&order](std::string name) {
+    return [&order, name](int32_t) { order.push_back(name); };
+  };
+  queue.push(record("low"), WorkOptions{Priority::kLow});
+  queue.push(record("normal"), WorkOptions{Priority::kNormal});
+  queue.push(record("high"), WorkOptions{Priority::kHigh});
+  while (!queue.empty()) {
+    queue.pop()(0);
+  }
+  EXPECT_EQ(order, (std::vector<std::string>{"high", "normal", "low"}));
+}
+
+TEST(WorkQueue, fairshare) {
+  WorkQueue queue;
+  std::string order;
+  // a bulk flow enqueues a backlog before an interactive flow shows up
+  for (int i = 0; i < 6; ++i) {
+    queue.push([&order](int32_t) { order += "b"; },
+               WorkOptions{Priority::kNormal, "bulk"});
+  }
+  queue.pop()(0);
+  for (int i = 0; i < 2; ++i) {
+    queue.push([&order](int32_t) { order += "i"; },
+               WorkOptions{Priority::kNormal, "interactive"});
+  }
+  while (!queue.empty()) {
+    queue.pop()(0);
+  }
+  // the interactive flow is interleaved instead of waiting for the backlog
+  EXPECT_EQ(order, "bibibbbb");
+}
+
+TEST(WorkQueue, weight) {
+  WorkQueue queue;
+  int heavy = 0;
+  int light = 0;
+  for (int i = 0; i < 30; ++i) {
+    queue.push([&heavy](int32_t) { ++heavy; },
+               WorkOptions{Priority::kNormal, "heavy", 2});
+    queue.push([&light](int32_t) { ++light; },
+               WorkOptions{Priority::kNormal, "light", 1});
+  }
+  for (int i = 0; i < 30; ++i) {
+    queue.pop()(0);
+  }
+  EXPECT_EQ(heavy, 20);
+  EXPECT_EQ(light, 10);
+}
+
+TEST(WorkQueue, starvation) {
+  WorkQueue queue(3);
+  std::string order;
+  queue.push([&order](int32_t) { order += "l"; }, WorkOptions{Priority::kLow});
+  for (int i = 0; i < 5; ++i) {
+    queue.push([&order](int32_t) { order += "h"; },
+               WorkOptions{Priority::kHigh});
+  }
+  while (!queue.empty()) {
+    queue.pop()(0);
+  }
+  EXPECT_EQ(order, "hhhlhh");
+}
+
+TEST(ThreadPool, spawn) {
+  ThreadPool pool(4);
+  std::atomic<int> count{0};
+  for (int i = 0; i < 100; ++i) {
+    pool.spawn([&count](int32_t) { ++count; },
+               WorkOptions{i % 2 ? Priority::kHigh : Priority::kLow});
+  }
+  pool.waitForCompletion();
+  EXPECT_EQ(count, 100);
+}
+
+TEST(ThreadPool, pinOutOfRange) {
+  ThreadPool pool(2);
+  EXPECT_FALSE(pool.pinThreads({-1}));
+  EXPECT_FALSE(pool.pinThreads({cpuLimit()}));
+  std::thread thread([] {});
+  EXPECT_FALSE(pinThread(thread, -5));
+  thread.join();
+}
+
+TEST(TaskGroup, waitsForItsOwnTasks) {
+  ThreadPool pool(2);
+  std::atomic<bool> release{false};
+  TaskGroup slow(pool);
+  slow.spawn([&release](int32_t) {
+    while (!release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  // a group sharing the pool with a busy one is not held up by it
+  TaskGroup fast(pool);
+  std::atomic<int> count{0};
+  for (int i = 0; i < 50; ++i) {
+    fast.spawn([&count](int32_t) { ++count; });
+  }
+  fast.wait();
+  EXPECT_EQ(count, 50);
+  EXPECT_EQ(slow.pending(), 1);
+  EXPECT_FALSE(slow.waitFor(std::chrono::milliseconds(10)));
+  release = true;
+  slow.wait();
+  EXPECT_EQ(slow.pending(), 0);
+}
+
+TEST(TaskGroup, cancel) {
+  ThreadPool pool(1);
+  std::atomic<bool> release{false};
+  std::atomic<int> ran{0};
+  TaskGroup group(pool);
+  group.spawn([&](int32_t) {
+    ++ran;
+    while (!release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  for (int i = 0; i < 10; ++i) {
+    group.spawn([&ran](int32_t) { ++ran; });
+  }
+  while (ran == 0) {
+    std::this_thread::yield();
+  }
+  group.cancel();
+  EXPECT_TRUE(group.cancelled());
+  // the queued tasks don't count anymore, the running one does
+  EXPECT_EQ(group.pending(), 1);
+  release = true;
+  group.wait();
+  pool.waitForCompletion();
+  EXPECT_EQ(ran, 1);
+}
+
+TEST(TaskGroup, errors) {
+  ThreadPool pool(4);
+  TaskGroup failing(pool);
+  TaskGroup fine(pool);
+  for (int i = 0; i < 3; ++i) {
+    failing.spawn([](int32_t) { throw std::runtime_error("broken"); });
+    fine.spawn([](int32_t) {});
+  }
+  failing.wait();
+  fine.wait();
+  EXPECT_EQ(failing.errors(),
+            (std::vector<std::string>{"broken", "broken", "broken"}));
+  EXPECT_TRUE(fine.errors().empty());
+}
+
+} // namespace mltdl
@@ -0,0 +1,98 @@
+#include "tracer.h"
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <thread>
+
+namespace mltdl {
+
+static std::string readFile(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+TEST(Tracer, disabled) {
+  auto &tracer = Tracer::global();
+  ASSERT_FALSE(tracer.enabled());
+  Tracer::Span span("nothing", "test");
+  span.arg("ignored", 1);
+}
+
+TEST(Tracer, events) {
+  const std::string path = "/tmp/mltdl_tracer_test.json";
+  auto &tracer = Tracer::global();
+  tracer.start(path);
+  {
+    Tracer::Span span("outer", "test");
+    span.arg("bytes", 42);
+    span.arg("url", std::string("http://example.com/\"q\""));
+  }
+  std::thread([&tracer] {
+    tracer.setThreadName("helper");
+    tracer.asyncBegin("job", "test", 7);
+    tracer.instant("mark", "test");
+  }).join();
+  tracer.asyncEnd("job", "test", 7);
+  ASSERT_TRUE(tracer.stop());
+  EXPECT_FALSE(tracer.enabled());
+
+  auto trace = readFile(path);
+  EXPECT_EQ(trace.rfind("{\"traceEvents\":[", 0), 0U);
+  EXPECT_NE(trace.find("\"name\":\"outer\",\"cat\":\"test\",\"ph\":\"X\""),
+            std::string::npos);
+  EXPECT_NE(trace.find("\"bytes\":42,\"url\":\"http://example.com/\\\"q\\\"\""),
+            std::string::npos);
+  EXPECT_NE(trace.find("\"args\":{\"name\":\"helper\"}"), std::string::npos);
+  EXPECT_NE(trace.find("\"ph\":\"b\",\"ts\":"), std::string::npos);
+  EXPECT_NE(trace.find("\"ph\":\"e\",\"ts\":"), std::string::npos);
+  EXPECT_NE(trace.find("\"id\":\"7\""), std::string::npos);
+  EXPECT_NE(trace.find("\"name\":\"mark\""), std::string::npos);
+  std::remove(path.c_str());
+}
+
+TEST(Tracer, exitedThreads) {
+  const std::string path = "/tmp/mltdl_tracer_exited.json";
+  auto &tracer = Tracer::global();
+  auto buffers = tracer.buffers();
+  // named threads while tracing is off, like those of every pool
+  for (int t = 0; t < 100; ++t) {
+    std::thread([&tracer] { tracer.setThreadName("idle"); }).join();
+  }
+  EXPECT_EQ(tracer.buffers(), buffers);
+
+  // named before the trace starts, the name shows once it records
+  std::promise<void> named;
+  std::promise<void> started;
+  std::thread early([&] {
+    tracer.setThreadName("early");
+    named.set_value();
+    started.get_future().wait();
+    tracer.instant("late", "test");
+  });
+  named.get_future().wait();
+  tracer.start(path);
+  started.set_value();
+  early.join();
+  std::thread([&tracer] {
+    tracer.setThreadName("worker");
+    tracer.instant("exited", "test");
+  }).join();
+  EXPECT_EQ(tracer.buffers(), buffers + 2);
+  ASSERT_TRUE(tracer.stop());
+  // written, then dropped
+  EXPECT_EQ(tracer.buffers(), buffers);
+  auto trace = readFile(path);
+  EXPECT_NE(trace.find("\"name\":\"exited\""), std::string::npos);
+  EXPECT_NE(trace.find("\"args\":{\"name\":\"worker\"}"),
+            std::string::npos);
+  EXPECT_NE(trace.find("\"args\":{\"name\":\"early\"}"),
+            std::string::npos);
+  std::remove(path.c_str());
+}
+
+} // namespace mltdl
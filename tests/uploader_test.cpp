@@ -0,0 +1,217 @@
+#include "uploader.h"
+#include "file_io.h"
+#include "sim_client.h"
+#include "test_util.h"
+#include "utils.h"
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <openssl/evp.h>
+
+namespace mltdl {
+
+namespace {
+
+// a file holding data, in a directory of the test's own
+std::string writeFile(const std::vector<char> &data) {
+  auto path = testDir("upload") + "/file";
+  std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+  return path;
+}
+
+// the Content-MD5 of the bytes
+std::string contentMd5(const std::string &bytes) {
+  auto hex = calculateMd5(bytes.data(), bytes.size());
+  unsigned char digest[16];
+  for (int i = 0; i < 16; ++i) {
+    digest[i] = std::stoi(hex.substr(2 * i, 2), nullptr, 16);
+  }
+  unsigned char encoded[25];
+  EVP_EncodeBlock(encoded, digest, 16);
+  return reinterpret_cast<char *>(encoded);
+}
+
+std::string replyEtag(const std::string &etag) {
+  return "HTTP/1.1 200 OK\r\nETag: \"" + etag +
+         "\"\r\nContent-Length: 0\r\n\r\n";
+}
+
+// the PUTs by where their part starts, the first "bytes a-b/n" number
+std::vector<TestRequest> putsInOrder(const std::vector<TestRequest> &all) {
+  std::vector<TestRequest> puts;
+  std::copy_if(all.begin(), all.end(), std::back_inserter(puts),
+               [](const TestRequest &r) { return r.method == "PUT"; });
+  std::sort(puts.begin(), puts.end(),
+            [](const TestRequest &a, const TestRequest &b) {
+              return std::stoll(a.header("Content-Range").substr(6)) <
+                     std::stoll(b.header("Content-Range").substr(6));
+            });
+  return puts;
+}
+
+} // namespace
+
+TEST(Uploader, split) {
+  auto parts = Uploader::split(10, 4);
+  ASSERT_EQ(parts.size(), 3);
+  EXPECT_EQ(parts[0].number, 1);
+  EXPECT_EQ(parts[2].number, 3);
+  EXPECT_EQ(parts[2].offset, 8);
+  EXPECT_EQ(parts[2].length, 2);
+
+  // an empty file is still sent, as one empty part
+  parts = Uploader::split(0, 4);
+  ASSERT_EQ(parts.size(), 1);
+  EXPECT_EQ(parts[0].length, 0);
+
+  EXPECT_EQ(Uploader::split(8, 4).size(), 2);
+}
+
+TEST(Uploader, partUrl) {
+  UploadOptions options;
+  EXPECT_EQ(Uploader::partUrl(options, "http://h/f", 3),
+            "http://h/f?partNumber=3");
+  EXPECT_EQ(Uploader::partUrl(options, "http://h/f?id=x", 3),
+            "http://h/f?id=x&partNumber=3");
+  options.part_url = "http://h/parts/{part}";
+  EXPECT_EQ(Uploader::partUrl(options, "http://h/f", 12), "http://h/parts/12");
+}
+
+TEST(Uploader, failures) {
+  Uploader uploader(2);
+  auto missing = std::filesystem::temp_directory_path() / "uploader_missing";
+  std::filesystem::remove(missing);
+  EXPECT_EQ(uploader.upload(missing.string(), "http://127.0.0.1/x").code(),
+            StatusCode::kIoError);
+  EXPECT_EQ(uploader.upload(missing.string(), "not a url").code(),
+            StatusCode::kInvalidArgument);
+
+  auto path = std::filesystem::temp_directory_path() / "uploader_file";
+  std::ofstream(path) << std::string(100, 'x');
+  // every part fails the same way, and is reported
+  UploadOptions options;
+  options.part_size = 30;
+  std::vector<UploadPart> parts;
+  auto status =
+      uploader.upload(path.string(), "ftp://127.0.0.1/x", options, nullptr,
+                      &parts);
+  EXPECT_EQ(status.code(), StatusCode::kUnsupported);
+  // the file is not kept open
+  EXPECT_EQ(FileIO::instance().openCount(), 0U);
+  ASSERT_EQ(parts.size(), 4);
+  for (const auto &part : parts) {
+    EXPECT_FALSE(part.status.ok());
+  }
+  std::filesystem::remove(path);
+}
+
+TEST(Uploader, rangedPut) {
+  std::vector<char> data(100000);
+  SimClient::fill(11, 0, data.data(), data.size());
+  auto path = writeFile(data);
+  // an ETag that is the MD5 of what arrived, as S3 and others answer
+  LoopbackServer server([](const TestRequest &request) {
+    return replyEtag(calculateMd5(request.body.data(), request.body.size()));
+  });
+  Uploader uploader(2);
+  UploadOptions options;
+  options.part_size = 30000;
+  std::vector<UploadPart> parts;
+  auto status =
+      uploader.upload(path, server.url(), options, nullptr, &parts);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  ASSERT_EQ(parts.size(), 4U);
+
+  auto puts = putsInOrder(server.requests());
+  ASSERT_EQ(puts.size(), 4U);
+  for (size_t i = 0; i < puts.size(); ++i) {
+    auto start = i * 30000;
+    auto end = std::min<size_t>(start + 30000, data.size());
+    std::string bytes(data.begin() + start, data.begin() + end);
+    EXPECT_EQ(puts[i].target, "/file");
+    EXPECT_EQ(puts[i].header("Content-Range"),
+              "bytes " + std::to_string(start) + "-" +
+                  std::to_string(end - 1) + "/100000");
+    EXPECT_EQ(puts[i].header("Content-MD5"), contentMd5(bytes));
+    EXPECT_TRUE(puts[i].body == bytes) << "part " << i + 1;
+    EXPECT_EQ(parts[i].md5, calculateMd5(bytes.data(), bytes.size()));
+  }
+}
+
+TEST(Uploader, resendsAPartTheServerGotWrong) {
+  std::vector<char> data(100000);
+  SimClient::fill(12, 0, data.data(), data.size());
+  auto path = writeFile(data);
+  const std::string wrong(32, 'a');
+  std::atomic<int> second_part{0};
+  LoopbackServer server([&](const TestRequest &request) {
+    // the first time the second part arrives it is taken as something else
+    if (request.header("Content-Range").rfind("bytes 30000-", 0) == 0 &&
+        ++second_part == 1) {
+      return replyEtag(wrong);
+    }
+    return replyEtag(calculateMd5(request.body.data(), request.body.size()));
+  });
+  Uploader uploader(2);
+  UploadOptions options;
+  options.part_size = 30000;
+  options.retry = RetryStrategy{3, 0, 1, 0};
+  std::vector<UploadPart> parts;
+  auto status =
+      uploader.upload(path, server.url(), options, nullptr, &parts);
+  ASSERT_TRUE(status.ok()) << status.toString();
+  EXPECT_EQ(second_part, 2);
+  EXPECT_EQ(server.requests().size(), 5U);
+  EXPECT_EQ(parts[1].etag, "\"" + parts[1].md5 + "\"");
+
+  // a server that never gets it right fails the upload
+  LoopbackServer broken(replyEtag(wrong));
+  status = uploader.upload(path, broken.url(), options);
+  EXPECT_EQ(status.code(), StatusCode::kCorrupted);
+}
+
+TEST(Uploader, multipart) {
+  std::vector<char> data(100000);
+  SimClient::fill(13, 0, data.data(), data.size());
+  auto path = writeFile(data);
+  LoopbackServer server([](const TestRequest &request) {
+    if (request.method == "POST") {
+      return std::string("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+    }
+    // an ETag that is no MD5, it is passed on as it is
+    auto number = request.target.substr(request.target.find('=') + 1);
+    return replyEtag("part-" + number);
+  });
+  Uploader uploader(2);
+  UploadOptions options;
+  options.mode = UploadMode::kMultipart;
+  options.part_size = 40000;
+  auto status = uploader.upload(path, server.url(), options);
+  ASSERT_TRUE(status.ok()) << status.toString();
+
+  auto requests = server.requests();
+  ASSERT_EQ(requests.size(), 4U);
+  std::vector<std::string> bodies(3);
+  for (const auto &request : requests) {
+    if (request.method != "PUT") {
+      continue;
+    }
+    EXPECT_EQ(request.header("Content-Range"), "");
+    auto number = std::stoi(request.target.substr(request.target.find('=') +
+                                                  1));
+    ASSERT_TRUE(number >= 1 && number <= 3) << request.target;
+    bodies[number - 1] = request.body;
+  }
+  EXPECT_TRUE(bodies[0] + bodies[1] + bodies[2] ==
+              std::string(data.begin(), data.end()));
+  // completed once every part is in
+  EXPECT_EQ(requests.back().method, "POST");
+  EXPECT_EQ(requests.back().target, "/file");
+  EXPECT_EQ(requests.back().body,
+            "1 \"part-1\"\n2 \"part-2\"\n3 \"part-3\"\n");
+}
+
+} // namespace mltdl
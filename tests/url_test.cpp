@@ -0,0 +1,77 @@
+#include "url.h"
+#include "utils.h"
+#include <gtest/gtest.h>
+
+namespace mltdl {
+
+TEST(Url, parts) {
+  UrlParts parts;
+  ASSERT_TRUE(
+      parseUrl("HTTPS://cdn.example.com:8443/a/b%20c.tar.gz?x=1&y=/z#top",
+               parts));
+  EXPECT_EQ(parts.scheme, "HTTPS");
+  EXPECT_EQ(parts.host, "cdn.example.com");
+  EXPECT_EQ(parts.port, "8443");
+  EXPECT_EQ(parts.port_number, 8443);
+  EXPECT_EQ(parts.path, "/a/b%20c.tar.gz");
+  EXPECT_EQ(parts.query, "x=1&y=/z");
+  EXPECT_EQ(parts.fragment, "top");
+  EXPECT_FALSE(parts.ipv6);
+
+  ASSERT_TRUE(parseUrl("http://example.com", parts));
+  EXPECT_EQ(parts.path, "");
+  EXPECT_EQ(parts.port_number, 0);
+
+  ASSERT_TRUE(parseUrl("http://example.com?q", parts));
+  EXPECT_EQ(parts.path, "");
+  EXPECT_EQ(parts.query, "q");
+}
+
+TEST(Url, ipv6) {
+  UrlParts parts;
+  ASSERT_TRUE(parseUrl("http://[::1]:8080/file.bin", parts));
+  EXPECT_TRUE(parts.ipv6);
+  EXPECT_EQ(parts.host, "[::1]");
+  EXPECT_EQ(parts.port_number, 8080);
+  EXPECT_EQ(parts.path, "/file.bin");
+  EXPECT_TRUE(parseUrl("http://[2001:db8::ffff:192.0.2.1]/", parts));
+
+  EXPECT_FALSE(parseUrl("http://[::1/file.bin", parts));
+  EXPECT_FALSE(parseUrl("http://[example.com]/", parts));
+  EXPECT_FALSE(parseUrl("http://[::1]x/", parts));
+  EXPECT_FALSE(parseUrl("http://[::1]:/", parts));
+}
+
+TEST(Url, invalid) {
+  UrlParts parts;
+  EXPECT_FALSE(parseUrl("http://example.com/a%2", parts));
+  EXPECT_FALSE(parseUrl("http://example.com/a%zz", parts));
+  EXPECT_FALSE(parseUrl("http://example.com:0", parts));
+  EXPECT_FALSE(parseUrl("http://example.com:123456", parts));
+  EXPECT_FALSE(parseUrl("http://example..com", parts));
+  EXPECT_FALSE(parseUrl("http://example.com/a b", parts));
+  EXPECT_FALSE(parseUrl("http://example.com/#a#b", parts));
+  // the scheme is still reported, so an unsupported one can be named
+  EXPECT_FALSE(parseUrl("gopher://example.com", parts));
+  EXPECT_EQ(parts.scheme, "gopher");
+}
+
+TEST(Url, decode) {
+  std::string out;
+  EXPECT_TRUE(percentDecode("a%20b%2Fc", out));
+  EXPECT_EQ(out, "a b/c");
+  EXPECT_FALSE(percentDecode("a%2", out));
+  EXPECT_FALSE(percentDecode("a%g0", out));
+}
+
+TEST(Url, name) {
+  EXPECT_EQ(getUrlName("http://example.com/a/b%20c.txt?x=1#y"), "b c.txt");
+  EXPECT_EQ(getUrlName("http://[::1]:8080/file.bin"), "file.bin");
+  EXPECT_EQ(getProtocol("HTTP://example.com"), "http");
+  // an encoded slash must not leave the download dir
+  EXPECT_EQ(getUrlName("http://example.com/..%2Fetc").find('/'),
+            std::string::npos);
+  EXPECT_EQ(getUrlName("http://example.com/%2E%2E").size(), 15U);
+}
+
+} // namespace mltdl